@@ -0,0 +1,281 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009-2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <common/mem.h>
+#include <common/log.h>
+
+#include "cache-item.h"
+#include "red-channel-client.h"
+#include "red-worker.h"
+#include "utils.h"
+
+#define RED_CACHE_MIN_SHIFT 6
+#define RED_CACHE_MIN_ENTRIES 64
+
+#define RED_CACHE_HASH_SIZE(cache) (1U << (cache)->shift)
+#define RED_CACHE_HASH_MASK(cache) (RED_CACHE_HASH_SIZE(cache) - 1)
+
+static inline uint32_t red_cache_hash_key(const RedCache *cache, uint64_t id)
+{
+    return id_hash(id, cache->shift);
+}
+
+/* returns the slot of id, RED_CACHE_NONE if not cached */
+static uint32_t red_cache_hash_lookup(const RedCache *cache, uint64_t id)
+{
+    uint32_t mask = RED_CACHE_HASH_MASK(cache);
+    uint32_t pos;
+
+    for (pos = red_cache_hash_key(cache, id); cache->slots[pos]; pos = (pos + 1) & mask) {
+        if (cache->entries[cache->slots[pos] - 1].id == id) {
+            return pos;
+        }
+    }
+    return RED_CACHE_NONE;
+}
+
+static void red_cache_hash_put(RedCache *cache, uint32_t index)
+{
+    uint32_t mask = RED_CACHE_HASH_MASK(cache);
+    uint32_t pos = red_cache_hash_key(cache, cache->entries[index].id);
+
+    while (cache->slots[pos]) {
+        pos = (pos + 1) & mask;
+    }
+    cache->slots[pos] = index + 1;
+}
+
+static void red_cache_hash_remove(RedCache *cache, uint32_t pos)
+{
+    uint32_t mask = RED_CACHE_HASH_MASK(cache);
+    uint32_t next;
+
+    cache->slots[pos] = 0;
+    for (next = (pos + 1) & mask; cache->slots[next]; next = (next + 1) & mask) {
+        uint32_t home = red_cache_hash_key(cache, cache->entries[cache->slots[next] - 1].id);
+
+        if (id_hash_fills_hole(next, home, pos, mask)) {
+            cache->slots[pos] = cache->slots[next];
+            cache->slots[next] = 0;
+            pos = next;
+        }
+    }
+}
+
+static void red_cache_hash_resize(RedCache *cache, uint32_t shift)
+{
+    uint32_t index;
+
+    free(cache->slots);
+    cache->shift = shift;
+    cache->slots = spice_new0(uint32_t, RED_CACHE_HASH_SIZE(cache));
+    for (index = cache->lru_head; index != RED_CACHE_NONE; index = cache->entries[index].next) {
+        red_cache_hash_put(cache, index);
+    }
+}
+
+static void red_cache_lru_link(RedCache *cache, uint32_t index)
+{
+    RedCacheEntry *entry = &cache->entries[index];
+
+    entry->prev = RED_CACHE_NONE;
+    entry->next = cache->lru_head;
+    if (cache->lru_head != RED_CACHE_NONE) {
+        cache->entries[cache->lru_head].prev = index;
+    } else {
+        cache->lru_tail = index;
+    }
+    cache->lru_head = index;
+}
+
+static void red_cache_lru_unlink(RedCache *cache, uint32_t index)
+{
+    RedCacheEntry *entry = &cache->entries[index];
+
+    if (entry->prev != RED_CACHE_NONE) {
+        cache->entries[entry->prev].next = entry->next;
+    } else {
+        cache->lru_head = entry->next;
+    }
+    if (entry->next != RED_CACHE_NONE) {
+        cache->entries[entry->next].prev = entry->prev;
+    } else {
+        cache->lru_tail = entry->prev;
+    }
+}
+
+static void red_cache_free_entries(RedCache *cache, uint32_t first)
+{
+    uint32_t index;
+
+    for (index = first; index < cache->entries_alloc; index++) {
+        cache->entries[index].next = index + 1 < cache->entries_alloc ? index + 1 : cache->free_entry;
+    }
+    cache->free_entry = first < cache->entries_alloc ? first : cache->free_entry;
+}
+
+static uint32_t red_cache_entry_new(RedCache *cache)
+{
+    uint32_t index;
+
+    if (cache->free_entry == RED_CACHE_NONE) {
+        uint32_t old_alloc = cache->entries_alloc;
+
+        cache->entries_alloc = MAX(old_alloc * 2, RED_CACHE_MIN_ENTRIES);
+        cache->entries = spice_renew(RedCacheEntry, cache->entries, cache->entries_alloc);
+        red_cache_free_entries(cache, old_alloc);
+    }
+    index = cache->free_entry;
+    cache->free_entry = cache->entries[index].next;
+    return index;
+}
+
+static void red_cache_push_inval(RedCache *cache, uint64_t id)
+{
+    RedCacheItem *item;
+
+    if (!cache->rcc) {
+        return;
+    }
+    item = spice_new(RedCacheItem, 1);
+    red_pipe_item_init(&item->base, RED_PIPE_ITEM_TYPE_INVAL_ONE);
+    item->id = id;
+    /* after the queued messages, which may still use the item */
+    red_channel_client_pipe_add_tail_and_push(cache->rcc, &item->base);
+}
+
+static void red_cache_evict(RedCache *cache, uint32_t index)
+{
+    RedCacheEntry *entry = &cache->entries[index];
+    uint32_t pos = red_cache_hash_lookup(cache, entry->id);
+
+    spice_assert(pos != RED_CACHE_NONE);
+    red_cache_hash_remove(cache, pos);
+    red_cache_lru_unlink(cache, index);
+    cache->items--;
+    cache->available += entry->size;
+    cache->evictions++;
+    red_cache_push_inval(cache, entry->id);
+
+    entry->next = cache->free_entry;
+    cache->free_entry = index;
+}
+
+void red_cache_init(RedCache *cache, RedChannelClient *rcc, long size)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->rcc = rcc;
+    cache->size = size;
+    cache->available = size;
+    cache->free_entry = RED_CACHE_NONE;
+    cache->lru_head = RED_CACHE_NONE;
+    cache->lru_tail = RED_CACHE_NONE;
+    cache->shift = RED_CACHE_MIN_SHIFT;
+    cache->slots = spice_new0(uint32_t, RED_CACHE_HASH_SIZE(cache));
+}
+
+void red_cache_destroy(RedCache *cache)
+{
+    free(cache->entries);
+    free(cache->slots);
+    cache->entries = NULL;
+    cache->slots = NULL;
+    cache->entries_alloc = 0;
+    cache->free_entry = RED_CACHE_NONE;
+    cache->lru_head = RED_CACHE_NONE;
+    cache->lru_tail = RED_CACHE_NONE;
+    cache->items = 0;
+    cache->available = cache->size;
+}
+
+void red_cache_reset(RedCache *cache)
+{
+    /* the pool and the table keep their size, the client is likely to
+     * fill them again */
+    if (cache->slots) {
+        memset(cache->slots, 0, sizeof(cache->slots[0]) * RED_CACHE_HASH_SIZE(cache));
+    }
+    cache->free_entry = RED_CACHE_NONE;
+    red_cache_free_entries(cache, 0);
+    cache->lru_head = RED_CACHE_NONE;
+    cache->lru_tail = RED_CACHE_NONE;
+    cache->items = 0;
+    cache->available = cache->size;
+}
+
+void red_cache_set_size(RedCache *cache, long size)
+{
+    cache->available += size - cache->size;
+    cache->size = size;
+    while (cache->available < 0 && cache->lru_tail != RED_CACHE_NONE) {
+        red_cache_evict(cache, cache->lru_tail);
+    }
+}
+
+int red_cache_find(RedCache *cache, uint64_t id)
+{
+    uint32_t pos;
+    uint32_t index;
+
+    spice_return_val_if_fail(cache->slots != NULL, FALSE);
+
+    pos = red_cache_hash_lookup(cache, id);
+    if (pos == RED_CACHE_NONE) {
+        return FALSE;
+    }
+    index = cache->slots[pos] - 1;
+    if (index != cache->lru_head) {
+        red_cache_lru_unlink(cache, index);
+        red_cache_lru_link(cache, index);
+    }
+    return TRUE;
+}
+
+int red_cache_add(RedCache *cache, uint64_t id, size_t size)
+{
+    RedCacheEntry *entry;
+    uint32_t index;
+
+    spice_return_val_if_fail(cache->slots != NULL, FALSE);
+
+    if (size > (size_t)MAX(cache->size, 0)) {
+        return FALSE;
+    }
+    cache->available -= size;
+    while (cache->available < 0) {
+        red_cache_evict(cache, cache->lru_tail);
+    }
+
+    // keep the table at most 3/4 full
+    if ((cache->items + 1) * 4 > RED_CACHE_HASH_SIZE(cache) * 3) {
+        red_cache_hash_resize(cache, cache->shift + 1);
+    }
+
+    index = red_cache_entry_new(cache);
+    entry = &cache->entries[index];
+    entry->id = id;
+    entry->size = size;
+    red_cache_lru_link(cache, index);
+    red_cache_hash_put(cache, index);
+    cache->items++;
+    return TRUE;
+}
@@ -18,22 +18,62 @@
 #ifndef CACHE_ITEM_H_
 # define CACHE_ITEM_H_
 
-#include <common/ring.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #include "red-pipe-item.h"
 
-typedef struct RedCacheItem RedCacheItem;
-
-struct RedCacheItem {
-    union {
-        RedPipeItem pipe_data;
-        struct {
-            RingItem lru_link;
-            RedCacheItem *next;
-            size_t size;
-        } cache_data;
-    } u;
+typedef struct RedChannelClient RedChannelClient;
+
+/* RED_PIPE_ITEM_TYPE_INVAL_ONE, pushed when an item is evicted so the
+ * client drops it from its own cache */
+typedef struct RedCacheItem {
+    RedPipeItem base;
+    uint64_t id;
+} RedCacheItem;
+
+/* Mirror of a client cache (cursors, palettes): the ids the client holds
+ * and their size, in the unit of the cache capacity. The entries are kept
+ * in a pool indexed by an open addressing table, both grow with the number
+ * of items so the capacity can be changed per client. */
+
+#define RED_CACHE_NONE UINT32_MAX
+
+typedef struct RedCacheEntry {
     uint64_t id;
-};
+    size_t size;
+    /* LRU links, the next free entry when not used */
+    uint32_t prev;
+    uint32_t next;
+} RedCacheEntry;
+
+typedef struct RedCache {
+    /* receives the invalidations, can be NULL */
+    RedChannelClient *rcc;
+    long size;
+    long available;
+    uint32_t items;
+    uint32_t evictions;
+
+    RedCacheEntry *entries;
+    uint32_t entries_alloc;
+    uint32_t free_entry;
+    uint32_t lru_head;
+    uint32_t lru_tail;
+
+    /* entry index + 1, 0 for an empty slot */
+    uint32_t *slots;
+    uint32_t shift;
+} RedCache;
+
+void red_cache_init(RedCache *cache, RedChannelClient *rcc, long size);
+void red_cache_destroy(RedCache *cache);
+/* drops all the items without notifying the client, which reset its own
+ * cache */
+void red_cache_reset(RedCache *cache);
+/* changes the capacity, evicting the least recently used items if needed */
+void red_cache_set_size(RedCache *cache, long size);
+int red_cache_find(RedCache *cache, uint64_t id);
+int red_cache_add(RedCache *cache, uint64_t id, size_t size);
 
 #endif /* CACHE_ITEM_H_ */
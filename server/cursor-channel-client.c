@@ -28,10 +28,6 @@
 
 #define CLIENT_CURSOR_CACHE_SIZE 256
 
-#define CURSOR_CACHE_HASH_SHIFT 8
-#define CURSOR_CACHE_HASH_SIZE (1 << CURSOR_CACHE_HASH_SHIFT)
-#define CURSOR_CACHE_HASH_MASK (CURSOR_CACHE_HASH_SIZE - 1)
-#define CURSOR_CACHE_HASH_KEY(id) ((id) & CURSOR_CACHE_HASH_MASK)
 #define CURSOR_CLIENT_TIMEOUT 30000000000ULL //nano
 
 enum {
@@ -43,10 +39,7 @@ enum {
 typedef struct CursorChannelClientPrivate CursorChannelClientPrivate;
 struct CursorChannelClientPrivate
 {
-    RedCacheItem *cursor_cache[CURSOR_CACHE_HASH_SIZE];
-    Ring cursor_cache_lru;
-    long cursor_cache_available;
-    uint32_t cursor_cache_items;
+    RedCache cursor_cache;
 };
 
 struct CursorChannelClient
@@ -56,17 +49,13 @@ struct CursorChannelClient
     CursorChannelClientPrivate priv[1];
 };
 
-#define CLIENT_CURSOR_CACHE
-#include "cache-item.tmpl.c"
-#undef CLIENT_CURSOR_CACHE
-
 #ifdef DEBUG_CURSORS
 static int _cursor_count = 0;
 #endif
 
 void cursor_channel_client_reset_cursor_cache(RedChannelClient *rcc)
 {
-    red_cursor_cache_reset(CURSOR_CHANNEL_CLIENT(rcc), CLIENT_CURSOR_CACHE_SIZE);
+    red_cache_reset(&CURSOR_CHANNEL_CLIENT(rcc)->priv->cursor_cache);
 }
 
 void cursor_channel_client_on_disconnect(RedChannelClient *rcc)
@@ -74,7 +63,7 @@ void cursor_channel_client_on_disconnect(RedChannelClient *rcc)
     if (!rcc) {
         return;
     }
-    cursor_channel_client_reset_cursor_cache(rcc);
+    red_cache_destroy(&CURSOR_CHANNEL_CLIENT(rcc)->priv->cursor_cache);
 }
 
 void cursor_channel_client_migrate(RedChannelClient *rcc)
@@ -108,18 +97,17 @@ CursorChannelClient* cursor_channel_client_new(CursorChannel *cursor, RedClient
     spice_return_val_if_fail(ccc != NULL, NULL);
     COMMON_GRAPHICS_CHANNEL(cursor)->during_target_migrate = mig_target;
 
-    ring_init(&ccc->priv->cursor_cache_lru);
-    ccc->priv->cursor_cache_available = CLIENT_CURSOR_CACHE_SIZE;
+    red_cache_init(&ccc->priv->cursor_cache, RED_CHANNEL_CLIENT(ccc), CLIENT_CURSOR_CACHE_SIZE);
 
     return ccc;
 }
 
-RedCacheItem* cursor_channel_client_cache_find(CursorChannelClient *ccc, uint64_t id)
+int cursor_channel_client_cache_find(CursorChannelClient *ccc, uint64_t id)
 {
-    return red_cursor_cache_find(ccc, id);
+    return red_cache_find(&ccc->priv->cursor_cache, id);
 }
 
 int cursor_channel_client_cache_add(CursorChannelClient *ccc, uint64_t id, size_t size)
 {
-    return red_cursor_cache_add(ccc, id, size);
+    return red_cache_add(&ccc->priv->cursor_cache, id, size);
 }
@@ -38,7 +38,7 @@ CursorChannelClient* cursor_channel_client_new(CursorChannel *cursor,
 
 void cursor_channel_client_reset_cursor_cache(RedChannelClient *rcc);
 void cursor_channel_client_on_disconnect(RedChannelClient *rcc);
-RedCacheItem* cursor_channel_client_cache_find(CursorChannelClient *ccc, uint64_t id);
+int cursor_channel_client_cache_find(CursorChannelClient *ccc, uint64_t id);
 int cursor_channel_client_cache_add(CursorChannelClient *ccc, uint64_t id, size_t size);
 
 #endif /* CURSOR_CHANNEL_CLIENT_H_ */
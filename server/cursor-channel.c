@@ -289,7 +289,7 @@ static void cursor_channel_send_item(RedChannelClient *rcc, RedPipeItem *pipe_it
         cursor_marshall(ccc, m, SPICE_UPCAST(RedCursorPipeItem, pipe_item));
         break;
     case RED_PIPE_ITEM_TYPE_INVAL_ONE:
-        red_marshall_inval(rcc, m, SPICE_CONTAINEROF(pipe_item, RedCacheItem, u.pipe_data));
+        red_marshall_inval(rcc, m, SPICE_UPCAST(RedCacheItem, pipe_item));
         break;
     case RED_PIPE_ITEM_TYPE_VERB:
         red_marshall_verb(rcc, SPICE_UPCAST(RedVerbItem, pipe_item));
@@ -24,6 +24,20 @@
 #include "stream.h"
 #include "red-channel-client.h"
 
+/* Per client cache statistics, logged every DCC_CACHE_STATS_INTERVAL and
+ * when the client leaves. For the images taken from a cache, the bytes
+ * are the size of the compressed image the client didn't receive. */
+typedef struct DccCacheStats {
+    uint64_t pixmap_lookups;
+    uint64_t pixmap_hits;
+    uint64_t palette_lookups;
+    uint64_t palette_hits;
+    uint64_t palette_saved_bytes;
+    uint64_t images[DCC_IMAGE_STAT_LAST];
+    uint64_t image_bytes[DCC_IMAGE_STAT_LAST];
+    red_time_t print_time;
+} DccCacheStats;
+
 typedef struct DisplayChannelClientPrivate DisplayChannelClientPrivate;
 struct DisplayChannelClientPrivate
 {
@@ -40,10 +54,8 @@ struct DisplayChannelClientPrivate
     uint32_t pixmap_cache_generation;
     int pending_pixmaps_sync;
 
-    RedCacheItem *palette_cache[PALETTE_CACHE_HASH_SIZE];
-    Ring palette_cache_lru;
-    long palette_cache_available;
-    uint32_t palette_cache_items;
+    RedCache palette_cache;
+    DccCacheStats cache_stats;
 
     struct {
         FreeList free_list;
@@ -53,6 +65,9 @@ struct DisplayChannelClientPrivate
 
     uint8_t surface_client_created[NUM_SURFACES];
     QRegion surface_client_lossy_region[NUM_SURFACES];
+    /* last lossy draw and last lossless upgrade, see dcc_upgrade_lossy_areas() */
+    red_time_t lossy_update_time;
+    red_time_t lossy_upgrade_time;
 
     StreamAgent stream_agents[NUM_STREAMS];
     int use_video_encoder_rate_control;
@@ -49,40 +49,12 @@ typedef struct BitmapData {
     SpiceRect lossy_rect;
 } BitmapData;
 
-static int dcc_pixmap_cache_unlocked_hit(DisplayChannelClient *dcc, uint64_t id, int *lossy)
+static int dcc_pixmap_cache_hit(DisplayChannelClient *dcc, uint64_t id, int *lossy,
+                                uint32_t *cost)
 {
-    PixmapCache *cache = dcc->priv->pixmap_cache;
-    NewCacheItem *item;
-    uint64_t serial;
-
-    serial = red_channel_client_get_message_serial(RED_CHANNEL_CLIENT(dcc));
-    item = cache->hash_table[BITS_CACHE_HASH_KEY(id)];
-
-    while (item) {
-        if (item->id == id) {
-            ring_remove(&item->lru_link);
-            ring_add(&cache->lru, &item->lru_link);
-            spice_assert(dcc->priv->id < MAX_CACHE_CLIENTS);
-            item->sync[dcc->priv->id] = serial;
-            cache->sync[dcc->priv->id] = serial;
-            *lossy = item->lossy;
-            break;
-        }
-        item = item->next;
-    }
-
-    return !!item;
-}
-
-static int dcc_pixmap_cache_hit(DisplayChannelClient *dcc, uint64_t id, int *lossy)
-{
-    int hit;
-    PixmapCache *cache = dcc->priv->pixmap_cache;
-
-    pthread_mutex_lock(&cache->lock);
-    hit = dcc_pixmap_cache_unlocked_hit(dcc, id, lossy);
-    pthread_mutex_unlock(&cache->lock);
-    return hit;
+    return pixmap_cache_hit(dcc->priv->pixmap_cache, dcc->priv->id, id,
+                            red_channel_client_get_message_serial(RED_CHANNEL_CLIENT(dcc)),
+                            lossy, cost);
 }
 
 /* set area=NULL for testing the whole surface */
@@ -145,7 +117,7 @@ static int is_bitmap_lossy(RedChannelClient *rcc, SpiceImage *image, SpiceRect *
         int is_hit_lossy;
 
         out_data->id = image->descriptor.id;
-        if (dcc_pixmap_cache_hit(dcc, image->descriptor.id, &is_hit_lossy)) {
+        if (dcc_pixmap_cache_hit(dcc, image->descriptor.id, &is_hit_lossy, NULL)) {
             out_data->type = BITMAP_DATA_TYPE_CACHE;
             if (is_hit_lossy) {
                 return TRUE;
@@ -194,7 +166,7 @@ static RedPipeItem *dcc_get_tail(DisplayChannelClient *dcc)
 
 static void red_display_add_image_to_pixmap_cache(RedChannelClient *rcc,
                                                   SpiceImage *image, SpiceImage *io_image,
-                                                  int is_lossy)
+                                                  uint32_t cost, int is_lossy)
 {
     DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
     DisplayChannel *display_channel = DCC_TO_DC(dcc);
@@ -204,7 +176,7 @@ static void red_display_add_image_to_pixmap_cache(RedChannelClient *rcc,
         if (!(io_image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME)) {
             if (dcc_pixmap_cache_unlocked_add(dcc, image->descriptor.id,
                                               image->descriptor.width * image->descriptor.height,
-                                              is_lossy)) {
+                                              cost, is_lossy)) {
                 io_image->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_ME;
                 dcc->priv->send_data.pixmap_cache_items[dcc->priv->send_data.num_pixmap_cache_items++] =
                                                                                image->descriptor.id;
@@ -291,7 +263,7 @@ static void send_free_list(RedChannelClient *rcc)
          * But all this message pixmaps cache references used its old serial.
          * we use pixmap_cache_items to collect these pixmaps, and we update their serial
          * by calling pixmap_cache_hit. */
-        dcc_pixmap_cache_hit(dcc, dcc->priv->send_data.pixmap_cache_items[i], &dummy);
+        dcc_pixmap_cache_hit(dcc, dcc->priv->send_data.pixmap_cache_items[i], &dummy, NULL);
     }
 
     if (free_list->wait.header.wait_count) {
@@ -377,11 +349,14 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
     if (simage->descriptor.flags & SPICE_IMAGE_FLAGS_HIGH_BITS_SET) {
         image.descriptor.flags = SPICE_IMAGE_FLAGS_HIGH_BITS_SET;
     }
-    pthread_mutex_lock(&dcc->priv->pixmap_cache->lock);
 
     if ((simage->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME)) {
         int lossy_cache_item;
-        if (dcc_pixmap_cache_unlocked_hit(dcc, image.descriptor.id, &lossy_cache_item)) {
+        uint32_t cost;
+
+        stat_inc_counter(reds, display->pixmap_cache_lookups_counter, 1);
+        dcc->priv->cache_stats.pixmap_lookups++;
+        if (dcc_pixmap_cache_hit(dcc, image.descriptor.id, &lossy_cache_item, &cost)) {
             dcc->priv->send_data.pixmap_cache_items[dcc->priv->send_data.num_pixmap_cache_items++] =
                 image.descriptor.id;
             if (can_lossy || !lossy_cache_item) {
@@ -398,16 +373,22 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
                 spice_assert(bitmap_palette_out == NULL);
                 spice_assert(lzplt_palette_out == NULL);
                 stat_inc_counter(reds, display->cache_hits_counter, 1);
-                pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
+                stat_inc_counter(reds, display->pixmap_cache_hits_counter, 1);
+                stat_inc_counter(reds, display->pixmap_cache_saved_counter, cost);
+                dcc->priv->cache_stats.pixmap_hits++;
+                dcc_cache_stats_add_image(dcc, image.descriptor.type, cost);
                 return FILL_BITS_TYPE_CACHE;
             } else {
-                pixmap_cache_unlocked_set_lossy(dcc->priv->pixmap_cache, simage->descriptor.id,
-                                                FALSE);
                 image.descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME;
             }
         }
     }
 
+    pthread_mutex_lock(&dcc->priv->pixmap_cache->lock);
+    if (image.descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME) {
+        pixmap_cache_unlocked_set_lossy(dcc->priv->pixmap_cache, simage->descriptor.id, FALSE);
+    }
+
     switch (simage->descriptor.type) {
     case SPICE_IMAGE_TYPE_SURFACE: {
         int surface_id;
@@ -432,6 +413,7 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
         spice_assert(bitmap_palette_out == NULL);
         spice_assert(lzplt_palette_out == NULL);
         pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
+        dcc_cache_stats_add_image(dcc, image.descriptor.type, 0);
         return FILL_BITS_TYPE_SURFACE;
     }
     case SPICE_IMAGE_TYPE_BITMAP: {
@@ -447,7 +429,9 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
                                 drawable, can_lossy, &comp_send_data)) {
             SpicePalette *palette;
 
-            red_display_add_image_to_pixmap_cache(rcc, simage, &image, FALSE);
+            red_display_add_image_to_pixmap_cache(rcc, simage, &image,
+                                                  simage->u.bitmap.y * simage->u.bitmap.stride,
+                                                  FALSE);
 
             *bitmap = simage->u.bitmap;
             bitmap->flags = bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN;
@@ -464,9 +448,12 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
 
             spice_marshaller_add_ref_chunks(m, bitmap->data);
             pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
+            dcc_cache_stats_add_image(dcc, image.descriptor.type,
+                                      (uint64_t)bitmap->y * bitmap->stride);
             return FILL_BITS_TYPE_BITMAP;
         } else {
             red_display_add_image_to_pixmap_cache(rcc, simage, &image,
+                                                  comp_send_data.comp_buf_size,
                                                   comp_send_data.is_lossy);
 
             spice_marshall_Image(m, &image,
@@ -482,13 +469,16 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
 
             spice_assert(!comp_send_data.is_lossy || can_lossy);
             pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
+            dcc_cache_stats_add_image(dcc, image.descriptor.type,
+                                      comp_send_data.comp_buf_size);
             return (comp_send_data.is_lossy ? FILL_BITS_TYPE_COMPRESS_LOSSY :
                                               FILL_BITS_TYPE_COMPRESS_LOSSLESS);
         }
         break;
     }
     case SPICE_IMAGE_TYPE_QUIC:
-        red_display_add_image_to_pixmap_cache(rcc, simage, &image, FALSE);
+        red_display_add_image_to_pixmap_cache(rcc, simage, &image,
+                                              simage->u.quic.data_size, FALSE);
         image.u.quic = simage->u.quic;
         spice_marshall_Image(m, &image,
                              &bitmap_palette_out, &lzplt_palette_out);
@@ -496,6 +486,7 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
         spice_assert(lzplt_palette_out == NULL);
         spice_marshaller_add_ref_chunks(m, image.u.quic.data);
         pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
+        dcc_cache_stats_add_image(dcc, image.descriptor.type, image.u.quic.data_size);
         return FILL_BITS_TYPE_COMPRESS_LOSSLESS;
     default:
         spice_error("invalid image type %u", image.descriptor.type);
@@ -568,6 +559,9 @@ static void surface_lossy_region_update(DisplayChannelClient *dcc,
     if (has_mask && !lossy) {
         return;
     }
+    if (lossy) {
+        dcc->priv->lossy_update_time = spice_get_monotonic_time_ns();
+    }
 
     surface_lossy_region = &dcc->priv->surface_client_lossy_region[item->surface_id];
     drawable = item->red_drawable;
@@ -1678,38 +1672,100 @@ static void red_release_video_encoder_buffer(uint8_t *data, void *opaque)
     buffer->free(buffer);
 }
 
-static int red_marshall_stream_data(RedChannelClient *rcc,
-                                    SpiceMarshaller *base_marshaller,
-                                    Drawable *drawable)
+static int stream_frame_is_sized(Stream *stream, const SpiceRect *src,
+                                 const SpiceRect *dest)
+{
+    return (src->right - src->left != stream->width) ||
+           (src->bottom - src->top != stream->height) ||
+           !rect_is_equal(dest, &stream->dest_area);
+}
+
+/* the marshaller takes the ownership of outbuf */
+static void red_marshall_stream_frame(RedChannelClient *rcc,
+                                      SpiceMarshaller *base_marshaller,
+                                      StreamAgent *agent,
+                                      uint32_t frame_mm_time,
+                                      const SpiceRect *src,
+                                      const SpiceRect *dest,
+                                      VideoBuffer *outbuf)
+{
+    DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    Stream *stream = agent->stream;
+
+    /* the frames scaled down by the encoder are sized frames too, the
+     * client scales them back to dest */
+    if (!outbuf->width && !stream_frame_is_sized(stream, src, dest)) {
+        SpiceMsgDisplayStreamData stream_data;
+
+        red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_DATA, NULL);
+
+        stream_data.base.id = get_stream_id(display, stream);
+        stream_data.base.multi_media_time = frame_mm_time;
+        stream_data.data_size = outbuf->size;
+
+        spice_marshall_msg_display_stream_data(base_marshaller, &stream_data);
+    } else {
+        SpiceMsgDisplayStreamDataSized stream_data;
+
+        red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_DATA_SIZED, NULL);
+
+        stream_data.base.id = get_stream_id(display, stream);
+        stream_data.base.multi_media_time = frame_mm_time;
+        stream_data.data_size = outbuf->size;
+        stream_data.width = outbuf->width ? outbuf->width : src->right - src->left;
+        stream_data.height = outbuf->height ? outbuf->height : src->bottom - src->top;
+        stream_data.dest = *dest;
+
+        spice_debug("stream %d: sized frame: dest ==> ", stream_data.base.id);
+        rect_debug(&stream_data.dest);
+        spice_marshall_msg_display_stream_data_sized(base_marshaller, &stream_data);
+    }
+    spice_marshaller_add_ref_full(base_marshaller, outbuf->data, outbuf->size,
+                                  &red_release_video_encoder_buffer, outbuf);
+    if (agent->start_time) {
+        stat_inc_counter(reds, display->stream_starts_counter, 1);
+        stat_inc_counter(reds, display->stream_start_time_counter,
+                         spice_get_monotonic_time_ns() - agent->start_time);
+        agent->start_time = 0;
+    }
+#ifdef STREAM_STATS
+    agent->stats.num_frames_sent++;
+    agent->stats.size_sent += outbuf->size;
+    agent->stats.end = frame_mm_time;
+#endif
+}
+
+/* returns the agent streaming the drawable to the client, NULL if the
+ * drawable must be sent as is */
+static StreamAgent *stream_frame_get_agent(RedChannelClient *rcc, Drawable *drawable)
 {
     DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
     DisplayChannel *display = DCC_TO_DC(dcc);
     Stream *stream = drawable->stream;
     SpiceCopy *copy;
-    uint32_t frame_mm_time;
-    int is_sized;
-    int ret;
 
     spice_assert(drawable->red_drawable->type == QXL_DRAW_COPY);
 
     copy = &drawable->red_drawable->u.copy;
     if (copy->src_bitmap->descriptor.type != SPICE_IMAGE_TYPE_BITMAP) {
-        return FALSE;
+        return NULL;
     }
 
-    is_sized = (copy->src_area.right - copy->src_area.left != stream->width) ||
-               (copy->src_area.bottom - copy->src_area.top != stream->height) ||
-               !rect_is_equal(&drawable->red_drawable->bbox, &stream->dest_area);
-
-    if (is_sized &&
+    if (stream_frame_is_sized(stream, &copy->src_area, &drawable->red_drawable->bbox) &&
         !red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_SIZED_STREAM)) {
-        return FALSE;
+        return NULL;
     }
 
-    StreamAgent *agent = &dcc->priv->stream_agents[get_stream_id(display, stream)];
-    uint64_t time_now = spice_get_monotonic_time_ns();
+    return &dcc->priv->stream_agents[get_stream_id(display, stream)];
+}
 
-    if (!dcc->priv->use_video_encoder_rate_control) {
+/* the frames of a region stream are parts of the area, they can't be
+ * dropped as the next one doesn't cover them */
+static int stream_frame_skip(DisplayChannelClient *dcc, StreamAgent *agent,
+                             uint64_t time_now)
+{
+    if (!dcc->priv->use_video_encoder_rate_control && !agent->stream->region) {
         if (time_now - agent->last_send_time < (1000 * 1000 * 1000) / agent->fps) {
             agent->frames--;
 #ifdef STREAM_STATS
@@ -1718,17 +1774,97 @@ static int red_marshall_stream_data(RedChannelClient *rcc,
             return TRUE;
         }
     }
+    return FALSE;
+}
 
-    VideoBuffer *outbuf;
+static uint32_t stream_frame_get_mm_time(Drawable *drawable)
+{
     /* workaround for vga streams */
-    frame_mm_time =  drawable->red_drawable->mm_time ?
-                        drawable->red_drawable->mm_time :
-                        reds_get_mm_time();
+    return drawable->red_drawable->mm_time ? drawable->red_drawable->mm_time :
+                                             reds_get_mm_time();
+}
+
+int dcc_stream_post_frame(DisplayChannelClient *dcc, Drawable *drawable)
+{
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
+    StreamAgent *agent;
+    SpiceCopy *copy;
+    SpiceRect src_area, dest;
+    uint64_t time_now;
+
+    if (!drawable->stream) {
+        return FALSE;
+    }
+    agent = stream_frame_get_agent(rcc, drawable);
+    if (!agent || !agent->encoder_thread) {
+        return FALSE;
+    }
+
+    time_now = spice_get_monotonic_time_ns();
+    if (stream_frame_skip(dcc, agent, time_now)) {
+        return TRUE;
+    }
+
+    copy = &drawable->red_drawable->u.copy;
+    src_area = copy->src_area;
+    dest = drawable->red_drawable->bbox;
+    /* only the visible part of a mostly covered stream is encoded */
+    stream_agent_crop_frame(agent, &drawable->red_drawable->bbox, &src_area, &dest);
+
+    /* the frame is sent by a RED_PIPE_ITEM_TYPE_STREAM_DATA item once
+     * encoded, a frame still waiting for the thread is dropped */
+    if (video_encoder_thread_post(agent->encoder_thread,
+                                  stream_frame_get_mm_time(drawable),
+                                  &copy->src_bitmap->u.bitmap,
+                                  &src_area, &dest,
+                                  drawable->stream->top_down, drawable->red_drawable)) {
+        if (!dcc->priv->use_video_encoder_rate_control) {
+            agent->drops++;
+        }
+#ifdef STREAM_STATS
+        agent->stats.num_drops_pipe++;
+#endif
+    }
+    agent->last_send_time = time_now;
+    return TRUE;
+}
+
+static int red_marshall_stream_data(RedChannelClient *rcc,
+                                    SpiceMarshaller *base_marshaller,
+                                    Drawable *drawable)
+{
+    DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
+    Stream *stream = drawable->stream;
+    StreamAgent *agent;
+    SpiceCopy *copy;
+    uint32_t frame_mm_time;
+    int ret;
+
+    agent = stream_frame_get_agent(rcc, drawable);
+    if (!agent) {
+        return FALSE;
+    }
+
+    uint64_t time_now = spice_get_monotonic_time_ns();
+
+    if (stream_frame_skip(dcc, agent, time_now)) {
+        return TRUE;
+    }
+
+    VideoBuffer *outbuf;
+    copy = &drawable->red_drawable->u.copy;
+    SpiceRect src_area = copy->src_area;
+    SpiceRect dest = drawable->red_drawable->bbox;
+
+    frame_mm_time = stream_frame_get_mm_time(drawable);
+    /* only the visible part of a mostly covered stream is encoded */
+    stream_agent_crop_frame(agent, &drawable->red_drawable->bbox, &src_area, &dest);
+
     ret = !agent->video_encoder ? VIDEO_ENCODER_FRAME_UNSUPPORTED :
           agent->video_encoder->encode_frame(agent->video_encoder,
                                              frame_mm_time,
                                              &copy->src_bitmap->u.bitmap,
-                                             &copy->src_area, stream->top_down,
+                                             &src_area, stream->top_down,
                                              drawable->red_drawable,
                                              &outbuf);
     switch (ret) {
@@ -1737,7 +1873,8 @@ static int red_marshall_stream_data(RedChannelClient *rcc,
 #ifdef STREAM_STATS
         agent->stats.num_drops_fps++;
 #endif
-        return TRUE;
+        /* sent as a drawable instead */
+        return !stream->region;
     case VIDEO_ENCODER_FRAME_UNSUPPORTED:
         return FALSE;
     case VIDEO_ENCODER_FRAME_ENCODE_DONE:
@@ -1747,44 +1884,22 @@ static int red_marshall_stream_data(RedChannelClient *rcc,
         return FALSE;
     }
 
-    if (!is_sized) {
-        SpiceMsgDisplayStreamData stream_data;
-
-        red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_DATA, NULL);
-
-        stream_data.base.id = get_stream_id(display, stream);
-        stream_data.base.multi_media_time = frame_mm_time;
-        stream_data.data_size = outbuf->size;
-
-        spice_marshall_msg_display_stream_data(base_marshaller, &stream_data);
-    } else {
-        SpiceMsgDisplayStreamDataSized stream_data;
-
-        red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_DATA_SIZED, NULL);
-
-        stream_data.base.id = get_stream_id(display, stream);
-        stream_data.base.multi_media_time = frame_mm_time;
-        stream_data.data_size = outbuf->size;
-        stream_data.width = copy->src_area.right - copy->src_area.left;
-        stream_data.height = copy->src_area.bottom - copy->src_area.top;
-        stream_data.dest = drawable->red_drawable->bbox;
-
-        spice_debug("stream %d: sized frame: dest ==> ", stream_data.base.id);
-        rect_debug(&stream_data.dest);
-        spice_marshall_msg_display_stream_data_sized(base_marshaller, &stream_data);
-    }
-    spice_marshaller_add_ref_full(base_marshaller, outbuf->data, outbuf->size,
-                                  &red_release_video_encoder_buffer, outbuf);
+    red_marshall_stream_frame(rcc, base_marshaller, agent, frame_mm_time,
+                              &src_area, &dest, outbuf);
     agent->last_send_time = time_now;
-#ifdef STREAM_STATS
-    agent->stats.num_frames_sent++;
-    agent->stats.size_sent += outbuf->size;
-    agent->stats.end = frame_mm_time;
-#endif
 
     return TRUE;
 }
 
+static void marshall_stream_data_item(RedChannelClient *rcc,
+                                      SpiceMarshaller *base_marshaller,
+                                      RedStreamDataItem *item)
+{
+    red_marshall_stream_frame(rcc, base_marshaller, item->agent, item->frame.mm_time,
+                              &item->frame.src, &item->frame.dest, item->frame.outbuf);
+    item->frame.outbuf = NULL;
+}
+
 static inline void marshall_inval_palette(RedChannelClient *rcc,
                                           SpiceMarshaller *base_marshaller,
                                           RedCacheItem *cache_item)
@@ -1828,6 +1943,46 @@ static void display_channel_marshall_migrate_data_surfaces(DisplayChannelClient
     }
 }
 
+typedef struct MigratePixmapCacheMarshaller {
+    SpiceMarshaller *m;
+    uint32_t num_items;
+} MigratePixmapCacheMarshaller;
+
+static void marshall_migrate_data_pixmap_cache_item(NewCacheItem *item, void *opaque)
+{
+    MigratePixmapCacheMarshaller *marshaller = opaque;
+    MigrateDisplayPixmapCacheItem mig_item;
+
+    mig_item.id = item->id;
+    mig_item.size = item->size;
+    mig_item.cost = item->cost;
+    mig_item.lossy = item->lossy;
+    spice_marshaller_add(marshaller->m, (uint8_t *)&mig_item, sizeof(mig_item));
+    marshaller->num_items++;
+}
+
+static void display_channel_marshall_migrate_data_pixmap_cache(DisplayChannelClient *dcc,
+                                                               SpiceMarshaller *m,
+                                                               int freezer)
+{
+    PixmapCache *cache = dcc->priv->pixmap_cache;
+    MigratePixmapCacheMarshaller marshaller = { NULL, 0 };
+    uint32_t *num_items;
+
+    if (!freezer) {
+        spice_marshaller_add_uint32(m, 0);
+        return;
+    }
+
+    marshaller.m = spice_marshaller_get_ptr_submarshaller(m, 0);
+    num_items = (uint32_t *)spice_marshaller_reserve_space(marshaller.m, sizeof(uint32_t));
+    pthread_mutex_lock(&cache->lock);
+    pixmap_cache_unlocked_foreach_frozen(cache, marshall_migrate_data_pixmap_cache_item,
+                                         &marshaller);
+    pthread_mutex_unlock(&cache->lock);
+    *num_items = marshaller.num_items;
+}
+
 static void display_channel_marshall_migrate_data(RedChannelClient *rcc,
                                                   SpiceMarshaller *base_marshaller)
 {
@@ -1835,12 +1990,18 @@ static void display_channel_marshall_migrate_data(RedChannelClient *rcc,
     DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
     ImageEncoders *encoders = dcc_get_encoders(dcc);
     SpiceMigrateDataDisplay display_data = {0,};
+    gboolean migrate_pixmap_cache;
 
     display_channel = DCC_TO_DC(dcc);
+    /* only when the destination server is known to restore it */
+    migrate_pixmap_cache =
+        reds_get_migrate_pixmap_cache(red_channel_get_server(RED_CHANNEL(display_channel)));
 
     red_channel_client_init_send_data(rcc, SPICE_MSG_MIGRATE_DATA, NULL);
     spice_marshaller_add_uint32(base_marshaller, SPICE_MIGRATE_DATA_DISPLAY_MAGIC);
-    spice_marshaller_add_uint32(base_marshaller, SPICE_MIGRATE_DATA_DISPLAY_VERSION);
+    /* an older destination would refuse the version with the pixmap cache */
+    spice_marshaller_add_uint32(base_marshaller, migrate_pixmap_cache ?
+                                SPICE_MIGRATE_DATA_DISPLAY_PIXMAP_CACHE_VERSION : 1);
 
     spice_assert(dcc->priv->pixmap_cache);
     spice_assert(MIGRATE_DATA_DISPLAY_MAX_CACHE_CLIENTS == 4 &&
@@ -1863,6 +2024,10 @@ static void display_channel_marshall_migrate_data(RedChannelClient *rcc,
                          (uint8_t *)&display_data, sizeof(display_data) - sizeof(uint32_t));
     display_channel_marshall_migrate_data_surfaces(dcc, base_marshaller,
                                                    display_channel->enable_jpeg);
+    if (migrate_pixmap_cache) {
+        display_channel_marshall_migrate_data_pixmap_cache(dcc, base_marshaller,
+                                                           display_data.pixmap_cache_freezer);
+    }
 }
 
 static void display_channel_marshall_pixmap_sync(RedChannelClient *rcc,
@@ -1925,6 +2090,9 @@ static void display_channel_marshall_reset_cache(RedChannelClient *rcc,
 
     red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_INVAL_ALL_PIXMAPS, NULL);
     dcc_pixmap_cache_reset(dcc, &wait);
+#ifdef USE_LZ4
+    image_encoders_lz4_stream_reset(&dcc->priv->encoders);
+#endif
 
     spice_marshall_msg_display_inval_all_pixmaps(base_marshaller,
                                                  &wait);
@@ -2008,6 +2176,7 @@ static void red_marshall_image(RedChannelClient *rcc,
 
         if (spice_image_descriptor_is_lossy(&red_image.descriptor)) {
             region_add(surface_lossy_region, &copy.base.box);
+            dcc->priv->lossy_update_time = spice_get_monotonic_time_ns();
         } else {
             region_remove(surface_lossy_region, &copy.base.box);
         }
@@ -2399,7 +2568,7 @@ void dcc_send_item(RedChannelClient *rcc, RedPipeItem *pipe_item)
         break;
     }
     case RED_PIPE_ITEM_TYPE_INVAL_ONE:
-        marshall_inval_palette(rcc, m, SPICE_CONTAINEROF(pipe_item, RedCacheItem, u.pipe_data));
+        marshall_inval_palette(rcc, m, SPICE_UPCAST(RedCacheItem, pipe_item));
         break;
     case RED_PIPE_ITEM_TYPE_STREAM_CREATE: {
         StreamCreateDestroyItem *item = SPICE_UPCAST(StreamCreateDestroyItem, pipe_item);
@@ -2409,6 +2578,9 @@ void dcc_send_item(RedChannelClient *rcc, RedPipeItem *pipe_item)
     case RED_PIPE_ITEM_TYPE_STREAM_CLIP:
         marshall_stream_clip(rcc, m, SPICE_UPCAST(RedStreamClipItem, pipe_item));
         break;
+    case RED_PIPE_ITEM_TYPE_STREAM_DATA:
+        marshall_stream_data_item(rcc, m, SPICE_UPCAST(RedStreamDataItem, pipe_item));
+        break;
     case RED_PIPE_ITEM_TYPE_STREAM_DESTROY: {
         StreamCreateDestroyItem *item = SPICE_UPCAST(StreamCreateDestroyItem, pipe_item);
         marshall_stream_end(rcc, m, item->agent);
@@ -254,6 +254,166 @@ void dcc_push_surface_image(DisplayChannelClient *dcc, int surface_id)
     red_channel_client_push(RED_CHANNEL_CLIENT(dcc));
 }
 
+/* The areas sent lossy (jpeg, lz4 over a low bandwidth link, stream
+ * frames) stay lossy on the client until something is drawn over them.
+ * With spice_server_set_lossy_upgrade(), once the primary surface is idle
+ * they are sent again losslessly, a few rows at a time so the upgrades
+ * only use a share of the bandwidth measured by the main channel and never
+ * delay the next drawables.
+ * The areas under the streams are left alone, the next frames replace
+ * them anyway. */
+#define LOSSY_UPGRADE_IDLE_DELAY (NSEC_PER_SEC / 2)
+#define LOSSY_UPGRADE_INTERVAL (NSEC_PER_SEC / 10)
+/* part of the bandwidth used by the upgrades */
+#define LOSSY_UPGRADE_BANDWIDTH_DIV 4
+/* the lossless codecs roughly halve the size of the upgraded areas */
+#define LOSSY_UPGRADE_COMPRESSION_RATIO 2
+/* per interval, when the network test did not run */
+#define LOSSY_UPGRADE_DEFAULT_BYTES (512 * 1024)
+#define LOSSY_UPGRADE_MIN_BYTES (16 * 1024)
+
+static red_time_t dcc_lossy_upgrade_next_time(DisplayChannelClient *dcc)
+{
+    return MAX(dcc->priv->lossy_update_time + LOSSY_UPGRADE_IDLE_DELAY,
+               dcc->priv->lossy_upgrade_time + LOSSY_UPGRADE_INTERVAL);
+}
+
+/* uncompressed bytes to upgrade in one interval */
+static uint64_t dcc_lossy_upgrade_budget(DisplayChannelClient *dcc)
+{
+    RedClient *client = red_channel_client_get_client(RED_CHANNEL_CLIENT(dcc));
+    MainChannelClient *mcc = red_client_get_main(client);
+    uint64_t bytes_per_sec;
+
+    if (!mcc || !main_channel_client_is_network_info_initialized(mcc)) {
+        return LOSSY_UPGRADE_DEFAULT_BYTES * LOSSY_UPGRADE_COMPRESSION_RATIO;
+    }
+    bytes_per_sec = main_channel_client_get_bitrate_per_sec(mcc) / 8;
+    return MAX(bytes_per_sec * LOSSY_UPGRADE_INTERVAL / NSEC_PER_SEC / LOSSY_UPGRADE_BANDWIDTH_DIV,
+               LOSSY_UPGRADE_MIN_BYTES) * LOSSY_UPGRADE_COMPRESSION_RATIO;
+}
+
+static int dcc_can_upgrade_lossy_areas(DisplayChannelClient *dcc)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
+
+    return display->enable_lossy_upgrade &&
+           display->surfaces[0].context.canvas &&
+           dcc->priv->surface_client_created[0] &&
+           !region_is_empty(&dcc->priv->surface_client_lossy_region[0]) &&
+           red_channel_client_pipe_is_empty(rcc) &&
+           !red_channel_client_is_blocked(rcc);
+}
+
+/* whether the client has some of the area drawn lossily */
+int dcc_is_area_lossy(DisplayChannelClient *dcc, uint32_t surface_id, const SpiceRect *area)
+{
+    QRegion *surface_lossy_region = &dcc->priv->surface_client_lossy_region[surface_id];
+    QRegion lossy_region;
+    int lossy;
+
+    if (region_is_empty(surface_lossy_region)) {
+        return FALSE;
+    }
+    region_init(&lossy_region);
+    region_add(&lossy_region, area);
+    region_and(&lossy_region, surface_lossy_region);
+    lossy = !region_is_empty(&lossy_region);
+    region_destroy(&lossy_region);
+    return lossy;
+}
+
+/* the lossy areas not under a stream, returns FALSE if there are none */
+static int dcc_get_lossy_upgrade_region(DisplayChannelClient *dcc, QRegion *region)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    RingItem *item;
+
+    region_clone(region, &dcc->priv->surface_client_lossy_region[0]);
+    RING_FOREACH(item, &display->streams) {
+        Stream *stream = SPICE_CONTAINEROF(item, Stream, link);
+
+        region_remove(region, &stream->dest_area);
+    }
+    return !region_is_empty(region);
+}
+
+/* ms until dcc_upgrade_lossy_areas() has something to send, rounded up
+ * so the worker does not wake up before it is time */
+int dcc_get_lossy_upgrade_timeout(DisplayChannelClient *dcc)
+{
+    red_time_t now;
+    red_time_t next;
+
+    if (!dcc_can_upgrade_lossy_areas(dcc)) {
+        return INT_MAX;
+    }
+    if (!ring_is_empty(&DCC_TO_DC(dcc)->streams)) {
+        QRegion upgrade_region;
+        int has_areas = dcc_get_lossy_upgrade_region(dcc, &upgrade_region);
+
+        region_destroy(&upgrade_region);
+        if (!has_areas) {
+            return INT_MAX;
+        }
+    }
+    now = spice_get_monotonic_time_ns();
+    next = dcc_lossy_upgrade_next_time(dcc);
+    if (next <= now) {
+        return 0;
+    }
+    return (next - now + NSEC_PER_MILLISEC - 1) / NSEC_PER_MILLISEC;
+}
+
+void dcc_upgrade_lossy_areas(DisplayChannelClient *dcc)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    RedSurface *surface = &display->surfaces[0];
+    QRegion upgrade_region;
+    SpiceRect *rects;
+    uint32_t num_rects;
+    uint32_t i;
+    red_time_t now;
+    int64_t budget;
+    int bpp;
+
+    if (!dcc_can_upgrade_lossy_areas(dcc)) {
+        return;
+    }
+    now = spice_get_monotonic_time_ns();
+    if (now < dcc_lossy_upgrade_next_time(dcc)) {
+        return;
+    }
+    if (!dcc_get_lossy_upgrade_region(dcc, &upgrade_region)) {
+        region_destroy(&upgrade_region);
+        return;
+    }
+    dcc->priv->lossy_upgrade_time = now;
+
+    bpp = SPICE_SURFACE_FMT_DEPTH(surface->context.format) / 8;
+    budget = dcc_lossy_upgrade_budget(dcc);
+    rects = region_dup_rects(&upgrade_region, &num_rects);
+    /* the rectangles are sorted top to bottom, the upper part of the
+     * screen is upgraded first */
+    for (i = 0; i < num_rects && budget > 0; i++) {
+        SpiceRect area = rects[i];
+        int64_t row_bytes = (int64_t)(area.right - area.left) * bpp;
+        int rows = MIN(area.bottom - area.top, MAX(budget / row_bytes, 1));
+
+        area.bottom = area.top + rows;
+        display_channel_draw(display, &area, 0);
+        dcc_add_surface_area_image(dcc, 0, &area, NULL, FALSE);
+        budget -= rows * row_bytes;
+        stat_inc_counter(reds, display->lossy_upgrades_counter, 1);
+        stat_inc_counter(reds, display->lossy_upgrade_bytes_counter, rows * row_bytes);
+    }
+    free(rects);
+    region_destroy(&upgrade_region);
+
+    red_channel_client_push(RED_CHANNEL_CLIENT(dcc));
+}
+
 static void add_drawable_surface_images(DisplayChannelClient *dcc, Drawable *drawable)
 {
     DisplayChannel *display = DCC_TO_DC(dcc);
@@ -314,8 +474,13 @@ static RedDrawablePipeItem *red_drawable_pipe_item_new(DisplayChannelClient *dcc
 
 void dcc_prepend_drawable(DisplayChannelClient *dcc, Drawable *drawable)
 {
-    RedDrawablePipeItem *dpi = red_drawable_pipe_item_new(dcc, drawable);
+    RedDrawablePipeItem *dpi;
 
+    /* the frames encoded on a thread don't go through the pipe */
+    if (dcc_stream_post_frame(dcc, drawable)) {
+        return;
+    }
+    dpi = red_drawable_pipe_item_new(dcc, drawable);
     add_drawable_surface_images(dcc, drawable);
     red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), &dpi->dpi_pipe_item);
 }
@@ -330,8 +495,12 @@ void dcc_append_drawable(DisplayChannelClient *dcc, Drawable *drawable)
 
 void dcc_add_drawable_after(DisplayChannelClient *dcc, Drawable *drawable, RedPipeItem *pos)
 {
-    RedDrawablePipeItem *dpi = red_drawable_pipe_item_new(dcc, drawable);
+    RedDrawablePipeItem *dpi;
 
+    if (dcc_stream_post_frame(dcc, drawable)) {
+        return;
+    }
+    dpi = red_drawable_pipe_item_new(dcc, drawable);
     add_drawable_surface_images(dcc, drawable);
     red_channel_client_pipe_add_after(RED_CHANNEL_CLIENT(dcc), &dpi->dpi_pipe_item, pos);
 }
@@ -360,7 +529,8 @@ DisplayChannelClient *dcc_new(DisplayChannel *display,
                               uint32_t *caps, int num_caps,
                               SpiceImageCompression image_compression,
                               spice_wan_compression_t jpeg_state,
-                              spice_wan_compression_t zlib_glz_state)
+                              spice_wan_compression_t zlib_glz_state,
+                              int zstd_level)
 
 {
     DisplayChannelClient *dcc;
@@ -377,8 +547,7 @@ DisplayChannelClient *dcc_new(DisplayChannel *display,
     spice_return_val_if_fail(dcc, NULL);
     spice_info("New display (client %p) dcc %p stream %p", client, dcc, stream);
 
-    ring_init(&dcc->priv->palette_cache_lru);
-    dcc->priv->palette_cache_available = CLIENT_PALETTE_CACHE_SIZE;
+    red_cache_init(&dcc->priv->palette_cache, RED_CHANNEL_CLIENT(dcc), CLIENT_PALETTE_CACHE_SIZE);
     dcc->priv->image_compression = image_compression;
     dcc->priv->jpeg_state = jpeg_state;
     dcc->priv->zlib_glz_state = zlib_glz_state;
@@ -393,6 +562,9 @@ DisplayChannelClient *dcc_new(DisplayChannel *display,
     dcc_init_stream_agents(dcc);
 
     image_encoders_init(&dcc->priv->encoders, &display->encoder_shared_data);
+#ifdef USE_ZSTD
+    dcc->priv->encoders.zstd_level = zstd_level;
+#endif
 
     return dcc;
 }
@@ -479,6 +651,7 @@ static void dcc_destroy_stream_agents(DisplayChannelClient *dcc)
         if (agent->video_encoder) {
             agent->video_encoder->destroy(agent->video_encoder);
             agent->video_encoder = NULL;
+            agent->encoder_thread = NULL;
         }
     }
 }
@@ -487,9 +660,10 @@ void dcc_stop(DisplayChannelClient *dcc)
 {
     DisplayChannel *dc = DCC_TO_DC(dcc);
 
+    dcc_cache_stats_print(dcc);
     pixmap_cache_unref(dcc->priv->pixmap_cache);
     dcc->priv->pixmap_cache = NULL;
-    dcc_palette_cache_reset(dcc);
+    red_cache_destroy(&dcc->priv->palette_cache);
     free(dcc->priv->send_data.free_list.res);
     dcc_destroy_stream_agents(dcc);
     image_encoders_free(&dcc->priv->encoders);
@@ -512,6 +686,8 @@ void dcc_stream_agent_clip(DisplayChannelClient* dcc, StreamAgent *agent)
     region_ret_rects(&agent->clip, item->rects->rects, n_rects);
 
     red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), &item->base);
+    stream_agent_update_crop(agent);
+    dcc_update_streams_bit_rate_share(dcc);
 }
 
 static void red_monitors_config_item_free(RedPipeItem *base)
@@ -702,8 +878,19 @@ static SpiceImageCompression get_compression_for_bitmap(SpiceBitmap *bitmap,
         }
     }
 
+#ifdef USE_ZSTD
+    if (preferred_compression == SPICE_IMAGE_COMPRESSION_ZSTD) {
+        if (!bitmap_fmt_is_rgb(bitmap->format)) {
+            preferred_compression = SPICE_IMAGE_COMPRESSION_LZ;
+        }
+    }
+#endif
+
     if (preferred_compression == SPICE_IMAGE_COMPRESSION_LZ ||
         preferred_compression == SPICE_IMAGE_COMPRESSION_LZ4 ||
+#ifdef USE_ZSTD
+        preferred_compression == SPICE_IMAGE_COMPRESSION_ZSTD ||
+#endif
         preferred_compression == SPICE_IMAGE_COMPRESSION_GLZ) {
         if (can_lz_compress(bitmap)) {
             return preferred_compression;
@@ -747,11 +934,28 @@ int dcc_compress_image(DisplayChannelClient *dcc,
             break;
         }
         goto lz_compress;
+#ifdef USE_ZSTD
+    case SPICE_IMAGE_COMPRESSION_ZSTD:
+        if (red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(dcc),
+                                               SPICE_DISPLAY_CAP_ZSTD_COMPRESSION)) {
+            success = image_encoders_compress_zstd(&dcc->priv->encoders, dest, src, o_comp_data);
+            if (success) {
+                break;
+            }
+        }
+        goto lz_compress;
+#endif
 #ifdef USE_LZ4
     case SPICE_IMAGE_COMPRESSION_LZ4:
         if (red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(dcc),
                                                SPICE_DISPLAY_CAP_LZ4_COMPRESSION)) {
-            success = image_encoders_compress_lz4(&dcc->priv->encoders, dest, src, o_comp_data);
+            gboolean stream_mode = FALSE;
+#if HAVE_DECL_SPICE_DISPLAY_CAP_LZ4_STREAM
+            stream_mode = red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(dcc),
+                                                             SPICE_DISPLAY_CAP_LZ4_STREAM);
+#endif
+            success = image_encoders_compress_lz4(&dcc->priv->encoders, dest, src, o_comp_data,
+                                                  stream_mode);
             break;
         }
 #endif
@@ -774,10 +978,6 @@ lz_compress:
     return success;
 }
 
-#define CLIENT_PALETTE_CACHE
-#include "cache-item.tmpl.c"
-#undef CLIENT_PALETTE_CACHE
-
 void dcc_palette_cache_palette(DisplayChannelClient *dcc, SpicePalette *palette,
                                uint8_t *flags)
 {
@@ -785,11 +985,22 @@ void dcc_palette_cache_palette(DisplayChannelClient *dcc, SpicePalette *palette,
         return;
     }
     if (palette->unique) {
-        if (red_palette_cache_find(dcc, palette->unique)) {
+        DisplayChannel *display = DCC_TO_DC(dcc);
+        DccCacheStats *stats = &dcc->priv->cache_stats;
+
+        stats->palette_lookups++;
+        if (red_cache_find(&dcc->priv->palette_cache, palette->unique)) {
+            uint64_t saved = palette->num_ents * sizeof(palette->ents[0]);
+
+            stats->palette_hits++;
+            stats->palette_saved_bytes += saved;
+            stat_inc_counter(reds, display->palette_hits_counter, 1);
+            stat_inc_counter(reds, display->palette_saved_counter, saved);
             *flags |= SPICE_BITMAP_FLAGS_PAL_FROM_CACHE;
             return;
         }
-        if (red_palette_cache_add(dcc, palette->unique, 1)) {
+        stat_inc_counter(reds, display->palette_misses_counter, 1);
+        if (red_cache_add(&dcc->priv->palette_cache, palette->unique, 1)) {
             *flags |= SPICE_BITMAP_FLAGS_PAL_CACHE_ME;
         }
     }
@@ -797,7 +1008,113 @@ void dcc_palette_cache_palette(DisplayChannelClient *dcc, SpicePalette *palette,
 
 void dcc_palette_cache_reset(DisplayChannelClient *dcc)
 {
-    red_palette_cache_reset(dcc, CLIENT_PALETTE_CACHE_SIZE);
+    red_cache_reset(&dcc->priv->palette_cache);
+}
+
+#define DCC_CACHE_STATS_INTERVAL (NSEC_PER_SEC * 60)
+
+static const char *const image_stat_type_names[DCC_IMAGE_STAT_LAST] = {
+    [DCC_IMAGE_STAT_BITMAP] = "bitmap",
+    [DCC_IMAGE_STAT_SURFACE] = "surface",
+    [DCC_IMAGE_STAT_FROM_CACHE] = "from_cache",
+    [DCC_IMAGE_STAT_FROM_CACHE_LOSSLESS] = "from_cache_ll",
+    [DCC_IMAGE_STAT_QUIC] = "quic",
+    [DCC_IMAGE_STAT_LZ_RGB] = "lz_rgb",
+    [DCC_IMAGE_STAT_LZ_PLT] = "lz_plt",
+    [DCC_IMAGE_STAT_GLZ_RGB] = "glz_rgb",
+    [DCC_IMAGE_STAT_ZLIB_GLZ_RGB] = "zlib_glz_rgb",
+    [DCC_IMAGE_STAT_JPEG] = "jpeg",
+    [DCC_IMAGE_STAT_JPEG_ALPHA] = "jpeg_alpha",
+    [DCC_IMAGE_STAT_LZ4] = "lz4",
+#ifdef USE_ZSTD
+    [DCC_IMAGE_STAT_ZSTD] = "zstd",
+#endif
+};
+
+const char *dcc_image_stat_type_name(DccImageStatType type)
+{
+    spice_return_val_if_fail(type < DCC_IMAGE_STAT_LAST, "invalid");
+
+    return image_stat_type_names[type];
+}
+
+static DccImageStatType image_stat_type(uint8_t image_type)
+{
+    switch (image_type) {
+    case SPICE_IMAGE_TYPE_SURFACE:
+        return DCC_IMAGE_STAT_SURFACE;
+    case SPICE_IMAGE_TYPE_FROM_CACHE:
+        return DCC_IMAGE_STAT_FROM_CACHE;
+    case SPICE_IMAGE_TYPE_FROM_CACHE_LOSSLESS:
+        return DCC_IMAGE_STAT_FROM_CACHE_LOSSLESS;
+    case SPICE_IMAGE_TYPE_QUIC:
+        return DCC_IMAGE_STAT_QUIC;
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+        return DCC_IMAGE_STAT_LZ_RGB;
+    case SPICE_IMAGE_TYPE_LZ_PLT:
+        return DCC_IMAGE_STAT_LZ_PLT;
+    case SPICE_IMAGE_TYPE_GLZ_RGB:
+        return DCC_IMAGE_STAT_GLZ_RGB;
+    case SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB:
+        return DCC_IMAGE_STAT_ZLIB_GLZ_RGB;
+    case SPICE_IMAGE_TYPE_JPEG:
+        return DCC_IMAGE_STAT_JPEG;
+    case SPICE_IMAGE_TYPE_JPEG_ALPHA:
+        return DCC_IMAGE_STAT_JPEG_ALPHA;
+    case SPICE_IMAGE_TYPE_LZ4:
+        return DCC_IMAGE_STAT_LZ4;
+#ifdef USE_ZSTD
+    case SPICE_IMAGE_TYPE_ZSTD:
+        return DCC_IMAGE_STAT_ZSTD;
+#endif
+    default:
+        return DCC_IMAGE_STAT_BITMAP;
+    }
+}
+
+/* bytes is the size of the image data sent, for the cache hits the size
+ * it had when it was added to the cache */
+void dcc_cache_stats_add_image(DisplayChannelClient *dcc, uint8_t image_type, uint64_t bytes)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    DccCacheStats *stats = &dcc->priv->cache_stats;
+    DccImageStatType type = image_stat_type(image_type);
+    red_time_t now;
+
+    stats->images[type]++;
+    stats->image_bytes[type] += bytes;
+    stat_inc_counter(reds, display->image_type_counters[type], 1);
+    stat_inc_counter(reds, display->image_type_bytes_counters[type], bytes);
+
+    now = spice_get_monotonic_time_ns();
+    if (stats->print_time == 0) {
+        stats->print_time = now;
+    } else if (now - stats->print_time >= DCC_CACHE_STATS_INTERVAL) {
+        dcc_cache_stats_print(dcc);
+        stats->print_time = now;
+    }
+}
+
+void dcc_cache_stats_print(DisplayChannelClient *dcc)
+{
+    DccCacheStats *stats = &dcc->priv->cache_stats;
+    int i;
+
+    spice_debug("display %u client %p cache stats:", dcc->priv->id, dcc);
+    spice_debug("pixmap cache: %" PRIu64 " lookups %" PRIu64 " hits (%.1f%%)",
+                stats->pixmap_lookups, stats->pixmap_hits,
+                stats->pixmap_lookups ? stats->pixmap_hits * 100.0 / stats->pixmap_lookups : 0.0);
+    spice_debug("palette cache: %" PRIu64 " lookups %" PRIu64 " hits (%.1f%%) %" PRIu64 " bytes saved",
+                stats->palette_lookups, stats->palette_hits,
+                stats->palette_lookups ? stats->palette_hits * 100.0 / stats->palette_lookups : 0.0,
+                stats->palette_saved_bytes);
+    for (i = 0; i < DCC_IMAGE_STAT_LAST; i++) {
+        if (stats->images[i] == 0) {
+            continue;
+        }
+        spice_debug("%-14s %10" PRIu64 " images %14" PRIu64 " bytes",
+                    image_stat_type_names[i], stats->images[i], stats->image_bytes[i]);
+    }
 }
 
 static void dcc_push_release(DisplayChannelClient *dcc, uint8_t type, uint64_t id,
@@ -825,17 +1142,22 @@ static void dcc_push_release(DisplayChannelClient *dcc, uint8_t type, uint64_t i
     free_list->res->resources[free_list->res->count++].id = id;
 }
 
+static void dcc_release_pixmap(NewCacheItem *item, void *opaque)
+{
+    DisplayChannelClient *dcc = opaque;
+
+    dcc_push_release(dcc, SPICE_RES_TYPE_PIXMAP, item->id, item->sync);
+}
+
 int dcc_pixmap_cache_unlocked_add(DisplayChannelClient *dcc, uint64_t id,
-                                  uint32_t size, int lossy)
+                                  uint32_t size, uint32_t cost, int lossy)
 {
     PixmapCache *cache = dcc->priv->pixmap_cache;
-    NewCacheItem *item;
     uint64_t serial;
-    int key;
+    int lossy_item;
 
     spice_assert(size > 0);
 
-    item = spice_new(NewCacheItem, 1);
     serial = red_channel_client_get_message_serial(RED_CHANNEL_CLIENT(dcc));
 
     if (cache->generation != dcc->priv->pixmap_cache_generation) {
@@ -844,51 +1166,18 @@ int dcc_pixmap_cache_unlocked_add(DisplayChannelClient *dcc, uint64_t id,
                                              RED_CHANNEL_CLIENT(dcc), RED_PIPE_ITEM_TYPE_PIXMAP_SYNC);
             dcc->priv->pending_pixmaps_sync = TRUE;
         }
-        free(item);
         return FALSE;
     }
 
-    cache->available -= size;
-    while (cache->available < 0) {
-        NewCacheItem *tail;
-        NewCacheItem **now;
-
-        verify(SPICE_OFFSETOF(NewCacheItem, lru_link) == 0);
-        if (!(tail = (NewCacheItem *)ring_get_tail(&cache->lru)) ||
-                                                   tail->sync[dcc->priv->id] == serial) {
-            cache->available += size;
-            free(item);
-            return FALSE;
-        }
+    /* the lock free lookup may have missed an item that another channel
+     * client of the same client added meanwhile, count it as a hit and
+     * send the image without caching it again */
+    if (pixmap_cache_unlocked_hit(cache, dcc->priv->id, id, serial, &lossy_item, NULL)) {
+        return FALSE;
+    }
 
-        now = &cache->hash_table[BITS_CACHE_HASH_KEY(tail->id)];
-        for (;;) {
-            spice_assert(*now);
-            if (*now == tail) {
-                *now = tail->next;
-                break;
-            }
-            now = &(*now)->next;
-        }
-        ring_remove(&tail->lru_link);
-        cache->items--;
-        cache->available += tail->size;
-        cache->sync[dcc->priv->id] = serial;
-        dcc_push_release(dcc, SPICE_RES_TYPE_PIXMAP, tail->id, tail->sync);
-        free(tail);
-    }
-    ++cache->items;
-    item->next = cache->hash_table[(key = BITS_CACHE_HASH_KEY(id))];
-    cache->hash_table[key] = item;
-    ring_item_init(&item->lru_link);
-    ring_add(&cache->lru, &item->lru_link);
-    item->id = id;
-    item->size = size;
-    item->lossy = lossy;
-    memset(item->sync, 0, sizeof(item->sync));
-    item->sync[dcc->priv->id] = serial;
-    cache->sync[dcc->priv->id] = serial;
-    return TRUE;
+    return pixmap_cache_unlocked_add(cache, dcc->priv->id, id, size, cost, lossy, serial,
+                                     dcc_release_pixmap, dcc);
 }
 
 static int dcc_handle_init(DisplayChannelClient *dcc, SpiceMsgcDisplayInit *init)
@@ -902,7 +1191,8 @@ static int dcc_handle_init(DisplayChannelClient *dcc, SpiceMsgcDisplayInit *init
     spice_return_val_if_fail(!dcc->priv->pixmap_cache, FALSE);
     dcc->priv->pixmap_cache = pixmap_cache_get(client,
                                                init->pixmap_cache_id,
-                                               init->pixmap_cache_size);
+                                               init->pixmap_cache_size,
+                                               DCC_TO_DC(dcc)->pixmap_cache_policy);
     spice_return_val_if_fail(dcc->priv->pixmap_cache, FALSE);
 
     success = image_encoders_get_glz_dictionary(&dcc->priv->encoders,
@@ -959,6 +1249,9 @@ static int dcc_handle_preferred_compression(DisplayChannelClient *dcc,
     case SPICE_IMAGE_COMPRESSION_QUIC:
 #ifdef USE_LZ4
     case SPICE_IMAGE_COMPRESSION_LZ4:
+#endif
+#ifdef USE_ZSTD
+    case SPICE_IMAGE_COMPRESSION_ZSTD:
 #endif
     case SPICE_IMAGE_COMPRESSION_LZ:
     case SPICE_IMAGE_COMPRESSION_GLZ:
@@ -1067,6 +1360,65 @@ static int restore_surfaces_lossy(DisplayChannelClient *dcc,
     return TRUE;
 }
 
+static MigrateDisplayPixmapCache *migrate_data_get_pixmap_cache(SpiceMigrateDataHeader *header,
+                                                                uint32_t size)
+{
+    SpiceMigrateDataDisplayPixmapCache *pixmap_cache_data;
+    MigrateDisplayPixmapCache *mig_cache;
+    uint32_t ptr;
+
+    if (header->version < SPICE_MIGRATE_DATA_DISPLAY_PIXMAP_CACHE_VERSION ||
+        size < sizeof(SpiceMigrateDataHeader) + sizeof(SpiceMigrateDataDisplay) +
+               sizeof(*pixmap_cache_data)) {
+        return NULL;
+    }
+    pixmap_cache_data = (SpiceMigrateDataDisplayPixmapCache *)
+        ((uint8_t *)(header + 1) + sizeof(SpiceMigrateDataDisplay));
+    ptr = pixmap_cache_data->pixmap_cache_items_ptr;
+    if (!ptr || ptr > size - sizeof(*mig_cache)) {
+        return NULL;
+    }
+    mig_cache = (MigrateDisplayPixmapCache *)((uint8_t *)header + ptr);
+    if (mig_cache->num_items > (size - ptr - sizeof(*mig_cache)) / sizeof(mig_cache->items[0])) {
+        spice_warning("invalid pixmap cache migration data");
+        return NULL;
+    }
+    return mig_cache;
+}
+
+/* the client kept the images of the source server cache, they are added
+ * back instead of resetting the caches */
+static void dcc_restore_pixmap_cache(DisplayChannelClient *dcc, int64_t size,
+                                     MigrateDisplayPixmapCache *mig_cache)
+{
+    PixmapCache *cache = dcc->priv->pixmap_cache;
+    uint32_t i;
+
+    pthread_mutex_lock(&cache->lock);
+    pixmap_cache_clear(cache);
+    pixmap_cache_write_begin(cache);
+    cache->size = size;
+    cache->available = size;
+    for (i = 0; i < mig_cache->num_items; i++) {
+        MigrateDisplayPixmapCacheItem *mig_item = &mig_cache->items[i];
+        NewCacheItem *item;
+
+        // the extra items are still at the client, but never used
+        if (mig_item->size == 0 || mig_item->size > cache->available ||
+            pixmap_cache_unlocked_lookup(cache, mig_item->id)) {
+            continue;
+        }
+        item = pixmap_cache_unlocked_insert(cache, mig_item->id, mig_item->size, mig_item->cost);
+        item->lossy = mig_item->lossy;
+        // the client got all the messages of the source server
+        memset(item->sync, 0, sizeof(item->sync));
+        cache->available -= mig_item->size;
+    }
+    pixmap_cache_write_end(cache);
+    pthread_mutex_unlock(&cache->lock);
+    spice_info("restored %d pixmap cache items", cache->items);
+}
+
 int dcc_handle_migrate_data(DisplayChannelClient *dcc, uint32_t size, void *message)
 {
     DisplayChannel *display = DCC_TO_DC(dcc);
@@ -1087,7 +1439,8 @@ int dcc_handle_migrate_data(DisplayChannelClient *dcc, uint32_t size, void *mess
      * data and unfreezes the cache by setting its size > 0 and by triggering
      * pixmap_cache_reset */
     dcc->priv->pixmap_cache = pixmap_cache_get(red_channel_client_get_client(RED_CHANNEL_CLIENT(dcc)),
-                                               migrate_data->pixmap_cache_id, -1);
+                                               migrate_data->pixmap_cache_id, -1,
+                                               DCC_TO_DC(dcc)->pixmap_cache_policy);
     spice_return_val_if_fail(dcc->priv->pixmap_cache, FALSE);
 
     pthread_mutex_lock(&dcc->priv->pixmap_cache->lock);
@@ -1098,10 +1451,17 @@ int dcc_handle_migrate_data(DisplayChannelClient *dcc, uint32_t size, void *mess
     pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
 
     if (migrate_data->pixmap_cache_freezer) {
-        /* activating the cache. The cache will start to be active after
-         * pixmap_cache_reset is called, when handling RED_PIPE_ITEM_TYPE_PIXMAP_RESET */
-        dcc->priv->pixmap_cache->size = migrate_data->pixmap_cache_size;
-        red_channel_client_pipe_add_type(RED_CHANNEL_CLIENT(dcc), RED_PIPE_ITEM_TYPE_PIXMAP_RESET);
+        MigrateDisplayPixmapCache *mig_cache = migrate_data_get_pixmap_cache(header, size);
+
+        if (mig_cache) {
+            dcc_restore_pixmap_cache(dcc, migrate_data->pixmap_cache_size, mig_cache);
+        } else {
+            /* activating the cache. The cache will start to be active after
+             * pixmap_cache_reset is called, when handling RED_PIPE_ITEM_TYPE_PIXMAP_RESET */
+            dcc->priv->pixmap_cache->size = migrate_data->pixmap_cache_size;
+            red_channel_client_pipe_add_type(RED_CHANNEL_CLIENT(dcc),
+                                             RED_PIPE_ITEM_TYPE_PIXMAP_RESET);
+        }
     }
 
     if (dcc_handle_migrate_glz_dictionary(dcc, migrate_data)) {
@@ -24,11 +24,9 @@
 #include "red-worker.h"
 #include "display-limits.h"
 
-#define PALETTE_CACHE_HASH_SHIFT 8
-#define PALETTE_CACHE_HASH_SIZE (1 << PALETTE_CACHE_HASH_SHIFT)
-#define PALETTE_CACHE_HASH_MASK (PALETTE_CACHE_HASH_SIZE - 1)
-#define PALETTE_CACHE_HASH_KEY(id) ((id) & PALETTE_CACHE_HASH_MASK)
-#define CLIENT_PALETTE_CACHE_SIZE 128
+/* the clients keep the palettes in unbounded tables and drop them on
+ * SPICE_MSG_DISPLAY_INVAL_PALETTE, the size only bounds what is tracked */
+#define CLIENT_PALETTE_CACHE_SIZE 1024
 
 #define DISPLAY_CLIENT_MIGRATE_DATA_TIMEOUT (NSEC_PER_SEC * 10)
 #define DISPLAY_CLIENT_RETRY_INTERVAL 10000 //micro
@@ -57,6 +55,30 @@ typedef struct FreeList {
     WaitForChannels wait;
 } FreeList;
 
+/* How fill_bits() sent an image: one entry per SpiceImageType, so the
+ * cache hits and the codecs chosen can be told apart */
+typedef enum {
+    DCC_IMAGE_STAT_BITMAP,
+    DCC_IMAGE_STAT_SURFACE,
+    DCC_IMAGE_STAT_FROM_CACHE,
+    DCC_IMAGE_STAT_FROM_CACHE_LOSSLESS,
+    DCC_IMAGE_STAT_QUIC,
+    DCC_IMAGE_STAT_LZ_RGB,
+    DCC_IMAGE_STAT_LZ_PLT,
+    DCC_IMAGE_STAT_GLZ_RGB,
+    DCC_IMAGE_STAT_ZLIB_GLZ_RGB,
+    DCC_IMAGE_STAT_JPEG,
+    DCC_IMAGE_STAT_JPEG_ALPHA,
+    DCC_IMAGE_STAT_LZ4,
+#ifdef USE_ZSTD
+    DCC_IMAGE_STAT_ZSTD,
+#endif
+
+    DCC_IMAGE_STAT_LAST
+} DccImageStatType;
+
+const char *dcc_image_stat_type_name(DccImageStatType type);
+
 typedef struct DisplayChannelClient DisplayChannelClient;
 
 #define DCC_TO_DC(dcc) ((DisplayChannel*)red_channel_client_get_channel((RedChannelClient*)dcc))
@@ -107,7 +129,8 @@ DisplayChannelClient*      dcc_new                                   (DisplayCha
                                                                       int num_caps,
                                                                       SpiceImageCompression image_compression,
                                                                       spice_wan_compression_t jpeg_state,
-                                                                      spice_wan_compression_t zlib_glz_state);
+                                                                      spice_wan_compression_t zlib_glz_state,
+                                                                      int zstd_level);
 void                       dcc_start                                 (DisplayChannelClient *dcc);
 void                       dcc_stop                                  (DisplayChannelClient *dcc);
 int                        dcc_handle_message                        (RedChannelClient *rcc,
@@ -131,12 +154,22 @@ RedImageItem *             dcc_add_surface_area_image                (DisplayCha
                                                                       SpiceRect *area,
                                                                       RedPipeItem *pos,
                                                                       int can_lossy);
+void                       dcc_upgrade_lossy_areas                   (DisplayChannelClient *dcc);
+int                        dcc_get_lossy_upgrade_timeout             (DisplayChannelClient *dcc);
+int                        dcc_is_area_lossy                         (DisplayChannelClient *dcc,
+                                                                      uint32_t surface_id,
+                                                                      const SpiceRect *area);
+void                       dcc_cache_stats_add_image                 (DisplayChannelClient *dcc,
+                                                                      uint8_t image_type,
+                                                                      uint64_t bytes);
+void                       dcc_cache_stats_print                     (DisplayChannelClient *dcc);
 void                       dcc_palette_cache_reset                   (DisplayChannelClient *dcc);
 void                       dcc_palette_cache_palette                 (DisplayChannelClient *dcc,
                                                                       SpicePalette *palette,
                                                                       uint8_t *flags);
 int                        dcc_pixmap_cache_unlocked_add             (DisplayChannelClient *dcc,
-                                                                      uint64_t id, uint32_t size, int lossy);
+                                                                      uint64_t id, uint32_t size,
+                                                                      uint32_t cost, int lossy);
 void                       dcc_prepend_drawable                      (DisplayChannelClient *dcc,
                                                                       Drawable *drawable);
 void                       dcc_append_drawable                       (DisplayChannelClient *dcc,
@@ -146,6 +179,10 @@ void                       dcc_add_drawable_after                    (DisplayCha
                                                                       RedPipeItem *pos);
 void                       dcc_send_item                             (RedChannelClient *dcc,
                                                                       RedPipeItem *item);
+/* posts the frame of a stream encoded on a thread, returns FALSE if the
+ * drawable must be added to the pipe */
+int                        dcc_stream_post_frame                     (DisplayChannelClient *dcc,
+                                                                      Drawable *drawable);
 int                        dcc_clear_surface_drawables_from_pipe     (DisplayChannelClient *dcc,
                                                                       int surface_id,
                                                                       int wait_if_used);
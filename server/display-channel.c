@@ -18,11 +18,14 @@
 #include <config.h>
 #endif
 
+#include <spice/stats.h>
 #include <common/sw_canvas.h>
 
 #include "display-channel.h"
 
 static void drawable_draw(DisplayChannel *display, Drawable *drawable);
+static Drawable* current_find_intersects_rect(Ring *current, RingItem *from,
+                                              const SpiceRect *area);
 static Drawable *display_channel_drawable_try_new(DisplayChannel *display,
                                                   uint32_t process_commands_generation);
 
@@ -119,6 +122,28 @@ int display_channel_get_streams_timeout(DisplayChannel *display)
     return timeout;
 }
 
+int display_channel_get_lossy_upgrade_timeout(DisplayChannel *display)
+{
+    DisplayChannelClient *dcc;
+    GList *link, *next;
+    int timeout = INT_MAX;
+
+    FOREACH_CLIENT(display, link, next, dcc) {
+        timeout = MIN(timeout, dcc_get_lossy_upgrade_timeout(dcc));
+    }
+    return timeout;
+}
+
+void display_channel_upgrade_lossy_areas(DisplayChannel *display)
+{
+    DisplayChannelClient *dcc;
+    GList *link, *next;
+
+    FOREACH_CLIENT(display, link, next, dcc) {
+        dcc_upgrade_lossy_areas(dcc);
+    }
+}
+
 void display_channel_set_stream_video(DisplayChannel *display, int stream_video)
 {
     spice_return_if_fail(display);
@@ -167,6 +192,7 @@ static void stop_streams(DisplayChannel *display)
 
     display->next_item_trace = 0;
     memset(display->items_trace, 0, sizeof(display->items_trace));
+    stream_heat_map_reset(&display->heat_map);
 }
 
 void display_channel_surface_unref(DisplayChannel *display, uint32_t surface_id)
@@ -893,6 +919,200 @@ static void handle_self_bitmap(DisplayChannel *display, Drawable *drawable)
     red_drawable->self_bitmap_image = image;
 }
 
+/* the unchanged part of a copy must be at least that much of its area
+ * to be worth sending a new, cropped, image */
+#define COPY_DIFF_MIN_UNCHANGED_PERCENT 25
+
+typedef enum {
+    COPY_DIFF_KEEP,
+    COPY_DIFF_CROP,
+    COPY_DIFF_DROP,
+} CopyDiffResult;
+
+static inline uint8_t *copy_diff_bitmap_line(SpiceBitmap *bitmap, int line)
+{
+    if (!(bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN)) {
+        line = bitmap->y - 1 - line;
+    }
+    return bitmap->data->chunk[0].data + line * bitmap->stride;
+}
+
+/* Only a plain copy of a bitmap over a surface area which the clients
+ * already have losslessly can be reduced. The area must not be part of a
+ * pending drawable, which could still be excluded from the pipes, nor of a
+ * stream, which frames are lossy, nor of the areas a client still has
+ * lossily, like a jpeg image or the last frame of an ended stream, which
+ * the copy repairs. */
+static int copy_diff_is_possible(DisplayChannel *display, RedDrawable *red_drawable)
+{
+    RedSurface *surface = &display->surfaces[red_drawable->surface_id];
+    SpiceCopy *copy = &red_drawable->u.copy;
+    SpiceImage *image = copy->src_bitmap;
+    DisplayChannelClient *dcc;
+    GList *link, *next;
+    RingItem *item;
+
+    if (!display->enable_copy_diff || display->enable_jpeg ||
+        red_drawable->type != QXL_DRAW_COPY ||
+        red_drawable->effect != QXL_EFFECT_OPAQUE ||
+        red_drawable->self_bitmap ||
+        red_drawable->clip.type != SPICE_CLIP_TYPE_NONE ||
+        copy->rop_descriptor != SPICE_ROPD_OP_PUT ||
+        copy->mask.bitmap != NULL) {
+        return FALSE;
+    }
+    /* an image to cache may be a hit already */
+    if (!image || image->descriptor.type != SPICE_IMAGE_TYPE_BITMAP ||
+        (image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME) ||
+        image->u.bitmap.format != SPICE_BITMAP_FMT_32BIT ||
+        image->u.bitmap.data->num_chunks != 1 ||
+        image->u.bitmap.data->chunk[0].len < image->u.bitmap.y * image->u.bitmap.stride) {
+        return FALSE;
+    }
+    if (copy->src_area.right - copy->src_area.left != red_drawable->bbox.right - red_drawable->bbox.left ||
+        copy->src_area.bottom - copy->src_area.top != red_drawable->bbox.bottom - red_drawable->bbox.top) {
+        return FALSE;
+    }
+    if (!surface->context.canvas_draws_on_surface ||
+        surface->context.format != SPICE_SURFACE_FMT_32_xRGB) {
+        return FALSE;
+    }
+    if (current_find_intersects_rect(&surface->current_list, NULL, &red_drawable->bbox)) {
+        return FALSE;
+    }
+    if (red_drawable->surface_id == 0) {
+        RING_FOREACH(item, &display->streams) {
+            Stream *stream = SPICE_CONTAINEROF(item, Stream, link);
+            if (rect_intersects(&stream->dest_area, &red_drawable->bbox)) {
+                return FALSE;
+            }
+        }
+    }
+    FOREACH_CLIENT(display, link, next, dcc) {
+        if (dcc_is_area_lossy(dcc, red_drawable->surface_id, &red_drawable->bbox)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Compares a copy with the surface content and finds the bounding box of
+ * the pixels it changes */
+static int copy_diff_find_changed(DisplayChannel *display, RedDrawable *red_drawable,
+                                  SpiceRect *changed)
+{
+    DrawContext *context = &display->surfaces[red_drawable->surface_id].context;
+    SpiceCopy *copy = &red_drawable->u.copy;
+    SpiceBitmap *bitmap = &copy->src_bitmap->u.bitmap;
+    SpiceRect *bbox = &red_drawable->bbox;
+    int width = bbox->right - bbox->left;
+    int y;
+
+    changed->left = bbox->right;
+    changed->right = bbox->left;
+    changed->top = bbox->bottom;
+    changed->bottom = bbox->top;
+
+    for (y = bbox->top; y < bbox->bottom; y++) {
+        const uint32_t *dest = (const uint32_t *)((uint8_t *)context->line_0 + y * context->stride) +
+                               bbox->left;
+        const uint32_t *src = (const uint32_t *)copy_diff_bitmap_line(bitmap,
+                                  copy->src_area.top + y - bbox->top) + copy->src_area.left;
+        int x;
+
+        if (memcmp(dest, src, width * sizeof(uint32_t)) == 0) {
+            continue;
+        }
+        /* the pad byte of xRGB pixels doesn't matter */
+        for (x = 0; x < width && ((dest[x] ^ src[x]) & 0x00ffffff) == 0; x++);
+        if (x == width) {
+            continue;
+        }
+        changed->left = MIN(changed->left, bbox->left + x);
+        for (x = width - 1; ((dest[x] ^ src[x]) & 0x00ffffff) == 0; x--);
+        changed->right = MAX(changed->right, bbox->left + x + 1);
+        changed->top = MIN(changed->top, y);
+        changed->bottom = y + 1;
+    }
+    return changed->top < changed->bottom;
+}
+
+/* Replaces the source of the copy with the changed area only */
+static void copy_diff_crop(DisplayChannel *display, RedDrawable *red_drawable,
+                           const SpiceRect *changed)
+{
+    SpiceCopy *copy = &red_drawable->u.copy;
+    SpiceBitmap *src = &copy->src_bitmap->u.bitmap;
+    int32_t width = changed->right - changed->left;
+    int32_t height = changed->bottom - changed->top;
+    int dest_stride = width * sizeof(uint32_t);
+    SpiceImage *image;
+    uint8_t *dest;
+    int y;
+
+    image = spice_new0(SpiceImage, 1);
+    image->descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
+    image->descriptor.flags = copy->src_bitmap->descriptor.flags & SPICE_IMAGE_FLAGS_HIGH_BITS_SET;
+    QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_RED, display_channel_generate_uid(display));
+    image->u.bitmap.flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    image->u.bitmap.format = src->format;
+    image->u.bitmap.stride = dest_stride;
+    image->descriptor.width = image->u.bitmap.x = width;
+    image->descriptor.height = image->u.bitmap.y = height;
+    image->u.bitmap.palette = NULL;
+
+    dest = (uint8_t *)spice_malloc_n(height, dest_stride);
+    image->u.bitmap.data = spice_chunks_new_linear(dest, height * dest_stride);
+    image->u.bitmap.data->flags |= SPICE_CHUNKS_FLAGS_FREE;
+
+    for (y = 0; y < height; y++) {
+        int line = copy->src_area.top + changed->top - red_drawable->bbox.top + y;
+        int left = copy->src_area.left + changed->left - red_drawable->bbox.left;
+
+        memcpy(dest + y * dest_stride,
+               copy_diff_bitmap_line(src, line) + left * sizeof(uint32_t), dest_stride);
+    }
+
+    red_put_image(copy->src_bitmap);
+    copy->src_bitmap = image;
+    copy->src_area.left = 0;
+    copy->src_area.top = 0;
+    copy->src_area.right = width;
+    copy->src_area.bottom = height;
+    red_drawable->bbox = *changed;
+}
+
+/* A copy which redraws an area with mostly the same content (e.g. a full
+ * window redraw) is reduced to the part which really changed, or dropped
+ * if nothing did. */
+static CopyDiffResult copy_diff(DisplayChannel *display, RedDrawable *red_drawable)
+{
+    SpiceRect *bbox = &red_drawable->bbox;
+    SpiceRect changed;
+    uint64_t area, changed_area;
+
+    if (!copy_diff_is_possible(display, red_drawable)) {
+        return COPY_DIFF_KEEP;
+    }
+
+    area = (uint64_t)(bbox->right - bbox->left) * (bbox->bottom - bbox->top);
+    if (!copy_diff_find_changed(display, red_drawable, &changed)) {
+        stat_inc_counter(reds, display->copy_diff_dropped_counter, 1);
+        stat_inc_counter(reds, display->copy_diff_saved_bytes_counter, area * sizeof(uint32_t));
+        return COPY_DIFF_DROP;
+    }
+
+    changed_area = (uint64_t)(changed.right - changed.left) * (changed.bottom - changed.top);
+    if (changed_area * 100 > area * (100 - COPY_DIFF_MIN_UNCHANGED_PERCENT)) {
+        return COPY_DIFF_KEEP;
+    }
+    copy_diff_crop(display, red_drawable, &changed);
+    stat_inc_counter(reds, display->copy_diff_cropped_counter, 1);
+    stat_inc_counter(reds, display->copy_diff_saved_bytes_counter,
+                     (area - changed_area) * sizeof(uint32_t));
+    return COPY_DIFF_CROP;
+}
+
 static void surface_add_reverse_dependency(DisplayChannel *display, int surface_id,
                                              DependItem *depend_item, Drawable *drawable)
 {
@@ -1080,6 +1300,73 @@ static void display_channel_add_drawable(DisplayChannel *display, Drawable *draw
 #endif
 }
 
+/* smaller images are cheap to resend, bigger ones are too expensive to hash */
+#define IMAGE_FINGERPRINT_MIN_SIZE (4 * 1024)
+#define IMAGE_FINGERPRINT_MAX_SIZE (16 * 1024 * 1024)
+
+/* Give the bitmaps the guest didn't ask to cache an id computed from
+ * their content, so the same image sent again under a new id is found
+ * in the client pixmap cache instead of being compressed again.
+ * The client cache ids are 64 bits, the fingerprint is folded. */
+static void image_fingerprint(DisplayChannel *display, SpiceImage *image)
+{
+    uint64_t fingerprint[2];
+    uint64_t size;
+    red_time_t start;
+
+    if (!image || image->descriptor.type != SPICE_IMAGE_TYPE_BITMAP ||
+        (image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME)) {
+        return;
+    }
+
+    size = (uint64_t) image->u.bitmap.y * image->u.bitmap.stride;
+    if (size < IMAGE_FINGERPRINT_MIN_SIZE || size > IMAGE_FINGERPRINT_MAX_SIZE) {
+        stat_inc_counter(reds, display->fingerprint_skipped_counter, 1);
+        return;
+    }
+
+    start = spice_get_monotonic_time_ns();
+    bitmap_get_fingerprint(&image->u.bitmap, fingerprint);
+    image->descriptor.id = fingerprint[0] ^ fingerprint[1];
+    image->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_ME;
+    stat_inc_counter(reds, display->fingerprint_time_counter,
+                     spice_get_monotonic_time_ns() - start);
+    stat_inc_counter(reds, display->fingerprint_images_counter, 1);
+    stat_inc_counter(reds, display->fingerprint_bytes_counter, size);
+}
+
+static void display_channel_fingerprint_images(DisplayChannel *display,
+                                               RedDrawable *red_drawable)
+{
+    if (!display->enable_image_fingerprint) {
+        return;
+    }
+
+    switch (red_drawable->type) {
+    case QXL_DRAW_COPY:
+        image_fingerprint(display, red_drawable->u.copy.src_bitmap);
+        break;
+    case QXL_DRAW_BLEND:
+        image_fingerprint(display, red_drawable->u.blend.src_bitmap);
+        break;
+    case QXL_DRAW_TRANSPARENT:
+        image_fingerprint(display, red_drawable->u.transparent.src_bitmap);
+        break;
+    case QXL_DRAW_ALPHA_BLEND:
+        image_fingerprint(display, red_drawable->u.alpha_blend.src_bitmap);
+        break;
+    case QXL_DRAW_ROP3:
+        image_fingerprint(display, red_drawable->u.rop3.src_bitmap);
+        break;
+    case QXL_DRAW_COMPOSITE:
+        image_fingerprint(display, red_drawable->u.composite.src_bitmap);
+        image_fingerprint(display, red_drawable->u.composite.mask_bitmap);
+        break;
+    default:
+        break;
+    }
+}
+
 void display_channel_process_draw(DisplayChannel *display, RedDrawable *red_drawable,
                                   uint32_t process_commands_generation)
 {
@@ -1091,6 +1378,12 @@ void display_channel_process_draw(DisplayChannel *display, RedDrawable *red_draw
         return;
     }
 
+    if (copy_diff(display, red_drawable) == COPY_DIFF_DROP) {
+        drawable_unref(drawable);
+        return;
+    }
+
+    display_channel_fingerprint_images(display, red_drawable);
     display_channel_add_drawable(display, drawable);
 
     drawable_unref(drawable);
@@ -1890,7 +2183,8 @@ static SpiceCanvas *image_surfaces_get(SpiceImageSurfaces *surfaces, uint32_t su
 DisplayChannel* display_channel_new(SpiceServer *reds, RedWorker *worker, 
                                     int migrate, int stream_video,
                                     GArray *video_codecs,
-                                    uint32_t n_surfaces)
+                                    uint32_t n_surfaces,
+                                    size_t image_cache_size)
 {
     DisplayChannel *display;
     ChannelCbs cbs = {
@@ -1925,8 +2219,77 @@ DisplayChannel* display_channel_new(SpiceServer *reds, RedWorker *worker,
                                                      "add_to_cache", TRUE);
     display->non_cache_counter = stat_add_counter(reds, channel->stat,
                                                   "non_cache", TRUE);
+    display->copy_diff_dropped_counter = stat_add_counter(reds, channel->stat,
+                                                          "copy_diff_dropped", TRUE);
+    display->copy_diff_cropped_counter = stat_add_counter(reds, channel->stat,
+                                                          "copy_diff_cropped", TRUE);
+    display->copy_diff_saved_bytes_counter = stat_add_counter(reds, channel->stat,
+                                                              "copy_diff_saved", TRUE);
+    display->fingerprint_images_counter = stat_add_counter(reds, channel->stat,
+                                                           "fingerprint_images", TRUE);
+    display->fingerprint_skipped_counter = stat_add_counter(reds, channel->stat,
+                                                            "fingerprint_skipped", TRUE);
+    display->fingerprint_bytes_counter = stat_add_counter(reds, channel->stat,
+                                                          "fingerprint_bytes", TRUE);
+    display->fingerprint_time_counter = stat_add_counter(reds, channel->stat,
+                                                         "fingerprint_time_ns", TRUE);
+    {
+        /* named after the policy, to compare the hit ratio and the bytes
+         * saved by each one */
+        const char *policy = pixmap_cache_policy_get(reds_get_pixmap_cache_policy(reds))->name;
+        char name[SPICE_STAT_NODE_NAME_MAX];
+
+        snprintf(name, sizeof(name), "pcache_%s_lookups", policy);
+        display->pixmap_cache_lookups_counter = stat_add_counter(reds, channel->stat, name, TRUE);
+        snprintf(name, sizeof(name), "pcache_%s_hits", policy);
+        display->pixmap_cache_hits_counter = stat_add_counter(reds, channel->stat, name, TRUE);
+        snprintf(name, sizeof(name), "pcache_%s_saved", policy);
+        display->pixmap_cache_saved_counter = stat_add_counter(reds, channel->stat, name, TRUE);
+    }
+    display->lossy_upgrades_counter = stat_add_counter(reds, channel->stat,
+                                                       "lossy_upgrades", TRUE);
+    display->lossy_upgrade_bytes_counter = stat_add_counter(reds, channel->stat,
+                                                            "lossy_upgrade_bytes", TRUE);
+    display->palette_hits_counter = stat_add_counter(reds, channel->stat,
+                                                     "palette_hits", TRUE);
+    display->palette_misses_counter = stat_add_counter(reds, channel->stat,
+                                                       "palette_misses", TRUE);
+    display->palette_saved_counter = stat_add_counter(reds, channel->stat,
+                                                      "palette_saved", TRUE);
+    /* the time from the stream creation to its first frame */
+    display->stream_starts_counter = stat_add_counter(reds, channel->stat,
+                                                      "stream_starts", TRUE);
+    display->stream_start_time_counter = stat_add_counter(reds, channel->stat,
+                                                          "stream_start_ns", TRUE);
+    {
+        /* images sent by type and codec, the bytes of the cache hits are
+         * the bytes saved */
+        StatNodeRef images = stat_add_node(reds, channel->stat, "images", TRUE);
+        char name[SPICE_STAT_NODE_NAME_MAX];
+        int i;
+
+        for (i = 0; i < DCC_IMAGE_STAT_LAST; i++) {
+            const char *type = dcc_image_stat_type_name(i);
+
+            display->image_type_counters[i] = stat_add_counter(reds, images, type, TRUE);
+            snprintf(name, sizeof(name), "%s_bytes", type);
+            display->image_type_bytes_counters[i] = stat_add_counter(reds, images, name, TRUE);
+        }
+    }
 #endif
     image_encoder_shared_init(&display->encoder_shared_data);
+#ifdef RED_STATISTICS
+    display->encoder_shared_data.glz_window_bytes_counter =
+        stat_add_counter(reds, channel->stat, "glz_window_bytes", TRUE);
+    display->encoder_shared_data.glz_window_images_counter =
+        stat_add_counter(reds, channel->stat, "glz_window_images", TRUE);
+    display->encoder_shared_data.glz_segs_realloc_counter =
+        stat_add_counter(reds, channel->stat, "glz_segs_reallocs", TRUE);
+    display->encoder_shared_data.compress_buf_hits_counter =
+        stat_add_counter(reds, channel->stat, "compress_buf_hits", TRUE);
+    display->encoder_shared_data.compress_buf_misses_counter =
+        stat_add_counter(reds, channel->stat, "compress_buf_misses", TRUE);
+#endif
 
     display->n_surfaces = n_surfaces;
     display->renderer = RED_RENDERER_INVALID;
@@ -1934,10 +2297,34 @@ DisplayChannel* display_channel_new(SpiceServer *reds, RedWorker *worker,
     ring_init(&display->current_list);
     display->image_surfaces.ops = &image_surfaces_ops;
     drawables_init(display);
-    image_cache_init(&display->image_cache);
+    image_cache_init(&display->image_cache, image_cache_size);
+#ifdef RED_STATISTICS
+    display->image_cache.hits_counter =
+        stat_add_counter(reds, channel->stat, "image_cache_hits", TRUE);
+    display->image_cache.misses_counter =
+        stat_add_counter(reds, channel->stat, "image_cache_misses", TRUE);
+    display->image_cache.evictions_counter =
+        stat_add_counter(reds, channel->stat, "image_cache_evicts", TRUE);
+    display->image_cache.resident_bytes_counter =
+        stat_add_counter(reds, channel->stat, "image_cache_bytes", TRUE);
+    display->image_cache.saved_bytes_counter =
+        stat_add_counter(reds, channel->stat, "image_cache_saved", TRUE);
+#endif
     display->stream_video = stream_video;
     display->video_codecs = g_array_ref(video_codecs);
     display_channel_init_streams(display);
+    display->enable_copy_diff = reds_get_copy_diff(reds);
+    spice_info("copy differencing %s", display->enable_copy_diff ? "enabled" : "disabled");
+    display->enable_image_fingerprint = reds_get_image_fingerprint(reds);
+    display->pixmap_cache_policy = pixmap_cache_policy_get(reds_get_pixmap_cache_policy(reds));
+    spice_info("image fingerprinting %s",
+               display->enable_image_fingerprint ? "enabled" : "disabled");
+    display->enable_lossy_upgrade = reds_get_lossy_upgrade(reds);
+    spice_info("lossless upgrade of lossy areas %s",
+               display->enable_lossy_upgrade ? "enabled" : "disabled");
+    display->stream_encode_thread = reds_get_stream_encode_thread(reds);
+    spice_info("stream encoding thread %s",
+               display->stream_encode_thread ? "enabled" : "disabled");
 
     return display;
 }
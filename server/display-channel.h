@@ -101,6 +101,7 @@ enum {
     RED_PIPE_ITEM_TYPE_STREAM_ACTIVATE_REPORT,
     RED_PIPE_ITEM_TYPE_GL_SCANOUT,
     RED_PIPE_ITEM_TYPE_GL_DRAW,
+    RED_PIPE_ITEM_TYPE_STREAM_DATA,
 };
 
 typedef struct MonitorsConfig {
@@ -166,6 +167,11 @@ struct DisplayChannel {
     uint32_t renderer;
     int enable_jpeg;
     int enable_zlib_glz_wrap;
+    int enable_copy_diff;
+    int enable_image_fingerprint;
+    const PixmapCachePolicy *pixmap_cache_policy;
+    int enable_lossy_upgrade;
+    int stream_encode_thread;
 
     Ring current_list; // of TreeItem
     uint32_t current_size;
@@ -182,6 +188,7 @@ struct DisplayChannel {
     Ring streams;
     ItemTrace items_trace[NUM_TRACE_ITEMS];
     uint32_t next_item_trace;
+    StreamHeatMap heat_map;
     uint64_t streams_size_total;
 
     RedSurface surfaces[NUM_SURFACES];
@@ -204,6 +211,26 @@ struct DisplayChannel {
     uint64_t *cache_hits_counter;
     uint64_t *add_to_cache_counter;
     uint64_t *non_cache_counter;
+    uint64_t *copy_diff_dropped_counter;
+    uint64_t *copy_diff_cropped_counter;
+    uint64_t *copy_diff_saved_bytes_counter;
+    uint64_t *fingerprint_images_counter;
+    uint64_t *fingerprint_skipped_counter;
+    uint64_t *fingerprint_bytes_counter;
+    uint64_t *fingerprint_time_counter;
+    uint64_t *pixmap_cache_lookups_counter;
+    uint64_t *pixmap_cache_hits_counter;
+    uint64_t *pixmap_cache_saved_counter;
+    uint64_t *lossy_upgrades_counter;
+    uint64_t *lossy_upgrade_bytes_counter;
+    uint64_t *palette_hits_counter;
+    uint64_t *palette_misses_counter;
+    uint64_t *palette_saved_counter;
+    uint64_t *stream_starts_counter;
+    uint64_t *stream_start_time_counter;
+    /* in the "images" node, see dcc_cache_stats_add_image() */
+    uint64_t *image_type_counters[DCC_IMAGE_STAT_LAST];
+    uint64_t *image_type_bytes_counters[DCC_IMAGE_STAT_LAST];
 #endif
     ImageEncoderSharedData encoder_shared_data;
 };
@@ -230,7 +257,8 @@ DisplayChannel*            display_channel_new                       (SpiceServe
                                                                       int migrate,
                                                                       int stream_video,
                                                                       GArray *video_codecs,
-                                                                      uint32_t n_surfaces);
+                                                                      uint32_t n_surfaces,
+                                                                      size_t image_cache_size);
 void                       display_channel_create_surface            (DisplayChannel *display, uint32_t surface_id,
                                                                       uint32_t width, uint32_t height,
                                                                       int32_t stride, uint32_t format, void *line_0,
@@ -254,6 +282,8 @@ void                       display_channel_set_stream_video          (DisplayCha
 void                       display_channel_set_video_codecs          (DisplayChannel *display,
                                                                       GArray *video_codecs);
 int                        display_channel_get_streams_timeout       (DisplayChannel *display);
+int                        display_channel_get_lossy_upgrade_timeout (DisplayChannel *display);
+void                       display_channel_upgrade_lossy_areas       (DisplayChannel *display);
 void                       display_channel_compress_stats_print      (const DisplayChannel *display);
 void                       display_channel_compress_stats_reset      (DisplayChannel *display);
 void                       display_channel_surface_unref             (DisplayChannel *display,
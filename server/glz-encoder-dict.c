@@ -21,6 +21,7 @@
 #include <pthread.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "glz-encoder.h"
 #include "glz-encoder-dict.h"
@@ -43,6 +44,7 @@ static inline void __glz_dictionary_window_reset_images(SharedDictionary *dict)
         dict->window.free_images = tmp;
     }
     dict->window.used_images_tail = NULL;
+    dict->window.used_images_num = 0;
 }
 
 /* allocate window fields (no reset)*/
@@ -72,8 +74,12 @@ static int glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
 
     dict->window.used_images_head = NULL;
     dict->window.used_images_tail = NULL;
+    dict->window.used_images_num = 0;
     dict->window.free_images = NULL;
     dict->window.pixels_so_far = 0;
+    dict->window.bytes_so_far = 0;
+    dict->window.bytes_limit = 0;
+    dict->window.segs_reallocs = 0;
 
     return TRUE;
 }
@@ -239,6 +245,50 @@ uint32_t glz_enc_dictionary_get_size(GlzEncDictContext *opaque_dict)
     return dict->window.size_limit;
 }
 
+void glz_enc_dictionary_set_max_bytes(GlzEncDictContext *opaque_dict, uint64_t max_bytes)
+{
+    SharedDictionary *dict = (SharedDictionary *)opaque_dict;
+
+    if (!opaque_dict) {
+        return;
+    }
+    pthread_mutex_lock(&dict->lock);
+    dict->window.bytes_limit = max_bytes;
+    pthread_mutex_unlock(&dict->lock);
+}
+
+uint64_t glz_enc_dictionary_get_max_bytes(GlzEncDictContext *opaque_dict)
+{
+    SharedDictionary *dict = (SharedDictionary *)opaque_dict;
+
+    if (!opaque_dict) {
+        return 0;
+    }
+    return dict->window.bytes_limit;
+}
+
+void glz_enc_dictionary_get_stats(GlzEncDictContext *opaque_dict, GlzEncDictStats *out_stats)
+{
+    SharedDictionary *dict = (SharedDictionary *)opaque_dict;
+
+    memset(out_stats, 0, sizeof(*out_stats));
+    if (!opaque_dict) {
+        return;
+    }
+
+    pthread_mutex_lock(&dict->lock);
+    // the physical head is used, since the images before the logical head are
+    // still referenced until the encoders that use them are done
+    if (dict->window.used_images_head) {
+        out_stats->window_bytes = dict->window.bytes_so_far -
+                                  dict->window.used_images_head->bytes_so_far;
+    }
+    out_stats->window_images = dict->window.used_images_num;
+    out_stats->segs_quota = dict->window.segs_quota;
+    out_stats->segs_reallocs = dict->window.segs_reallocs;
+    pthread_mutex_unlock(&dict->lock);
+}
+
 /* doesn't call the remove image callback */
 void glz_enc_dictionary_remove_image(GlzEncDictContext *opaque_dict,
                                      GlzEncDictImageContext *opaque_image,
@@ -305,6 +355,7 @@ static void __glz_dictionary_window_segs_realloc(SharedDictionary *dict)
     dict->cur_usr->free(dict->cur_usr, dict->window.segs);
     dict->window.segs = new_segs;
     dict->window.segs_quota = new_quota;
+    dict->window.segs_reallocs++;
 
     pthread_rwlock_unlock(&dict->rw_alloc_lock);
 }
@@ -329,6 +380,7 @@ static WindowImage *__glz_dictionary_window_alloc_image(SharedDictionary *dict)
         dict->window.used_images_tail->next = ret;
     }
     dict->window.used_images_tail = ret;
+    dict->window.used_images_num++;
 
     if (!dict->window.used_images_head) {
         dict->window.used_images_head = ret;
@@ -387,18 +439,33 @@ static inline void __glz_dictionary_window_free_image_segs(SharedDictionary *dic
     dict->window.segs[seg_id].next = old_free_head;
 }
 
+static inline int glz_dictionary_window_is_over_limit(SharedDictionary *dict,
+                                                      uint32_t win_size, uint64_t win_bytes)
+{
+    return (win_size > dict->window.size_limit) ||
+           (dict->window.bytes_limit && (win_bytes > dict->window.bytes_limit));
+}
+
 /* Returns the logical head of the window after we add an image with the give size to its tail.
+   The window is limited both by its size in pixels and by the number of bytes its images
+   refer to.
    Returns NULL when the window is empty, of when we have to empty the window in order
    to insert the new image. */
-static WindowImage *glz_dictionary_window_get_new_head(SharedDictionary *dict, int new_image_size)
+static WindowImage *glz_dictionary_window_get_new_head(SharedDictionary *dict, int new_image_size,
+                                                       uint32_t new_image_bytes)
 {
     uint32_t cur_win_size;
+    uint64_t cur_win_bytes;
     WindowImage *cur_head;
 
     if ((uint32_t)new_image_size > dict->window.size_limit) {
         dict->cur_usr->error(dict->cur_usr, "image is bigger than window\n");
     }
 
+    if (dict->window.bytes_limit && new_image_bytes > dict->window.bytes_limit) {
+        dict->cur_usr->error(dict->cur_usr, "image is bigger than window bytes limit\n");
+    }
+
     GLZ_ASSERT(dict->cur_usr, new_image_size < dict->window.size_limit)
 
     // the window is empty
@@ -415,9 +482,13 @@ static WindowImage *glz_dictionary_window_get_new_head(SharedDictionary *dict, i
         dict->window.segs[dict->window.used_segs_tail].pixels_so_far -
         dict->window.segs[dict->window.used_segs_head].pixels_so_far;
 
-    while ((cur_win_size + new_image_size) > dict->window.size_limit) {
+    cur_win_bytes = dict->window.bytes_so_far - cur_head->bytes_so_far;
+
+    while (glz_dictionary_window_is_over_limit(dict, cur_win_size + new_image_size,
+                                               cur_win_bytes + new_image_bytes)) {
         GLZ_ASSERT(dict->cur_usr, cur_head);
         cur_win_size -= cur_head->size;
+        cur_win_bytes -= cur_head->bytes;
         cur_head = cur_head->next;
     }
 
@@ -447,6 +518,7 @@ static void glz_dictionary_window_remove_head(SharedDictionary *dict, uint32_t e
 
         __glz_dictionary_window_free_image_segs(dict, image);
         dict->window.used_images_head = image->next;
+        dict->window.used_images_num--;
         __glz_dictionary_window_free_image(dict, image);
     }
 
@@ -479,7 +551,8 @@ static uint32_t glz_dictionary_window_alloc_image_seg(SharedDictionary *dict, Wi
 }
 
 static WindowImage *glz_dictionary_window_add_image(SharedDictionary *dict, LzImageType image_type,
-                                                    int image_size, int image_height,
+                                                    int image_size, uint32_t image_bytes,
+                                                    int image_height,
                                                     int image_stride, uint8_t *first_lines,
                                                     unsigned int num_first_lines,
                                                     GlzUsrImageContext *usr_image_context)
@@ -492,6 +565,9 @@ static WindowImage *glz_dictionary_window_add_image(SharedDictionary *dict, LzIm
     WindowImage *image = __glz_dictionary_window_alloc_image(dict);
     image->id = dict->last_image_id++;
     image->size = image_size;
+    image->bytes = image_bytes;
+    image->bytes_so_far = dict->window.bytes_so_far;
+    dict->window.bytes_so_far += image_bytes;
     image->type = image_type;
     image->usr_context = usr_image_context;
 
@@ -557,6 +633,7 @@ WindowImage *glz_dictionary_pre_encode(uint32_t encoder_id, GlzEncoderUsrContext
 {
     WindowImage *new_win_head, *ret;
     int image_size;
+    uint32_t image_bytes;
 
 
     pthread_mutex_lock(&dict->lock);
@@ -565,13 +642,15 @@ WindowImage *glz_dictionary_pre_encode(uint32_t encoder_id, GlzEncoderUsrContext
     GLZ_ASSERT(dict->cur_usr, dict->window.encoders_heads[encoder_id] == NULL_IMAGE_SEG_ID);
 
     image_size = __get_pixels_num(image_type, image_height, image_stride);
-    new_win_head = glz_dictionary_window_get_new_head(dict, image_size);
+    image_bytes = image_height * abs(image_stride);
+    new_win_head = glz_dictionary_window_get_new_head(dict, image_size, image_bytes);
 
     if (!glz_dictionary_is_in_use(dict)) {
         glz_dictionary_window_remove_head(dict, encoder_id, new_win_head);
     }
 
-    ret = glz_dictionary_window_add_image(dict, image_type, image_size, image_height, image_stride,
+    ret = glz_dictionary_window_add_image(dict, image_type, image_size, image_bytes,
+                                          image_height, image_stride,
                                           first_lines, num_first_lines, usr_image_context);
 
     if (new_win_head) {
@@ -39,6 +39,13 @@ typedef struct GlzEncDictRestoreData {
     uint64_t last_image_id;
 } GlzEncDictRestoreData;
 
+typedef struct GlzEncDictStats {
+    uint64_t window_bytes;       // bytes referenced by the images held in the window
+    uint32_t window_images;      // number of images held in the window
+    uint32_t segs_quota;         // number of allocated image segments
+    uint32_t segs_reallocs;      // number of times the image segments were reallocated
+} GlzEncDictStats;
+
 /* size        : maximal number of pixels occupying the window
    max_encoders: maximal number of encoders that use the dictionary
    usr         : callbacks */
@@ -50,6 +57,19 @@ void glz_enc_dictionary_destroy(GlzEncDictContext *opaque_dict, GlzEncoderUsrCon
 /* returns the window capacity in pixels */
 uint32_t glz_enc_dictionary_get_size(GlzEncDictContext *);
 
+/* max_bytes: maximal number of bytes referenced by the images occupying the window.
+              Images are evicted from the window head when either this limit or the
+              limit in pixels is exceeded. 0 means the window is limited only in pixels.
+   NOTE - the limit is not part of GlzEncDictRestoreData, and should be set again
+          after restoring the dictionary. */
+void glz_enc_dictionary_set_max_bytes(GlzEncDictContext *opaque_dict, uint64_t max_bytes);
+
+/* returns the window capacity in bytes, 0 if unlimited */
+uint64_t glz_enc_dictionary_get_max_bytes(GlzEncDictContext *opaque_dict);
+
+/* returns the current occupancy of the window */
+void glz_enc_dictionary_get_stats(GlzEncDictContext *opaque_dict, GlzEncDictStats *out_stats);
+
 /* returns the current state of the dictionary.
    NOTE - you should use it only when no encoder uses the dictionary. */
 void glz_enc_dictionary_get_restore_data(GlzEncDictContext *opaque_dict,
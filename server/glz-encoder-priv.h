@@ -51,6 +51,8 @@ struct WindowImage {
     uint64_t id;
     LzImageType type;
     int size;                    // in pixels
+    uint32_t bytes;              // size of the image lines, in bytes
+    uint64_t bytes_so_far;       // Total no. bytes passed through the window till this image.
     uint32_t first_seg;
     GlzUsrImageContext  *usr_context;
     WindowImage*       next;
@@ -107,10 +109,16 @@ struct SharedDictionary {
         /* the window in a resolution of images. But here the head contains the oldest head*/
         WindowImage*        used_images_tail;
         WindowImage*        used_images_head;
+        uint32_t            used_images_num;
         WindowImage*        free_images;
 
         uint64_t pixels_so_far;
         uint32_t size_limit;                 // max number of pixels in a window (per encoder)
+
+        uint64_t bytes_so_far;
+        uint64_t bytes_limit;                // max number of bytes referenced by the window,
+                                             // 0 for no limit
+        uint32_t segs_reallocs;              // number of times segs was reallocated
     } window;
 
     /* Concurrency issues: the reading/writing of each entry field should be atomic.
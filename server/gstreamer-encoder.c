@@ -25,14 +25,15 @@
 #include <gst/gst.h>
 #include <gst/app/gstappsrc.h>
 #include <gst/app/gstappsink.h>
+#ifndef HAVE_GSTREAMER_0_10
+#include <gst/video/video.h>
+#endif
 
 #include "red-common.h"
 #include "video-encoder.h"
+#include "video-rate-control.h"
 #include "utils.h"
 
-
-#define SPICE_GST_DEFAULT_FPS 30
-
 #ifndef HAVE_GSTREAMER_0_10
 # define DO_ZERO_COPY
 #endif
@@ -57,18 +58,6 @@ typedef struct SpiceGstVideoBuffer {
 #endif
 } SpiceGstVideoBuffer;
 
-typedef struct {
-    uint32_t mm_time;
-    uint32_t size;
-    uint64_t duration;
-} SpiceGstFrameInformation;
-
-typedef enum SpiceGstBitRateStatus {
-    SPICE_GST_BITRATE_DECREASING,
-    SPICE_GST_BITRATE_INCREASING,
-    SPICE_GST_BITRATE_STABLE,
-} SpiceGstBitRateStatus;
-
 typedef struct SpiceGstEncoder {
     VideoEncoder base;
 
@@ -78,13 +67,10 @@ typedef struct SpiceGstEncoder {
 
 #ifdef DO_ZERO_COPY
     GAsyncQueue *unused_bitmap_opaques;
-#endif
-
-    /* Rate control callbacks */
-    VideoEncoderRateControlCbs cbs;
 
-    /* Spice's initial bit rate estimation in bits per second. */
-    uint64_t starting_bit_rate;
+    /* The number of frames pushed without copying the bitmap. */
+    uint64_t zero_copy_frames;
+#endif
 
     /* ---------- Video characteristics ---------- */
 
@@ -129,56 +115,14 @@ typedef struct SpiceGstEncoder {
 #   define SPICE_GST_VIDEO_BITRATE_MARGIN 0.05
 
 
-    /* ---------- Encoded frame statistics ---------- */
-
-    /* Should be >= than FRAME_STATISTICS_COUNT. This is also used to
-     * annotate the client report debug traces with bit rate information.
-     */
-#   define SPICE_GST_HISTORY_SIZE 60
-
-    /* A circular buffer containing the past encoded frames information. */
-    SpiceGstFrameInformation history[SPICE_GST_HISTORY_SIZE];
-
-    /* The indices of the oldest and newest frames in the history buffer. */
-    uint32_t history_first;
-    uint32_t history_last;
-
-    /* How many frames to take into account when computing the effective
-     * bit rate, average frame size, etc. This should be large enough so the
-     * I and P frames average out, and short enough for it to reflect the
-     * current situation.
-     */
-#   define SPICE_GST_FRAME_STATISTICS_COUNT 21
-
-    /* The index of the oldest frame taken into account for the statistics. */
-    uint32_t stat_first;
-
-    /* Used to compute the average frame encoding time. */
-    uint64_t stat_duration_sum;
-
-    /* Used to compute the average frame size. */
-    uint64_t stat_size_sum;
-
-    /* Tracks the maximum frame size. */
-    uint32_t stat_size_max;
-
-
     /* ---------- Encoder bit rate control ----------
      *
      * GStreamer encoders don't follow the specified video_bit_rate very
-     * closely. These fields are used to ensure we don't exceed the desired
-     * stream bit rate, regardless of the GStreamer encoder's output.
+     * closely. These fields are used to ensure we don't exceed the bit rate
+     * picked by the network bit rate control, regardless of the GStreamer
+     * encoder's output.
      */
 
-    /* The bit rate target for the outgoing network stream. (bits per second) */
-    uint64_t bit_rate;
-
-    /* The minimum bit rate / bit rate increment. */
-#   define SPICE_GST_MIN_BITRATE (128 * 1024)
-
-    /* The default bit rate. */
-#   define SPICE_GST_DEFAULT_BITRATE (8 * 1024 * 1024)
-
     /* The bit rate control is performed using a virtual buffer to allow
      * short term variations: bursts are allowed until the virtual buffer is
      * full. Then frames are dropped to limit the bit rate. VBUFFER_SIZE
@@ -189,100 +133,120 @@ typedef struct SpiceGstEncoder {
     int32_t vbuffer_size;
     int32_t vbuffer_free;
 
-    /* When dropping frames, this is set to the minimum mm_time of the next
-     * frame to encode. Otherwise set to zero.
-     */
-    uint32_t next_frame_mm_time;
-
     /* Defines the minimum allowed fps. */
 #   define SPICE_GST_MAX_PERIOD (NSEC_PER_SEC / 3)
 
-    /* How big of a margin to take to cover for latency jitter. */
-#   define SPICE_GST_LATENCY_MARGIN 0.1
-
-
-    /* ---------- Network bit rate control ----------
-     *
-     * State information for figuring out the optimal bit rate for the
-     * current network conditions.
-     */
-
-    /* The mm_time of the last bit rate change. */
-    uint32_t last_change;
 
-    /* How much to reduce the bit rate in case of network congestion. */
-#   define SPICE_GST_BITRATE_CUT 2
-#   define SPICE_GST_BITRATE_REDUCE (4.0 / 3.0)
+    /* ---------- Network bit rate control ---------- */
 
-    /* Never increase the bit rate by more than this amount (bits per second). */
-#   define SPICE_GST_BITRATE_MAX_STEP (1024 * 1024)
-
-    /* The maximum bit rate that one can maybe use without causing network
-     * congestion.
-     */
-    uint64_t max_bit_rate;
-
-    /* The last bit rate that let us recover from network congestion. */
-    uint64_t min_bit_rate;
-
-    /* Defines when the spread between max_bit_rate and min_bit_rate has been
-     * narrowed down enough. Note that this value should be large enough for
-     * min_bit_rate to allow recovery from network congestion in a reasonable
-     * time frame, and to absorb transient traffic spikes (potentially from
-     * other sources).
-     * This is also used as a multiplier for the video_bit_rate so it does
-     * not have to be changed too often.
-     */
-#   define SPICE_GST_BITRATE_MARGIN SPICE_GST_BITRATE_REDUCE
+    VideoRateControl rate;
+} SpiceGstEncoder;
 
-    /* Whether the bit rate was last decreased, increased or kept stable. */
-    SpiceGstBitRateStatus status;
 
-    /* The network bit rate control uses an AIMD scheme (Additive Increase,
-     * Multiplicative Decrease). The increment step depends on the spread
-     * between the minimum and maximum bit rates.
-     */
-    uint64_t bit_rate_step;
+/* ---------- The pipeline pool ---------- */
 
-    /* How often to increase the bit rate. */
-    uint32_t increase_interval;
+/* Building a pipeline with gst_parse_launch() means looking up and
+ * instantiating all its elements which makes up most of the stream start
+ * latency. So the pipelines of the destroyed encoders are kept in the NULL
+ * state and reused by the next encoder of the same codec, which then only
+ * has to set its caps and bitrate.
+ *
+ * The encoders are created and destroyed by the worker, so there is one
+ * pool per worker thread.
+ */
+#define SPICE_GST_POOL_SIZE 2
 
-#   define SPICE_GST_BITRATE_UP_INTERVAL (MSEC_PER_SEC * 2)
-#   define SPICE_GST_BITRATE_UP_CLIENT_STABLE (MSEC_PER_SEC * 60 * 2)
-#   define SPICE_GST_BITRATE_UP_SERVER_STABLE (MSEC_PER_SEC * 3600 * 4)
-#   define SPICE_GST_BITRATE_UP_RESET_MAX (MSEC_PER_SEC * 30)
+typedef struct SpiceGstPipeline {
+    SpiceVideoCodecType codec_type;
+    GstElement *pipeline;
+    GstAppSrc *appsrc;
+    GstElement *gstenc;
+    GstAppSink *appsink;
+} SpiceGstPipeline;
 
+static void pipeline_free(gpointer data)
+{
+    SpiceGstPipeline *pooled = data;
+
+    gst_element_set_state(pooled->pipeline, GST_STATE_NULL);
+    gst_object_unref(pooled->appsrc);
+    gst_object_unref(pooled->gstenc);
+    gst_object_unref(pooled->appsink);
+    gst_object_unref(pooled->pipeline);
+    free(pooled);
+}
 
-    /* ---------- Client feedback ---------- */
+static void pipeline_pool_free(gpointer data)
+{
+    g_queue_free_full(data, pipeline_free);
+}
 
-    /* TRUE if gst_encoder_client_stream_report() is being called. */
-    gboolean has_client_reports;
+static GPrivate pipeline_pool = G_PRIVATE_INIT(pipeline_pool_free);
 
-    /* The margin is the amount of time between the reception of a piece of
-     * media data by the client and the time when it should be displayed.
-     * Increasing the bit rate increases the transmission time and thus
-     * reduces the margin.
-     */
-    int32_t last_video_margin;
-    int32_t max_video_margin;
-    uint32_t max_audio_margin;
+static GQueue *get_pipeline_pool(void)
+{
+    GQueue *pool = g_private_get(&pipeline_pool);
 
-#   define SPICE_GST_VIDEO_MARGIN_GOOD 0.75
-#   define SPICE_GST_VIDEO_MARGIN_AVERAGE 0.5
-#   define SPICE_GST_VIDEO_MARGIN_BAD 0.3
+    if (!pool) {
+        pool = g_queue_new();
+        g_private_set(&pipeline_pool, pool);
+    }
+    return pool;
+}
 
-#   define SPICE_GST_VIDEO_DELTA_BAD 0.2
-#   define SPICE_GST_VIDEO_DELTA_AVERAGE 0.15
+static gint pipeline_has_codec(gconstpointer data, gconstpointer codec_type)
+{
+    const SpiceGstPipeline *pooled = data;
 
-#   define SPICE_GST_AUDIO_MARGIN_BAD 0.5
-#   define SPICE_GST_AUDIO_VIDEO_RATIO 1.25
+    return pooled->codec_type == GPOINTER_TO_INT(codec_type) ? 0 : 1;
+}
 
+/* Moves a pipeline of the pool to the encoder, returns FALSE if there is
+ * none for its codec */
+static gboolean pipeline_pool_take(SpiceGstEncoder *encoder)
+{
+    GQueue *pool = get_pipeline_pool();
+    GList *link = g_queue_find_custom(pool, GINT_TO_POINTER(encoder->base.codec_type),
+                                      pipeline_has_codec);
+    if (!link) {
+        return FALSE;
+    }
 
-    /* ---------- Server feedback ---------- */
+    SpiceGstPipeline *pooled = link->data;
+    g_queue_delete_link(pool, link);
+    encoder->pipeline = pooled->pipeline;
+    encoder->appsrc = pooled->appsrc;
+    encoder->gstenc = pooled->gstenc;
+    encoder->appsink = pooled->appsink;
+    free(pooled);
+    return TRUE;
+}
 
-    /* How many frames were dropped by the server since the last encoded frame. */
-    uint32_t server_drops;
-} SpiceGstEncoder;
+/* Moves the encoder pipeline to the pool, or frees it if the pool already
+ * has enough pipelines for this codec */
+static void pipeline_pool_put(SpiceGstEncoder *encoder)
+{
+    GQueue *pool = get_pipeline_pool();
+    SpiceGstPipeline *pooled = spice_new(SpiceGstPipeline, 1);
+    GList *link;
+    int count = 0;
+
+    pooled->codec_type = encoder->base.codec_type;
+    pooled->pipeline = encoder->pipeline;
+    pooled->appsrc = encoder->appsrc;
+    pooled->gstenc = encoder->gstenc;
+    pooled->appsink = encoder->appsink;
+    encoder->pipeline = NULL;
+
+    for (link = pool->head; link; link = link->next) {
+        count += pipeline_has_codec(link->data, GINT_TO_POINTER(pooled->codec_type)) == 0;
+    }
+    if (count >= SPICE_GST_POOL_SIZE) {
+        pipeline_free(pooled);
+        return;
+    }
+    g_queue_push_tail(pool, pooled);
+}
 
 
 /* ---------- The SpiceGstVideoBuffer implementation ---------- */
@@ -309,32 +273,6 @@ static SpiceGstVideoBuffer* create_gst_video_buffer(void)
 
 /* ---------- Miscellaneous SpiceGstEncoder helpers ---------- */
 
-static inline double get_mbps(uint64_t bit_rate)
-{
-    return (double)bit_rate / 1024 / 1024;
-}
-
-/* Returns the source frame rate which may change at any time so don't store
- * the result.
- */
-static uint32_t get_source_fps(SpiceGstEncoder *encoder)
-{
-    return encoder->cbs.get_source_fps ?
-        encoder->cbs.get_source_fps(encoder->cbs.opaque) : SPICE_GST_DEFAULT_FPS;
-}
-
-static uint32_t get_network_latency(SpiceGstEncoder *encoder)
-{
-    /* Assume that the network latency is symmetric */
-    return encoder->cbs.get_roundtrip_ms ?
-        encoder->cbs.get_roundtrip_ms(encoder->cbs.opaque) / 2 : 0;
-}
-
-static inline int rate_control_is_active(SpiceGstEncoder* encoder)
-{
-    return encoder->cbs.get_roundtrip_ms != NULL;
-}
-
 static void set_pipeline_changes(SpiceGstEncoder *encoder, uint32_t flags)
 {
     encoder->set_pipeline |= flags;
@@ -356,133 +294,37 @@ static void free_pipeline(SpiceGstEncoder *encoder)
     }
 }
 
-
-/* ---------- Encoded frame statistics ---------- */
-
-static inline uint32_t get_last_frame_mm_time(SpiceGstEncoder *encoder)
-{
-    return encoder->history[encoder->history_last].mm_time;
-}
-
-/* Returns the current bit rate based on the last
- * SPICE_GST_FRAME_STATISTICS_COUNT frames.
- */
-static uint64_t get_effective_bit_rate(SpiceGstEncoder *encoder)
-{
-    uint32_t next_mm_time = encoder->next_frame_mm_time ?
-                            encoder->next_frame_mm_time :
-                            get_last_frame_mm_time(encoder) +
-                                MSEC_PER_SEC / get_source_fps(encoder);
-    uint32_t elapsed = next_mm_time - encoder->history[encoder->stat_first].mm_time;
-    return elapsed ? encoder->stat_size_sum * 8 * MSEC_PER_SEC / elapsed : 0;
-}
-
-static uint64_t get_average_encoding_time(SpiceGstEncoder *encoder)
-{
-    uint32_t count = encoder->history_last +
-        (encoder->history_last < encoder->stat_first ? SPICE_GST_HISTORY_SIZE : 0) -
-        encoder->stat_first + 1;
-    return encoder->stat_duration_sum / count;
-}
-
-static uint64_t get_average_frame_size(SpiceGstEncoder *encoder)
-{
-    uint32_t count = encoder->history_last +
-        (encoder->history_last < encoder->stat_first ? SPICE_GST_HISTORY_SIZE : 0) -
-        encoder->stat_first + 1;
-    return encoder->stat_size_sum / count;
-}
-
-static uint32_t get_maximum_frame_size(SpiceGstEncoder *encoder)
-{
-    if (encoder->stat_size_max == 0) {
-        uint32_t index = encoder->history_last;
-        while (1) {
-            encoder->stat_size_max = MAX(encoder->stat_size_max,
-                                         encoder->history[index].size);
-            if (index == encoder->stat_first) {
-                break;
-            }
-            index = (index ? index : SPICE_GST_HISTORY_SIZE) - 1;
-        }
-    }
-    return encoder->stat_size_max;
-}
-
-/* Returns the bit rate of the specified period. from and to must be the
- * mm time of the first and last frame to consider.
- */
-static uint64_t get_period_bit_rate(SpiceGstEncoder *encoder, uint32_t from,
-                                    uint32_t to)
+/* Like free_pipeline() but keeps the pipeline for the next encoder */
+static void release_pipeline(SpiceGstEncoder *encoder)
 {
-    uint32_t sum = 0;
-    uint32_t last_mm_time = 0;
-    uint32_t index = encoder->history_last;
-    while (1) {
-        if (encoder->history[index].mm_time == to) {
-            if (last_mm_time == 0) {
-                /* We don't know how much time elapsed between the period's
-                 * last frame and the next so we cannot include it.
-                 */
-                sum = 1;
-                last_mm_time = to;
-            } else {
-                sum = encoder->history[index].size + 1;
-            }
-
-        } else if (encoder->history[index].mm_time == from) {
-            sum += encoder->history[index].size;
-            return (sum - 1) * 8 * MSEC_PER_SEC / (last_mm_time - from);
-
-        } else if (sum > 0) {
-            sum += encoder->history[index].size;
-
-        } else {
-            last_mm_time = encoder->history[index].mm_time;
-        }
-
-        if (index == encoder->history_first) {
-            /* This period is outside the recorded history */
-            spice_debug("period (%u-%u) outside known history (%u-%u)",
-                        from, to,
-                        encoder->history[encoder->history_first].mm_time,
-                        encoder->history[encoder->history_last].mm_time);
-           return 0;
-        }
-        index = (index ? index : SPICE_GST_HISTORY_SIZE) - 1;
+    if (encoder->src_caps) {
+        gst_caps_unref(encoder->src_caps);
+        encoder->src_caps = NULL;
     }
-
-}
-
-static void add_frame(SpiceGstEncoder *encoder, uint32_t frame_mm_time,
-                      uint64_t duration, uint32_t size)
-{
-    /* Update the statistics */
-    uint32_t count = encoder->history_last +
-        (encoder->history_last < encoder->stat_first ? SPICE_GST_HISTORY_SIZE : 0) -
-        encoder->stat_first + 1;
-    if (count == SPICE_GST_FRAME_STATISTICS_COUNT) {
-        encoder->stat_duration_sum -= encoder->history[encoder->stat_first].duration;
-        encoder->stat_size_sum -= encoder->history[encoder->stat_first].size;
-        if (encoder->stat_size_max == encoder->history[encoder->stat_first].size) {
-            encoder->stat_size_max = 0;
-        }
-        encoder->stat_first = (encoder->stat_first + 1) % SPICE_GST_HISTORY_SIZE;
+    if (!encoder->pipeline) {
+        return;
     }
-    encoder->stat_duration_sum += duration;
-    encoder->stat_size_sum += size;
-    if (encoder->stat_size_max > 0 && size > encoder->stat_size_max) {
-        encoder->stat_size_max = size;
+    if (gst_element_set_state(encoder->pipeline, GST_STATE_NULL) == GST_STATE_CHANGE_FAILURE) {
+        free_pipeline(encoder);
+        return;
     }
 
-    /* Update the frame history */
-    encoder->history_last = (encoder->history_last + 1) % SPICE_GST_HISTORY_SIZE;
-    if (encoder->history_last == encoder->history_first) {
-        encoder->history_first = (encoder->history_first + 1) % SPICE_GST_HISTORY_SIZE;
-    }
-    encoder->history[encoder->history_last].mm_time = frame_mm_time;
-    encoder->history[encoder->history_last].duration = duration;
-    encoder->history[encoder->history_last].size = size;
+    /* Detach the pipeline from this encoder */
+#ifdef HAVE_GSTREAMER_0_10
+    GstAppSinkCallbacks appsink_cbs = {NULL, NULL, NULL, NULL, {NULL}};
+#else
+    GstAppSinkCallbacks appsink_cbs = {NULL, NULL, NULL, {NULL}};
+#endif
+    gst_app_sink_set_callbacks(encoder->appsink, &appsink_cbs, NULL, NULL);
+    GstBus *bus = gst_element_get_bus(encoder->pipeline);
+#ifdef HAVE_GSTREAMER_0_10
+    gst_bus_set_sync_handler(bus, NULL, NULL);
+#else
+    gst_bus_set_sync_handler(bus, NULL, NULL, NULL);
+#endif
+    gst_object_unref(bus);
+
+    pipeline_pool_put(encoder);
 }
 
 
@@ -503,48 +345,26 @@ static void set_video_bit_rate(SpiceGstEncoder *encoder, uint64_t bit_rate)
     }
 }
 
-static uint32_t get_min_playback_delay(SpiceGstEncoder *encoder)
-{
-    /* Make sure the delay is large enough to send a large frame (typically
-     * an I frame) and an average frame. This also takes into account the
-     * frames dropped by the encoder bit rate control.
-     */
-    uint32_t size = get_maximum_frame_size(encoder) + get_average_frame_size(encoder);
-    uint32_t send_time = MSEC_PER_SEC * size * 8 / encoder->bit_rate;
-
-    /* Also factor in the network latency with a margin for jitter. */
-    uint32_t net_latency = get_network_latency(encoder) * (1.0 + SPICE_GST_LATENCY_MARGIN);
-
-    return send_time + net_latency;
-}
-
-static void update_client_playback_delay(SpiceGstEncoder *encoder)
-{
-    if (encoder->cbs.update_client_playback_delay) {
-        uint32_t min_delay = get_min_playback_delay(encoder) + get_average_encoding_time(encoder) / NSEC_PER_MILLISEC;
-        encoder->cbs.update_client_playback_delay(encoder->cbs.opaque, min_delay);
-    }
-}
-
 static void update_next_frame_mm_time(SpiceGstEncoder *encoder)
 {
-    uint64_t period_ns = NSEC_PER_SEC / get_source_fps(encoder);
-    uint64_t min_delay_ns = get_average_encoding_time(encoder);
+    VideoRateControl *rc = &encoder->rate;
+    uint64_t period_ns = NSEC_PER_SEC / video_rate_control_get_source_fps(rc);
+    uint64_t min_delay_ns = video_rate_control_get_average_encoding_time(rc);
     if (min_delay_ns > period_ns) {
         spice_warning("your system seems to be too slow to encode this %dx%d video in real time", encoder->width, encoder->height);
     }
 
     min_delay_ns = MIN(min_delay_ns, SPICE_GST_MAX_PERIOD);
     if (encoder->vbuffer_free >= 0) {
-        encoder->next_frame_mm_time = get_last_frame_mm_time(encoder) +
-                                      min_delay_ns / NSEC_PER_MILLISEC;
+        rc->next_frame_mm_time = video_rate_control_get_last_frame_mm_time(rc) +
+                                 min_delay_ns / NSEC_PER_MILLISEC;
         return;
     }
 
     /* Figure out how many frames to drop to not exceed the current bit rate.
      * Use nanoseconds to avoid precision loss.
      */
-    uint64_t delay_ns = -encoder->vbuffer_free * 8 * NSEC_PER_SEC / encoder->bit_rate;
+    uint64_t delay_ns = -encoder->vbuffer_free * 8 * NSEC_PER_SEC / rc->bit_rate;
     uint32_t drops = (delay_ns + period_ns - 1) / period_ns; /* round up */
     spice_debug("drops=%u vbuffer %d/%d", drops, encoder->vbuffer_free,
                 encoder->vbuffer_size);
@@ -552,195 +372,43 @@ static void update_next_frame_mm_time(SpiceGstEncoder *encoder)
     delay_ns = drops * period_ns + period_ns / 2;
     if (delay_ns > SPICE_GST_MAX_PERIOD) {
         /* Reduce the video bit rate so we don't have to drop so many frames. */
-        if (encoder->video_bit_rate > encoder->bit_rate * SPICE_GST_BITRATE_MARGIN) {
-            set_video_bit_rate(encoder, encoder->bit_rate * SPICE_GST_BITRATE_MARGIN);
+        if (encoder->video_bit_rate > rc->bit_rate * VIDEO_RC_BITRATE_MARGIN) {
+            set_video_bit_rate(encoder, rc->bit_rate * VIDEO_RC_BITRATE_MARGIN);
         } else {
-            set_video_bit_rate(encoder, encoder->bit_rate);
+            set_video_bit_rate(encoder, rc->bit_rate);
         }
         delay_ns = SPICE_GST_MAX_PERIOD;
     }
-    encoder->next_frame_mm_time = get_last_frame_mm_time(encoder) +
-                                  MAX(delay_ns, min_delay_ns) / NSEC_PER_MILLISEC;
+    rc->next_frame_mm_time = video_rate_control_get_last_frame_mm_time(rc) +
+                             MAX(delay_ns, min_delay_ns) / NSEC_PER_MILLISEC;
 
     /* Drops mean a higher delay between encoded frames so update the
      * playback delay.
      */
-    update_client_playback_delay(encoder);
+    video_rate_control_update_client_playback_delay(rc);
 }
 
-
-/* ---------- Network bit rate control ---------- */
-
-/* The maximum bit rate we will use for the current video.
- *
- * This is based on a 10x compression ratio which should be more than enough
- * for even MJPEG to provide good quality.
- */
-static uint64_t get_bit_rate_cap(SpiceGstEncoder *encoder)
+/* Adapts the encoder to the bit rate picked by the network bit rate control */
+static void bit_rate_changed(VideoRateControl *rc, gboolean stable)
 {
-    uint32_t raw_frame_bits = encoder->width * encoder->height * encoder->format->bpp;
-    return raw_frame_bits * get_source_fps(encoder) / 10;
-}
+    SpiceGstEncoder *encoder = SPICE_CONTAINEROF(rc, SpiceGstEncoder, rate);
 
-static void set_bit_rate(SpiceGstEncoder *encoder, uint64_t bit_rate)
-{
-    if (bit_rate == 0) {
-        /* Use the default value */
-        bit_rate = SPICE_GST_DEFAULT_BITRATE;
+    if (stable) {
+        set_video_bit_rate(encoder, rc->bit_rate);
     }
-    if (bit_rate == encoder->bit_rate) {
-        return;
-    }
-    if (bit_rate < SPICE_GST_MIN_BITRATE) {
-        /* Don't let the bit rate go too low... */
-        encoder->bit_rate = SPICE_GST_MIN_BITRATE;
-    } else if (bit_rate > encoder->bit_rate) {
-        /* or too high */
-        bit_rate = MIN(bit_rate, get_bit_rate_cap(encoder));
-    }
-
-    if (bit_rate < encoder->min_bit_rate) {
-        encoder->min_bit_rate = bit_rate;
-        encoder->bit_rate_step = 0;
-    } else if (encoder->status == SPICE_GST_BITRATE_DECREASING &&
-               bit_rate > encoder->bit_rate) {
-        encoder->min_bit_rate = encoder->bit_rate;
-        encoder->bit_rate_step = 0;
-    } else if (encoder->status != SPICE_GST_BITRATE_DECREASING &&
-               bit_rate < encoder->bit_rate) {
-        encoder->max_bit_rate = encoder->bit_rate - SPICE_GST_MIN_BITRATE;
-        encoder->bit_rate_step = 0;
-    }
-    encoder->increase_interval = SPICE_GST_BITRATE_UP_INTERVAL;
-
-    if (encoder->bit_rate_step == 0) {
-        encoder->bit_rate_step = MAX(SPICE_GST_MIN_BITRATE,
-                                     MIN(SPICE_GST_BITRATE_MAX_STEP,
-                                         (encoder->max_bit_rate - encoder->min_bit_rate) / 10));
-        encoder->status = (bit_rate < encoder->bit_rate) ? SPICE_GST_BITRATE_DECREASING : SPICE_GST_BITRATE_INCREASING;
-        if (encoder->max_bit_rate / SPICE_GST_BITRATE_MARGIN < encoder->min_bit_rate) {
-            /* We have sufficiently narrowed down the optimal bit rate range.
-             * Settle on the lower end to keep a safety margin and stop
-             * rocking the boat.
-             */
-            bit_rate = encoder->min_bit_rate;
-            encoder->status = SPICE_GST_BITRATE_STABLE;
-            encoder->increase_interval = encoder->has_client_reports ? SPICE_GST_BITRATE_UP_CLIENT_STABLE : SPICE_GST_BITRATE_UP_SERVER_STABLE;
-            set_video_bit_rate(encoder, bit_rate);
-        }
-    }
-    spice_debug("%u set_bit_rate(%.3fMbps) eff %.3f %.3f-%.3f %d",
-                get_last_frame_mm_time(encoder) - encoder->last_change,
-                get_mbps(bit_rate), get_mbps(get_effective_bit_rate(encoder)),
-                get_mbps(encoder->min_bit_rate),
-                get_mbps(encoder->max_bit_rate), encoder->status);
 
-    encoder->last_change = get_last_frame_mm_time(encoder);
-    encoder->bit_rate = bit_rate;
     /* Adjust the vbuffer size without ever increasing vbuffer_free to avoid
      * sudden bit rate increases.
      */
-    int32_t new_size = bit_rate * SPICE_GST_VBUFFER_SIZE / MSEC_PER_SEC / 8;
+    int32_t new_size = rc->bit_rate * SPICE_GST_VBUFFER_SIZE / MSEC_PER_SEC / 8;
     if (new_size < encoder->vbuffer_size && encoder->vbuffer_free > 0) {
         encoder->vbuffer_free = MAX(0, encoder->vbuffer_free + new_size - encoder->vbuffer_size);
     }
     encoder->vbuffer_size = new_size;
     update_next_frame_mm_time(encoder);
 
-    /* Frames preceeding the bit rate change are not relevant to the current
-     * situation anymore.
-     */
-    encoder->stat_first = encoder->history_last;
-    encoder->stat_duration_sum = encoder->history[encoder->history_last].duration;
-    encoder->stat_size_sum = encoder->stat_size_max = encoder->history[encoder->history_last].size;
-
-    if (bit_rate > encoder->video_bit_rate) {
-        set_video_bit_rate(encoder, bit_rate * SPICE_GST_BITRATE_MARGIN);
-    }
-}
-
-static void increase_bit_rate(SpiceGstEncoder *encoder)
-{
-    if (get_effective_bit_rate(encoder) < encoder->bit_rate) {
-        /* The GStreamer encoder currently uses less bandwidth than allowed.
-         * So increasing the limit again makes no sense.
-         */
-        return;
-    }
-
-    if (encoder->bit_rate == encoder->max_bit_rate &&
-        get_last_frame_mm_time(encoder) - encoder->last_change > SPICE_GST_BITRATE_UP_RESET_MAX) {
-        /* The maximum bit rate seems to be sustainable so it was probably
-         * set too low. Probe for the maximum bit rate again.
-         */
-        encoder->max_bit_rate = get_bit_rate_cap(encoder);
-        encoder->status = SPICE_GST_BITRATE_INCREASING;
-    }
-
-    uint64_t new_bit_rate = MIN(encoder->bit_rate + encoder->bit_rate_step,
-                                encoder->max_bit_rate);
-    spice_debug("increase bit rate to %.3fMbps %.3f-%.3fMbps %d",
-                get_mbps(new_bit_rate), get_mbps(encoder->min_bit_rate),
-                get_mbps(encoder->max_bit_rate), encoder->status);
-    set_bit_rate(encoder, new_bit_rate);
-}
-
-
-/* ---------- Server feedback ---------- */
-
-/* A helper for gst_encoder_encode_frame()
- *
- * Checks how many frames got dropped since the last encoded frame and
- * adjusts the bit rate accordingly.
- */
-static inline gboolean handle_server_drops(SpiceGstEncoder *encoder,
-                                           uint32_t frame_mm_time)
-{
-    if (encoder->server_drops == 0) {
-        return FALSE;
-    }
-
-    spice_debug("server report: got %u drops in %ums after %ums",
-                encoder->server_drops,
-                frame_mm_time - get_last_frame_mm_time(encoder),
-                frame_mm_time - encoder->last_change);
-
-    /* The server dropped a frame so clearly the buffer is full. */
-    encoder->vbuffer_free = MIN(encoder->vbuffer_free, 0);
-    /* Add a 0 byte frame so the time spent dropping frames is not counted as
-     * time during which the buffer was refilling. This implies dropping this
-     * frame.
-     */
-    add_frame(encoder, frame_mm_time, 0, 0);
-
-    if (encoder->server_drops >= get_source_fps(encoder)) {
-        spice_debug("cut the bit rate");
-        uint64_t bit_rate = (encoder->bit_rate == encoder->min_bit_rate) ?
-            encoder->bit_rate / SPICE_GST_BITRATE_CUT :
-            MAX(encoder->min_bit_rate, encoder->bit_rate / SPICE_GST_BITRATE_CUT);
-        set_bit_rate(encoder, bit_rate);
-
-    } else {
-        spice_debug("reduce the bit rate");
-        uint64_t bit_rate = (encoder->bit_rate == encoder->min_bit_rate) ?
-            encoder->bit_rate / SPICE_GST_BITRATE_REDUCE :
-            MAX(encoder->min_bit_rate, encoder->bit_rate / SPICE_GST_BITRATE_REDUCE);
-        set_bit_rate(encoder, bit_rate);
-    }
-    encoder->server_drops = 0;
-    return TRUE;
-}
-
-/* A helper for gst_encoder_encode_frame() */
-static inline void server_increase_bit_rate(SpiceGstEncoder *encoder,
-                                            uint32_t frame_mm_time)
-{
-    /* Let gst_encoder_client_stream_report() deal with bit rate increases if
-     * we receive client reports.
-     */
-    if (!encoder->has_client_reports && encoder->server_drops == 0 &&
-        frame_mm_time - encoder->last_change >= encoder->increase_interval) {
-        increase_bit_rate(encoder);
+    if (rc->bit_rate > encoder->video_bit_rate) {
+        set_video_bit_rate(encoder, rc->bit_rate * VIDEO_RC_BITRATE_MARGIN);
     }
 }
 
@@ -799,7 +467,7 @@ static void set_appsrc_caps(SpiceGstEncoder *encoder)
 #endif
         "width", G_TYPE_INT, encoder->width,
         "height", G_TYPE_INT, encoder->height,
-        "framerate", GST_TYPE_FRACTION, get_source_fps(encoder), 1,
+        "framerate", GST_TYPE_FRACTION, video_rate_control_get_source_fps(&encoder->rate), 1,
         NULL);
     gst_app_src_set_caps(encoder->appsrc, encoder->src_caps);
 }
@@ -883,7 +551,8 @@ static const gchar* get_gst_codec_name(SpiceGstEncoder *encoder)
     }
 }
 
-static gboolean create_pipeline(SpiceGstEncoder *encoder)
+/* A helper for create_pipeline() */
+static gboolean build_pipeline(SpiceGstEncoder *encoder)
 {
 #ifdef HAVE_GSTREAMER_0_10
     const gchar *converter = "ffmpegcolorspace";
@@ -965,6 +634,22 @@ static gboolean create_pipeline(SpiceGstEncoder *encoder)
     encoder->gstenc = gst_bin_get_by_name(GST_BIN(encoder->pipeline), "encoder");
     encoder->appsink = GST_APP_SINK(gst_bin_get_by_name(GST_BIN(encoder->pipeline), "sink"));
 
+    if (encoder->base.codec_type == SPICE_VIDEO_CODEC_TYPE_MJPEG) {
+        /* See https://bugzilla.gnome.org/show_bug.cgi?id=753257 */
+        spice_debug("removing the pipeline clock");
+        gst_pipeline_use_clock(GST_PIPELINE(encoder->pipeline), NULL);
+    }
+    return TRUE;
+}
+
+static gboolean create_pipeline(SpiceGstEncoder *encoder)
+{
+    if (pipeline_pool_take(encoder)) {
+        spice_debug("reusing a pooled GStreamer pipeline");
+    } else if (!build_pipeline(encoder)) {
+        return FALSE;
+    }
+
 #ifdef HAVE_GSTREAMER_0_10
     GstAppSinkCallbacks appsink_cbs = {NULL, NULL, &new_sample, NULL, {NULL}};
 #else
@@ -981,12 +666,6 @@ static gboolean create_pipeline(SpiceGstEncoder *encoder)
 #endif
     gst_object_unref(bus);
 
-    if (encoder->base.codec_type == SPICE_VIDEO_CODEC_TYPE_MJPEG) {
-        /* See https://bugzilla.gnome.org/show_bug.cgi?id=753257 */
-        spice_debug("removing the pipeline clock");
-        gst_pipeline_use_clock(GST_PIPELINE(encoder->pipeline), NULL);
-    }
-
     /* Figure out which parameter controls the GStreamer encoder's bitrate */
     GObjectClass *class = G_OBJECT_GET_CLASS(encoder->gstenc);
     encoder->gstenc_bitrate_param = g_object_class_find_property(class, "bitrate");
@@ -996,7 +675,8 @@ static gboolean create_pipeline(SpiceGstEncoder *encoder)
     if (encoder->gstenc_bitrate_param) {
         encoder->gstenc_bitrate_is_dynamic = (encoder->gstenc_bitrate_param->flags & GST_PARAM_MUTABLE_PLAYING);
     } else {
-        spice_warning("GStreamer error: could not find the %s bitrate parameter", gstenc_name);
+        spice_warning("GStreamer error: could not find the %s bitrate parameter",
+                      get_gst_codec_name(encoder));
     }
 
     set_pipeline_changes(encoder, SPICE_GST_VIDEO_PIPELINE_STATE |
@@ -1107,19 +787,6 @@ static gboolean configure_pipeline(SpiceGstEncoder *encoder)
     return TRUE;
 }
 
-/* A helper for the *_copy() functions */
-static int is_chunk_stride_aligned(const SpiceBitmap *bitmap, uint32_t index)
-{
-    SpiceChunks *chunks = bitmap->data;
-    if (chunks->chunk[index].len % bitmap->stride != 0) {
-        /* A line straddles two chunks. This is not supported */
-        spice_warning("chunk %d/%d contains an incomplete line, cannot copy",
-                      index, chunks->num_chunks);
-        return FALSE;
-    }
-    return TRUE;
-}
-
 /* A helper for push_raw_frame() */
 static inline int line_copy(SpiceGstEncoder *encoder, const SpiceBitmap *bitmap,
                             uint32_t chunk_offset, uint32_t stream_stride,
@@ -1129,22 +796,35 @@ static inline int line_copy(SpiceGstEncoder *encoder, const SpiceBitmap *bitmap,
      SpiceChunks *chunks = bitmap->data;
      uint32_t chunk_index = 0;
      for (int l = 0; l < height; l++) {
-         /* We may have to move forward by more than one chunk the first
-          * time around. This also protects us against 0-byte chunks.
+         /* Copy the line, which may straddle chunks. Skipping whole chunks
+          * also protects us against 0-byte chunks.
           */
-         while (chunk_offset >= chunks->chunk[chunk_index].len) {
-             if (!is_chunk_stride_aligned(bitmap, chunk_index)) {
+         uint32_t offset = chunk_offset;
+         uint32_t len = stream_stride;
+         uint32_t index = chunk_index;
+         while (len) {
+             while (index < chunks->num_chunks && offset >= chunks->chunk[index].len) {
+                 offset -= chunks->chunk[index].len;
+                 index++;
+             }
+             if (index == chunks->num_chunks) {
+                 spice_warning("the bitmap chunks are too short, cannot copy");
                  return FALSE;
              }
-             chunk_offset -= chunks->chunk[chunk_index].len;
-             chunk_index++;
+             uint32_t thislen = MIN(chunks->chunk[index].len - offset, len);
+             memcpy(dst, chunks->chunk[index].data + offset, thislen);
+             dst += thislen;
+             offset += thislen;
+             len -= thislen;
          }
 
-         /* Copy the line */
-         uint8_t *src = chunks->chunk[chunk_index].data + chunk_offset;
-         memcpy(dst, src, stream_stride);
-         dst += stream_stride;
+         /* Move to the next line from the chunk of this one */
          chunk_offset += bitmap->stride;
+         while (chunk_index < chunks->num_chunks &&
+                chunk_offset >= chunks->chunk[chunk_index].len) {
+             chunk_offset -= chunks->chunk[chunk_index].len;
+             chunk_index++;
+         }
      }
      spice_return_val_if_fail(dst - buffer == stream_stride * height, FALSE);
      return TRUE;
@@ -1197,9 +877,6 @@ static inline int zero_copy(SpiceGstEncoder *encoder,
     const SpiceChunks *chunks = bitmap->data;
     while (*chunk_index < chunks->num_chunks &&
            *chunk_offset >= chunks->chunk[*chunk_index].len) {
-        if (!is_chunk_stride_aligned(bitmap, *chunk_index)) {
-            return FALSE;
-        }
         *chunk_offset -= chunks->chunk[*chunk_index].len;
         (*chunk_index)++;
     }
@@ -1219,9 +896,6 @@ static inline int zero_copy(SpiceGstEncoder *encoder,
 
     BitmapWrapper *wrapper = NULL;
     while (*len && *chunk_index < max_block_count) {
-        if (!is_chunk_stride_aligned(bitmap, *chunk_index)) {
-            return FALSE;
-        }
         if (wrapper) {
             g_atomic_int_inc(&wrapper->refs);
         } else {
@@ -1240,6 +914,49 @@ static inline int zero_copy(SpiceGstEncoder *encoder,
     }
     return TRUE;
 }
+
+/* A helper for push_raw_frame()
+ * Wraps the lines of a frame narrower than the bitmap, leaving the pixels
+ * on the left and right in place, and gives GStreamer the bitmap stride
+ * through a GstVideoMeta.
+ * Returns FALSE, leaving the buffer untouched, if the frame spans several
+ * chunks: gst_video_frame_map() would merge, thus copy, their memory
+ * objects so line_copy() is just as good and only copies the stream area.
+ */
+static inline int zero_copy_lines(SpiceGstEncoder *encoder,
+                                  const SpiceBitmap *bitmap, gpointer bitmap_opaque,
+                                  GstBuffer *buffer, uint32_t chunk_offset,
+                                  uint32_t stream_stride, uint32_t height)
+{
+    const SpiceChunks *chunks = bitmap->data;
+    uint32_t len = bitmap->stride * (height - 1) + stream_stride;
+    uint32_t chunk_index = 0;
+    while (chunk_index < chunks->num_chunks &&
+           chunk_offset >= chunks->chunk[chunk_index].len) {
+        chunk_offset -= chunks->chunk[chunk_index].len;
+        chunk_index++;
+    }
+
+    if (chunk_index == chunks->num_chunks ||
+        chunks->chunk[chunk_index].len - chunk_offset < len) {
+        return FALSE;
+    }
+
+    BitmapWrapper *wrapper = bitmap_wrapper_new(encoder, bitmap_opaque);
+    GstMemory *mem = gst_memory_new_wrapped(GST_MEMORY_FLAG_READONLY,
+                                            chunks->chunk[chunk_index].data,
+                                            chunks->chunk[chunk_index].len,
+                                            chunk_offset, len,
+                                            wrapper, bitmap_wrapper_unref);
+    gst_buffer_append_memory(buffer, mem);
+
+    gsize offset[GST_VIDEO_MAX_PLANES] = { 0 };
+    gint stride[GST_VIDEO_MAX_PLANES] = { bitmap->stride };
+    gst_buffer_add_video_meta_full(buffer, GST_VIDEO_FRAME_FLAG_NONE,
+                                   gst_video_format_from_string(encoder->format->format),
+                                   encoder->width, encoder->height, 1, offset, stride);
+    return TRUE;
+}
 #else
 static void clear_zero_copy_queue(SpiceGstEncoder *encoder, gboolean unref_queue)
 {
@@ -1256,18 +973,12 @@ static inline int chunk_copy(SpiceGstEncoder *encoder, const SpiceBitmap *bitmap
     /* Skip chunks until we find the start of the frame */
     while (chunk_index < chunks->num_chunks &&
            chunk_offset >= chunks->chunk[chunk_index].len) {
-        if (!is_chunk_stride_aligned(bitmap, chunk_index)) {
-            return FALSE;
-        }
         chunk_offset -= chunks->chunk[chunk_index].len;
         chunk_index++;
     }
 
     /* We can copy the frame chunk by chunk */
     while (len && chunk_index < chunks->num_chunks) {
-        if (!is_chunk_stride_aligned(bitmap, chunk_index)) {
-            return FALSE;
-        }
         uint8_t *src = chunks->chunk[chunk_index].data + chunk_offset;
         uint32_t thislen = MIN(chunks->chunk[chunk_index].len - chunk_offset, len);
         memcpy(dst, src, thislen);
@@ -1342,18 +1053,26 @@ static int push_raw_frame(SpiceGstEncoder *encoder,
     uint32_t chunk_offset = bitmap->stride * skip_lines;
 
     if (stream_stride != bitmap->stride) {
-        /* We have to do a line-by-line copy because for each we have to
-         * leave out pixels on the left or right.
-         */
-        uint8_t *dst = allocate_and_map_memory(len, &map, buffer);
-        if (!dst) {
-            return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+        chunk_offset += src->left * encoder->format->bpp / 8;
+#ifdef DO_ZERO_COPY
+        if (zero_copy_lines(encoder, bitmap, bitmap_opaque, buffer,
+                            chunk_offset, stream_stride, height)) {
+            len = 0;
         }
+#endif
 
-        chunk_offset += src->left * encoder->format->bpp / 8;
-        if (!line_copy(encoder, bitmap, chunk_offset, stream_stride, height, dst)) {
-            unmap_and_release_memory(&map, buffer);
-            return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+        if (len) {
+            /* We have to do a line-by-line copy because for each we have
+             * to leave out pixels on the left or right.
+             */
+            uint8_t *dst = allocate_and_map_memory(len, &map, buffer);
+            if (!dst) {
+                return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+            }
+            if (!line_copy(encoder, bitmap, chunk_offset, stream_stride, height, dst)) {
+                unmap_and_release_memory(&map, buffer);
+                return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+            }
         }
     } else {
         /* We can copy the bitmap chunk by chunk */
@@ -1389,6 +1108,10 @@ static int push_raw_frame(SpiceGstEncoder *encoder,
     if (map.memory) {
         gst_memory_unmap(map.memory, &map);
         gst_buffer_append_memory(buffer, map.memory);
+    } else if (gst_buffer_n_memory(buffer) == 1) {
+        /* GStreamer merges, thus copies, the memory blocks of a plane so
+         * only the frames held in a single chunk are not copied at all */
+        encoder->zero_copy_frames++;
     }
 #endif
 
@@ -1430,7 +1153,7 @@ static void spice_gst_encoder_destroy(VideoEncoder *video_encoder)
 {
     SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
 
-    free_pipeline(encoder);
+    release_pipeline(encoder);
     g_mutex_clear(&encoder->outbuf_mutex);
     g_cond_clear(&encoder->outbuf_cond);
 
@@ -1470,12 +1193,8 @@ static int spice_gst_encoder_encode_frame(VideoEncoder *video_encoder,
         encoder->spice_format = bitmap->format;
         encoder->width = width;
         encoder->height = height;
-        if (encoder->bit_rate == 0) {
-            encoder->history[0].mm_time = frame_mm_time;
-            encoder->max_bit_rate = get_bit_rate_cap(encoder);
-            encoder->min_bit_rate = SPICE_GST_MIN_BITRATE;
-            encoder->status = SPICE_GST_BITRATE_DECREASING;
-            set_bit_rate(encoder, encoder->starting_bit_rate);
+        if (video_rate_control_set_frame_size(&encoder->rate, frame_mm_time,
+                                              (uint64_t)width * height * encoder->format->bpp)) {
             encoder->vbuffer_free = 0; /* Slow start */
         } else if (encoder->pipeline) {
             set_pipeline_changes(encoder, SPICE_GST_VIDEO_PIPELINE_CAPS);
@@ -1495,11 +1214,18 @@ static int spice_gst_encoder_encode_frame(VideoEncoder *video_encoder,
         return VIDEO_ENCODER_FRAME_UNSUPPORTED;
     }
 
-    if (rate_control_is_active(encoder) &&
-        (handle_server_drops(encoder, frame_mm_time) ||
-         frame_mm_time < encoder->next_frame_mm_time)) {
-        /* Drop the frame to limit the outgoing bit rate. */
-        return VIDEO_ENCODER_FRAME_DROP;
+    VideoRateControl *rc = &encoder->rate;
+    if (video_rate_control_is_active(rc)) {
+        video_rate_control_limit_bit_rate(rc);
+        if (rc->server_drops) {
+            /* The server dropped a frame so clearly the buffer is full. */
+            encoder->vbuffer_free = MIN(encoder->vbuffer_free, 0);
+        }
+        if (video_rate_control_handle_server_drops(rc, frame_mm_time) ||
+            frame_mm_time < rc->next_frame_mm_time) {
+            /* Drop the frame to limit the outgoing bit rate. */
+            return VIDEO_ENCODER_FRAME_DROP;
+        }
     }
 
     if (!configure_pipeline(encoder)) {
@@ -1528,15 +1254,16 @@ static int spice_gst_encoder_encode_frame(VideoEncoder *video_encoder,
     if (rc != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
         return rc;
     }
-    uint32_t last_mm_time = get_last_frame_mm_time(encoder);
-    add_frame(encoder, frame_mm_time, spice_get_monotonic_time_ns() - start,
-              (*outbuf)->size);
+    uint32_t last_mm_time = video_rate_control_get_last_frame_mm_time(rc);
+    video_rate_control_add_frame(rc, frame_mm_time,
+                                 spice_get_monotonic_time_ns() - start,
+                                 (*outbuf)->size);
 
-    int32_t refill = encoder->bit_rate * (frame_mm_time - last_mm_time) / MSEC_PER_SEC / 8;
+    int32_t refill = rc->bit_rate * (frame_mm_time - last_mm_time) / MSEC_PER_SEC / 8;
     encoder->vbuffer_free = MIN(encoder->vbuffer_free + refill,
                                 encoder->vbuffer_size) - (*outbuf)->size;
 
-    server_increase_bit_rate(encoder, frame_mm_time);
+    video_rate_control_server_increase_bit_rate(rc, frame_mm_time);
     update_next_frame_mm_time(encoder);
 
     return rc;
@@ -1551,134 +1278,41 @@ static void spice_gst_encoder_client_stream_report(VideoEncoder *video_encoder,
                                              uint32_t audio_margin)
 {
     SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
-    encoder->has_client_reports = TRUE;
-
-    encoder->max_video_margin = MAX(encoder->max_video_margin, video_margin);
-    encoder->max_audio_margin = MAX(encoder->max_audio_margin, audio_margin);
-    int32_t margin_delta = video_margin - encoder->last_video_margin;
-    encoder->last_video_margin = video_margin;
-
-    uint64_t period_bit_rate = get_period_bit_rate(encoder, start_frame_mm_time, end_frame_mm_time);
-    spice_debug("client report: %u/%u drops in %ums margins video %3d/%3d audio %3u/%3u bw %.3f/%.3fMbps%s",
-                num_drops, num_frames, end_frame_mm_time - start_frame_mm_time,
-                video_margin, encoder->max_video_margin,
-                audio_margin, encoder->max_audio_margin,
-                get_mbps(period_bit_rate),
-                get_mbps(get_effective_bit_rate(encoder)),
-                start_frame_mm_time < encoder->last_change ? " obsolete" : "");
-    if (encoder->status == SPICE_GST_BITRATE_DECREASING &&
-        start_frame_mm_time < encoder->last_change) {
-        /* Some of this data predates the last bit rate reduction
-         * so it is obsolete.
-         */
-        return;
-    }
-
-    /* We normally arrange for even the largest frames to arrive a bit over
-     * one period before they should be displayed.
-     */
-    uint32_t min_margin = MSEC_PER_SEC / get_source_fps(encoder) +
-        get_network_latency(encoder) * SPICE_GST_LATENCY_MARGIN;
-
-    /* A low video margin indicates that the bit rate is too high. */
-    uint32_t score;
-    if (num_drops) {
-        score = 4;
-    } else if (margin_delta >= 0) {
-        /* The situation was bad but seems to be improving */
-        score = 0;
-    } else if (video_margin < min_margin * SPICE_GST_VIDEO_MARGIN_BAD ||
-               video_margin < encoder->max_video_margin * SPICE_GST_VIDEO_MARGIN_BAD) {
-        score = 3;
-    } else if (video_margin < min_margin ||
-               video_margin < encoder->max_video_margin * SPICE_GST_VIDEO_MARGIN_AVERAGE) {
-        score = 2;
-    } else if (video_margin < encoder->max_video_margin * SPICE_GST_VIDEO_MARGIN_GOOD) {
-        score = 1;
-    } else {
-        score = 0;
-    }
-    /* A fast dropping video margin is a compounding factor. */
-    if (margin_delta < -abs(encoder->max_video_margin) * SPICE_GST_VIDEO_DELTA_BAD) {
-        score += 2;
-    } else if (margin_delta < -abs(encoder->max_video_margin) * SPICE_GST_VIDEO_DELTA_AVERAGE) {
-        score += 1;
-    }
-
-    if (score > 3) {
-        spice_debug("score %u, cut the bit rate", score);
-        uint64_t bit_rate = (encoder->bit_rate == encoder->min_bit_rate) ?
-            encoder->bit_rate / SPICE_GST_BITRATE_CUT :
-            MAX(encoder->min_bit_rate, encoder->bit_rate / SPICE_GST_BITRATE_CUT);
-        set_bit_rate(encoder, bit_rate);
-
-    } else if (score == 3) {
-        spice_debug("score %u, reduce the bit rate", score);
-        uint64_t bit_rate = (encoder->bit_rate == encoder->min_bit_rate) ?
-            encoder->bit_rate / SPICE_GST_BITRATE_REDUCE :
-            MAX(encoder->min_bit_rate, encoder->bit_rate / SPICE_GST_BITRATE_REDUCE);
-        set_bit_rate(encoder, bit_rate);
-
-    } else if (score == 2) {
-        spice_debug("score %u, decrement the bit rate", score);
-        set_bit_rate(encoder, encoder->bit_rate - encoder->bit_rate_step);
-
-    } else if (audio_margin < encoder->max_audio_margin * SPICE_GST_AUDIO_MARGIN_BAD &&
-               audio_margin * SPICE_GST_AUDIO_VIDEO_RATIO < video_margin) {
-        /* The audio margin has decreased a lot while the video_margin
-         * remained higher. It may be that the video stream is starving the
-         * audio one of bandwidth. So reduce the bit rate.
-         */
-        spice_debug("free some bandwidth for the audio stream");
-        set_bit_rate(encoder, encoder->bit_rate - encoder->bit_rate_step);
-
-    } else if (score == 1 && period_bit_rate <= encoder->bit_rate &&
-               encoder->status == SPICE_GST_BITRATE_INCREASING) {
-        /* We only increase the bit rate when score == 0 so things got worse
-         * since the last increase, and not because of a transient bit rate
-         * peak.
-         */
-        spice_debug("degraded margin, decrement bit rate %.3f <= %.3fMbps",
-                    get_mbps(period_bit_rate), get_mbps(encoder->bit_rate));
-        set_bit_rate(encoder, encoder->bit_rate - encoder->bit_rate_step);
-
-    } else if (score == 0 &&
-               get_last_frame_mm_time(encoder) - encoder->last_change >= encoder->increase_interval) {
-        /* The video margin is consistently high so increase the bit rate. */
-        increase_bit_rate(encoder);
-    }
+    video_rate_control_client_stream_report(&encoder->rate, num_frames, num_drops,
+                                            start_frame_mm_time, end_frame_mm_time,
+                                            video_margin, audio_margin);
 }
 
 static void spice_gst_encoder_notify_server_frame_drop(VideoEncoder *video_encoder)
 {
     SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
-    if (encoder->server_drops == 0) {
-        spice_debug("server report: getting frame drops...");
-    }
-    encoder->server_drops++;
+    video_rate_control_notify_server_frame_drop(&encoder->rate);
 }
 
 static uint64_t spice_gst_encoder_get_bit_rate(VideoEncoder *video_encoder)
 {
     SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
-    return get_effective_bit_rate(encoder);
+    return video_rate_control_get_effective_bit_rate(&encoder->rate);
 }
 
 static void spice_gst_encoder_get_stats(VideoEncoder *video_encoder,
                                         VideoEncoderStats *stats)
 {
     SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
-    uint64_t raw_bit_rate = encoder->width * encoder->height * encoder->format->bpp * get_source_fps(encoder);
+    uint64_t raw_bit_rate = encoder->width * encoder->height * encoder->format->bpp * video_rate_control_get_source_fps(&encoder->rate);
 
     spice_return_if_fail(stats != NULL);
-    stats->starting_bit_rate = encoder->starting_bit_rate;
-    stats->cur_bit_rate = get_effective_bit_rate(encoder);
+    stats->starting_bit_rate = encoder->rate.starting_bit_rate;
+    stats->cur_bit_rate = video_rate_control_get_effective_bit_rate(&encoder->rate);
 
     /* Use the compression level as a proxy for the quality */
     stats->avg_quality = stats->cur_bit_rate ? 100.0 - raw_bit_rate / stats->cur_bit_rate : 0;
     if (stats->avg_quality < 0) {
         stats->avg_quality = 0;
     }
+#ifdef DO_ZERO_COPY
+    stats->num_zero_copy_frames = encoder->zero_copy_frames;
+#endif
 }
 
 VideoEncoder *gstreamer_encoder_new(SpiceVideoCodecType codec_type,
@@ -1687,7 +1321,6 @@ VideoEncoder *gstreamer_encoder_new(SpiceVideoCodecType codec_type,
                                     bitmap_ref_t bitmap_ref,
                                     bitmap_unref_t bitmap_unref)
 {
-    verify(SPICE_GST_FRAME_STATISTICS_COUNT <= SPICE_GST_HISTORY_SIZE);
     spice_return_val_if_fail(codec_type == SPICE_VIDEO_CODEC_TYPE_MJPEG ||
                              codec_type == SPICE_VIDEO_CODEC_TYPE_VP8 ||
                              codec_type == SPICE_VIDEO_CODEC_TYPE_H264, NULL);
@@ -1711,10 +1344,8 @@ VideoEncoder *gstreamer_encoder_new(SpiceVideoCodecType codec_type,
     encoder->unused_bitmap_opaques = g_async_queue_new();
 #endif
 
-    if (cbs) {
-        encoder->cbs = *cbs;
-    }
-    encoder->starting_bit_rate = starting_bit_rate;
+    video_rate_control_init(&encoder->rate, cbs, starting_bit_rate,
+                            bit_rate_changed);
     encoder->bitmap_ref = bitmap_ref;
     encoder->bitmap_unref = bitmap_unref;
     encoder->format = GSTREAMER_FORMAT_INVALID;
@@ -21,6 +21,7 @@
 #include "image-cache.h"
 #include "red-parse-qxl.h"
 #include "display-channel.h"
+#include "stat.h"
 
 static ImageCacheItem *image_cache_find(ImageCache *cache, uint64_t id)
 {
@@ -35,18 +36,16 @@ static ImageCacheItem *image_cache_find(ImageCache *cache, uint64_t id)
     return NULL;
 }
 
-static int image_cache_hit(ImageCache *cache, uint64_t id)
+static ImageCacheItem *image_cache_hit(ImageCache *cache, uint64_t id)
 {
     ImageCacheItem *item;
     if (!(item = image_cache_find(cache, id))) {
-        return FALSE;
+        return NULL;
     }
-#ifdef IMAGE_CACHE_AGE
     item->age = cache->age;
-#endif
     ring_remove(&item->lru_link);
     ring_add(&cache->lru, &item->lru_link);
-    return TRUE;
+    return item;
 }
 
 static void image_cache_remove(ImageCache *cache, ImageCacheItem *item)
@@ -64,36 +63,46 @@ static void image_cache_remove(ImageCache *cache, ImageCacheItem *item)
     }
     ring_remove(&item->lru_link);
     pixman_image_unref(item->image);
+    cache->resident_bytes -= item->size;
+    stat_inc_counter(reds, cache->resident_bytes_counter, -(uint64_t)item->size);
     free(item);
-#ifndef IMAGE_CACHE_AGE
-    cache->num_items--;
-#endif
 }
 
-#define IMAGE_CACHE_MAX_ITEMS 2
+static void image_cache_evict(ImageCache *cache, ImageCacheItem *item)
+{
+    stat_inc_counter(reds, cache->evictions_counter, 1);
+    image_cache_remove(cache, item);
+}
+
+static size_t image_get_size(pixman_image_t *image)
+{
+    return (size_t)pixman_image_get_stride(image) * pixman_image_get_height(image);
+}
 
 static void image_cache_put(SpiceImageCache *spice_cache, uint64_t id, pixman_image_t *image)
 {
     ImageCache *cache = SPICE_UPCAST(ImageCache, spice_cache);
     ImageCacheItem *item;
+    ImageCacheItem *tail;
+    size_t size = image_get_size(image);
 
-#ifndef IMAGE_CACHE_AGE
-    if (cache->num_items == IMAGE_CACHE_MAX_ITEMS) {
-        verify(SPICE_OFFSETOF(ImageCacheItem, lru_link) == 0);
-        ImageCacheItem *tail = (ImageCacheItem *)ring_get_tail(&cache->lru);
-        spice_assert(tail);
-        image_cache_remove(cache, tail);
+    /* make room from the least recently used items, the ones of the
+     * current drawable may still be needed by the canvas, so the budget
+     * can be exceeded until the next aging */
+    verify(SPICE_OFFSETOF(ImageCacheItem, lru_link) == 0);
+    while (cache->resident_bytes + size > cache->max_bytes &&
+           (tail = (ImageCacheItem *)ring_get_tail(&cache->lru)) &&
+           tail->age != cache->age) {
+        image_cache_evict(cache, tail);
     }
-#endif
 
     item = spice_new(ImageCacheItem, 1);
     item->id = id;
-#ifdef IMAGE_CACHE_AGE
     item->age = cache->age;
-#else
-    cache->num_items++;
-#endif
+    item->size = size;
     item->image = pixman_image_ref(image);
+    cache->resident_bytes += size;
+    stat_inc_counter(reds, cache->resident_bytes_counter, size);
     ring_item_init(&item->lru_link);
 
     item->next = cache->hash_table[item->id % IMAGE_CACHE_HASH_SIZE];
@@ -113,7 +122,7 @@ static pixman_image_t *image_cache_get(SpiceImageCache *spice_cache, uint64_t id
     return pixman_image_ref(item->image);
 }
 
-void image_cache_init(ImageCache *cache)
+void image_cache_init(ImageCache *cache, size_t max_bytes)
 {
     static SpiceImageCacheOps image_cache_ops = {
         image_cache_put,
@@ -123,10 +132,14 @@ void image_cache_init(ImageCache *cache)
     cache->base.ops = &image_cache_ops;
     memset(cache->hash_table, 0, sizeof(cache->hash_table));
     ring_init(&cache->lru);
-#ifdef IMAGE_CACHE_AGE
     cache->age = 0;
-#else
-    cache->num_items = 0;
+    cache->max_bytes = max_bytes;
+    cache->resident_bytes = 0;
+#ifdef RED_STATISTICS
+    cache->hits_counter = NULL;
+    cache->misses_counter = NULL;
+    cache->evictions_counter = NULL;
+    cache->resident_bytes_counter = NULL;
 #endif
 }
 
@@ -138,31 +151,31 @@ void image_cache_reset(ImageCache *cache)
     while ((item = (ImageCacheItem *)ring_get_head(&cache->lru))) {
         image_cache_remove(cache, item);
     }
-#ifdef IMAGE_CACHE_AGE
     cache->age = 0;
-#endif
 }
 
-#define IMAGE_CACHE_DEPTH 4
+/* drawables after which an image not used is dropped even if there is
+ * room left, so a static screen doesn't keep its images forever */
+#define IMAGE_CACHE_DEPTH 1024
 
 void image_cache_aging(ImageCache *cache)
 {
-    verify(SPICE_OFFSETOF(ImageCacheItem, lru_link) == 0);
-#ifdef IMAGE_CACHE_AGE
     ImageCacheItem *item;
 
+    verify(SPICE_OFFSETOF(ImageCacheItem, lru_link) == 0);
     cache->age++;
     while ((item = (ImageCacheItem *)ring_get_tail(&cache->lru)) &&
-           cache->age - item->age > IMAGE_CACHE_DEPTH) {
-        image_cache_remove(cache, item);
+           (cache->age - item->age > IMAGE_CACHE_DEPTH ||
+            cache->resident_bytes > cache->max_bytes)) {
+        image_cache_evict(cache, item);
     }
-#endif
 }
 
 void image_cache_localize(ImageCache *cache, SpiceImage **image_ptr,
                           SpiceImage *image_store, Drawable *drawable)
 {
     SpiceImage *image = *image_ptr;
+    ImageCacheItem *item;
 
     if (image == NULL) {
         spice_assert(drawable != NULL);
@@ -171,7 +184,9 @@ void image_cache_localize(ImageCache *cache, SpiceImage **image_ptr,
         return;
     }
 
-    if (image_cache_hit(cache, image->descriptor.id)) {
+    if ((item = image_cache_hit(cache, image->descriptor.id))) {
+        stat_inc_counter(reds, cache->hits_counter, 1);
+        stat_inc_counter(reds, cache->saved_bytes_counter, item->size);
         image_store->descriptor = image->descriptor;
         image_store->descriptor.type = SPICE_IMAGE_TYPE_FROM_CACHE;
         image_store->descriptor.flags = 0;
@@ -184,13 +199,13 @@ void image_cache_localize(ImageCache *cache, SpiceImage **image_ptr,
         image_store->descriptor = image->descriptor;
         image_store->u.quic = image->u.quic;
         *image_ptr = image_store;
-#ifdef IMAGE_CACHE_AGE
-        image_store->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_ME;
-#else
-        if (image_store->descriptor.width * image->descriptor.height >= 640 * 480) {
+        stat_inc_counter(reds, cache->misses_counter, 1);
+        /* an image taking more than a quarter of the budget would flush
+         * the others for a single use most of the time */
+        if ((uint64_t)image->descriptor.width * image->descriptor.height * 4 <=
+            cache->max_bytes / 4) {
             image_store->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_ME;
         }
-#endif
         break;
     }
     case SPICE_IMAGE_TYPE_BITMAP:
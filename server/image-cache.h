@@ -29,27 +29,37 @@ typedef struct Drawable Drawable;
 typedef struct ImageCacheItem {
     RingItem lru_link;
     uint64_t id;
-#ifdef IMAGE_CACHE_AGE
     uint32_t age;
-#endif
+    size_t size;
     struct ImageCacheItem *next;
     pixman_image_t *image;
 } ImageCacheItem;
 
 #define IMAGE_CACHE_HASH_SIZE 1024
 
+/* decoded bytes kept by default for each display channel */
+#define IMAGE_CACHE_DEFAULT_SIZE (32 * 1024 * 1024)
+
 typedef struct ImageCache {
     SpiceImageCache base;
     ImageCacheItem *hash_table[IMAGE_CACHE_HASH_SIZE];
     Ring lru;
-#ifdef IMAGE_CACHE_AGE
+    /* bumped for each drawable, the items used by the current one are
+     * not evicted */
     uint32_t age;
-#else
-    uint32_t num_items;
+    size_t max_bytes;
+    size_t resident_bytes;
+#ifdef RED_STATISTICS
+    uint64_t *hits_counter;
+    uint64_t *misses_counter;
+    uint64_t *evictions_counter;
+    uint64_t *resident_bytes_counter;
+    /* size of the decoded images the hits didn't decode again */
+    uint64_t *saved_bytes_counter;
 #endif
 } ImageCache;
 
-void         image_cache_init              (ImageCache *cache);
+void         image_cache_init              (ImageCache *cache, size_t max_bytes);
 void         image_cache_reset             (ImageCache *cache);
 void         image_cache_aging             (ImageCache *cache);
 void         image_cache_localize          (ImageCache *cache, SpiceImage **image_ptr,
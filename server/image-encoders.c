@@ -32,6 +32,19 @@
 
 #define MAX_GLZ_DRAWABLE_INSTANCES 2
 
+/* max number of unused compress buffers kept for reuse by each ImageEncoders */
+#define COMPRESS_BUF_POOL_MAX_FREE 16
+
+/* Compress buffers are released by the marshaller only after the message is
+ * sent, so the pool is reference counted: one reference for the ImageEncoders
+ * and one for each buffer that was allocated and not released yet. */
+struct RedCompressBufPool {
+    uint32_t refs;
+    RedCompressBuf *free_bufs;
+    uint32_t num_free;
+    ImageEncoderSharedData *shared_data;
+};
+
 typedef struct RedGlzDrawable RedGlzDrawable;
 typedef struct GlzDrawableInstanceItem GlzDrawableInstanceItem;
 
@@ -43,6 +56,9 @@ struct GlzSharedDictionary {
     pthread_rwlock_t encode_lock;
     int migrate_freeze;
     RedClient *client; // channel clients of the same client share the dict
+    /* the only encoder accounting the dictionary in its stat counters, so
+     * that a dictionary shared by several channels is counted once */
+    ImageEncoders *stats_owner;
 };
 
 /* for each qxl drawable, there may be several instances of lz drawables */
@@ -193,11 +209,76 @@ static void glz_usr_free(GlzEncoderUsrContext *usr, void *ptr)
     free(ptr);
 }
 
+static RedCompressBufPool *compress_buf_pool_new(ImageEncoderSharedData *shared_data)
+{
+    RedCompressBufPool *pool = spice_new0(RedCompressBufPool, 1);
+
+    pool->refs = 1;
+    pool->shared_data = shared_data;
+    return pool;
+}
+
+static void compress_buf_pool_unref(RedCompressBufPool *pool)
+{
+    if (--pool->refs != 0) {
+        return;
+    }
+    spice_assert(pool->free_bufs == NULL);
+    free(pool);
+}
+
+/* Drops the unused buffers and the reference of the owner.
+ * Buffers still held by the marshaller are freed when released. */
+static void compress_buf_pool_release(RedCompressBufPool *pool)
+{
+    while (pool->free_bufs) {
+        RedCompressBuf *buf = pool->free_bufs;
+        pool->free_bufs = buf->send_next;
+        g_free(buf);
+    }
+    pool->num_free = 0;
+    pool->shared_data = NULL;
+    compress_buf_pool_unref(pool);
+}
+
+static RedCompressBuf *compress_buf_new(RedCompressBufPool *pool)
+{
+    RedCompressBuf *buf;
+
+    if (pool->free_bufs) {
+        buf = pool->free_bufs;
+        pool->free_bufs = buf->send_next;
+        pool->num_free--;
+        stat_inc_counter(reds, pool->shared_data->compress_buf_hits_counter, 1);
+    } else {
+        buf = g_new(RedCompressBuf, 1);
+        stat_inc_counter(reds, pool->shared_data->compress_buf_misses_counter, 1);
+    }
+    pool->refs++;
+    buf->pool = pool;
+    buf->send_next = NULL;
+    return buf;
+}
+
+void compress_buf_free(RedCompressBuf *buf)
+{
+    RedCompressBufPool *pool = buf->pool;
+
+    /* the pool doesn't keep buffers anymore once its owner released it */
+    if (pool->shared_data && pool->num_free < COMPRESS_BUF_POOL_MAX_FREE) {
+        buf->send_next = pool->free_bufs;
+        pool->free_bufs = buf;
+        pool->num_free++;
+    } else {
+        g_free(buf);
+    }
+    compress_buf_pool_unref(pool);
+}
+
 static void encoder_data_init(EncoderData *data)
 {
-    data->bufs_tail = g_new(RedCompressBuf, 1);
+    data->bufs_tail = compress_buf_new(data->pool);
     data->bufs_head = data->bufs_tail;
-    data->bufs_head->send_next = NULL;
 }
 
 static void encoder_data_reset(EncoderData *data)
@@ -205,7 +286,7 @@ static void encoder_data_reset(EncoderData *data)
     RedCompressBuf *buf = data->bufs_head;
     while (buf) {
         RedCompressBuf *next = buf->send_next;
-        g_free(buf);
+        compress_buf_free(buf);
         buf = next;
     }
     data->bufs_head = data->bufs_tail = NULL;
@@ -218,10 +299,9 @@ static int encoder_usr_more_space(EncoderData *enc_data, uint8_t **io_ptr)
 {
     RedCompressBuf *buf;
 
-    buf = g_new(RedCompressBuf, 1);
+    buf = compress_buf_new(enc_data->pool);
     enc_data->bufs_tail->send_next = buf;
     enc_data->bufs_tail = buf;
-    buf->send_next = NULL;
     *io_ptr = buf->buf.bytes;
     return sizeof(buf->buf);
 }
@@ -258,6 +338,14 @@ static int lz4_usr_more_space(Lz4EncoderUsrContext *usr, uint8_t **io_ptr)
 }
 #endif
 
+#ifdef USE_ZSTD
+static int zstd_usr_more_space(ZstdEncoderUsrContext *usr, uint8_t **io_ptr)
+{
+    EncoderData *usr_data = &(((ZstdData *)usr)->data);
+    return encoder_usr_more_space(usr_data, io_ptr);
+}
+#endif
+
 static int zlib_usr_more_space(ZlibEncoderUsrContext *usr, uint8_t **io_ptr)
 {
     EncoderData *usr_data = &(((ZlibData *)usr)->data);
@@ -326,6 +414,14 @@ static int lz4_usr_more_lines(Lz4EncoderUsrContext *usr, uint8_t **lines)
 }
 #endif
 
+#ifdef USE_ZSTD
+static int zstd_usr_more_lines(ZstdEncoderUsrContext *usr, uint8_t **lines)
+{
+    EncoderData *usr_data = &(((ZstdData *)usr)->data);
+    return encoder_usr_more_lines(usr_data, lines);
+}
+#endif
+
 static int zlib_usr_more_input(ZlibEncoderUsrContext *usr, uint8_t** input)
 {
     EncoderData *usr_data = &(((ZlibData *)usr)->data);
@@ -440,6 +536,20 @@ static inline void image_encoders_init_lz4(ImageEncoders *enc)
 }
 #endif
 
+#ifdef USE_ZSTD
+static inline void image_encoders_init_zstd(ImageEncoders *enc)
+{
+    enc->zstd_data.usr.more_space = zstd_usr_more_space;
+    enc->zstd_data.usr.more_lines = zstd_usr_more_lines;
+
+    enc->zstd = zstd_encoder_create(&enc->zstd_data.usr);
+
+    if (!enc->zstd) {
+        spice_critical("create zstd encoder failed");
+    }
+}
+#endif
+
 static void image_encoders_init_zlib(ImageEncoders *enc)
 {
     enc->zlib_data.usr.more_space = zlib_usr_more_space;
@@ -460,6 +570,20 @@ void image_encoders_init(ImageEncoders *enc, ImageEncoderSharedData *shared_data
     ring_init(&enc->glz_drawables);
     ring_init(&enc->glz_drawables_inst_to_free);
     pthread_mutex_init(&enc->glz_drawables_inst_to_free_lock, NULL);
+    memset(&enc->glz_reported_stats, 0, sizeof(enc->glz_reported_stats));
+
+    enc->compress_buf_pool = compress_buf_pool_new(shared_data);
+    enc->quic_data.data.pool = enc->compress_buf_pool;
+    enc->lz_data.data.pool = enc->compress_buf_pool;
+    enc->jpeg_data.data.pool = enc->compress_buf_pool;
+#ifdef USE_LZ4
+    enc->lz4_data.data.pool = enc->compress_buf_pool;
+#endif
+#ifdef USE_ZSTD
+    enc->zstd_data.data.pool = enc->compress_buf_pool;
+#endif
+    enc->zlib_data.data.pool = enc->compress_buf_pool;
+    enc->glz_data.data.pool = enc->compress_buf_pool;
 
     image_encoders_init_glz_data(enc);
     image_encoders_init_quic(enc);
@@ -467,6 +591,10 @@ void image_encoders_init(ImageEncoders *enc, ImageEncoderSharedData *shared_data
     image_encoders_init_jpeg(enc);
 #ifdef USE_LZ4
     image_encoders_init_lz4(enc);
+#endif
+#ifdef USE_ZSTD
+    image_encoders_init_zstd(enc);
+    enc->zstd_level = ZSTD_ENCODER_DEFAULT_LEVEL;
 #endif
     image_encoders_init_zlib(enc);
 
@@ -486,9 +614,15 @@ void image_encoders_free(ImageEncoders *enc)
 #ifdef USE_LZ4
     lz4_encoder_destroy(enc->lz4);
     enc->lz4 = NULL;
+#endif
+#ifdef USE_ZSTD
+    zstd_encoder_destroy(enc->zstd);
+    enc->zstd = NULL;
 #endif
     zlib_encoder_destroy(enc->zlib);
     enc->zlib = NULL;
+    compress_buf_pool_release(enc->compress_buf_pool);
+    enc->compress_buf_pool = NULL;
     pthread_mutex_destroy(&enc->glz_drawables_inst_to_free_lock);
 }
 
@@ -722,15 +856,22 @@ static GlzSharedDictionary *find_glz_dictionary(RedClient *client, uint8_t dict_
 
 #define MAX_LZ_ENCODERS MAX_CACHE_CLIENTS
 
+/* Upper bound of the memory referenced by the images held in the glz window
+ * of a single client. The window size requested by the client is in pixels,
+ * so without this bound the memory kept alive per client depends on the
+ * depth of the images it is sent. */
+#define GLZ_DICT_MAX_BYTES (64 * 1024 * 1024)
+
 static GlzSharedDictionary *create_glz_dictionary(ImageEncoders *enc,
                                                   RedClient *client,
                                                   uint8_t id, int window_size)
 {
-    spice_info("Lz Window %d Size=%d", id, window_size);
+    spice_info("Lz Window %d Size=%d Max bytes=%d", id, window_size, GLZ_DICT_MAX_BYTES);
 
     GlzEncDictContext *glz_dict =
         glz_enc_dictionary_create(window_size, MAX_LZ_ENCODERS, &enc->glz_data.usr);
 
+    glz_enc_dictionary_set_max_bytes(glz_dict, GLZ_DICT_MAX_BYTES);
     return glz_shared_dictionary_new(client, id, glz_dict);
 }
 
@@ -765,6 +906,7 @@ static GlzSharedDictionary *restore_glz_dictionary(ImageEncoders *enc,
     GlzEncDictContext *glz_dict =
         glz_enc_dictionary_restore(restore_data, &enc->glz_data.usr);
 
+    glz_enc_dictionary_set_max_bytes(glz_dict, GLZ_DICT_MAX_BYTES);
     return glz_shared_dictionary_new(client, id, glz_dict);
 }
 
@@ -799,12 +941,55 @@ gboolean image_encoders_glz_create(ImageEncoders *enc, uint8_t id)
     return enc->glz != NULL;
 }
 
+/* Accounts the changes in the state of the glz window since the last call
+ * in the stat counters shared by the encoders of the display channel.
+ * A NULL stats removes the window from the counters. */
+static void image_encoders_glz_update_stats(ImageEncoders *enc, const GlzEncDictStats *stats)
+{
+    GlzEncDictStats *reported = &enc->glz_reported_stats;
+    GlzEncDictStats empty_stats = { 0, };
+
+    if (stats == NULL) {
+        /* the number of reallocations is a count of events, it is not reverted */
+        empty_stats.segs_reallocs = reported->segs_reallocs;
+        stats = &empty_stats;
+    }
+
+    stat_inc_counter(reds, enc->shared_data->glz_window_bytes_counter,
+                     stats->window_bytes - reported->window_bytes);
+    stat_inc_counter(reds, enc->shared_data->glz_window_images_counter,
+                     (uint64_t)stats->window_images - reported->window_images);
+    stat_inc_counter(reds, enc->shared_data->glz_segs_realloc_counter,
+                     stats->segs_reallocs - reported->segs_reallocs);
+    *reported = *stats;
+    if (stats == &empty_stats) {
+        reported->segs_reallocs = 0;
+    }
+}
+
+static gboolean image_encoders_glz_is_stats_owner(ImageEncoders *enc)
+{
+    GlzSharedDictionary *shared_dict = enc->glz_dict;
+    ImageEncoders *owner = __atomic_load_n(&shared_dict->stats_owner, __ATOMIC_RELAXED);
+
+    if (owner == NULL) {
+        pthread_mutex_lock(&glz_dictionary_list_lock);
+        if (shared_dict->stats_owner == NULL) {
+            __atomic_store_n(&shared_dict->stats_owner, enc, __ATOMIC_RELAXED);
+        }
+        owner = shared_dict->stats_owner;
+        pthread_mutex_unlock(&glz_dictionary_list_lock);
+    }
+    return owner == enc;
+}
+
 /* destroy encoder, and dictionary if no one uses it*/
 static void image_encoders_release_glz(ImageEncoders *enc)
 {
     GlzSharedDictionary *shared_dict;
 
     image_encoders_free_glz_drawables(enc);
+    image_encoders_glz_update_stats(enc, NULL);
 
     glz_encoder_destroy(enc->glz);
     enc->glz = NULL;
@@ -815,6 +1000,10 @@ static void image_encoders_release_glz(ImageEncoders *enc)
 
     enc->glz_dict = NULL;
     pthread_mutex_lock(&glz_dictionary_list_lock);
+    if (shared_dict->stats_owner == enc) {
+        /* the next encoder using the dictionary takes over */
+        __atomic_store_n(&shared_dict->stats_owner, NULL, __ATOMIC_RELAXED);
+    }
     if (--shared_dict->refs != 0) {
         pthread_mutex_unlock(&glz_dictionary_list_lock);
         return;
@@ -1104,8 +1293,14 @@ int image_encoders_compress_jpeg(ImageEncoders *enc, SpiceImage *dest,
 }
 
 #ifdef USE_LZ4
+void image_encoders_lz4_stream_reset(ImageEncoders *enc)
+{
+    lz4_encoder_stream_reset(enc->lz4);
+}
+
 int image_encoders_compress_lz4(ImageEncoders *enc, SpiceImage *dest,
-                                SpiceBitmap *src, compress_send_data_t* o_comp_data)
+                                SpiceBitmap *src, compress_send_data_t* o_comp_data,
+                                gboolean stream_mode)
 {
     Lz4Data *lz4_data = &enc->lz4_data;
     Lz4EncoderContext *lz4 = enc->lz4;
@@ -1121,6 +1316,8 @@ int image_encoders_compress_lz4(ImageEncoders *enc, SpiceImage *dest,
 
     if (setjmp(lz4_data->data.jmp_env)) {
         encoder_data_reset(&lz4_data->data);
+        // the image won't be sent, the client history would diverge
+        lz4_encoder_stream_reset(lz4);
         return FALSE;
     }
 
@@ -1135,7 +1332,8 @@ int image_encoders_compress_lz4(ImageEncoders *enc, SpiceImage *dest,
 
     lz4_size = lz4_encode(lz4, src->y, src->stride, lz4_data->data.bufs_head->buf.bytes,
                           sizeof(lz4_data->data.bufs_head->buf),
-                          src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN, src->format);
+                          src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN, src->format,
+                          stream_mode);
 
     // the compressed buffer is bigger than the original data
     if (lz4_size > (src->y * src->stride)) {
@@ -1154,6 +1352,57 @@ int image_encoders_compress_lz4(ImageEncoders *enc, SpiceImage *dest,
 }
 #endif
 
+#ifdef USE_ZSTD
+int image_encoders_compress_zstd(ImageEncoders *enc, SpiceImage *dest,
+                                 SpiceBitmap *src, compress_send_data_t* o_comp_data)
+{
+    ZstdData *zstd_data = &enc->zstd_data;
+    int zstd_size = 0;
+    stat_start_time_t start_time;
+    stat_start_time_init(&start_time, &enc->shared_data->zstd_stat);
+
+#ifdef COMPRESS_DEBUG
+    spice_info("ZSTD compress");
+#endif
+
+    encoder_data_init(&zstd_data->data);
+
+    if (setjmp(zstd_data->data.jmp_env)) {
+        encoder_data_reset(&zstd_data->data);
+        return FALSE;
+    }
+
+    if (src->data->flags & SPICE_CHUNKS_FLAGS_UNSTABLE) {
+        spice_chunks_linearize(src->data);
+    }
+
+    zstd_data->data.u.lines_data.chunks = src->data;
+    zstd_data->data.u.lines_data.stride = src->stride;
+    zstd_data->data.u.lines_data.next = 0;
+    zstd_data->data.u.lines_data.reverse = 0;
+
+    zstd_size = zstd_encode(enc->zstd, enc->zstd_level, src->y, src->stride,
+                            zstd_data->data.bufs_head->buf.bytes,
+                            sizeof(zstd_data->data.bufs_head->buf),
+                            src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN, src->format);
+
+    // the compressed buffer is bigger than the original data
+    if (zstd_size == 0 || zstd_size > (src->y * src->stride)) {
+        longjmp(zstd_data->data.jmp_env, 1);
+    }
+
+    dest->descriptor.type = SPICE_IMAGE_TYPE_ZSTD;
+    dest->u.zstd.data_size = zstd_size;
+
+    o_comp_data->comp_buf = zstd_data->data.bufs_head;
+    o_comp_data->comp_buf_size = zstd_size;
+
+    stat_compress_add(&enc->shared_data->zstd_stat, start_time, src->stride * src->y,
+                      o_comp_data->comp_buf_size);
+    return TRUE;
+}
+#endif
+
 /* if already exists, returns it. Otherwise allocates and adds it (1) to the ring tail
    in the channel (2) to the Drawable*/
 static RedGlzDrawable *get_glz_drawable(ImageEncoders *enc, RedDrawable *red_drawable,
@@ -1222,6 +1471,8 @@ int image_encoders_compress_glz(ImageEncoders *enc,
     LzImageType type = bitmap_fmt_to_lz_image_type[src->format];
     RedGlzDrawable *glz_drawable;
     GlzDrawableInstanceItem *glz_drawable_instance;
+    GlzEncDictStats dict_stats;
+    uint64_t max_bytes;
     int glz_size;
     int zlib_size;
 
@@ -1233,6 +1484,11 @@ int image_encoders_compress_glz(ImageEncoders *enc,
         return FALSE;
     }
 
+    max_bytes = glz_enc_dictionary_get_max_bytes(enc->glz_dict->dict);
+    if (max_bytes && ((uint64_t)src->stride * src->y) > max_bytes) {
+        return FALSE;
+    }
+
     pthread_rwlock_rdlock(&enc->glz_dict->encode_lock);
     /* using the global dictionary only if it is not frozen */
     if (enc->glz_dict->migrate_freeze) {
@@ -1259,6 +1515,11 @@ int image_encoders_compress_glz(ImageEncoders *enc,
 
     stat_compress_add(&enc->shared_data->glz_stat, start_time, src->stride * src->y, glz_size);
 
+    if (image_encoders_glz_is_stats_owner(enc)) {
+        glz_enc_dictionary_get_stats(enc->glz_dict->dict, &dict_stats);
+        image_encoders_glz_update_stats(enc, &dict_stats);
+    }
+
     if (!enable_zlib_glz_wrap || (glz_size < MIN_GLZ_SIZE_FOR_ZLIB)) {
         goto glz;
     }
@@ -1317,6 +1578,14 @@ void image_encoder_shared_init(ImageEncoderSharedData *shared_data)
     stat_compress_init(&shared_data->zlib_glz_stat, "zlib", stat_clock);
     stat_compress_init(&shared_data->jpeg_alpha_stat, "jpeg_alpha", stat_clock);
     stat_compress_init(&shared_data->lz4_stat, "lz4", stat_clock);
+    stat_compress_init(&shared_data->zstd_stat, "zstd", stat_clock);
+#ifdef RED_STATISTICS
+    shared_data->glz_window_bytes_counter = NULL;
+    shared_data->glz_window_images_counter = NULL;
+    shared_data->glz_segs_realloc_counter = NULL;
+    shared_data->compress_buf_hits_counter = NULL;
+    shared_data->compress_buf_misses_counter = NULL;
+#endif
 }
 
 void image_encoder_shared_stat_reset(ImageEncoderSharedData *shared_data)
@@ -1329,6 +1598,7 @@ void image_encoder_shared_stat_reset(ImageEncoderSharedData *shared_data)
     stat_reset(&shared_data->zlib_glz_stat);
     stat_reset(&shared_data->jpeg_alpha_stat);
     stat_reset(&shared_data->lz4_stat);
+    stat_reset(&shared_data->zstd_stat);
 }
 
 #define STAT_FMT "%s\t%8u\t%13.8g\t%12.8g\t%12.8g"
@@ -1368,6 +1638,7 @@ void image_encoder_shared_stat_print(const ImageEncoderSharedData *shared_data)
     stat_sum(&total, &shared_data->jpeg_stat);
     stat_sum(&total, &shared_data->jpeg_alpha_stat);
     stat_sum(&total, &shared_data->lz4_stat);
+    stat_sum(&total, &shared_data->zstd_stat);
 
     /* fix for zlib glz */
     total.total += shared_data->zlib_glz_stat.total;
@@ -1385,6 +1656,7 @@ void image_encoder_shared_stat_print(const ImageEncoderSharedData *shared_data)
     stat_print_one("JPEG     ", &shared_data->jpeg_stat);
     stat_print_one("JPEG-RGBA", &shared_data->jpeg_alpha_stat);
     stat_print_one("LZ4      ", &shared_data->lz4_stat);
+    stat_print_one("ZSTD     ", &shared_data->zstd_stat);
     spice_info("-------------------------------------------------------------------");
     stat_print_one("Total    ", &total);
 #endif
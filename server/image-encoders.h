@@ -29,11 +29,15 @@
 #ifdef USE_LZ4
 #include "lz4-encoder.h"
 #endif
+#ifdef USE_ZSTD
+#include "zstd-encoder.h"
+#endif
 #include "zlib-encoder.h"
 
 struct RedClient;
 
 typedef struct RedCompressBuf RedCompressBuf;
+typedef struct RedCompressBufPool RedCompressBufPool;
 typedef struct ImageEncoders ImageEncoders;
 typedef struct ImageEncoderSharedData ImageEncoderSharedData;
 typedef struct GlzSharedDictionary GlzSharedDictionary;
@@ -67,12 +71,13 @@ struct RedCompressBuf {
         uint32_t words[RED_COMPRESS_BUF_SIZE / 4];
     } buf;
     RedCompressBuf *send_next;
+    RedCompressBufPool *pool; // the pool the buffer returns to when freed
 };
 
-static inline void compress_buf_free(RedCompressBuf *buf)
-{
-    g_free(buf);
-}
+/* Releases a buffer returned by one of the image_encoders_compress_xxx functions.
+ * The buffer is kept for reuse by the ImageEncoders it was allocated by.
+ * NOTE - should be called from the thread of the ImageEncoders */
+void compress_buf_free(RedCompressBuf *buf);
 
 gboolean image_encoders_get_glz_dictionary(ImageEncoders *enc,
                                            struct RedClient *client,
@@ -83,6 +88,7 @@ gboolean image_encoders_restore_glz_dictionary(ImageEncoders *enc,
                                                GlzEncDictRestoreData *restore_data);
 
 typedef struct  {
+    RedCompressBufPool *pool;
     RedCompressBuf *bufs_head;
     RedCompressBuf *bufs_tail;
     jmp_buf jmp_env;
@@ -122,6 +128,13 @@ typedef struct {
 } Lz4Data;
 #endif
 
+#ifdef USE_ZSTD
+typedef struct {
+    ZstdEncoderUsrContext usr;
+    EncoderData data;
+} ZstdData;
+#endif
+
 typedef struct {
     ZlibEncoderUsrContext usr;
     EncoderData data;
@@ -152,11 +165,22 @@ struct ImageEncoderSharedData {
     stat_info_t zlib_glz_stat;
     stat_info_t jpeg_alpha_stat;
     stat_info_t lz4_stat;
+    stat_info_t zstd_stat;
+
+#ifdef RED_STATISTICS
+    uint64_t *glz_window_bytes_counter;
+    uint64_t *glz_window_images_counter;
+    uint64_t *glz_segs_realloc_counter;
+    uint64_t *compress_buf_hits_counter;
+    uint64_t *compress_buf_misses_counter;
+#endif
 };
 
 struct ImageEncoders {
     ImageEncoderSharedData *shared_data;
 
+    RedCompressBufPool *compress_buf_pool;
+
     QuicData quic_data;
     QuicContext *quic;
 
@@ -173,6 +197,13 @@ struct ImageEncoders {
     Lz4EncoderContext *lz4;
 #endif
 
+#ifdef USE_ZSTD
+    int zstd_level;
+
+    ZstdData zstd_data;
+    ZstdEncoder *zstd;
+#endif
+
     int zlib_level;
 
     ZlibData zlib_data;
@@ -182,6 +213,7 @@ struct ImageEncoders {
     GlzSharedDictionary *glz_dict;
     GlzEncoderContext *glz;
     GlzData glz_data;
+    GlzEncDictStats glz_reported_stats; // dictionary state last accounted in the stat counters
 
     Ring glz_drawables;               // all the living lz drawable, ordered by encoding time
     Ring glz_drawables_inst_to_free;               // list of instances to be freed
@@ -202,8 +234,15 @@ int image_encoders_compress_lz(ImageEncoders *enc,
                                compress_send_data_t* o_comp_data);
 int image_encoders_compress_jpeg(ImageEncoders *enc, SpiceImage *dest,
                                  SpiceBitmap *src, compress_send_data_t* o_comp_data);
+/* stream_mode: match against the previous LZ4 images too. The client must
+ * decode the stream images in the order they were compressed. */
 int image_encoders_compress_lz4(ImageEncoders *enc, SpiceImage *dest,
-                                SpiceBitmap *src, compress_send_data_t* o_comp_data);
+                                SpiceBitmap *src, compress_send_data_t* o_comp_data,
+                                gboolean stream_mode);
+/* makes the next LZ4 stream image reset the client decoding history */
+void image_encoders_lz4_stream_reset(ImageEncoders *enc);
+int image_encoders_compress_zstd(ImageEncoders *enc, SpiceImage *dest,
+                                 SpiceBitmap *src, compress_send_data_t* o_comp_data);
 int image_encoders_compress_glz(ImageEncoders *enc,
                                 SpiceImage *dest, SpiceBitmap *src,
                                 RedDrawable *red_drawable,
@@ -35,6 +35,7 @@ typedef struct JpegEncoder {
         int height;
         int stride;
         unsigned int out_size;
+        /* NULL when libjpeg reads the lines directly */
         void (*convert_line_to_RGB24) (void *line, int width, uint8_t **out_line);
     } cur_image;
 } JpegEncoder;
@@ -122,6 +123,7 @@ static void convert_RGB16_to_RGB24(void *line, int width, uint8_t **out_line)
    }
 }
 
+#ifndef JCS_EXTENSIONS
 static void convert_BGR24_to_RGB24(void *in_line, int width, uint8_t **out_line)
 {
     int x;
@@ -157,10 +159,7 @@ static void convert_BGRX32_to_RGB24(void *line, int width, uint8_t **out_line)
     }
 }
 
-static void convert_RGB24_to_RGB24(void *line, int width, uint8_t **out_line)
-{
-    *out_line = line;
-}
+#endif
 
 
 #define FILL_LINES() {                                                  \
@@ -173,31 +172,44 @@ static void convert_RGB24_to_RGB24(void *line, int width, uint8_t **out_line)
     }                                                                   \
 }
 
+/* libjpeg is given up to JPEG_BATCH_LINES lines of the same chunk per
+ * call, enough for a full MCU row */
+#define JPEG_BATCH_LINES 16
+
 static void do_jpeg_encode(JpegEncoder *jpeg, uint8_t *lines, unsigned int num_lines)
 {
     uint8_t *lines_end;
-    uint8_t *RGB24_line;
+    uint8_t *RGB24_lines = NULL;
     int stride, width;
-    JSAMPROW row_pointer[1];
+    JSAMPROW row_pointers[JPEG_BATCH_LINES];
     width = jpeg->cur_image.width;
     stride = jpeg->cur_image.stride;
 
-    if (jpeg->cur_image.type != JPEG_IMAGE_TYPE_RGB24) {
-        RGB24_line = (uint8_t *)spice_malloc(width*3);
+    if (jpeg->cur_image.convert_line_to_RGB24) {
+        RGB24_lines = (uint8_t *)spice_malloc_n(width * 3, JPEG_BATCH_LINES);
     }
 
     lines_end = lines + (stride * num_lines);
 
-    for (;jpeg->cinfo.next_scanline < jpeg->cinfo.image_height; lines += stride) {
+    while (jpeg->cinfo.next_scanline < jpeg->cinfo.image_height) {
+        unsigned int n;
+
         FILL_LINES();
-        jpeg->cur_image.convert_line_to_RGB24(lines, width, &RGB24_line);
-        row_pointer[0] = RGB24_line;
-        jpeg_write_scanlines(&jpeg->cinfo, row_pointer, 1);
+        for (n = 0; n < JPEG_BATCH_LINES && lines != lines_end &&
+             jpeg->cinfo.next_scanline + n < jpeg->cinfo.image_height; n++, lines += stride) {
+            if (RGB24_lines) {
+                uint8_t *RGB24_line = RGB24_lines + n * width * 3;
+
+                jpeg->cur_image.convert_line_to_RGB24(lines, width, &RGB24_line);
+                row_pointers[n] = RGB24_line;
+            } else {
+                row_pointers[n] = lines;
+            }
+        }
+        jpeg_write_scanlines(&jpeg->cinfo, row_pointers, n);
     }
 
-    if (jpeg->cur_image.type != JPEG_IMAGE_TYPE_RGB24) {
-        free(RGB24_line);
-    }
+    free(RGB24_lines);
 }
 
 int jpeg_encode(JpegEncoderContext *jpeg, int quality, JpegEncoderImageType type,
@@ -212,18 +224,30 @@ int jpeg_encode(JpegEncoderContext *jpeg, int quality, JpegEncoderImageType type
     enc->cur_image.stride = stride;
     enc->cur_image.out_size = 0;
 
+    enc->cur_image.convert_line_to_RGB24 = NULL;
+    enc->cinfo.input_components = 3;
+    enc->cinfo.in_color_space = JCS_RGB;
+
     switch (type) {
     case JPEG_IMAGE_TYPE_RGB16:
         enc->cur_image.convert_line_to_RGB24 = convert_RGB16_to_RGB24;
         break;
     case JPEG_IMAGE_TYPE_RGB24:
-        enc->cur_image.convert_line_to_RGB24 = convert_RGB24_to_RGB24;
         break;
     case JPEG_IMAGE_TYPE_BGR24:
+#ifdef JCS_EXTENSIONS
+        enc->cinfo.in_color_space = JCS_EXT_BGR;
+#else
         enc->cur_image.convert_line_to_RGB24 = convert_BGR24_to_RGB24;
+#endif
         break;
     case JPEG_IMAGE_TYPE_BGRX32:
+#ifdef JCS_EXTENSIONS
+        enc->cinfo.in_color_space = JCS_EXT_BGRX;
+        enc->cinfo.input_components = 4;
+#else
         enc->cur_image.convert_line_to_RGB24 = convert_BGRX32_to_RGB24;
+#endif
         break;
     default:
         spice_error("bad image type");
@@ -231,8 +255,6 @@ int jpeg_encode(JpegEncoderContext *jpeg, int quality, JpegEncoderImageType type
 
     enc->cinfo.image_width = width;
     enc->cinfo.image_height = height;
-    enc->cinfo.input_components = 3;
-    enc->cinfo.in_color_space = JCS_RGB;
     jpeg_set_defaults(&enc->cinfo);
     jpeg_set_quality(&enc->cinfo, quality, TRUE);
 
@@ -25,8 +25,15 @@
 #include "red-common.h"
 #include "lz4-encoder.h"
 
+/* LZ4 can't reference data farther than 64KB */
+#define LZ4_STREAM_DICT_SIZE (64 * 1024)
+
 typedef struct Lz4Encoder {
     Lz4EncoderUsrContext *usr;
+    /* stream mode state, allocated on first use */
+    LZ4_stream_t *stream;
+    char *dict;
+    int stream_reset;
 } Lz4Encoder;
 
 Lz4EncoderContext* lz4_encoder_create(Lz4EncoderUsrContext *usr)
@@ -38,17 +45,68 @@ Lz4EncoderContext* lz4_encoder_create(Lz4EncoderUsrContext *usr)
 
     enc = spice_new0(Lz4Encoder, 1);
     enc->usr = usr;
+    enc->stream_reset = TRUE;
 
     return (Lz4EncoderContext*)enc;
 }
 
 void lz4_encoder_destroy(Lz4EncoderContext* encoder)
 {
-    free(encoder);
+    Lz4Encoder *enc = (Lz4Encoder *)encoder;
+
+    if (enc->stream) {
+        LZ4_freeStream(enc->stream);
+    }
+    free(enc->dict);
+    free(enc);
+}
+
+void lz4_encoder_stream_reset(Lz4EncoderContext *encoder)
+{
+    Lz4Encoder *enc = (Lz4Encoder *)encoder;
+
+    enc->stream_reset = TRUE;
+}
+
+static LZ4_stream_t *lz4_encoder_get_stream(Lz4Encoder *enc, int stream_mode, uint8_t *flags)
+{
+    if (!stream_mode) {
+        return LZ4_createStream();
+    }
+
+    if (!enc->stream) {
+        enc->stream = LZ4_createStream();
+        enc->dict = spice_malloc(LZ4_STREAM_DICT_SIZE);
+        enc->stream_reset = TRUE;
+    }
+    *flags |= LZ4_ENCODER_FLAG_STREAM;
+    if (enc->stream_reset) {
+        LZ4_resetStream(enc->stream);
+        *flags |= LZ4_ENCODER_FLAG_STREAM_RESET;
+        enc->stream_reset = FALSE;
+    }
+    return enc->stream;
+}
+
+static void lz4_encoder_put_stream(Lz4Encoder *enc, LZ4_stream_t *stream, int success)
+{
+    if (stream != enc->stream) {
+        LZ4_freeStream(stream);
+        return;
+    }
+
+    if (!success) {
+        enc->stream_reset = TRUE;
+        return;
+    }
+    /* the image lines are not ours, keep a copy of the history
+     * for the next image */
+    LZ4_saveDict(stream, enc->dict, LZ4_STREAM_DICT_SIZE);
 }
 
 int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
-               unsigned int num_io_bytes, int top_down, uint8_t format)
+               unsigned int num_io_bytes, int top_down, uint8_t format,
+               int stream_mode)
 {
     Lz4Encoder *enc = (Lz4Encoder *)lz4;
     uint8_t *lines;
@@ -57,10 +115,11 @@ int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
     int in_size, enc_size, out_size, already_copied;
     uint8_t *in_buf, *compressed_lines;
     uint8_t *out_buf = io_ptr;
-    LZ4_stream_t *stream = LZ4_createStream();
+    uint8_t flags = top_down ? LZ4_ENCODER_FLAG_TOP_DOWN : 0;
+    LZ4_stream_t *stream = lz4_encoder_get_stream(enc, stream_mode, &flags);
 
-    // Encode direction and format
-    *(out_buf++) = top_down ? 1 : 0;
+    // Encode direction, stream flags and format
+    *(out_buf++) = flags;
     *(out_buf++) = format;
     num_io_bytes -= 2;
     out_size = 2;
@@ -69,7 +128,7 @@ int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
         num_lines = enc->usr->more_lines(enc->usr, &lines);
         if (num_lines <= 0) {
             spice_error("more lines failed");
-            LZ4_freeStream(stream);
+            lz4_encoder_put_stream(enc, stream, FALSE);
             return 0;
         }
         in_buf = lines;
@@ -81,7 +140,7 @@ int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
         if (enc_size <= 0) {
             spice_error("compress failed!");
             free(compressed_lines);
-            LZ4_freeStream(stream);
+            lz4_encoder_put_stream(enc, stream, FALSE);
             return 0;
         }
         *((uint32_t *)compressed_lines) = htonl(enc_size);
@@ -96,7 +155,7 @@ int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
             if (num_io_bytes <= 0) {
                 spice_error("more space failed");
                 free(compressed_lines);
-                LZ4_freeStream(stream);
+                lz4_encoder_put_stream(enc, stream, FALSE);
                 return 0;
             }
             out_buf = io_ptr;
@@ -109,11 +168,11 @@ int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
         total_lines += num_lines;
     } while (total_lines < height);
 
-    LZ4_freeStream(stream);
     if (total_lines != height) {
         spice_error("too many lines\n");
         out_size = 0;
     }
+    lz4_encoder_put_stream(enc, stream, out_size != 0);
 
     return out_size;
 }
@@ -40,10 +40,24 @@ struct Lz4EncoderUsrContext {
     int (*more_lines)(Lz4EncoderUsrContext *usr, uint8_t **lines);
 };
 
+/* Flags of the first byte of the encoded data.
+ * In stream mode the encoder keeps the last bytes of the previous images as
+ * dictionary, so the decoder must feed every stream image to the same
+ * decoding stream (LZ4_decompress_safe_continue) in the order they were sent.
+ * LZ4_ENCODER_FLAG_STREAM_RESET tells the decoder to drop its history first. */
+#define LZ4_ENCODER_FLAG_TOP_DOWN (1 << 0)
+#define LZ4_ENCODER_FLAG_STREAM (1 << 1)
+#define LZ4_ENCODER_FLAG_STREAM_RESET (1 << 2)
+
 Lz4EncoderContext* lz4_encoder_create(Lz4EncoderUsrContext *usr);
 void lz4_encoder_destroy(Lz4EncoderContext *encoder);
 
+/* Drops the history of the stream mode. Must be called whenever the client
+ * may not have decoded all the stream images encoded so far. */
+void lz4_encoder_stream_reset(Lz4EncoderContext *encoder);
+
 /* returns the total size of the encoded data. */
 int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
-               unsigned int num_io_bytes, int top_down, uint8_t format);
+               unsigned int num_io_bytes, int top_down, uint8_t format,
+               int stream);
 #endif
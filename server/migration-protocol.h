@@ -117,7 +117,10 @@ typedef struct __attribute__ ((__packed__)) SpiceMigrateDataMain {
  * display channel
  * ***************/
 
-#define SPICE_MIGRATE_DATA_DISPLAY_VERSION 1
+#define SPICE_MIGRATE_DATA_DISPLAY_VERSION 2
+/* the destination keeps the client pixmap cache, see
+ * SpiceMigrateDataDisplayPixmapCache */
+#define SPICE_MIGRATE_DATA_DISPLAY_PIXMAP_CACHE_VERSION 2
 #define SPICE_MIGRATE_DATA_DISPLAY_MAGIC SPICE_MAGIC_CONST("DCMD")
 
 /*
@@ -134,7 +137,7 @@ typedef struct __attribute__ ((__packed__)) SpiceMigrateDataDisplay {
 
     /*
      * Synchronizing the shared pixmap cache.
-     * For now, the cache is not migrated, and instead, we reset it and send
+     * Before version 2, the cache is not migrated, and instead, we reset it and send
      * SPICE_MSG_DISPLAY_INVAL_ALL_PIXMAPS to the client.
      * In order to keep the client and server caches consistent:
      * The channel which freezed the cache on the src side, unfreezes it
@@ -185,6 +188,26 @@ typedef struct __attribute__ ((__packed__)) MigrateDisplaySurfacesAtClientLossy
     MigrateDisplaySurfaceLossy surfaces[0];
 } MigrateDisplaySurfacesAtClientLossy;
 
+/* Since version 2, SpiceMigrateDataDisplay is followed by the reference to
+ * the items of the pixmap cache, sent by the freezer only (0 otherwise).
+ * They are listed from the least recently used, the destination adds them
+ * to its cache, already known by the client, instead of resetting it. */
+typedef struct __attribute__ ((__packed__)) SpiceMigrateDataDisplayPixmapCache {
+    uint32_t pixmap_cache_items_ptr; /* reference to MigrateDisplayPixmapCache */
+} SpiceMigrateDataDisplayPixmapCache;
+
+typedef struct __attribute__ ((__packed__)) MigrateDisplayPixmapCacheItem {
+    uint64_t id;
+    uint64_t size;
+    uint32_t cost;
+    uint8_t lossy;
+} MigrateDisplayPixmapCacheItem;
+
+typedef struct __attribute__ ((__packed__)) MigrateDisplayPixmapCache {
+    uint32_t num_items;
+    MigrateDisplayPixmapCacheItem items[0];
+} MigrateDisplayPixmapCache;
+
 /* ****************
  * inputs channel
  * ***************/
@@ -42,6 +42,15 @@ static const int mjpeg_quality_samples[MJPEG_QUALITY_SAMPLE_NUM] = {20, 30, 40,
 #define MJPEG_BIT_RATE_EVAL_MIN_NUM_FRAMES 3
 #define MJPEG_LOW_FPS_RATE_TH 3
 
+/*
+ * When the worst quality does not reach MJPEG_IMPROVE_QUALITY_FPS_PERMISSIVE_TH
+ * the frames are scaled down by 2, then by 4, and the client scales them
+ * back up. The scale is restored once the full frames could get
+ * MJPEG_IMPROVE_QUALITY_FPS_STRICT_TH with the median quality.
+ */
+#define MJPEG_MAX_SCALE_SHIFT 2
+#define MJPEG_MIN_SCALED_SIZE 64
+
 #define MJPEG_SERVER_STATUS_EVAL_FPS_INTERVAL 1
 #define MJPEG_SERVER_STATUS_DOWNGRADE_DROP_FACTOR_TH 0.1
 
@@ -155,6 +164,9 @@ typedef struct MJpegEncoderRateControl {
     uint32_t num_recent_enc_frames;
 
     uint64_t warmup_start_time;
+
+    /* the frames are scaled down by 2^scale_shift */
+    int scale_shift;
 } MJpegEncoderRateControl;
 
 typedef struct MJpegVideoBuffer {
@@ -166,6 +178,14 @@ typedef struct MJpegEncoder {
     VideoEncoder base;
     uint8_t *row;
     uint32_t row_size;
+    /* the lines of the frame when they need no conversion */
+    JSAMPROW *lines;
+    uint32_t lines_size;
+    /* the sums of the blocks of pixels of the scaled frames */
+    uint32_t *block_sums;
+    uint32_t block_sums_size;
+    /* the scale of the frame being encoded */
+    int frame_scale_shift;
     int first_frame;
 
     struct jpeg_compress_struct cinfo;
@@ -219,6 +239,8 @@ static void mjpeg_encoder_destroy(VideoEncoder *video_encoder)
     free(encoder->cinfo.dest);
     jpeg_destroy_compress(&encoder->cinfo);
     free(encoder->row);
+    free(encoder->lines);
+    free(encoder->block_sums);
     free(encoder);
 }
 
@@ -227,7 +249,6 @@ static uint8_t mjpeg_encoder_get_bytes_per_pixel(MJpegEncoder *encoder)
     return encoder->bytes_per_pixel;
 }
 
-#ifndef JCS_EXTENSIONS
 /* Pixel conversion routines */
 static void pixel_rgb24bpp_to_24(void *src_ptr, uint8_t *dest)
 {
@@ -245,7 +266,6 @@ static void pixel_rgb32bpp_to_24(void *src, uint8_t *dest)
     *dest++ = (pixel >>  8) & 0xff;
     *dest++ = (pixel >>  0) & 0xff;
 }
-#endif
 
 static void pixel_rgb16bpp_to_24(void *src, uint8_t *dest)
 {
@@ -347,6 +367,13 @@ spice_jpeg_mem_dest(j_compress_ptr cinfo,
 }
 /* end of code from libjpeg */
 
+/* the share of the link of the stream, 0 if not limited */
+static inline uint64_t mjpeg_encoder_get_max_byte_rate(MJpegEncoder *encoder)
+{
+    return encoder->cbs.get_max_bit_rate ?
+        encoder->cbs.get_max_bit_rate(encoder->cbs.opaque) / 8 : 0;
+}
+
 static inline uint32_t mjpeg_encoder_get_source_fps(MJpegEncoder *encoder)
 {
     return encoder->cbs.get_source_fps ?
@@ -364,6 +391,50 @@ static uint32_t get_max_fps(uint64_t frame_size, uint64_t bytes_per_sec)
     return frame_size ? bytes_per_sec / frame_size : MJPEG_MAX_FPS;
 }
 
+static inline int mjpeg_encoder_can_scale_frames(MJpegEncoder *encoder)
+{
+    return encoder->cbs.can_scale_frames &&
+           encoder->cbs.can_scale_frames(encoder->cbs.opaque);
+}
+
+/*
+ * Moves along the resolution ladder once the quality and the frame rate
+ * were evaluated. Halving the width and the height divides the size of the
+ * encoded frames by about 4, the evaluation that follows the size change
+ * picks the quality and the frame rate of the new scale.
+ */
+static void mjpeg_encoder_adjust_scale(MJpegEncoder *encoder, uint32_t src_fps)
+{
+    MJpegEncoderRateControl *rate_control = &encoder->rate_control;
+    int scale_shift = rate_control->scale_shift;
+
+    if (rate_control->quality_id == 0 &&
+        rate_control->fps < MJPEG_IMPROVE_QUALITY_FPS_PERMISSIVE_TH &&
+        rate_control->fps < src_fps &&
+        scale_shift < MJPEG_MAX_SCALE_SHIFT &&
+        mjpeg_encoder_can_scale_frames(encoder)) {
+        scale_shift++;
+    } else if (scale_shift > 0 &&
+               rate_control->quality_id >= MJPEG_QUALITY_SAMPLE_NUM / 2 &&
+               get_max_fps(rate_control->base_enc_size * 4, rate_control->byte_rate) >=
+               MIN(src_fps, MJPEG_IMPROVE_QUALITY_FPS_STRICT_TH)) {
+        scale_shift--;
+    } else if (scale_shift > 0 && !mjpeg_encoder_can_scale_frames(encoder)) {
+        scale_shift = 0;
+    }
+
+    if (scale_shift == rate_control->scale_shift) {
+        return;
+    }
+    spice_debug("mjpeg %p: frames scaled down by %d (was %d)",
+                encoder, 1 << scale_shift, 1 << rate_control->scale_shift);
+    rate_control->scale_shift = scale_shift;
+    /* the sizes measured at the previous scale don't apply anymore */
+    rate_control->last_enc_size = 0;
+    rate_control->sum_recent_enc_size = 0;
+    rate_control->num_recent_enc_frames = 0;
+}
+
 static inline void mjpeg_encoder_reset_quality(MJpegEncoder *encoder,
                                                int quality_id,
                                                uint32_t fps,
@@ -545,6 +616,7 @@ complete_sample:
 
     spice_debug("MJpeg quality sample end %p: quality %d fps %d",
                 encoder, mjpeg_quality_samples[rate_control->quality_id], rate_control->fps);
+    mjpeg_encoder_adjust_scale(encoder, src_fps);
     if (encoder->cbs.update_client_playback_delay) {
         uint32_t latency = mjpeg_encoder_get_latency(encoder);
         uint32_t min_delay = get_min_required_playback_delay(final_quality_enc_size,
@@ -730,11 +802,15 @@ static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
                                      uint32_t frame_mm_time)
 {
     uint32_t quality;
+    uint32_t width = src->right - src->left;
+    uint32_t height = src->bottom - src->top;
+    int scale_shift;
 
     if (rate_control_is_active(encoder)) {
         MJpegEncoderRateControl *rate_control = &encoder->rate_control;
         uint64_t now;
         uint64_t interval;
+        uint64_t max_byte_rate;
 
         now = spice_get_monotonic_time_ns();
 
@@ -744,6 +820,15 @@ static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
         mjpeg_encoder_adjust_fps(encoder, now);
         interval = (now - rate_control->bit_rate_info.last_frame_time);
 
+        /* give the bandwidth back when other streams start */
+        max_byte_rate = mjpeg_encoder_get_max_byte_rate(encoder);
+        if (max_byte_rate && rate_control->byte_rate > max_byte_rate) {
+            spice_debug("bit rate %.2f (Mbps) above the share of the stream %.2f (Mbps)",
+                        rate_control->byte_rate * 8 / 1024.0 / 1024.0,
+                        max_byte_rate * 8 / 1024.0 / 1024.0);
+            rate_control->byte_rate = max_byte_rate;
+        }
+
         if (interval < NSEC_PER_SEC / rate_control->adjusted_fps) {
             return VIDEO_ENCODER_FRAME_DROP;
         }
@@ -764,19 +849,30 @@ static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
         }
     }
 
+    /* small frames are not worth scaling */
+    scale_shift = encoder->rate_control.scale_shift;
+    while (scale_shift > 0 &&
+           ((width >> scale_shift) < MJPEG_MIN_SCALED_SIZE ||
+            (height >> scale_shift) < MJPEG_MIN_SCALED_SIZE)) {
+        scale_shift--;
+    }
+    encoder->frame_scale_shift = scale_shift;
+
     encoder->cinfo.in_color_space   = JCS_RGB;
     encoder->cinfo.input_components = 3;
-    encoder->pixel_converter = NULL;
 
+    /* the scaled frames are converted to add up the pixels */
     switch (format) {
     case SPICE_BITMAP_FMT_32BIT:
     case SPICE_BITMAP_FMT_RGBA:
         encoder->bytes_per_pixel = 4;
-#ifdef JCS_EXTENSIONS
-        encoder->cinfo.in_color_space   = JCS_EXT_BGRX;
-        encoder->cinfo.input_components = 4;
-#else
         encoder->pixel_converter = pixel_rgb32bpp_to_24;
+#ifdef JCS_EXTENSIONS
+        if (!scale_shift) {
+            encoder->cinfo.in_color_space   = JCS_EXT_BGRX;
+            encoder->cinfo.input_components = 4;
+            encoder->pixel_converter = NULL;
+        }
 #endif
         break;
     case SPICE_BITMAP_FMT_16BIT:
@@ -785,10 +881,12 @@ static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
         break;
     case SPICE_BITMAP_FMT_24BIT:
         encoder->bytes_per_pixel = 3;
-#ifdef JCS_EXTENSIONS
-        encoder->cinfo.in_color_space = JCS_EXT_BGR;
-#else
         encoder->pixel_converter = pixel_rgb24bpp_to_24;
+#ifdef JCS_EXTENSIONS
+        if (!scale_shift) {
+            encoder->cinfo.in_color_space = JCS_EXT_BGR;
+            encoder->pixel_converter = NULL;
+        }
 #endif
         break;
     default:
@@ -796,8 +894,17 @@ static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
         return VIDEO_ENCODER_FRAME_UNSUPPORTED;
     }
 
-    encoder->cinfo.image_width = src->right - src->left;
-    encoder->cinfo.image_height = src->bottom - src->top;
+    encoder->cinfo.image_width = width >> scale_shift;
+    encoder->cinfo.image_height = height >> scale_shift;
+    if (scale_shift) {
+        uint32_t num_sums = encoder->cinfo.image_width * 3;
+
+        if (encoder->block_sums_size < num_sums) {
+            encoder->block_sums = spice_renew(uint32_t, encoder->block_sums, num_sums);
+            encoder->block_sums_size = num_sums;
+        }
+        memset(encoder->block_sums, 0, num_sums * sizeof(uint32_t));
+    }
     if (encoder->pixel_converter != NULL) {
         JDIMENSION stride = encoder->cinfo.image_width * 3;
         /* check for integer overflow */
@@ -829,20 +936,17 @@ static int mjpeg_encoder_encode_scanline(MJpegEncoder *encoder,
 {
     unsigned int scanlines_written;
     uint8_t *row;
+    unsigned int x;
 
+    /* the lines without conversion go through mjpeg_encoder_encode_lines() */
     row = encoder->row;
-    if (encoder->pixel_converter) {
-        unsigned int x;
-        for (x = 0; x < image_width; x++) {
-            /* src_pixels is expected to be 4 bytes aligned */
-            encoder->pixel_converter(src_pixels, row);
-            row += 3;
-            src_pixels += encoder->bytes_per_pixel;
-        }
-        scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &encoder->row, 1);
-    } else {
-        scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &src_pixels, 1);
+    for (x = 0; x < image_width; x++) {
+        /* src_pixels is expected to be 4 bytes aligned */
+        encoder->pixel_converter(src_pixels, row);
+        row += 3;
+        src_pixels += encoder->bytes_per_pixel;
     }
+    scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &encoder->row, 1);
     if (scanlines_written == 0) { /* Not enough space */
         jpeg_abort_compress(&encoder->cinfo);
         encoder->rate_control.last_enc_size = 0;
@@ -852,6 +956,62 @@ static int mjpeg_encoder_encode_scanline(MJpegEncoder *encoder,
     return scanlines_written;
 }
 
+/* Adds up the pixels of a line of a scaled frame, the scaled line is
+ * averaged and written once the last line of its blocks is added. */
+static int mjpeg_encoder_encode_scaled_line(MJpegEncoder *encoder,
+                                            uint8_t *src_pixels,
+                                            unsigned int line)
+{
+    const int shift = encoder->frame_scale_shift;
+    const unsigned int width = encoder->cinfo.image_width;
+    uint32_t *sums = encoder->block_sums;
+    uint8_t rgb[3];
+    unsigned int x, i;
+
+    for (x = 0; x < width << shift; x++) {
+        uint32_t *sum = sums + (x >> shift) * 3;
+
+        encoder->pixel_converter(src_pixels, rgb);
+        sum[0] += rgb[0];
+        sum[1] += rgb[1];
+        sum[2] += rgb[2];
+        src_pixels += encoder->bytes_per_pixel;
+    }
+
+    if ((line + 1) % (1 << shift) != 0) {
+        return TRUE;
+    }
+    for (i = 0; i < width * 3; i++) {
+        encoder->row[i] = sums[i] >> (2 * shift);
+        sums[i] = 0;
+    }
+    if (jpeg_write_scanlines(&encoder->cinfo, &encoder->row, 1) == 0) { /* Not enough space */
+        jpeg_abort_compress(&encoder->cinfo);
+        encoder->rate_control.last_enc_size = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Gives all the lines of the frame to libjpeg at once, which saves the
+ * per line overhead of jpeg_write_scanlines(). */
+static int mjpeg_encoder_encode_lines(MJpegEncoder *encoder, unsigned int num_lines)
+{
+    unsigned int lines_written = 0;
+
+    while (lines_written < num_lines) {
+        unsigned int n = jpeg_write_scanlines(&encoder->cinfo, encoder->lines + lines_written,
+                                              num_lines - lines_written);
+        if (n == 0) { /* Not enough space */
+            jpeg_abort_compress(&encoder->cinfo);
+            encoder->rate_control.last_enc_size = 0;
+            return FALSE;
+        }
+        lines_written += n;
+    }
+    return TRUE;
+}
+
 static size_t mjpeg_encoder_end_frame(MJpegEncoder *encoder)
 {
     mem_destination_mgr *dest = (mem_destination_mgr *) encoder->cinfo.dest;
@@ -925,9 +1085,16 @@ static int encode_frame(MJpegEncoder *encoder, const SpiceRect *src,
         get_image_line(chunks, &offset, &chunk, image_stride);
     }
 
-    const unsigned int stream_height = src->bottom - src->top;
+    /* the last lines and columns of a scaled frame may not fill a block,
+     * they are left out */
+    const unsigned int stream_height = encoder->cinfo.image_height << encoder->frame_scale_shift;
     const unsigned int stream_width = src->right - src->left;
 
+    if (!encoder->pixel_converter && encoder->lines_size < stream_height) {
+        encoder->lines = spice_renew(JSAMPROW, encoder->lines, stream_height);
+        encoder->lines_size = stream_height;
+    }
+
     for (i = 0; i < stream_height; i++) {
         uint8_t *src_line = get_image_line(chunks, &offset, &chunk, image_stride);
 
@@ -936,11 +1103,21 @@ static int encode_frame(MJpegEncoder *encoder, const SpiceRect *src,
         }
 
         src_line += src->left * mjpeg_encoder_get_bytes_per_pixel(encoder);
-        if (mjpeg_encoder_encode_scanline(encoder, src_line, stream_width) == 0) {
+        if (!encoder->pixel_converter) {
+            /* libjpeg reads the bitmap directly */
+            encoder->lines[i] = src_line;
+        } else if (encoder->frame_scale_shift) {
+            if (!mjpeg_encoder_encode_scaled_line(encoder, src_line, i)) {
+                return FALSE;
+            }
+        } else if (mjpeg_encoder_encode_scanline(encoder, src_line, stream_width) == 0) {
             return FALSE;
         }
     }
 
+    if (!encoder->pixel_converter) {
+        return mjpeg_encoder_encode_lines(encoder, stream_height);
+    }
     return TRUE;
 }
 
@@ -962,6 +1139,10 @@ static int mjpeg_encoder_encode_frame(VideoEncoder *video_encoder,
     if (ret == VIDEO_ENCODER_FRAME_ENCODE_DONE) {
         if (encode_frame(encoder, src, bitmap, top_down)) {
             buffer->base.size = mjpeg_encoder_end_frame(encoder);
+            if (encoder->frame_scale_shift) {
+                buffer->base.width = encoder->cinfo.image_width;
+                buffer->base.height = encoder->cinfo.image_height;
+            }
             *outbuf = (VideoBuffer*)buffer;
         } else {
             ret = VIDEO_ENCODER_FRAME_UNSUPPORTED;
@@ -1127,7 +1308,13 @@ static void mjpeg_encoder_increase_bit_rate(MJpegEncoder *encoder)
     if (measured_byte_rate + increase_size < rate_control->byte_rate) {
         spice_debug("measured byte rate is small: not upgrading, just re-evaluating");
     } else {
+        uint64_t max_byte_rate = mjpeg_encoder_get_max_byte_rate(encoder);
+
         rate_control->byte_rate = MIN(measured_byte_rate, rate_control->byte_rate) + increase_size;
+        if (max_byte_rate && rate_control->byte_rate > max_byte_rate) {
+            spice_debug("bit rate limited to the share of the stream");
+            rate_control->byte_rate = max_byte_rate;
+        }
     }
 
     bit_rate_info->change_start_time = 0;
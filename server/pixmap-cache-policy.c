@@ -0,0 +1,334 @@
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pixmap-cache.h"
+
+/* The hits don't reach the policies, they only count them in the items
+ * (see pixmap_cache_hit), the policies take them into account when they
+ * look for a victim. */
+static inline uint32_t item_take_hits(NewCacheItem *item)
+{
+    return __atomic_exchange_n(&item->hits, 0, __ATOMIC_RELAXED);
+}
+
+static void policy_nop(PixmapCache *cache)
+{
+}
+
+static void policy_item_nop(PixmapCache *cache, NewCacheItem *item)
+{
+}
+
+/* LRU, approximated by a clock as the hits don't move the items */
+
+static NewCacheItem *lru_get_victim(PixmapCache *cache)
+{
+    NewCacheItem *tail;
+
+    verify(SPICE_OFFSETOF(NewCacheItem, lru_link) == 0);
+    while ((tail = (NewCacheItem *)ring_get_tail(&cache->lru)) && item_take_hits(tail)) {
+        ring_remove(&tail->lru_link);
+        ring_add(&cache->lru, &tail->lru_link);
+    }
+    return tail;
+}
+
+static const PixmapCachePolicy lru_policy = {
+    .name = "lru",
+    .init = policy_nop,
+    .add = policy_item_nop,
+    .get_victim = lru_get_victim,
+    .remove = policy_item_nop,
+    .reset = policy_nop,
+    .destroy = policy_nop,
+};
+
+/* GreedyDual-Size-Frequency: the items are kept in a min heap of
+ * clock + frequency * cost / size, where the cost is what was sent to
+ * the client for the item. The clock is raised to the priority of the
+ * evicted items so the ones not hit anymore age. */
+
+#define GDSF_SCALE 65536
+
+static uint64_t gdsf_priority(PixmapCache *cache, NewCacheItem *item)
+{
+    return cache->gdsf.clock +
+           (uint64_t) item->frequency * item->cost * GDSF_SCALE / MAX(item->size, 1);
+}
+
+static void gdsf_heap_set(PixmapCache *cache, uint32_t index, NewCacheItem *item)
+{
+    cache->gdsf.heap[index] = item;
+    item->heap_index = index;
+}
+
+static void gdsf_sift_up(PixmapCache *cache, uint32_t index)
+{
+    NewCacheItem *item = cache->gdsf.heap[index];
+
+    while (index > 0) {
+        uint32_t parent = (index - 1) / 2;
+
+        if (cache->gdsf.heap[parent]->priority <= item->priority) {
+            break;
+        }
+        gdsf_heap_set(cache, index, cache->gdsf.heap[parent]);
+        index = parent;
+    }
+    gdsf_heap_set(cache, index, item);
+}
+
+static void gdsf_sift_down(PixmapCache *cache, uint32_t index)
+{
+    NewCacheItem *item = cache->gdsf.heap[index];
+
+    for (;;) {
+        uint32_t child = index * 2 + 1;
+
+        if (child >= cache->gdsf.heap_size) {
+            break;
+        }
+        if (child + 1 < cache->gdsf.heap_size &&
+            cache->gdsf.heap[child + 1]->priority < cache->gdsf.heap[child]->priority) {
+            child++;
+        }
+        if (item->priority <= cache->gdsf.heap[child]->priority) {
+            break;
+        }
+        gdsf_heap_set(cache, index, cache->gdsf.heap[child]);
+        index = child;
+    }
+    gdsf_heap_set(cache, index, item);
+}
+
+static void gdsf_add(PixmapCache *cache, NewCacheItem *item)
+{
+    if (cache->gdsf.heap_size == cache->gdsf.heap_alloc) {
+        cache->gdsf.heap_alloc = MAX(cache->gdsf.heap_alloc * 2, 1024);
+        cache->gdsf.heap = spice_renew(NewCacheItem *, cache->gdsf.heap,
+                                       cache->gdsf.heap_alloc);
+    }
+    item->frequency = 1;
+    item->priority = gdsf_priority(cache, item);
+    gdsf_heap_set(cache, cache->gdsf.heap_size++, item);
+    gdsf_sift_up(cache, item->heap_index);
+}
+
+static NewCacheItem *gdsf_get_victim(PixmapCache *cache)
+{
+    while (cache->gdsf.heap_size) {
+        NewCacheItem *item = cache->gdsf.heap[0];
+        uint32_t hits = item_take_hits(item);
+
+        if (!hits) {
+            return item;
+        }
+        item->frequency += hits;
+        item->priority = gdsf_priority(cache, item);
+        gdsf_sift_down(cache, 0);
+    }
+    return NULL;
+}
+
+static void gdsf_remove(PixmapCache *cache, NewCacheItem *item)
+{
+    uint32_t index = item->heap_index;
+    NewCacheItem *last = cache->gdsf.heap[--cache->gdsf.heap_size];
+
+    spice_assert(cache->gdsf.heap[index] == item);
+    if (last != item) {
+        gdsf_heap_set(cache, index, last);
+        gdsf_sift_down(cache, index);
+        gdsf_sift_up(cache, last->heap_index);
+    }
+    cache->gdsf.clock = MAX(cache->gdsf.clock, item->priority);
+}
+
+static void gdsf_reset(PixmapCache *cache)
+{
+    cache->gdsf.heap_size = 0;
+    cache->gdsf.clock = 0;
+}
+
+static void gdsf_destroy(PixmapCache *cache)
+{
+    free(cache->gdsf.heap);
+    cache->gdsf.heap = NULL;
+    cache->gdsf.heap_alloc = 0;
+    cache->gdsf.heap_size = 0;
+}
+
+static const PixmapCachePolicy gdsf_policy = {
+    .name = "gdsf",
+    .init = policy_nop,
+    .add = gdsf_add,
+    .get_victim = gdsf_get_victim,
+    .remove = gdsf_remove,
+    .reset = gdsf_reset,
+    .destroy = gdsf_destroy,
+};
+
+/* Adaptive replacement, in its clock form (CAR): the items seen once are
+ * in the recent ring and move to the frequent ring once hit. The ids of
+ * the evicted items are remembered (ghosts), an item added again after
+ * its eviction from one ring gives more room to that ring. A scan only
+ * goes through the recent ring and leaves the frequent items alone. */
+
+typedef struct ArcGhost {
+    RingItem link;
+    uint64_t id;
+    size_t size;
+    int frequent;
+} ArcGhost;
+
+static void arc_ghost_free(PixmapCache *cache, ArcGhost *ghost)
+{
+    g_hash_table_remove(cache->arc.ghost_ids, &ghost->id);
+    ring_remove(&ghost->link);
+    cache->arc.ghost_size -= ghost->size;
+    free(ghost);
+}
+
+static void arc_init(PixmapCache *cache)
+{
+    ring_init(&cache->arc.recent);
+    ring_init(&cache->arc.frequent);
+    ring_init(&cache->arc.ghosts);
+    cache->arc.ghost_ids = g_hash_table_new(g_int64_hash, g_int64_equal);
+    cache->arc.recent_size = 0;
+    cache->arc.ghost_size = 0;
+    cache->arc.target = 0;
+}
+
+static void arc_add(PixmapCache *cache, NewCacheItem *item)
+{
+    ArcGhost *ghost = g_hash_table_lookup(cache->arc.ghost_ids, &item->id);
+
+    ring_item_init(&item->policy_link);
+    if (!ghost) {
+        item->frequent = FALSE;
+        ring_add(&cache->arc.recent, &item->policy_link);
+        cache->arc.recent_size += item->size;
+        return;
+    }
+
+    if (ghost->frequent) {
+        cache->arc.target = MAX(cache->arc.target - (int64_t) item->size, 0);
+    } else {
+        cache->arc.target = MAX(MIN(cache->arc.target + (int64_t) item->size, cache->size), 0);
+    }
+    arc_ghost_free(cache, ghost);
+    item->frequent = TRUE;
+    ring_add(&cache->arc.frequent, &item->policy_link);
+}
+
+static NewCacheItem *arc_get_victim(PixmapCache *cache)
+{
+    for (;;) {
+        int from_recent = !ring_is_empty(&cache->arc.recent) &&
+                          (cache->arc.recent_size >= MAX(cache->arc.target, 1) ||
+                           ring_is_empty(&cache->arc.frequent));
+        RingItem *link = ring_get_tail(from_recent ? &cache->arc.recent : &cache->arc.frequent);
+        NewCacheItem *item;
+
+        if (!link) {
+            return NULL;
+        }
+        item = SPICE_CONTAINEROF(link, NewCacheItem, policy_link);
+        if (!item_take_hits(item)) {
+            return item;
+        }
+        ring_remove(link);
+        if (!item->frequent) {
+            item->frequent = TRUE;
+            cache->arc.recent_size -= item->size;
+        }
+        ring_add(&cache->arc.frequent, link);
+    }
+}
+
+static void arc_remove(PixmapCache *cache, NewCacheItem *item)
+{
+    ArcGhost *ghost;
+
+    ring_remove(&item->policy_link);
+    if (!item->frequent) {
+        cache->arc.recent_size -= item->size;
+    }
+
+    ghost = spice_new(ArcGhost, 1);
+    ghost->id = item->id;
+    ghost->size = item->size;
+    ghost->frequent = item->frequent;
+    ring_item_init(&ghost->link);
+    ring_add(&cache->arc.ghosts, &ghost->link);
+    g_hash_table_insert(cache->arc.ghost_ids, &ghost->id, ghost);
+    cache->arc.ghost_size += ghost->size;
+
+    // remember as many evicted items as the cache can hold
+    while (cache->arc.ghost_size > MAX(cache->size, 0)) {
+        RingItem *tail = ring_get_tail(&cache->arc.ghosts);
+
+        arc_ghost_free(cache, SPICE_CONTAINEROF(tail, ArcGhost, link));
+    }
+}
+
+static void arc_reset(PixmapCache *cache)
+{
+    RingItem *link;
+
+    while ((link = ring_get_head(&cache->arc.ghosts))) {
+        arc_ghost_free(cache, SPICE_CONTAINEROF(link, ArcGhost, link));
+    }
+    ring_init(&cache->arc.recent);
+    ring_init(&cache->arc.frequent);
+    cache->arc.recent_size = 0;
+    cache->arc.target = 0;
+}
+
+static void arc_destroy(PixmapCache *cache)
+{
+    arc_reset(cache);
+    g_hash_table_destroy(cache->arc.ghost_ids);
+    cache->arc.ghost_ids = NULL;
+}
+
+static const PixmapCachePolicy arc_policy = {
+    .name = "arc",
+    .init = arc_init,
+    .add = arc_add,
+    .get_victim = arc_get_victim,
+    .remove = arc_remove,
+    .reset = arc_reset,
+    .destroy = arc_destroy,
+};
+
+static const PixmapCachePolicy *const policies[] = {
+    [PIXMAP_CACHE_POLICY_LRU] = &lru_policy,
+    [PIXMAP_CACHE_POLICY_GDSF] = &gdsf_policy,
+    [PIXMAP_CACHE_POLICY_ARC] = &arc_policy,
+};
+
+const PixmapCachePolicy *pixmap_cache_policy_get(PixmapCachePolicyType type)
+{
+    spice_return_val_if_fail(type < SPICE_N_ELEMENTS(policies), &lru_policy);
+
+    return policies[type];
+}
@@ -19,19 +19,254 @@
 #endif
 
 #include "pixmap-cache.h"
+#include "utils.h"
 
-int pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy)
+#define BITS_CACHE_HASH_SIZE(table) (1U << (table)->shift)
+#define BITS_CACHE_HASH_MASK(table) (BITS_CACHE_HASH_SIZE(table) - 1)
+
+static PixmapCacheTable *pixmap_cache_table_new(uint32_t shift)
 {
+    PixmapCacheTable *table;
+
+    table = spice_malloc0(sizeof(*table) + sizeof(table->slots[0]) * (1U << shift));
+    table->shift = shift;
+    return table;
+}
+
+static inline uint32_t pixmap_cache_hash_key(const PixmapCacheTable *table, uint64_t id)
+{
+    return id_hash(id, table->shift);
+}
+
+/* can be called without the lock inside a read section, in which case
+ * the result is only valid if the section is */
+NewCacheItem *pixmap_cache_unlocked_lookup(PixmapCache *cache, uint64_t id)
+{
+    PixmapCacheTable *table = __atomic_load_n(&cache->table, __ATOMIC_ACQUIRE);
+    uint32_t mask = BITS_CACHE_HASH_MASK(table);
+    uint32_t slot = pixmap_cache_hash_key(table, id);
     NewCacheItem *item;
 
-    item = cache->hash_table[BITS_CACHE_HASH_KEY(id)];
+    while ((item = __atomic_load_n(&table->slots[slot], __ATOMIC_ACQUIRE))) {
+        if (__atomic_load_n(&item->id, __ATOMIC_RELAXED) == id) {
+            return item;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
 
-    while (item) {
-        if (item->id == id) {
-            item->lossy = lossy;
+static void pixmap_cache_hash_put(PixmapCacheTable *table, NewCacheItem *item)
+{
+    uint32_t mask = BITS_CACHE_HASH_MASK(table);
+    uint32_t slot = pixmap_cache_hash_key(table, item->id);
+
+    while (table->slots[slot]) {
+        slot = (slot + 1) & mask;
+    }
+    __atomic_store_n(&table->slots[slot], item, __ATOMIC_RELEASE);
+    item->slot = slot;
+}
+
+static void pixmap_cache_hash_grow(PixmapCache *cache)
+{
+    PixmapCacheTable *old_table = cache->table;
+    PixmapCacheTable *table = pixmap_cache_table_new(old_table->shift + 1);
+    uint32_t i;
+
+    for (i = 0; i < BITS_CACHE_HASH_SIZE(old_table); i++) {
+        if (old_table->slots[i]) {
+            pixmap_cache_hash_put(table, old_table->slots[i]);
+        }
+    }
+    __atomic_store_n(&cache->table, table, __ATOMIC_RELEASE);
+
+    /* readers may still be probing the old table, it is freed with the cache */
+    old_table->retired_next = cache->retired_tables;
+    cache->retired_tables = old_table;
+}
+
+NewCacheItem *pixmap_cache_unlocked_insert(PixmapCache *cache, uint64_t id,
+                                           size_t size, uint32_t cost)
+{
+    NewCacheItem *item;
+
+    spice_assert(cache->seq & 1);
+
+    // keep the load under 3/4 so the probe sequences stay short
+    if ((cache->items + 1) * 4 > BITS_CACHE_HASH_SIZE(cache->table) * 3) {
+        pixmap_cache_hash_grow(cache);
+    }
+
+    item = cache->free_items;
+    if (item) {
+        cache->free_items = item->next;
+    } else {
+        item = spice_new0(NewCacheItem, 1);
+    }
+    __atomic_store_n(&item->id, id, __ATOMIC_RELAXED);
+    item->size = size;
+    item->cost = cost;
+    item->hits = 0;
+    pixmap_cache_hash_put(cache->table, item);
+    ring_item_init(&item->lru_link);
+    ring_add(&cache->lru, &item->lru_link);
+    cache->policy->add(cache, item);
+    cache->items++;
+    return item;
+}
+
+void pixmap_cache_unlocked_remove(PixmapCache *cache, NewCacheItem *item)
+{
+    PixmapCacheTable *table = cache->table;
+    uint32_t mask = BITS_CACHE_HASH_MASK(table);
+    uint32_t hole = item->slot;
+    uint32_t slot = hole;
+    NewCacheItem *next;
+
+    spice_assert(cache->seq & 1);
+    spice_assert(table->slots[hole] == item);
+
+    /* move back the following items of the probe sequence which
+     * can't be found anymore past the hole */
+    for (;;) {
+        slot = (slot + 1) & mask;
+        next = table->slots[slot];
+        if (!next) {
             break;
         }
-        item = item->next;
+        if (id_hash_fills_hole(slot, pixmap_cache_hash_key(table, next->id), hole, mask)) {
+            __atomic_store_n(&table->slots[hole], next, __ATOMIC_RELAXED);
+            next->slot = hole;
+            hole = slot;
+        }
+    }
+    __atomic_store_n(&table->slots[hole], NULL, __ATOMIC_RELAXED);
+
+    cache->policy->remove(cache, item);
+    ring_remove(&item->lru_link);
+    cache->items--;
+    item->next = cache->free_items;
+    cache->free_items = item;
+}
+
+int pixmap_cache_unlocked_add(PixmapCache *cache, uint8_t client, uint64_t id,
+                              uint32_t size, uint32_t cost, int lossy, uint64_t serial,
+                              void (*release)(NewCacheItem *item, void *opaque),
+                              void *opaque)
+{
+    NewCacheItem *item;
+
+    /* the evicted items sync must be read inside the write section so that
+     * the concurrent lock free hits either show up or fail */
+    pixmap_cache_write_begin(cache);
+    cache->available -= size;
+    while (cache->available < 0) {
+        NewCacheItem *tail = pixmap_cache_unlocked_get_victim(cache);
+
+        if (!tail || tail->sync[client] == serial) {
+            cache->available += size;
+            pixmap_cache_write_end(cache);
+            return FALSE;
+        }
+        cache->available += tail->size;
+        cache->sync[client] = serial;
+        release(tail, opaque);
+        pixmap_cache_unlocked_remove(cache, tail);
+    }
+    item = pixmap_cache_unlocked_insert(cache, id, size, cost);
+    item->lossy = lossy;
+    memset(item->sync, 0, sizeof(item->sync));
+    item->sync[client] = serial;
+    cache->sync[client] = serial;
+    pixmap_cache_write_end(cache);
+    return TRUE;
+}
+
+NewCacheItem *pixmap_cache_unlocked_get_victim(PixmapCache *cache)
+{
+    // the frozen items are not in the hash table anymore
+    if (cache->freezed) {
+        return NULL;
+    }
+    return cache->policy->get_victim(cache);
+}
+
+void pixmap_cache_unlocked_set_policy(PixmapCache *cache, const PixmapCachePolicy *policy)
+{
+    spice_return_if_fail(cache->items == 0 && !cache->freezed);
+
+    cache->policy->destroy(cache);
+    cache->policy = policy;
+    cache->policy->init(cache);
+}
+
+int pixmap_cache_unlocked_hit(PixmapCache *cache, uint8_t client, uint64_t id,
+                              uint64_t serial, int *lossy, uint32_t *cost)
+{
+    NewCacheItem *item;
+
+    spice_assert(client < MAX_CACHE_CLIENTS);
+    item = pixmap_cache_unlocked_lookup(cache, id);
+    if (item) {
+        __atomic_store_n(&item->sync[client], serial, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&item->hits, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&cache->sync[client], serial, __ATOMIC_RELAXED);
+        *lossy = __atomic_load_n(&item->lossy, __ATOMIC_RELAXED);
+        if (cost) {
+            *cost = item->cost;
+        }
+    }
+    return !!item;
+}
+
+int pixmap_cache_hit(PixmapCache *cache, uint8_t client, uint64_t id,
+                     uint64_t serial, int *lossy, uint32_t *cost)
+{
+    NewCacheItem *item;
+    uint32_t item_cost = 0;
+    uint32_t seq;
+    int hit;
+
+    spice_assert(client < MAX_CACHE_CLIENTS);
+
+    seq = __atomic_load_n(&cache->seq, __ATOMIC_ACQUIRE);
+    if (!(seq & 1)) {
+        item = pixmap_cache_unlocked_lookup(cache, id);
+        if (item) {
+            /* set before checking the section: either the writer evicting
+             * the item sees this sync, or the check fails */
+            __atomic_store_n(&item->sync[client], serial, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&item->hits, 1, __ATOMIC_RELAXED);
+            *lossy = __atomic_load_n(&item->lossy, __ATOMIC_RELAXED);
+            item_cost = __atomic_load_n(&item->cost, __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&cache->seq, __ATOMIC_RELAXED) == seq) {
+            if (item) {
+                __atomic_store_n(&cache->sync[client], serial, __ATOMIC_RELAXED);
+                if (cost) {
+                    *cost = item_cost;
+                }
+            }
+            return !!item;
+        }
+    }
+
+    __atomic_add_fetch(&cache->read_retries, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&cache->lock);
+    hit = pixmap_cache_unlocked_hit(cache, client, id, serial, lossy, cost);
+    pthread_mutex_unlock(&cache->lock);
+    return hit;
+}
+
+int pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy)
+{
+    NewCacheItem *item;
+
+    item = pixmap_cache_unlocked_lookup(cache, id);
+    if (item) {
+        __atomic_store_n(&item->lossy, lossy, __ATOMIC_RELAXED);
     }
     return !!item;
 }
@@ -40,6 +275,7 @@ void pixmap_cache_clear(PixmapCache *cache)
 {
     NewCacheItem *item;
 
+    pixmap_cache_write_begin(cache);
     if (cache->freezed) {
         cache->lru.next = cache->freezed_head;
         cache->lru.prev = cache->freezed_tail;
@@ -49,12 +285,15 @@ void pixmap_cache_clear(PixmapCache *cache)
     verify(SPICE_OFFSETOF(NewCacheItem, lru_link) == 0);
     while ((item = (NewCacheItem *)ring_get_head(&cache->lru))) {
         ring_remove(&item->lru_link);
-        free(item);
+        item->next = cache->free_items;
+        cache->free_items = item;
     }
-    memset(cache->hash_table, 0, sizeof(*cache->hash_table) * BITS_CACHE_HASH_SIZE);
+    memset(cache->table->slots, 0, sizeof(cache->table->slots[0]) * BITS_CACHE_HASH_SIZE(cache->table));
+    cache->policy->reset(cache);
 
     cache->available = cache->size;
     cache->items = 0;
+    pixmap_cache_write_end(cache);
 }
 
 int pixmap_cache_freeze(PixmapCache *cache)
@@ -66,23 +305,57 @@ int pixmap_cache_freeze(PixmapCache *cache)
         return FALSE;
     }
 
+    pixmap_cache_write_begin(cache);
     cache->freezed_head = cache->lru.next;
     cache->freezed_tail = cache->lru.prev;
     ring_init(&cache->lru);
-    memset(cache->hash_table, 0, sizeof(*cache->hash_table) * BITS_CACHE_HASH_SIZE);
+    memset(cache->table->slots, 0, sizeof(cache->table->slots[0]) * BITS_CACHE_HASH_SIZE(cache->table));
     cache->available = -1;
     cache->freezed = TRUE;
+    pixmap_cache_write_end(cache);
 
     pthread_mutex_unlock(&cache->lock);
     return TRUE;
 }
 
+void pixmap_cache_unlocked_foreach_frozen(PixmapCache *cache,
+                                          void (*func)(NewCacheItem *item, void *opaque),
+                                          void *opaque)
+{
+    RingItem *link;
+
+    // the frozen items still point to the reinitialized ring at both ends
+    if (!cache->freezed || cache->freezed_head == &cache->lru) {
+        return;
+    }
+    for (link = cache->freezed_tail; ; link = link->prev) {
+        func(SPICE_CONTAINEROF(link, NewCacheItem, lru_link), opaque);
+        if (link == cache->freezed_head) {
+            break;
+        }
+    }
+}
+
 static void pixmap_cache_destroy(PixmapCache *cache)
 {
+    PixmapCacheTable *table;
+    NewCacheItem *item;
+
     spice_assert(cache);
 
     pthread_mutex_lock(&cache->lock);
     pixmap_cache_clear(cache);
+    cache->policy->destroy(cache);
+    while ((item = cache->free_items)) {
+        cache->free_items = item->next;
+        free(item);
+    }
+    while ((table = cache->retired_tables)) {
+        cache->retired_tables = table->retired_next;
+        free(table);
+    }
+    free(cache->table);
+    cache->table = NULL;
     pthread_mutex_unlock(&cache->lock);
 }
 
@@ -90,7 +363,8 @@ static void pixmap_cache_destroy(PixmapCache *cache)
 static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
 static Ring pixmap_cache_list = {&pixmap_cache_list, &pixmap_cache_list};
 
-static PixmapCache *pixmap_cache_new(RedClient *client, uint8_t id, int64_t size)
+static PixmapCache *pixmap_cache_new(RedClient *client, uint8_t id, int64_t size,
+                                     const PixmapCachePolicy *policy)
 {
     PixmapCache *cache = spice_new0(PixmapCache, 1);
 
@@ -98,7 +372,10 @@ static PixmapCache *pixmap_cache_new(RedClient *client, uint8_t id, int64_t size
     pthread_mutex_init(&cache->lock, NULL);
     cache->id = id;
     cache->refs = 1;
+    cache->table = pixmap_cache_table_new(BITS_CACHE_HASH_MIN_SHIFT);
     ring_init(&cache->lru);
+    cache->policy = policy;
+    cache->policy->init(cache);
     cache->available = size;
     cache->size = size;
     cache->client = client;
@@ -106,7 +383,8 @@ static PixmapCache *pixmap_cache_new(RedClient *client, uint8_t id, int64_t size
     return cache;
 }
 
-PixmapCache *pixmap_cache_get(RedClient *client, uint8_t id, int64_t size)
+PixmapCache *pixmap_cache_get(RedClient *client, uint8_t id, int64_t size,
+                              const PixmapCachePolicy *policy)
 {
     PixmapCache *ret = NULL;
     RingItem *now;
@@ -122,7 +400,7 @@ PixmapCache *pixmap_cache_get(RedClient *client, uint8_t id, int64_t size)
         }
     }
     if (!ret) {
-        ret = pixmap_cache_new(client, id, size);
+        ret = pixmap_cache_new(client, id, size, policy);
         ring_add(&pixmap_cache_list, &ret->base);
     }
     pthread_mutex_unlock(&cache_lock);
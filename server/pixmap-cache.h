@@ -22,21 +22,55 @@
 
 #define MAX_CACHE_CLIENTS 4
 
-#define BITS_CACHE_HASH_SHIFT 10
-#define BITS_CACHE_HASH_SIZE (1 << BITS_CACHE_HASH_SHIFT)
-#define BITS_CACHE_HASH_MASK (BITS_CACHE_HASH_SIZE - 1)
-#define BITS_CACHE_HASH_KEY(id) ((id) & BITS_CACHE_HASH_MASK)
+/* initial number of slots of the hash table, it grows with the items */
+#define BITS_CACHE_HASH_MIN_SHIFT 10
 
 typedef struct PixmapCache PixmapCache;
+typedef struct PixmapCacheTable PixmapCacheTable;
 typedef struct NewCacheItem NewCacheItem;
+typedef struct PixmapCachePolicy PixmapCachePolicy;
+
+typedef enum {
+    PIXMAP_CACHE_POLICY_LRU,
+    PIXMAP_CACHE_POLICY_GDSF,
+    PIXMAP_CACHE_POLICY_ARC,
+} PixmapCachePolicyType;
 
 struct NewCacheItem {
     RingItem lru_link;
-    NewCacheItem *next;
+    NewCacheItem *next; // in the free items list
+    uint32_t slot; // in the hash table
     uint64_t id;
     uint64_t sync[MAX_CACHE_CLIENTS];
     size_t size;
+    uint32_t cost; // bytes sent to the client to add it
     int lossy;
+    uint32_t hits; // since the policy last looked at the item
+
+    /* policies data */
+    RingItem policy_link;
+    int frequent;
+    uint64_t priority;
+    uint32_t frequency;
+    uint32_t heap_index;
+};
+
+/* Chooses the items to evict. The items are added to and removed from
+ * the policy with the lock, the hits are only counted in the items. */
+struct PixmapCachePolicy {
+    const char *name;
+    void (*init)(PixmapCache *cache);
+    void (*add)(PixmapCache *cache, NewCacheItem *item);
+    NewCacheItem *(*get_victim)(PixmapCache *cache);
+    void (*remove)(PixmapCache *cache, NewCacheItem *item);
+    void (*reset)(PixmapCache *cache);
+    void (*destroy)(PixmapCache *cache);
+};
+
+struct PixmapCacheTable {
+    PixmapCacheTable *retired_next;
+    uint32_t shift;
+    NewCacheItem *slots[];
 };
 
 struct PixmapCache {
@@ -44,8 +78,33 @@ struct PixmapCache {
     pthread_mutex_t lock;
     uint8_t id;
     uint32_t refs;
-    NewCacheItem *hash_table[BITS_CACHE_HASH_SIZE];
+    /* open addressing with linear probing, the items are removed by moving
+     * back the following ones so no tombstone is needed */
+    PixmapCacheTable *table;
+    /* the hits read the table and the items without the lock, so the
+     * replaced tables and the removed items are only freed with the cache */
+    PixmapCacheTable *retired_tables;
+    NewCacheItem *free_items;
+    /* odd while the table is changed (seqlock), see pixmap_cache_hit */
+    uint32_t seq;
+    uint32_t read_retries;
     Ring lru;
+    const PixmapCachePolicy *policy;
+    struct {
+        NewCacheItem **heap;
+        uint32_t heap_size;
+        uint32_t heap_alloc;
+        uint64_t clock;
+    } gdsf;
+    struct {
+        Ring recent;
+        Ring frequent;
+        Ring ghosts;
+        GHashTable *ghost_ids;
+        int64_t recent_size;
+        int64_t ghost_size;
+        int64_t target; // of the recent items size
+    } arc;
     int64_t available;
     int64_t size;
     int32_t items;
@@ -64,10 +123,55 @@ struct PixmapCache {
     RedClient *client;
 };
 
-PixmapCache *pixmap_cache_get(RedClient *client, uint8_t id, int64_t size);
+/* the changes of the hash table, under the lock, must be enclosed in
+ * write_begin/write_end */
+static inline void pixmap_cache_write_begin(PixmapCache *cache)
+{
+    __atomic_store_n(&cache->seq, cache->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void pixmap_cache_write_end(PixmapCache *cache)
+{
+    __atomic_store_n(&cache->seq, cache->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* policy is only used if the client has no cache with this id yet */
+PixmapCache *pixmap_cache_get(RedClient *client, uint8_t id, int64_t size,
+                              const PixmapCachePolicy *policy);
 void         pixmap_cache_unref(PixmapCache *cache);
 void         pixmap_cache_clear(PixmapCache *cache);
 int          pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy);
+NewCacheItem *pixmap_cache_unlocked_lookup(PixmapCache *cache, uint64_t id);
+/* adds a new item, the caller fills its lossy and sync fields */
+NewCacheItem *pixmap_cache_unlocked_insert(PixmapCache *cache, uint64_t id,
+                                           size_t size, uint32_t cost);
+void         pixmap_cache_unlocked_remove(PixmapCache *cache, NewCacheItem *item);
+/* evicts the items needed to make room for size, calling release on each
+ * one, and adds id as sent to client at serial. Fails if an item to evict
+ * is used by the same message. */
+int          pixmap_cache_unlocked_add(PixmapCache *cache, uint8_t client, uint64_t id,
+                                       uint32_t size, uint32_t cost, int lossy,
+                                       uint64_t serial,
+                                       void (*release)(NewCacheItem *item, void *opaque),
+                                       void *opaque);
+/* the item to evict according to the cache policy */
+NewCacheItem *pixmap_cache_unlocked_get_victim(PixmapCache *cache);
+int          pixmap_cache_unlocked_hit(PixmapCache *cache, uint8_t client, uint64_t id,
+                                       uint64_t serial, int *lossy, uint32_t *cost);
+/* takes the lock only if the table is changed meanwhile */
+int          pixmap_cache_hit(PixmapCache *cache, uint8_t client, uint64_t id,
+                              uint64_t serial, int *lossy, uint32_t *cost);
 int          pixmap_cache_freeze(PixmapCache *cache);
+/* calls func on the items frozen by pixmap_cache_freeze, from the least
+ * recently used one */
+void         pixmap_cache_unlocked_foreach_frozen(PixmapCache *cache,
+                                                  void (*func)(NewCacheItem *item, void *opaque),
+                                                  void *opaque);
+
+/* the cache must be empty */
+void         pixmap_cache_unlocked_set_policy(PixmapCache *cache,
+                                              const PixmapCachePolicy *policy);
+const PixmapCachePolicy *pixmap_cache_policy_get(PixmapCachePolicyType type);
 
 #endif /* _PIXMAP_CACHE_H */
@@ -583,7 +583,7 @@ error:
     return NULL;
 }
 
-static void red_put_image(SpiceImage *red)
+void red_put_image(SpiceImage *red)
 {
     if (red == NULL)
         return;
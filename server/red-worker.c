@@ -78,6 +78,7 @@ struct RedWorker {
     SpiceImageCompression image_compression;
     spice_wan_compression_t jpeg_state;
     spice_wan_compression_t zlib_glz_state;
+    int zstd_level;
 
     uint32_t process_display_generation;
 #ifdef RED_STATISTICS
@@ -870,7 +871,8 @@ static void handle_dev_display_connect(void *opaque, void *payload)
 
     dcc = dcc_new(display, msg->client, msg->stream, msg->migration,
                   msg->common_caps, msg->num_common_caps, msg->caps, msg->num_caps,
-                  worker->image_compression, worker->jpeg_state, worker->zlib_glz_state);
+                  worker->image_compression, worker->jpeg_state, worker->zlib_glz_state,
+                  worker->zstd_level);
     if (!dcc) {
         return;
     }
@@ -1010,6 +1012,11 @@ static void handle_dev_set_compression(void *opaque, void *payload)
     case SPICE_IMAGE_COMPRESSION_LZ4:
         spice_info("ic lz4");
         break;
+#endif
+#ifdef USE_ZSTD
+    case SPICE_IMAGE_COMPRESSION_ZSTD:
+        spice_info("ic zstd");
+        break;
 #endif
     case SPICE_IMAGE_COMPRESSION_LZ:
         spice_info("ic lz");
@@ -1386,6 +1393,8 @@ static gboolean worker_source_prepare(GSource *source, gint *p_timeout)
 
     timeout = MIN(worker->event_timeout,
                   display_channel_get_streams_timeout(worker->display_channel));
+    timeout = MIN(timeout,
+                  display_channel_get_lossy_upgrade_timeout(worker->display_channel));
 
     *p_timeout = (timeout == INF_EVENT_WAIT) ? -1 : timeout;
     if (*p_timeout == 0)
@@ -1422,6 +1431,7 @@ static gboolean worker_source_dispatch(GSource *source, GSourceFunc callback,
 
     /* TODO: could use its own source */
     stream_timeout(display);
+    display_channel_upgrade_lossy_areas(display);
 
     worker->event_timeout = INF_EVENT_WAIT;
     worker->was_blocked = FALSE;
@@ -1471,6 +1481,7 @@ RedWorker* red_worker_new(QXLInstance *qxl,
     worker->image_compression = spice_server_get_image_compression(reds);
     worker->jpeg_state = reds_get_jpeg_state(reds);
     worker->zlib_glz_state = reds_get_zlib_glz_state(reds);
+    worker->zstd_level = reds_get_zstd_level(reds);
     worker->driver_cap_monitors_config = 0;
 #ifdef RED_STATISTICS
     char worker_str[20];
@@ -1510,13 +1521,20 @@ RedWorker* red_worker_new(QXLInstance *qxl,
     worker->display_channel = display_channel_new(reds, worker, FALSE,
                                                   reds_get_streaming_video(reds),
                                                   reds_get_video_codecs(reds),
-                                                  init_info.n_surfaces);
+                                                  init_info.n_surfaces,
+                                                  reds_get_image_cache_size(reds));
 
     channel = RED_CHANNEL(worker->display_channel);
     red_channel_register_client_cbs(channel, client_display_cbs, dispatcher);
     red_channel_set_cap(channel, SPICE_DISPLAY_CAP_MONITORS_CONFIG);
     red_channel_set_cap(channel, SPICE_DISPLAY_CAP_PREF_COMPRESSION);
     red_channel_set_cap(channel, SPICE_DISPLAY_CAP_STREAM_REPORT);
+#if defined(USE_LZ4) && HAVE_DECL_SPICE_DISPLAY_CAP_LZ4_STREAM
+    red_channel_set_cap(channel, SPICE_DISPLAY_CAP_LZ4_STREAM);
+#endif
+#ifdef USE_ZSTD
+    red_channel_set_cap(channel, SPICE_DISPLAY_CAP_ZSTD_COMPRESSION);
+#endif
     reds_register_channel(reds, channel);
 
     return worker;
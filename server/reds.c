@@ -72,6 +72,10 @@
 
 #include "reds-private.h"
 #include "video-encoder.h"
+#ifdef USE_ZSTD
+#include "zstd-encoder.h"
+#endif
+#include "image-cache.h"
 #include "red-channel-client.h"
 
 static void reds_client_monitors_config(RedsState *reds, VDAgentMonitorsConfig *monitors_config);
@@ -186,6 +190,14 @@ struct RedServerConfig {
     uint32_t playback_compression;
     spice_wan_compression_t jpeg_state;
     spice_wan_compression_t zlib_glz_state;
+    int zstd_level;
+    size_t image_cache_size;
+    gboolean copy_diff;
+    gboolean image_fingerprint;
+    PixmapCachePolicyType pixmap_cache_policy;
+    gboolean migrate_pixmap_cache;
+    gboolean lossy_upgrade;
+    gboolean stream_encode_thread;
 
     gboolean agent_mouse;
     gboolean agent_copypaste;
@@ -3558,6 +3570,11 @@ SPICE_GNUC_VISIBLE SpiceServer *spice_server_new(void)
     reds->config->playback_compression = TRUE;
     reds->config->jpeg_state = SPICE_WAN_COMPRESSION_AUTO;
     reds->config->zlib_glz_state = SPICE_WAN_COMPRESSION_AUTO;
+#ifdef USE_ZSTD
+    reds->config->zstd_level = ZSTD_ENCODER_DEFAULT_LEVEL;
+#endif
+    reds->config->image_cache_size = IMAGE_CACHE_DEFAULT_SIZE;
+    reds->config->pixmap_cache_policy = PIXMAP_CACHE_POLICY_LRU;
     reds->config->agent_mouse = TRUE;
     reds->config->agent_copypaste = TRUE;
     reds->config->agent_file_xfer = TRUE;
@@ -3604,6 +3621,7 @@ static gboolean reds_add_renderer(RedsState *reds, const char *name)
 static const EnumNames video_encoder_names[] = {
     {0, "spice"},
     {1, "gstreamer"},
+    {2, "x264"},
     {0, NULL},
 };
 
@@ -3614,6 +3632,11 @@ static const new_video_encoder_t video_encoder_procs[] = {
 #else
     NULL,
 #endif
+#ifdef HAVE_X264
+    &x264_encoder_new,
+#else
+    NULL,
+#endif
 };
 
 static const EnumNames video_codec_names[] = {
@@ -3901,6 +3924,14 @@ SPICE_GNUC_VISIBLE int spice_server_set_image_compression(SpiceServer *s,
         reds_config_set_image_compression(s, comp);
         return -1;
     }
+#endif
+#if !defined(USE_ZSTD) && HAVE_DECL_SPICE_IMAGE_COMPRESSION_ZSTD
+    if (comp == SPICE_IMAGE_COMPRESSION_ZSTD) {
+        spice_warning("zstd compression not supported, falling back to auto GLZ");
+        comp = SPICE_IMAGE_COMPRESSION_AUTO_GLZ;
+        reds_config_set_image_compression(s, comp);
+        return -1;
+    }
 #endif
     reds_config_set_image_compression(s, comp);
     return 0;
@@ -3917,7 +3948,6 @@ SPICE_GNUC_VISIBLE int spice_server_set_jpeg_compression(SpiceServer *s, spice_w
         spice_error("invalid jpeg state");
         return -1;
     }
-    // todo: support dynamically changing the state
     s->config->jpeg_state = comp;
     return 0;
 }
@@ -3928,11 +3958,103 @@ SPICE_GNUC_VISIBLE int spice_server_set_zlib_glz_compression(SpiceServer *s, spi
         spice_error("invalid zlib_glz state");
         return -1;
     }
-    // todo: support dynamically changing the state
     s->config->zlib_glz_state = comp;
     return 0;
 }
 
+SPICE_GNUC_VISIBLE int spice_server_set_zstd_compression_level(SpiceServer *s, int level)
+{
+#ifdef USE_ZSTD
+    /* the workers read the level when they are created */
+    if (s->qxl_instances) {
+        spice_warning("the zstd level must be set before adding a QXL interface");
+        return -1;
+    }
+    s->config->zstd_level = zstd_encoder_check_level(level);
+    return 0;
+#else
+    spice_warning("zstd compression not supported");
+    return -1;
+#endif
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_image_cache_size(SpiceServer *s, size_t size)
+{
+    /* the caches are sized when the display channels are created */
+    if (s->qxl_instances) {
+        spice_warning("the image cache size must be set before adding a QXL interface");
+        return -1;
+    }
+    s->config->image_cache_size = size;
+    return 0;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_copy_diff(SpiceServer *s, int enable)
+{
+    /* the display channels read it when they are created */
+    if (s->qxl_instances) {
+        spice_warning("the copy differencing must be set before adding a QXL interface");
+        return -1;
+    }
+    s->config->copy_diff = !!enable;
+    return 0;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_image_fingerprint(SpiceServer *s, int enable)
+{
+    /* the display channels read it when they are created */
+    if (s->qxl_instances) {
+        spice_warning("the image fingerprinting must be set before adding a QXL interface");
+        return -1;
+    }
+    s->config->image_fingerprint = !!enable;
+    return 0;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_pixmap_cache_policy(SpiceServer *s,
+                                                             spice_pixmap_cache_policy_t policy)
+{
+    static const PixmapCachePolicyType types[] = {
+        [ SPICE_PIXMAP_CACHE_POLICY_LRU  ] = PIXMAP_CACHE_POLICY_LRU,
+        [ SPICE_PIXMAP_CACHE_POLICY_GDSF ] = PIXMAP_CACHE_POLICY_GDSF,
+        [ SPICE_PIXMAP_CACHE_POLICY_ARC  ] = PIXMAP_CACHE_POLICY_ARC,
+    };
+
+    if (policy == SPICE_PIXMAP_CACHE_POLICY_INVALID || policy >= SPICE_N_ELEMENTS(types)) {
+        spice_warning("invalid pixmap cache policy %u", policy);
+        return -1;
+    }
+    /* the display channels read it when they are created */
+    if (s->qxl_instances) {
+        spice_warning("the pixmap cache policy must be set before adding a QXL interface");
+        return -1;
+    }
+    s->config->pixmap_cache_policy = types[policy];
+    return 0;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_lossy_upgrade(SpiceServer *s, int enable)
+{
+    /* the display channels read it when they are created */
+    if (s->qxl_instances) {
+        spice_warning("the lossy upgrade must be set before adding a QXL interface");
+        return -1;
+    }
+    s->config->lossy_upgrade = !!enable;
+    return 0;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_stream_encode_thread(SpiceServer *s, int enable)
+{
+    /* the display channels read it when they are created */
+    if (s->qxl_instances) {
+        spice_warning("the stream encoding thread must be set before adding a QXL interface");
+        return -1;
+    }
+    s->config->stream_encode_thread = !!enable;
+    return 0;
+}
+
 SPICE_GNUC_VISIBLE int spice_server_set_channel_security(SpiceServer *s, const char *channel, int security)
 {
     static const char *const names[] = {
@@ -4226,6 +4348,13 @@ SPICE_GNUC_VISIBLE void spice_server_set_seamless_migration(SpiceServer *reds, i
     spice_debug("seamless migration enabled=%d", enable);
 }
 
+SPICE_GNUC_VISIBLE void spice_server_set_migrate_pixmap_cache(SpiceServer *reds, int enable)
+{
+    /* read by the display channels when they send their migration data */
+    reds->config->migrate_pixmap_cache = !!enable;
+    spice_debug("pixmap cache migration enabled=%d", enable);
+}
+
 GArray* reds_get_renderers(RedsState *reds)
 {
     return reds->config->renderers;
@@ -4241,6 +4370,46 @@ spice_wan_compression_t reds_get_zlib_glz_state(const RedsState *reds)
     return reds->config->zlib_glz_state;
 }
 
+int reds_get_zstd_level(const RedsState *reds)
+{
+    return reds->config->zstd_level;
+}
+
+size_t reds_get_image_cache_size(const RedsState *reds)
+{
+    return reds->config->image_cache_size;
+}
+
+gboolean reds_get_copy_diff(const RedsState *reds)
+{
+    return reds->config->copy_diff;
+}
+
+gboolean reds_get_image_fingerprint(const RedsState *reds)
+{
+    return reds->config->image_fingerprint;
+}
+
+PixmapCachePolicyType reds_get_pixmap_cache_policy(const RedsState *reds)
+{
+    return reds->config->pixmap_cache_policy;
+}
+
+gboolean reds_get_migrate_pixmap_cache(const RedsState *reds)
+{
+    return reds->config->migrate_pixmap_cache;
+}
+
+gboolean reds_get_lossy_upgrade(const RedsState *reds)
+{
+    return reds->config->lossy_upgrade;
+}
+
+gboolean reds_get_stream_encode_thread(const RedsState *reds)
+{
+    return reds->config->stream_encode_thread;
+}
+
 SpiceCoreInterfaceInternal* reds_get_core_interface(RedsState *reds)
 {
     return reds->core;
@@ -29,6 +29,7 @@
 #include "red-channel.h"
 #include "main-dispatcher.h"
 #include "migration-protocol.h"
+#include "pixmap-cache.h"
 
 static inline QXLInterface * qxl_get_interface(QXLInstance *qxl)
 {
@@ -96,6 +97,14 @@ uint32_t reds_get_streaming_video(const RedsState *reds);
 GArray* reds_get_video_codecs(const RedsState *reds);
 spice_wan_compression_t reds_get_jpeg_state(const RedsState *reds);
 spice_wan_compression_t reds_get_zlib_glz_state(const RedsState *reds);
+int reds_get_zstd_level(const RedsState *reds);
+size_t reds_get_image_cache_size(const RedsState *reds);
+gboolean reds_get_copy_diff(const RedsState *reds);
+gboolean reds_get_image_fingerprint(const RedsState *reds);
+PixmapCachePolicyType reds_get_pixmap_cache_policy(const RedsState *reds);
+gboolean reds_get_migrate_pixmap_cache(const RedsState *reds);
+gboolean reds_get_lossy_upgrade(const RedsState *reds);
+gboolean reds_get_stream_encode_thread(const RedsState *reds);
 SpiceCoreInterfaceInternal* reds_get_core_interface(RedsState *reds);
 void reds_update_client_mouse_allowed(RedsState *reds);
 MainDispatcher* reds_get_main_dispatcher(RedsState *reds);
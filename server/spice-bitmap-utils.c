@@ -135,6 +135,96 @@ int spice_bitmap_from_surface_type(uint32_t surface_format)
     return 0;
 }
 
+/* 128 bits MurmurHash3 (x64 variant) extended to process the data in
+ * several pieces, the blocks don't span the pieces so the result
+ * depends on how the data is split */
+typedef struct Fingerprint {
+    uint64_t h1;
+    uint64_t h2;
+    uint64_t len;
+} Fingerprint;
+
+#define FINGERPRINT_C1 UINT64_C(0x87c37b91114253d5)
+#define FINGERPRINT_C2 UINT64_C(0x4cf5ad432745937f)
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= UINT64_C(0xff51afd7ed558ccd);
+    k ^= k >> 33;
+    k *= UINT64_C(0xc4ceb9fe1a85ec53);
+    k ^= k >> 33;
+    return k;
+}
+
+static inline void fingerprint_mix(Fingerprint *fp, uint64_t k1, uint64_t k2)
+{
+    k1 *= FINGERPRINT_C1; k1 = rotl64(k1, 31); k1 *= FINGERPRINT_C2; fp->h1 ^= k1;
+    k2 *= FINGERPRINT_C2; k2 = rotl64(k2, 33); k2 *= FINGERPRINT_C1; fp->h2 ^= k2;
+}
+
+static void fingerprint_update(Fingerprint *fp, const uint8_t *data, size_t len)
+{
+    const uint8_t *end = data + (len & ~(size_t)15);
+    uint64_t k[2];
+
+    for (; data < end; data += 16) {
+        memcpy(k, data, 16);
+        fingerprint_mix(fp, k[0], 0);
+        fp->h1 = rotl64(fp->h1, 27); fp->h1 += fp->h2; fp->h1 = fp->h1 * 5 + 0x52dce729;
+        fingerprint_mix(fp, 0, k[1]);
+        fp->h2 = rotl64(fp->h2, 31); fp->h2 += fp->h1; fp->h2 = fp->h2 * 5 + 0x38495ab5;
+    }
+    if (len & 15) {
+        k[0] = k[1] = 0;
+        memcpy(k, data, len & 15);
+        fingerprint_mix(fp, k[0], k[1]);
+    }
+    fp->len += len;
+}
+
+static void fingerprint_final(Fingerprint *fp, uint64_t fingerprint[2])
+{
+    uint64_t h1 = fp->h1 ^ fp->len;
+    uint64_t h2 = fp->h2 ^ fp->len;
+
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    fingerprint[0] = h1;
+    fingerprint[1] = h2;
+}
+
+void bitmap_get_fingerprint(const SpiceBitmap *bitmap, uint64_t fingerprint[2])
+{
+    Fingerprint fp = { 0, 0, 0 };
+    uint32_t header[5];
+    uint32_t i;
+
+    header[0] = bitmap->format;
+    header[1] = bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN;
+    header[2] = bitmap->x;
+    header[3] = bitmap->y;
+    header[4] = bitmap->stride;
+    fingerprint_update(&fp, (const uint8_t *)header, sizeof(header));
+    if (bitmap->palette) {
+        fingerprint_update(&fp, (const uint8_t *)bitmap->palette->ents,
+                           bitmap->palette->num_ents * sizeof(bitmap->palette->ents[0]));
+    }
+    for (i = 0; i < bitmap->data->num_chunks; i++) {
+        fingerprint_update(&fp, bitmap->data->chunk[i].data, bitmap->data->chunk[i].len);
+    }
+    fingerprint_final(&fp, fingerprint);
+}
+
 #ifdef DUMP_BITMAP
 #define RAM_PATH "/tmp/tmpfs"
 
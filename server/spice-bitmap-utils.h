@@ -84,6 +84,10 @@ static inline int bitmap_fmt_has_graduality(uint8_t fmt)
 
 BitmapGradualType bitmap_get_graduality_level     (SpiceBitmap *bitmap);
 int               bitmap_has_extra_stride         (SpiceBitmap *bitmap);
+/* hash of the pixels and the description of the bitmap, equal bitmaps
+ * have the same fingerprint */
+void              bitmap_get_fingerprint          (const SpiceBitmap *bitmap,
+                                                   uint64_t fingerprint[2]);
 
 void dump_bitmap(SpiceBitmap *bitmap);
 
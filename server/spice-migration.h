@@ -57,5 +57,9 @@ int spice_server_migrate_start(SpiceServer *s);
 int spice_server_migrate_end(SpiceServer *s, int completed);
 
 void spice_server_set_seamless_migration(SpiceServer *s, int enable);
+/* the destination server restores the client pixmap caches, off by
+ * default as older servers refuse the display migration data then. Set it
+ * before spice_server_migrate_start() once the destination is known. */
+void spice_server_set_migrate_pixmap_cache(SpiceServer *s, int enable);
 
 #endif /* SPICE_MIGRATION_H_ */
@@ -94,8 +94,46 @@ typedef enum {
     SPICE_WAN_COMPRESSION_NEVER,
 } spice_wan_compression_t;
 
+/* these two only apply to the QXL interfaces added afterwards */
 int spice_server_set_jpeg_compression(SpiceServer *s, spice_wan_compression_t comp);
 int spice_server_set_zlib_glz_compression(SpiceServer *s, spice_wan_compression_t comp);
+/* level of SPICE_IMAGE_COMPRESSION_ZSTD, clamped to the range supported by
+ * libzstd. Must be called before the QXL interface is added. Returns -1
+ * if the server was built without zstd support or if it is too late. */
+int spice_server_set_zstd_compression_level(SpiceServer *s, int level);
+/* bytes of decoded images kept by each display channel for the rendering
+ * done on the server side, 0 disables the cache. Must be called before
+ * the QXL interface is added, returns -1 afterwards. */
+int spice_server_set_image_cache_size(SpiceServer *s, size_t size);
+/* only send the part of the copies which changes the surface, off by
+ * default. Must be called before the QXL interface is added, returns -1
+ * afterwards. */
+int spice_server_set_copy_diff(SpiceServer *s, int enable);
+/* cache the uncached guest bitmaps by a hash of their content, so the
+ * images the guest sends again are not sent to the clients again. Off by
+ * default. Must be called before the QXL interface is added, returns -1
+ * afterwards. */
+int spice_server_set_image_fingerprint(SpiceServer *s, int enable);
+
+typedef enum {
+    SPICE_PIXMAP_CACHE_POLICY_INVALID,
+    SPICE_PIXMAP_CACHE_POLICY_LRU,
+    SPICE_PIXMAP_CACHE_POLICY_GDSF,
+    SPICE_PIXMAP_CACHE_POLICY_ARC,
+} spice_pixmap_cache_policy_t;
+
+/* eviction policy of the client pixmap caches, SPICE_PIXMAP_CACHE_POLICY_LRU
+ * by default. Must be called before the QXL interface is added, returns -1
+ * afterwards or for an invalid policy. */
+int spice_server_set_pixmap_cache_policy(SpiceServer *s, spice_pixmap_cache_policy_t policy);
+/* send again losslessly the areas sent lossily once the screen is idle,
+ * using up to a quarter of the measured bandwidth. Off by default. Must be
+ * called before the QXL interface is added, returns -1 afterwards. */
+int spice_server_set_lossy_upgrade(SpiceServer *s, int enable);
+/* encode the stream frames on a thread of each stream instead of the
+ * display worker. Off by default. Must be called before the QXL interface
+ * is added, returns -1 afterwards. */
+int spice_server_set_stream_encode_thread(SpiceServer *s, int enable);
 
 #define SPICE_CHANNEL_SECURITY_NONE (1 << 0)
 #define SPICE_CHANNEL_SECURITY_SSL (1 << 1)
@@ -42,7 +42,7 @@ static void stream_agent_stats_print(StreamAgent *agent)
                 "out/in=%.2f #drops=%"PRIu64" (#pipe=%"PRIu64" #fps=%"PRIu64") out-avg-fps=%.2f "
                 "passed-mm-time(sec)=%.2f size-total(MB)=%.2f size-per-sec(Mbps)=%.2f "
                 "size-per-frame(KBpf)=%.2f avg-quality=%.2f "
-                "start-bit-rate(Mbps)=%.2f end-bit-rate(Mbps)=%.2f",
+                "start-bit-rate(Mbps)=%.2f end-bit-rate(Mbps)=%.2f #zero-copy-frames=%"PRIu64,
                 agent, agent->stream->width, agent->stream->height,
                 stats->num_input_frames,
                 stats->num_input_frames / passed_mm_time,
@@ -59,7 +59,8 @@ static void stream_agent_stats_print(StreamAgent *agent)
                 stats->size_sent / 1000.0 / stats->num_frames_sent,
                 encoder_stats.avg_quality,
                 encoder_stats.starting_bit_rate / (1024.0 * 1024),
-                encoder_stats.cur_bit_rate / (1024.0 * 1024));
+                encoder_stats.cur_bit_rate / (1024.0 * 1024),
+                encoder_stats.num_zero_copy_frames);
 #endif
 }
 
@@ -123,6 +124,9 @@ void stream_stop(DisplayChannel *display, Stream *stream)
     }
     display->streams_size_total -= stream->width * stream->height;
     ring_remove(&stream->link);
+    FOREACH_CLIENT(display, link, next, dcc) {
+        dcc_update_streams_bit_rate_share(dcc);
+    }
     stream_unref(display, stream);
 }
 
@@ -143,6 +147,7 @@ void display_channel_init_streams(DisplayChannel *display)
         ring_item_init(&stream->link);
         stream_free(display, stream);
     }
+    memset(&display->heat_map, 0, sizeof(display->heat_map));
 }
 
 void stream_unref(DisplayChannel *display, Stream *stream)
@@ -237,7 +242,11 @@ static bool is_next_stream_frame(DisplayChannel *display,
     }
 
     red_drawable = candidate->red_drawable;
-    if (!container_candidate_allowed) {
+    if (stream && stream->region) {
+        if (!rect_contains(other_dest, &red_drawable->bbox)) {
+            return FALSE;
+        }
+    } else if (!container_candidate_allowed) {
         SpiceRect* candidate_src;
 
         if (!rect_is_equal(&red_drawable->bbox, other_dest)) {
@@ -280,6 +289,7 @@ static void attach_stream(DisplayChannel *display, Drawable *drawable, Stream *s
 {
     DisplayChannelClient *dcc;
     GList *link, *next;
+    bool input_fps_updated = FALSE;
 
     spice_assert(drawable && stream);
     spice_assert(!drawable->stream && !stream->current);
@@ -294,9 +304,13 @@ static void attach_stream(DisplayChannel *display, Drawable *drawable, Stream *s
         spice_debug("input-fps=%u", stream->input_fps);
         stream->num_input_frames = 0;
         stream->input_fps_start_time = drawable->creation_time;
-    } else {
+        input_fps_updated = TRUE;
+    } else if (!stream->region ||
+               drawable->process_commands_generation != stream->input_generation) {
+        /* the tiles of a region stream drawn together are one frame */
         stream->num_input_frames++;
     }
+    stream->input_generation = drawable->process_commands_generation;
 
     FOREACH_CLIENT(display, link, next, dcc) {
         StreamAgent *agent;
@@ -313,6 +327,8 @@ static void attach_stream(DisplayChannel *display, Drawable *drawable, Stream *s
             region_remove(&agent->clip, &drawable->red_drawable->bbox);
             region_or(&agent->clip, &drawable->tree_item.base.rgn);
             dcc_stream_agent_clip(dcc, agent);
+        } else if (input_fps_updated) {
+            dcc_update_streams_bit_rate_share(dcc);
         }
 #ifdef STREAM_STATS
         agent->stats.num_input_frames++;
@@ -414,7 +430,10 @@ static Stream *display_channel_stream_try_new(DisplayChannel *display)
     return stream;
 }
 
-static void display_channel_create_stream(DisplayChannel *display, Drawable *drawable)
+/* region is NULL for the streams found by the traces, the stream then
+ * has the size and the position of the drawable */
+static void display_channel_create_stream(DisplayChannel *display, Drawable *drawable,
+                                          const SpiceRect *region)
 {
     DisplayChannelClient *dcc;
     GList *link, *next;
@@ -433,9 +452,17 @@ static void display_channel_create_stream(DisplayChannel *display, Drawable *dra
     ring_add(&display->streams, &stream->link);
     stream->current = drawable;
     stream->last_time = drawable->creation_time;
-    stream->width = src_rect->right - src_rect->left;
-    stream->height = src_rect->bottom - src_rect->top;
-    stream->dest_area = drawable->red_drawable->bbox;
+    if (region) {
+        stream->width = region->right - region->left;
+        stream->height = region->bottom - region->top;
+        stream->dest_area = *region;
+    } else {
+        stream->width = src_rect->right - src_rect->left;
+        stream->height = src_rect->bottom - src_rect->top;
+        stream->dest_area = drawable->red_drawable->bbox;
+    }
+    stream->region = region != NULL;
+    stream->input_generation = drawable->process_commands_generation;
     stream->refs = 1;
     SpiceBitmap *bitmap = &drawable->red_drawable->u.copy.src_bitmap->u.bitmap;
     stream->top_down = !!(bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN);
@@ -445,7 +472,9 @@ static void display_channel_create_stream(DisplayChannel *display, Drawable *dra
      * the nearest integer, for instance 24 for 23.976.
      */
     uint64_t duration = drawable->creation_time - drawable->first_frame_time;
-    if (duration > NSEC_PER_SEC * drawable->frames_count / MAX_FPS) {
+    if (region) {
+        stream->input_fps = MAX_FPS;
+    } else if (duration > NSEC_PER_SEC * drawable->frames_count / MAX_FPS) {
         stream->input_fps = (NSEC_PER_SEC * drawable->frames_count + duration / 2) / duration;
     } else {
         stream->input_fps = MAX_FPS;
@@ -457,7 +486,8 @@ static void display_channel_create_stream(DisplayChannel *display, Drawable *dra
     FOREACH_CLIENT(display, link, next, dcc) {
         dcc_create_stream(dcc, stream);
     }
-    spice_debug("stream %d %dx%d (%d, %d) (%d, %d) %u fps",
+    spice_debug("%s stream %d %dx%d (%d, %d) (%d, %d) %u fps",
+                stream->region ? "region" : "frame",
                 (int)(stream - display->streams_buf), stream->width,
                 stream->height, stream->dest_area.left, stream->dest_area.top,
                 stream->dest_area.right, stream->dest_area.bottom,
@@ -492,7 +522,229 @@ static int stream_add_frame(DisplayChannel *display,
     }
 
     if (is_stream_start(frame_drawable)) {
-        display_channel_create_stream(display, frame_drawable);
+        display_channel_create_stream(display, frame_drawable, NULL);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+void stream_heat_map_reset(StreamHeatMap *heat_map)
+{
+    free(heat_map->updates);
+    free(heat_map->hot_windows);
+    memset(heat_map, 0, sizeof(*heat_map));
+}
+
+static void stream_heat_map_age(StreamHeatMap *heat_map, red_time_t now)
+{
+    red_time_t windows;
+    int i;
+
+    if (now < heat_map->window_start + RED_STREAM_HEAT_WINDOW) {
+        return;
+    }
+    /* a cell stays hot only if it was updated in every window */
+    windows = (now - heat_map->window_start) / RED_STREAM_HEAT_WINDOW;
+    for (i = 0; i < heat_map->cols * heat_map->rows; i++) {
+        if (windows == 1 && heat_map->updates[i] >= RED_STREAM_HEAT_MIN_UPDATES) {
+            heat_map->hot_windows[i] = MIN(heat_map->hot_windows[i] + 1, UINT8_MAX);
+        } else {
+            heat_map->hot_windows[i] = 0;
+        }
+        heat_map->updates[i] = 0;
+    }
+    heat_map->window_start += windows * RED_STREAM_HEAT_WINDOW;
+}
+
+static inline bool stream_heat_map_is_hot(StreamHeatMap *heat_map, int x, int y)
+{
+    return heat_map->hot_windows[y * heat_map->cols + x] >= RED_STREAM_HEAT_START_WINDOWS;
+}
+
+/* counts the update of the cells under bbox on a width x height surface,
+ * returns whether the cell at its center is hot */
+bool stream_heat_map_update(StreamHeatMap *heat_map, int width, int height,
+                            const SpiceRect *bbox, red_time_t time)
+{
+    int cols = (width + (1 << RED_STREAM_HEAT_CELL_SHIFT) - 1) >> RED_STREAM_HEAT_CELL_SHIFT;
+    int rows = (height + (1 << RED_STREAM_HEAT_CELL_SHIFT) - 1) >> RED_STREAM_HEAT_CELL_SHIFT;
+    int left, top, right, bottom;
+    int x, y;
+
+    if (cols <= 0 || rows <= 0) {
+        return FALSE;
+    }
+    if (heat_map->cols != cols || heat_map->rows != rows) {
+        stream_heat_map_reset(heat_map);
+        heat_map->cols = cols;
+        heat_map->rows = rows;
+        heat_map->updates = spice_new0(uint8_t, cols * rows);
+        heat_map->hot_windows = spice_new0(uint8_t, cols * rows);
+        heat_map->window_start = time;
+    }
+    stream_heat_map_age(heat_map, time);
+
+    left = MAX(bbox->left, 0) >> RED_STREAM_HEAT_CELL_SHIFT;
+    top = MAX(bbox->top, 0) >> RED_STREAM_HEAT_CELL_SHIFT;
+    right = MIN((bbox->right - 1) >> RED_STREAM_HEAT_CELL_SHIFT, cols - 1);
+    bottom = MIN((bbox->bottom - 1) >> RED_STREAM_HEAT_CELL_SHIFT, rows - 1);
+    if (left > right || top > bottom) {
+        return FALSE;
+    }
+    for (y = top; y <= bottom; y++) {
+        for (x = left; x <= right; x++) {
+            uint8_t *updates = &heat_map->updates[y * cols + x];
+
+            if (*updates < UINT8_MAX) {
+                (*updates)++;
+            }
+        }
+    }
+    return stream_heat_map_is_hot(heat_map, (left + right) / 2, (top + bottom) / 2);
+}
+
+/* bounding box of the hot cells connected to the cell (x, y) */
+static void stream_heat_map_get_hot_cells(StreamHeatMap *heat_map, int x, int y,
+                                          SpiceRect *region)
+{
+    static const int neighbours[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+    int num_cells = heat_map->cols * heat_map->rows;
+    uint8_t *visited = spice_new0(uint8_t, num_cells);
+    int *stack = spice_new(int, num_cells);
+    int stack_size = 0;
+    int left = x, right = x, top = y, bottom = y;
+
+    visited[y * heat_map->cols + x] = TRUE;
+    stack[stack_size++] = y * heat_map->cols + x;
+    while (stack_size) {
+        int cell = stack[--stack_size];
+        unsigned int i;
+
+        x = cell % heat_map->cols;
+        y = cell / heat_map->cols;
+        left = MIN(left, x);
+        right = MAX(right, x);
+        top = MIN(top, y);
+        bottom = MAX(bottom, y);
+        for (i = 0; i < SPICE_N_ELEMENTS(neighbours); i++) {
+            int nx = x + neighbours[i][0];
+            int ny = y + neighbours[i][1];
+
+            if (nx < 0 || ny < 0 || nx >= heat_map->cols || ny >= heat_map->rows ||
+                visited[ny * heat_map->cols + nx] || !stream_heat_map_is_hot(heat_map, nx, ny)) {
+                continue;
+            }
+            visited[ny * heat_map->cols + nx] = TRUE;
+            stack[stack_size++] = ny * heat_map->cols + nx;
+        }
+    }
+    free(stack);
+    free(visited);
+
+    region->left = left << RED_STREAM_HEAT_CELL_SHIFT;
+    region->top = top << RED_STREAM_HEAT_CELL_SHIFT;
+    region->right = (right + 1) << RED_STREAM_HEAT_CELL_SHIFT;
+    region->bottom = (bottom + 1) << RED_STREAM_HEAT_CELL_SHIFT;
+}
+
+/* gets the area to stream for the hot drawable drawn at bbox, the hot
+ * cells around it, returns FALSE if the area is too small for a stream */
+bool stream_heat_map_get_region(StreamHeatMap *heat_map, int width, int height,
+                                const SpiceRect *bbox, SpiceRect *region)
+{
+    int x, y;
+
+    x = ((MAX(bbox->left, 0) >> RED_STREAM_HEAT_CELL_SHIFT) +
+         MIN((bbox->right - 1) >> RED_STREAM_HEAT_CELL_SHIFT, heat_map->cols - 1)) / 2;
+    y = ((MAX(bbox->top, 0) >> RED_STREAM_HEAT_CELL_SHIFT) +
+         MIN((bbox->bottom - 1) >> RED_STREAM_HEAT_CELL_SHIFT, heat_map->rows - 1)) / 2;
+    stream_heat_map_get_hot_cells(heat_map, x, y, region);
+
+    /* the drawable is the first frame, it must be inside the stream */
+    region->left = MIN(region->left, bbox->left);
+    region->top = MIN(region->top, bbox->top);
+    region->right = MIN(MAX(region->right, bbox->right), width);
+    region->bottom = MIN(MAX(region->bottom, bbox->bottom), height);
+    return rect_get_area(region) >= RED_STREAM_MIN_SIZE;
+}
+
+static bool stream_heat_map_add_drawable(DisplayChannel *display, Drawable *drawable)
+{
+    RedSurface *surface = &display->surfaces[0];
+
+    if (display->stream_video == SPICE_STREAM_VIDEO_FILTER) {
+        /* same filter as the traces, scrolled text is not a video */
+        update_copy_graduality(display, drawable);
+        if (drawable->copy_bitmap_graduality == BITMAP_GRADUAL_LOW) {
+            return FALSE;
+        }
+    }
+    return stream_heat_map_update(&display->heat_map, surface->context.width,
+                                  surface->context.height,
+                                  &drawable->red_drawable->bbox,
+                                  drawable->creation_time);
+}
+
+static bool dcc_can_decode_mjpeg(DisplayChannelClient *dcc)
+{
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
+
+    return !red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_MULTI_CODEC) ||
+           red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_CODEC_MJPEG);
+}
+
+// returns whether a region stream was created for the drawable
+static bool stream_try_create_region(DisplayChannel *display, Drawable *drawable)
+{
+    RedSurface *surface = &display->surfaces[0];
+    DisplayChannelClient *dcc;
+    GList *link, *next;
+    SpiceRect region;
+    RingItem *item;
+
+    /* the region streams are only encoded with MJPEG */
+    FOREACH_CLIENT(display, link, next, dcc) {
+        if (!dcc_can_decode_mjpeg(dcc)) {
+            return FALSE;
+        }
+    }
+    if (!stream_heat_map_get_region(&display->heat_map, surface->context.width,
+                                    surface->context.height,
+                                    &drawable->red_drawable->bbox, &region)) {
+        return FALSE;
+    }
+
+    FOREACH_STREAMS(display, item) {
+        Stream *stream = SPICE_CONTAINEROF(item, Stream, link);
+
+        if (rect_intersects(&stream->dest_area, &region)) {
+            return FALSE;
+        }
+    }
+
+    display_channel_create_stream(display, drawable, &region);
+    return drawable->stream != NULL;
+}
+
+/* attaches the drawable to the region stream it is drawn in, if any */
+static bool stream_try_attach_region(DisplayChannel *display, Drawable *drawable)
+{
+    RingItem *item;
+
+    FOREACH_STREAMS(display, item) {
+        Stream *stream = SPICE_CONTAINEROF(item, Stream, link);
+
+        if (!stream->region ||
+            !is_next_stream_frame(display, drawable, stream->width, stream->height,
+                                  &stream->dest_area, stream->last_time, stream, TRUE)) {
+            continue;
+        }
+        if (stream->current) {
+            stream->current->streamable = FALSE; //prevent item trace
+            before_reattach_stream(display, stream, drawable);
+            detach_stream(display, stream);
+        }
+        attach_stream(display, drawable, stream);
         return TRUE;
     }
     return FALSE;
@@ -505,7 +757,18 @@ void stream_trace_update(DisplayChannel *display, Drawable *drawable)
     ItemTrace *trace_end;
     RingItem *item;
 
-    if (drawable->stream || !drawable->streamable || drawable->frames_count) {
+    if (drawable->stream || !drawable->streamable) {
+        return;
+    }
+
+    /* the drawables matched by stream_maintenance() are counted too, a
+     * tile updated in place is part of a larger video most of the time */
+    if (stream_heat_map_add_drawable(display, drawable) &&
+        stream_try_create_region(display, drawable)) {
+        return;
+    }
+
+    if (drawable->frames_count) {
         return;
     }
 
@@ -571,6 +834,10 @@ void stream_maintenance(DisplayChannel *display,
     } else if (candidate->streamable) {
         SpiceRect* prev_src = &prev->red_drawable->u.copy.src_area;
 
+        if (stream_try_attach_region(display, candidate)) {
+            return;
+        }
+
         is_next_frame =
             is_next_stream_frame(display, candidate, prev_src->right - prev_src->left,
                                  prev_src->bottom - prev_src->top,
@@ -612,7 +879,8 @@ static void dcc_update_streams_max_latency(DisplayChannelClient *dcc, StreamAgen
     dcc_set_max_stream_latency(dcc, new_max_latency);
 }
 
-static uint64_t get_initial_bit_rate(DisplayChannelClient *dcc, Stream *stream)
+/* The estimated bandwidth of the link to the client */
+static uint64_t get_link_bit_rate(DisplayChannelClient *dcc)
 {
     char *env_bit_rate_str;
     uint64_t bit_rate = 0;
@@ -651,6 +919,12 @@ static uint64_t get_initial_bit_rate(DisplayChannelClient *dcc, Stream *stream)
                 RED_STREAM_DEFAULT_HIGH_START_BIT_RATE;
         }
     }
+    return bit_rate;
+}
+
+static uint64_t get_initial_bit_rate(DisplayChannelClient *dcc, Stream *stream)
+{
+    uint64_t bit_rate = get_link_bit_rate(dcc);
 
     spice_debug("base-bit-rate %.2f (Mbps)", bit_rate / 1024.0 / 1024.0);
     /* dividing the available bandwidth among the active streams, and saving
@@ -687,6 +961,90 @@ static uint32_t get_source_fps(void *opaque)
     return agent->stream->input_fps;
 }
 
+static uint64_t get_max_bit_rate(void *opaque)
+{
+    StreamAgent *agent = opaque;
+
+    return agent->max_bit_rate;
+}
+
+/* the frames of a region stream are parts of the area, scaling them
+ * would show the seams */
+static gboolean can_scale_frames(void *opaque)
+{
+    StreamAgent *agent = opaque;
+
+    return !agent->stream->region &&
+           red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(agent->dcc),
+                                              SPICE_DISPLAY_CAP_SIZED_STREAM);
+}
+
+static uint64_t region_get_area(QRegion *region)
+{
+    pixman_box32_t *boxes;
+    uint64_t area = 0;
+    int n, i;
+
+    boxes = pixman_region32_rectangles(region, &n);
+    for (i = 0; i < n; i++) {
+        area += (uint64_t)(boxes[i].x2 - boxes[i].x1) * (boxes[i].y2 - boxes[i].y1);
+    }
+    return area;
+}
+
+/*
+ * Each encoder adapts its bit rate as if it had the link to itself, so
+ * several streams playing together (a video call next to a video) keep
+ * taking the bandwidth from each other. The link capacity is divided
+ * between the streams in proportion to the pixels per second they show,
+ * their visible area times their input frame rate, and the encoders keep
+ * their bit rate below their share.
+ *
+ * Called when a stream starts or stops, when its clipping changes and
+ * when its input frame rate is measured again.
+ */
+void dcc_update_streams_bit_rate_share(DisplayChannelClient *dcc)
+{
+    uint64_t weights[NUM_STREAMS];
+    uint64_t total_weight = 0;
+    uint64_t link_bit_rate;
+    int num_streams = 0;
+    int i;
+
+    if (!dcc_use_video_encoder_rate_control(dcc)) {
+        return;
+    }
+
+    for (i = 0; i < NUM_STREAMS; i++) {
+        StreamAgent *agent = dcc_get_stream_agent(dcc, i);
+
+        weights[i] = 0;
+        if (!agent->video_encoder || !agent->stream ||
+            !ring_item_is_linked(&agent->stream->link)) {
+            continue;
+        }
+        weights[i] = region_get_area(&agent->clip) * MAX(agent->stream->input_fps, 1);
+        total_weight += weights[i];
+        num_streams++;
+    }
+
+    link_bit_rate = RED_STREAM_CHANNEL_CAPACITY * get_link_bit_rate(dcc);
+    for (i = 0; i < NUM_STREAMS; i++) {
+        StreamAgent *agent = dcc_get_stream_agent(dcc, i);
+        uint64_t max_bit_rate = 0;
+
+        if (num_streams > 1 && weights[i]) {
+            max_bit_rate = MAX((double)link_bit_rate * weights[i] / total_weight,
+                               RED_STREAM_MIN_BIT_RATE_SHARE);
+        }
+        if (max_bit_rate != agent->max_bit_rate && weights[i]) {
+            spice_debug("stream %d: bit rate share %.2f (Mbps)", i,
+                        max_bit_rate / 1024.0 / 1024.0);
+        }
+        agent->max_bit_rate = max_bit_rate;
+    }
+}
+
 static void update_client_playback_delay(void *opaque, uint32_t delay_ms)
 {
     StreamAgent *agent = opaque;
@@ -722,7 +1080,9 @@ static void bitmap_unref(gpointer data)
 /* A helper for dcc_create_stream(). */
 static VideoEncoder* dcc_create_video_encoder(DisplayChannelClient *dcc,
                                               uint64_t starting_bit_rate,
-                                              VideoEncoderRateControlCbs *cbs)
+                                              VideoEncoderRateControlCbs *cbs,
+                                              bitmap_ref_t bitmap_ref,
+                                              bitmap_unref_t bitmap_unref)
 {
     DisplayChannel *display = DCC_TO_DC(dcc);
     RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
@@ -750,13 +1110,193 @@ static VideoEncoder* dcc_create_video_encoder(DisplayChannelClient *dcc,
     }
 
     /* Try to use the builtin MJPEG video encoder as a fallback */
-    if (!client_has_multi_codec || red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_CODEC_MJPEG)) {
+    if (dcc_can_decode_mjpeg(dcc)) {
         return mjpeg_encoder_new(SPICE_VIDEO_CODEC_TYPE_MJPEG, starting_bit_rate, cbs, bitmap_ref, bitmap_unref);
     }
 
     return NULL;
 }
 
+/*
+ * When most of a stream is covered by other windows only the bounding box
+ * of its visible part is encoded and sent as sized frames. The box is
+ * aligned so that small moves of the covering windows don't change the
+ * frame size, which makes the encoder reconfigure itself.
+ */
+void stream_agent_update_crop(StreamAgent *agent)
+{
+    Stream *stream = agent->stream;
+    const SpiceRect *dest_area = &stream->dest_area;
+    SpiceRect crop = { 0, 0, 0, 0 };
+    bool enable = FALSE;
+
+    if (!stream->region && !region_is_empty(&agent->clip) &&
+        red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(agent->dcc),
+                                           SPICE_DISPLAY_CAP_SIZED_STREAM)) {
+        pixman_box32_t *extents = pixman_region32_extents(&agent->clip);
+        int left = MAX(extents->x1, dest_area->left) - dest_area->left;
+        int top = MAX(extents->y1, dest_area->top) - dest_area->top;
+        int right = MIN(extents->x2, dest_area->right) - dest_area->left;
+        int bottom = MIN(extents->y2, dest_area->bottom) - dest_area->top;
+
+        if (left < right && top < bottom) {
+            crop.left = dest_area->left + left / RED_STREAM_CROP_ALIGN * RED_STREAM_CROP_ALIGN;
+            crop.top = dest_area->top + top / RED_STREAM_CROP_ALIGN * RED_STREAM_CROP_ALIGN;
+            crop.right = dest_area->left + SPICE_ALIGN(right, RED_STREAM_CROP_ALIGN);
+            crop.bottom = dest_area->top + SPICE_ALIGN(bottom, RED_STREAM_CROP_ALIGN);
+            crop.right = MIN(crop.right, dest_area->right);
+            crop.bottom = MIN(crop.bottom, dest_area->bottom);
+            enable = rect_get_area(&crop) <
+                     RED_STREAM_CROP_MAX_RATIO * rect_get_area(dest_area);
+        }
+    }
+
+    if (enable != agent->crop ||
+        (enable && !rect_is_equal(&crop, &agent->crop_area))) {
+        spice_debug("stream %d: encoding %s", get_stream_id(DCC_TO_DC(agent->dcc), stream),
+                    enable ? "the visible area" : "the whole frame");
+        if (enable) {
+            rect_debug(&crop);
+        }
+    }
+    agent->crop = enable;
+    agent->crop_area = crop;
+}
+
+/* Restricts the frame to the visible part of the stream.
+ * Returns FALSE if the frame is sent whole. */
+bool stream_agent_crop_frame(StreamAgent *agent, const SpiceRect *bbox,
+                             SpiceRect *src, SpiceRect *dest)
+{
+    SpiceRect crop;
+
+    if (!agent->crop) {
+        return FALSE;
+    }
+    /* the scaled frames are sent whole */
+    if (src->right - src->left != bbox->right - bbox->left ||
+        src->bottom - src->top != bbox->bottom - bbox->top) {
+        return FALSE;
+    }
+    crop = agent->crop_area;
+    rect_sect(&crop, bbox);
+    if (rect_is_empty(&crop) || rect_is_equal(&crop, bbox)) {
+        return FALSE;
+    }
+    src->left += crop.left - bbox->left;
+    src->top += crop.top - bbox->top;
+    src->right = src->left + (crop.right - crop.left);
+    src->bottom = src->top + (crop.bottom - crop.top);
+    *dest = crop;
+    return TRUE;
+}
+
+static void red_stream_data_item_free(RedPipeItem *base)
+{
+    RedStreamDataItem *item = SPICE_UPCAST(RedStreamDataItem, base);
+    DisplayChannel *display = DCC_TO_DC(item->agent->dcc);
+
+    if (item->frame.outbuf) {
+        item->frame.outbuf->free(item->frame.outbuf);
+    }
+    stream_agent_unref(display, item->agent);
+    free(item);
+}
+
+/* Called on the worker for each frame out of the encoder thread. */
+static void stream_agent_frame_encoded(void *opaque, VideoEncoderFrame *frame)
+{
+    StreamAgent *agent = opaque;
+    DisplayChannelClient *dcc = agent->dcc;
+    RedStreamDataItem *item;
+
+    switch (frame->result) {
+    case VIDEO_ENCODER_FRAME_ENCODE_DONE:
+        break;
+    case VIDEO_ENCODER_FRAME_DROP:
+#ifdef STREAM_STATS
+        agent->stats.num_drops_fps++;
+#endif
+        return;
+    default:
+        /* the drawable is gone, send the area it updated instead */
+        if (ring_item_is_linked(&agent->stream->link)) {
+            SpiceRect area = frame->dest;
+
+            display_channel_draw(DCC_TO_DC(dcc), &area, 0);
+            dcc_add_surface_area_image(dcc, 0, &area, NULL, FALSE);
+            red_channel_client_push(RED_CHANNEL_CLIENT(dcc));
+        }
+        return;
+    }
+
+    /* the stream was stopped, its destroy message may already be in
+     * the pipe */
+    if (!ring_item_is_linked(&agent->stream->link)) {
+        frame->outbuf->free(frame->outbuf);
+        return;
+    }
+
+    item = spice_new(RedStreamDataItem, 1);
+    red_pipe_item_init_full(&item->base, RED_PIPE_ITEM_TYPE_STREAM_DATA,
+                            red_stream_data_item_free);
+    item->agent = agent;
+    agent->stream->refs++;
+    item->frame = *frame;
+    red_channel_client_pipe_add_push(RED_CHANNEL_CLIENT(dcc), &item->base);
+}
+
+static VideoEncoder *dcc_create_stream_video_encoder(DisplayChannelClient *dcc,
+                                                     StreamAgent *agent,
+                                                     Stream *stream)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    VideoEncoderRateControlCbs video_cbs;
+    VideoEncoderRateControlCbs *cbs = NULL;
+    uint64_t initial_bit_rate = 0;
+    VideoEncoderThread *thread;
+    VideoEncoder *encoder;
+
+    if (dcc_use_video_encoder_rate_control(dcc)) {
+        video_cbs.opaque = agent;
+        video_cbs.get_roundtrip_ms = get_roundtrip_ms;
+        video_cbs.get_source_fps = get_source_fps;
+        video_cbs.update_client_playback_delay = update_client_playback_delay;
+        video_cbs.get_max_bit_rate = get_max_bit_rate;
+        video_cbs.can_scale_frames = can_scale_frames;
+        cbs = &video_cbs;
+
+        initial_bit_rate = get_initial_bit_rate(dcc, stream);
+    }
+
+    agent->encoder_thread = NULL;
+    /* the tiles of a region stream are sized frames of changing sizes,
+     * which only the builtin MJPEG encoder takes without reconfiguring
+     * itself and losing the prediction of the inter-frame codecs. They
+     * can't replace each other either so they are not given to a thread. */
+    if (stream->region) {
+        return mjpeg_encoder_new(SPICE_VIDEO_CODEC_TYPE_MJPEG, initial_bit_rate, cbs,
+                                 bitmap_ref, bitmap_unref);
+    }
+    if (!display->stream_encode_thread) {
+        return dcc_create_video_encoder(dcc, initial_bit_rate, cbs,
+                                        bitmap_ref, bitmap_unref);
+    }
+
+    thread = video_encoder_thread_new(RED_CHANNEL(display)->core->main_context, cbs,
+                                      bitmap_ref, bitmap_unref,
+                                      stream_agent_frame_encoded, agent);
+    encoder = dcc_create_video_encoder(dcc, initial_bit_rate,
+                                       video_encoder_thread_get_cbs(thread),
+                                       video_encoder_thread_bitmap_ref,
+                                       video_encoder_thread_bitmap_unref);
+    encoder = video_encoder_thread_start(thread, encoder);
+    if (encoder) {
+        agent->encoder_thread = thread;
+    }
+    return encoder;
+}
+
 void dcc_create_stream(DisplayChannelClient *dcc, Stream *stream)
 {
     StreamAgent *agent = dcc_get_stream_agent(dcc, get_stream_id(DCC_TO_DC(dcc), stream));
@@ -773,21 +1313,12 @@ void dcc_create_stream(DisplayChannelClient *dcc, Stream *stream)
     agent->drops = 0;
     agent->fps = MAX_FPS;
     agent->dcc = dcc;
+    stream_agent_update_crop(agent);
 
-    if (dcc_use_video_encoder_rate_control(dcc)) {
-        VideoEncoderRateControlCbs video_cbs;
-        uint64_t initial_bit_rate;
-
-        video_cbs.opaque = agent;
-        video_cbs.get_roundtrip_ms = get_roundtrip_ms;
-        video_cbs.get_source_fps = get_source_fps;
-        video_cbs.update_client_playback_delay = update_client_playback_delay;
-
-        initial_bit_rate = get_initial_bit_rate(dcc, stream);
-        agent->video_encoder = dcc_create_video_encoder(dcc, initial_bit_rate, &video_cbs);
-    } else {
-        agent->video_encoder = dcc_create_video_encoder(dcc, 0, NULL);
-    }
+    agent->max_bit_rate = 0;
+    agent->start_time = spice_get_monotonic_time_ns();
+    agent->video_encoder = dcc_create_stream_video_encoder(dcc, agent, stream);
+    dcc_update_streams_bit_rate_share(dcc);
     red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), stream_create_item_new(agent));
 
     if (red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(dcc), SPICE_DISPLAY_CAP_STREAM_REPORT)) {
@@ -815,6 +1346,7 @@ void stream_agent_stop(StreamAgent *agent)
     if (agent->video_encoder) {
         agent->video_encoder->destroy(agent->video_encoder);
         agent->video_encoder = NULL;
+        agent->encoder_thread = NULL;
     }
 }
 
@@ -23,6 +23,7 @@
 
 #include "utils.h"
 #include "video-encoder.h"
+#include "video-encoder-thread.h"
 #include "red-channel.h"
 #include "dcc.h"
 
@@ -40,8 +41,25 @@
 #define RED_STREAM_CLIENT_REPORT_TIMEOUT MSEC_PER_SEC
 #define RED_STREAM_DEFAULT_HIGH_START_BIT_RATE (10 * 1024 * 1024) // 10Mbps
 #define RED_STREAM_DEFAULT_LOW_START_BIT_RATE (2.5 * 1024 * 1024) // 2.5Mbps
+#define RED_STREAM_MIN_BIT_RATE_SHARE (256 * 1024) // 256Kbps
+/* the visible part of a stream is encoded alone when it is smaller than
+ * RED_STREAM_CROP_MAX_RATIO of the stream area */
+#define RED_STREAM_CROP_MAX_RATIO 0.75
+#define RED_STREAM_CROP_ALIGN 16
 #define MAX_FPS 30
 
+/* The videos drawn in tiles or in changing rectangles never match the
+ * traces, which need the same bbox in consecutive drawables. Instead the
+ * updates are counted on a coarse grid over the primary surface and the
+ * cells updated at a video rate for a while are streamed as one region,
+ * the drawables inside it being sent as sized frames. */
+#define RED_STREAM_HEAT_CELL_SHIFT 6
+#define RED_STREAM_HEAT_WINDOW (NSEC_PER_SEC / 2)
+/* updates in a window for a cell to be hot, 10 fps */
+#define RED_STREAM_HEAT_MIN_UPDATES 5
+/* consecutive hot windows before a region is streamed */
+#define RED_STREAM_HEAT_START_WINDOWS 2
+
 /* move back to display_channel once struct private */
 typedef struct DisplayChannel DisplayChannel;
 
@@ -77,7 +95,11 @@ typedef struct StreamAgent {
 
     Stream *stream;
     uint64_t last_send_time;
+    /* when the stream was created, reset once its first frame is sent */
+    uint64_t start_time;
     VideoEncoder *video_encoder;
+    /* set when video_encoder runs on a thread of its own */
+    VideoEncoderThread *encoder_thread;
     DisplayChannelClient *dcc;
 
     int frames;
@@ -86,6 +108,12 @@ typedef struct StreamAgent {
 
     uint32_t report_id;
     uint32_t client_required_latency;
+    /* the share of the link of the stream, 0 when it is alone */
+    uint64_t max_bit_rate;
+    /* the part of the stream area encoded when the stream is mostly
+     * covered, see stream_agent_update_crop() */
+    bool crop;
+    SpiceRect crop_area;
 #ifdef STREAM_STATS
     StreamStats stats;
 #endif
@@ -100,11 +128,27 @@ typedef struct RedStreamClipItem {
 
 RedStreamClipItem *   red_stream_clip_item_new                      (StreamAgent *agent);
 
+/* a frame encoded by the encoder thread of the agent */
+typedef struct RedStreamDataItem {
+    RedPipeItem base;
+    StreamAgent *agent;
+    VideoEncoderFrame frame;
+} RedStreamDataItem;
+
 typedef struct StreamCreateDestroyItem {
     RedPipeItem base;
     StreamAgent *agent;
 } StreamCreateDestroyItem;
 
+typedef struct StreamHeatMap {
+    int cols;
+    int rows;
+    red_time_t window_start;
+    /* per cell, updates in the current window and consecutive hot windows */
+    uint8_t *updates;
+    uint8_t *hot_windows;
+} StreamHeatMap;
+
 typedef struct ItemTrace {
     red_time_t time;
     red_time_t first_frame_time;
@@ -130,6 +174,11 @@ struct Stream {
     uint32_t num_input_frames;
     uint64_t input_fps_start_time;
     uint32_t input_fps;
+
+    /* detected by the heat map, the frames are the drawables inside
+     * dest_area, see RED_STREAM_HEAT_CELL_SHIFT */
+    bool region;
+    uint32_t input_generation;
 };
 
 void                  display_channel_init_streams                  (DisplayChannel *display);
@@ -150,9 +199,25 @@ void                  stream_detach_behind                          (DisplayChan
                                                                      QRegion *region,
                                                                      Drawable *drawable);
 
+void                  stream_heat_map_reset                         (StreamHeatMap *heat_map);
+bool                  stream_heat_map_update                        (StreamHeatMap *heat_map,
+                                                                     int width, int height,
+                                                                     const SpiceRect *bbox,
+                                                                     red_time_t time);
+bool                  stream_heat_map_get_region                    (StreamHeatMap *heat_map,
+                                                                     int width, int height,
+                                                                     const SpiceRect *bbox,
+                                                                     SpiceRect *region);
+
 void                  stream_agent_unref                            (DisplayChannel *display,
                                                                      StreamAgent *agent);
 void                  stream_agent_stop                             (StreamAgent *agent);
+void                  dcc_update_streams_bit_rate_share             (DisplayChannelClient *dcc);
+void                  stream_agent_update_crop                      (StreamAgent *agent);
+bool                  stream_agent_crop_frame                       (StreamAgent *agent,
+                                                                     const SpiceRect *bbox,
+                                                                     SpiceRect *src,
+                                                                     SpiceRect *dest);
 
 void detach_stream(DisplayChannel *display, Stream *stream);
 
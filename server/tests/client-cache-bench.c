@@ -0,0 +1,192 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Measure the caches mirroring the client cursor and palette caches:
+ * time of the lookups and of the insertions evicting the least recently
+ * used items, for several capacities, and the hit ratio of a guest
+ * cycling through more palettes than the cache holds.
+ *
+ * The cache is used without channel client, the evictions are only
+ * counted.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <glib.h>
+
+#include "cache-item.h"
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* compare with a plain array kept in LRU order */
+static void check_cache(GRand *rand, gint ops)
+{
+    RedCache cache;
+    uint64_t lru[32];
+    int n = 0;
+    gint i;
+
+    red_cache_init(&cache, NULL, SPICE_N_ELEMENTS(lru));
+    for (i = 0; i < ops; i++) {
+        uint64_t id = g_rand_int_range(rand, 0, 64);
+        int found = red_cache_find(&cache, id);
+        int j;
+
+        for (j = 0; j < n && lru[j] != id; j++) {
+        }
+        assert(found == (j < n));
+        if (!found) {
+            assert(red_cache_add(&cache, id, 1));
+            if (n == SPICE_N_ELEMENTS(lru)) {
+                n--;
+            }
+            j = n++;
+        }
+        memmove(&lru[1], &lru[0], j * sizeof(lru[0]));
+        lru[0] = id;
+        assert((int) cache.items == n);
+        if (i % 1000 == 999) {
+            red_cache_set_size(&cache, g_rand_int_range(rand, 1, SPICE_N_ELEMENTS(lru) + 1));
+            n = MIN(n, cache.size);
+            red_cache_set_size(&cache, SPICE_N_ELEMENTS(lru));
+        }
+    }
+    assert(!red_cache_add(&cache, 1000, SPICE_N_ELEMENTS(lru) + 1));
+    red_cache_reset(&cache);
+    assert(cache.items == 0 && !red_cache_find(&cache, lru[0]));
+    red_cache_destroy(&cache);
+}
+
+static void bench_capacity(GRand *rand, long capacity, gint ops)
+{
+    RedCache cache;
+    uint64_t next_id = 0;
+    uint64_t start, hit_ns, miss_ns, add_ns;
+    gint i;
+
+    red_cache_init(&cache, NULL, capacity);
+    for (i = 0; i < capacity; i++) {
+        red_cache_add(&cache, next_id++, 1);
+    }
+
+    start = get_time_ns();
+    for (i = 0; i < ops; i++) {
+        assert(red_cache_find(&cache, next_id - 1 - g_rand_int_range(rand, 0, capacity)));
+    }
+    hit_ns = get_time_ns() - start;
+
+    start = get_time_ns();
+    for (i = 0; i < ops; i++) {
+        assert(!red_cache_find(&cache, next_id + g_rand_int_range(rand, 0, capacity)));
+    }
+    miss_ns = get_time_ns() - start;
+
+    start = get_time_ns();
+    for (i = 0; i < ops; i++) {
+        red_cache_add(&cache, next_id++, 1);
+    }
+    add_ns = get_time_ns() - start;
+    assert((long) cache.items == capacity);
+
+    printf("%8ld\t%8.1f\t%8.1f\t%8.1f\n", capacity,
+           (double) hit_ns / ops, (double) miss_ns / ops, (double) add_ns / ops);
+    red_cache_destroy(&cache);
+}
+
+/* the palettes of the guest are drawn again in a loop, a few of them
+ * much more often than the others */
+static void bench_palettes(GRand *rand, long capacity, gint palettes, gint ops)
+{
+    RedCache cache;
+    uint64_t hits = 0;
+    gint i;
+
+    red_cache_init(&cache, NULL, capacity);
+    for (i = 0; i < ops; i++) {
+        uint64_t id = g_rand_boolean(rand) ? g_rand_int_range(rand, 0, 16) :
+                                             (uint64_t) i % palettes;
+
+        if (red_cache_find(&cache, id)) {
+            hits++;
+        } else {
+            red_cache_add(&cache, id, 1);
+        }
+    }
+    printf("%8ld\t%8d\t%7.1f%%\t%10u\n", capacity, palettes, hits * 100.0 / ops,
+           cache.evictions);
+    red_cache_destroy(&cache);
+}
+
+int main(int argc, char **argv)
+{
+    static const long capacities[] = { 128, 256, 1024, 4096, 65536 };
+    gint ops = 1000000;
+    gint palettes = 512;
+    unsigned int i;
+    GRand *rand;
+    GOptionContext *context;
+    GError *error = NULL;
+    GOptionEntry entries[] = {
+        { "ops", 'n', 0, G_OPTION_ARG_INT, &ops, "Operations for each test", "n" },
+        { "palettes", 'p', 0, G_OPTION_ARG_INT, &palettes, "Palettes used by the guest", "n" },
+        { NULL }
+    };
+
+    context = g_option_context_new("- client cache benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    g_option_context_free(context);
+    if (ops <= 0 || palettes <= 0) {
+        g_printerr("invalid parameters\n");
+        exit(1);
+    }
+
+    rand = g_rand_new_with_seed(1);
+    check_cache(rand, 100000);
+
+    printf("capacity\thit(ns)\tmiss(ns)\tadd+evict(ns)\n");
+    for (i = 0; i < SPICE_N_ELEMENTS(capacities); i++) {
+        bench_capacity(rand, capacities[i], ops);
+    }
+
+    printf("\ncapacity\tpalettes\thits\tevictions\n");
+    for (i = 0; i < SPICE_N_ELEMENTS(capacities); i++) {
+        bench_palettes(rand, capacities[i], palettes, ops);
+    }
+
+    g_rand_free(rand);
+    return 0;
+}
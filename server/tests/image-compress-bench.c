@@ -0,0 +1,255 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Compare the image codecs on the bitmaps of a recorded session
+ * (via SPICE_WORKER_RECORD_FILENAME).
+ *
+ * Every QXL_DRAW_COPY bitmap of the record is compressed with each codec
+ * and the ratio and speed are printed. GLZ is not included as it needs a
+ * client dictionary and the worker drawables life cycle, its figures are
+ * printed by the server itself when built with COMPRESS_STAT.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <glib.h>
+
+#include <spice/macros.h>
+#include <common/log.h>
+#include "red-replay-qxl.h"
+#include "red-parse-qxl.h"
+#include "memslot.h"
+#include "image-encoders.h"
+#include "spice-bitmap-utils.h"
+
+#define MAX_SURFACE_NUM 1024
+
+typedef int (*CompressFunc)(ImageEncoders *enc, SpiceImage *dest, SpiceBitmap *src,
+                            compress_send_data_t* o_comp_data);
+
+typedef struct Codec {
+    const char *name;
+    CompressFunc compress;
+    gboolean rgb_only;
+
+    unsigned int count;
+    unsigned int failed;
+    uint64_t orig_size;
+    uint64_t comp_size;
+    uint64_t time_ns;
+} Codec;
+
+static ImageEncoders encoders;
+
+#ifdef USE_LZ4
+static int compress_lz4(ImageEncoders *enc, SpiceImage *dest, SpiceBitmap *src,
+                        compress_send_data_t* o_comp_data)
+{
+    return image_encoders_compress_lz4(enc, dest, src, o_comp_data, FALSE);
+}
+
+static int compress_lz4_stream(ImageEncoders *enc, SpiceImage *dest, SpiceBitmap *src,
+                               compress_send_data_t* o_comp_data)
+{
+    return image_encoders_compress_lz4(enc, dest, src, o_comp_data, TRUE);
+}
+#endif
+
+static Codec codecs[] = {
+    { "quic", image_encoders_compress_quic, FALSE },
+    { "lz", image_encoders_compress_lz, FALSE },
+    { "jpeg", image_encoders_compress_jpeg, TRUE },
+#ifdef USE_LZ4
+    { "lz4", compress_lz4, TRUE },
+    { "lz4-stream", compress_lz4_stream, TRUE },
+#endif
+#ifdef USE_ZSTD
+    { "zstd", image_encoders_compress_zstd, TRUE },
+#endif
+};
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void codec_compress(Codec *codec, SpiceBitmap *bitmap)
+{
+    compress_send_data_t comp_data = {0};
+    SpiceImage dest;
+    uint64_t start;
+    int success;
+
+    if (codec->rgb_only && !bitmap_fmt_is_rgb(bitmap->format)) {
+        return;
+    }
+
+    memset(&dest, 0, sizeof(dest));
+    start = get_time_ns();
+    success = codec->compress(&encoders, &dest, bitmap, &comp_data);
+    if (!success) {
+        codec->failed++;
+        return;
+    }
+    codec->time_ns += get_time_ns() - start;
+    codec->count++;
+    codec->orig_size += bitmap->y * bitmap->stride;
+    codec->comp_size += comp_data.comp_buf_size;
+
+    while (comp_data.comp_buf) {
+        RedCompressBuf *next = comp_data.comp_buf->send_next;
+        compress_buf_free(comp_data.comp_buf);
+        comp_data.comp_buf = next;
+    }
+}
+
+static void replay_destroy_primary_surface(QXLWorker *worker, uint32_t surface_id)
+{
+}
+
+static void replay_create_primary_surface(QXLWorker *worker, uint32_t surface_id,
+                                          QXLDevSurfaceCreate *surface)
+{
+}
+
+static void replay_destroy_surfaces(QXLWorker *worker)
+{
+}
+
+static void print_results(void)
+{
+    unsigned int i;
+
+    printf("codec      \t  count \tfailed\torig_size(MB)\tenc_size(MB)\t ratio \tMB/s\n");
+    for (i = 0; i < SPICE_N_ELEMENTS(codecs); i++) {
+        const Codec *codec = &codecs[i];
+        double orig_mb = codec->orig_size / (1024.0 * 1024.0);
+        double comp_mb = codec->comp_size / (1024.0 * 1024.0);
+
+        printf("%-11s\t%8u\t%6u\t%13.2f\t%12.2f\t%7.2f\t%7.1f\n",
+               codec->name, codec->count, codec->failed, orig_mb, comp_mb,
+               codec->comp_size ? orig_mb / comp_mb : 0.0,
+               codec->time_ns ? orig_mb * 1e9 / codec->time_ns : 0.0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ImageEncoderSharedData shared_data;
+    RedMemSlotInfo mem_slots;
+    QXLWorker worker = { 0, };
+    SpiceReplay *replay;
+    QXLCommandExt *cmd;
+    FILE *file;
+    gint max_images = 0;
+    gint zstd_level = 0;
+    gint images = 0;
+    gchar **file_args = NULL;
+    GOptionContext *context;
+    GError *error = NULL;
+    GOptionEntry entries[] = {
+        { "max-images", 'n', 0, G_OPTION_ARG_INT, &max_images, "Stop after n images", "n" },
+        { "zstd-level", 'l', 0, G_OPTION_ARG_INT, &zstd_level, "zstd compression level", "level" },
+        { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &file_args, "record file", "FILENAME" },
+        { NULL }
+    };
+
+    context = g_option_context_new("- compare the image codecs on a recorded session");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    if (!file_args || g_strv_length(file_args) != 1) {
+        g_printerr("%s\n", g_option_context_get_help(context, TRUE, NULL));
+        exit(1);
+    }
+    g_option_context_free(context);
+
+    file = fopen(file_args[0], "r");
+    if (!file) {
+        g_printerr("error opening %s\n", file_args[0]);
+        exit(1);
+    }
+
+    worker.destroy_primary_surface = replay_destroy_primary_surface;
+    worker.create_primary_surface = replay_create_primary_surface;
+    worker.destroy_surfaces = replay_destroy_surfaces;
+
+    /* the record addresses are pointers of this process */
+    memslot_info_init(&mem_slots, 1 /* groups */, 1 /* slots */, 1, 1, 0);
+    memslot_info_add_slot(&mem_slots, 0, 0, 0 /* delta */, 0 /* start */, ~0ul /* end */, 0 /* generation */);
+
+    image_encoder_shared_init(&shared_data);
+    image_encoders_init(&encoders, &shared_data);
+    encoders.jpeg_quality = 85;
+#ifdef USE_ZSTD
+    if (zstd_level) {
+        encoders.zstd_level = zstd_encoder_check_level(zstd_level);
+    }
+#endif
+
+    replay = spice_replay_new(file, MAX_SURFACE_NUM);
+    if (!replay) {
+        g_printerr("invalid record %s\n", file_args[0]);
+        exit(1);
+    }
+    g_strfreev(file_args);
+
+    while ((cmd = spice_replay_next_cmd(replay, &worker)) != NULL) {
+        RedDrawable red;
+        SpiceImage *image;
+        unsigned int i;
+
+        memset(&red, 0, sizeof(red));
+        if (cmd->cmd.type != QXL_CMD_DRAW ||
+            red_get_drawable(&mem_slots, cmd->group_id, &red, cmd->cmd.data, cmd->flags)) {
+            spice_replay_free_cmd(replay, cmd);
+            continue;
+        }
+
+        image = red.type == QXL_DRAW_COPY ? red.u.copy.src_bitmap : NULL;
+        if (image && image->descriptor.type == SPICE_IMAGE_TYPE_BITMAP) {
+            for (i = 0; i < SPICE_N_ELEMENTS(codecs); i++) {
+                codec_compress(&codecs[i], &image->u.bitmap);
+            }
+            images++;
+        }
+        red_put_drawable(&red);
+        spice_replay_free_cmd(replay, cmd);
+
+        if (max_images && images >= max_images) {
+            break;
+        }
+    }
+
+    print_results();
+
+    image_encoders_free(&encoders);
+    spice_replay_free(replay);
+    return 0;
+}
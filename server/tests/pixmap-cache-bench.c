@@ -0,0 +1,354 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Measure the pixmap cache operations done by the display channel
+ * under the cache lock: lookup of present and missing ids, insertion
+ * with eviction of the least recently used items and the time the
+ * lock is held by each of them.
+ *
+ * The eviction policies are compared on a mix of small images used
+ * again and again (icons) and of big images never used again (video).
+ *
+ * Then several threads, like the workers of a multi head guest sharing
+ * the cache of a client, hit and add images concurrently, with the hits
+ * under the lock and without it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "pixmap-cache.h"
+
+#define ITEM_SIZE (64 * 1024)
+
+typedef struct LockStat {
+    const char *name;
+    uint64_t ops;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} LockStat;
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void lock_stat_add(LockStat *stat, uint64_t start)
+{
+    uint64_t elapsed = get_time_ns() - start;
+
+    stat->ops++;
+    stat->total_ns += elapsed;
+    if (elapsed > stat->max_ns) {
+        stat->max_ns = elapsed;
+    }
+}
+
+static void lock_stat_print(const LockStat *stat)
+{
+    printf("%-14s\t%10" PRIu64 "\t%8.1f\t%8" PRIu64 "\n", stat->name, stat->ops,
+           stat->ops ? (double) stat->total_ns / stat->ops : 0.0, stat->max_ns);
+}
+
+/* the guest ids are a slot/generation pair, simulate the low 32 bits
+ * increasing with a few high bits set */
+static inline uint64_t image_id(uint64_t n)
+{
+    return (UINT64_C(0x5) << 40) | n;
+}
+
+/* the message serials of each channel client, increasing like the real
+ * ones across all the tests so an item is never seen as used by the
+ * message adding another one */
+static uint64_t client_serials[MAX_CACHE_CLIENTS];
+
+/* no client to release the evicted items */
+static void release_item(NewCacheItem *item, void *opaque)
+{
+}
+
+static int cache_add(PixmapCache *cache, uint8_t client, uint64_t serial, uint64_t id)
+{
+    return pixmap_cache_unlocked_add(cache, client, id, ITEM_SIZE, ITEM_SIZE / 4, FALSE,
+                                     serial, release_item, NULL);
+}
+
+static int cache_hit(PixmapCache *cache, uint64_t id)
+{
+    int lossy;
+
+    return pixmap_cache_unlocked_hit(cache, 0, id, ++client_serials[0], &lossy, NULL);
+}
+
+#define ICONS 256
+#define ICON_SIZE (32 * 32)
+#define FRAME_SIZE (640 * 480)
+
+/* each round uses all the icons twice then plays twice as many frames
+ * as the cache can hold, the frames are compressed less than the icons */
+static void run_policy(PixmapCache *cache, PixmapCachePolicyType type, int rounds)
+{
+    const PixmapCachePolicy *policy = pixmap_cache_policy_get(type);
+    uint64_t lookups = 0, hits = 0, saved = 0, sent = 0;
+    uint64_t frame_id = ICONS;
+    int frames = 2 * cache->size / FRAME_SIZE;
+    int round, i;
+
+    pthread_mutex_lock(&cache->lock);
+    pixmap_cache_clear(cache);
+    pixmap_cache_unlocked_set_policy(cache, policy);
+    for (round = 0; round < rounds; round++) {
+        for (i = 0; i < ICONS * 2; i++) {
+            uint64_t serial = ++client_serials[0];
+            uint32_t cost;
+            int lossy;
+
+            lookups++;
+            if (pixmap_cache_unlocked_hit(cache, 0, i % ICONS, serial, &lossy, &cost)) {
+                hits++;
+                saved += cost;
+            } else {
+                pixmap_cache_unlocked_add(cache, 0, i % ICONS, ICON_SIZE, ICON_SIZE * 2,
+                                          FALSE, serial, release_item, NULL);
+                sent += ICON_SIZE * 2;
+            }
+        }
+        for (i = 0; i < frames; i++) {
+            lookups++;
+            pixmap_cache_unlocked_add(cache, 0, frame_id++, FRAME_SIZE, FRAME_SIZE / 8,
+                                      FALSE, ++client_serials[0], release_item, NULL);
+            sent += FRAME_SIZE / 8;
+        }
+    }
+    pixmap_cache_clear(cache);
+    pthread_mutex_unlock(&cache->lock);
+
+    printf("%-6s\t%6.1f%%\t%10.1f\t%10.1f\n", policy->name, hits * 100.0 / lookups,
+           saved / (1024.0 * 1024.0), sent / (1024.0 * 1024.0));
+}
+
+typedef struct Worker {
+    pthread_t thread;
+    PixmapCache *cache;
+    uint8_t client;
+    gboolean lock_free;
+    int ops;
+    int items;
+    uint64_t hits;
+} Worker;
+
+static uint64_t shared_next_id;
+
+/* one add for 16 hits, the ids to hit are among the recent ones */
+static void *worker_run(void *opaque)
+{
+    Worker *worker = opaque;
+    PixmapCache *cache = worker->cache;
+    GRand *rand = g_rand_new_with_seed(worker->client + 1);
+    uint64_t serial = client_serials[worker->client];
+    int lossy;
+    int i;
+
+    for (i = 0; i < worker->ops; i++) {
+        uint64_t last = __atomic_load_n(&shared_next_id, __ATOMIC_RELAXED);
+        uint64_t id = image_id(last - 1 - g_rand_int_range(rand, 0, worker->items));
+        int hit;
+
+        serial++;
+        if ((i & 15) == 15) {
+            id = image_id(__atomic_fetch_add(&shared_next_id, 1, __ATOMIC_RELAXED));
+            pthread_mutex_lock(&cache->lock);
+            cache_add(cache, worker->client, serial, id);
+            pthread_mutex_unlock(&cache->lock);
+            continue;
+        }
+        if (worker->lock_free) {
+            hit = pixmap_cache_hit(cache, worker->client, id, serial, &lossy, NULL);
+        } else {
+            pthread_mutex_lock(&cache->lock);
+            hit = pixmap_cache_unlocked_hit(cache, worker->client, id, serial, &lossy, NULL);
+            pthread_mutex_unlock(&cache->lock);
+        }
+        worker->hits += hit;
+    }
+    client_serials[worker->client] = serial;
+    g_rand_free(rand);
+    return NULL;
+}
+
+static void run_workers(PixmapCache *cache, int n_workers, gboolean lock_free,
+                        int ops, int items)
+{
+    Worker workers[MAX_CACHE_CLIENTS];
+    uint32_t retries = cache->read_retries;
+    uint64_t hits = 0;
+    uint64_t start, elapsed;
+    int i;
+
+    memset(workers, 0, sizeof(workers));
+    start = get_time_ns();
+    for (i = 0; i < n_workers; i++) {
+        workers[i].cache = cache;
+        workers[i].client = i;
+        workers[i].lock_free = lock_free;
+        workers[i].ops = ops;
+        workers[i].items = items;
+        assert(pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) == 0);
+    }
+    for (i = 0; i < n_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        hits += workers[i].hits;
+    }
+    elapsed = get_time_ns() - start;
+
+    pthread_mutex_lock(&cache->lock);
+    assert(cache->items == items);
+    pthread_mutex_unlock(&cache->lock);
+
+    printf("%-9s\t%7d\t%10.2f\t%5.1f%%\t%10u\n", lock_free ? "lock free" : "locked",
+           n_workers, (double) ops * n_workers * 1000.0 / elapsed,
+           hits * 100.0 / (ops * n_workers * 15.0 / 16), cache->read_retries - retries);
+}
+
+int main(int argc, char **argv)
+{
+    PixmapCache *cache;
+    PixmapCache *policy_cache;
+    LockStat lookup_hit = { "lookup hit" };
+    LockStat lookup_miss = { "lookup miss" };
+    LockStat insert_evict = { "insert+evict" };
+    gint cache_mb = 512;
+    gint ops = 1000000;
+    gint threads = MAX_CACHE_CLIENTS;
+    gint items;
+    uint64_t next_id = 0;
+    gint i;
+    GRand *rand;
+    GOptionContext *context;
+    GError *error = NULL;
+    GOptionEntry entries[] = {
+        { "cache-size", 's', 0, G_OPTION_ARG_INT, &cache_mb, "Cache size in MB", "MB" },
+        { "ops", 'n', 0, G_OPTION_ARG_INT, &ops, "Operations for each test", "n" },
+        { "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Concurrent clients of the cache", "n" },
+        { NULL }
+    };
+
+    context = g_option_context_new("- pixmap cache benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    g_option_context_free(context);
+    if (cache_mb <= 0 || ops <= 0 || threads <= 0 || threads > MAX_CACHE_CLIENTS) {
+        g_printerr("invalid parameters\n");
+        exit(1);
+    }
+
+    items = ((int64_t) cache_mb * 1024 * 1024) / ITEM_SIZE;
+    /* the checks below expect the least recently used items to go */
+    cache = pixmap_cache_get(NULL, 0, (int64_t) cache_mb * 1024 * 1024,
+                             pixmap_cache_policy_get(PIXMAP_CACHE_POLICY_LRU));
+    /* sized in pixels like the display channel does */
+    policy_cache = pixmap_cache_get(NULL, 1, (int64_t) cache_mb * 1024 * 1024 / 4,
+                                    pixmap_cache_policy_get(PIXMAP_CACHE_POLICY_LRU));
+    rand = g_rand_new_with_seed(1);
+
+    pthread_mutex_lock(&cache->lock);
+    for (i = 0; i < items; i++) {
+        assert(cache_add(cache, 0, ++client_serials[0], image_id(next_id++)));
+    }
+    assert(cache->items == items);
+    assert(cache->available == 0);
+    pthread_mutex_unlock(&cache->lock);
+
+    for (i = 0; i < ops; i++) {
+        uint64_t id = image_id(next_id - 1 - g_rand_int_range(rand, 0, items));
+        uint64_t start;
+
+        pthread_mutex_lock(&cache->lock);
+        start = get_time_ns();
+        assert(cache_hit(cache, id));
+        lock_stat_add(&lookup_hit, start);
+        pthread_mutex_unlock(&cache->lock);
+
+        id = image_id(next_id + g_rand_int_range(rand, 0, items));
+        pthread_mutex_lock(&cache->lock);
+        start = get_time_ns();
+        assert(!cache_hit(cache, id));
+        lock_stat_add(&lookup_miss, start);
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    for (i = 0; i < ops; i++) {
+        uint64_t start;
+
+        pthread_mutex_lock(&cache->lock);
+        start = get_time_ns();
+        assert(cache_add(cache, 0, ++client_serials[0], image_id(next_id++)));
+        lock_stat_add(&insert_evict, start);
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    /* once all the items were replaced, the most recent ids must be
+     * there and the evicted ones not */
+    pthread_mutex_lock(&cache->lock);
+    assert(cache->items == items);
+    for (i = 0; ops >= items && i < items; i++) {
+        assert(pixmap_cache_unlocked_lookup(cache, image_id(next_id - 1 - i)));
+        assert(!pixmap_cache_unlocked_lookup(cache, image_id(next_id - items - 1 - i)));
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    printf("%d items of %d bytes\n", items, ITEM_SIZE);
+    printf("operation     \t       ops\t  avg(ns)\t max(ns)\n");
+    lock_stat_print(&lookup_hit);
+    lock_stat_print(&lookup_miss);
+    lock_stat_print(&insert_evict);
+
+    printf("\npolicy\t  hits\tsaved(MB)\t sent(MB)\n");
+    run_policy(policy_cache, PIXMAP_CACHE_POLICY_LRU, 20);
+    run_policy(policy_cache, PIXMAP_CACHE_POLICY_GDSF, 20);
+    run_policy(policy_cache, PIXMAP_CACHE_POLICY_ARC, 20);
+
+    __atomic_store_n(&shared_next_id, next_id, __ATOMIC_RELAXED);
+    printf("\nhits     \tthreads\t   Mops/s\t  hits\t   retries\n");
+    for (i = 1; i <= threads; i++) {
+        run_workers(cache, i, FALSE, ops, items);
+        run_workers(cache, i, TRUE, ops, items);
+    }
+
+    g_rand_free(rand);
+    pixmap_cache_unref(policy_cache);
+    pixmap_cache_unref(cache);
+    return 0;
+}
@@ -40,6 +40,15 @@ int main(int argc, char *argv[])
     spice_server_set_agent_mouse(server, 0);
     spice_server_set_agent_copypaste(server, 0);
     spice_server_set_agent_file_xfer(server, 0);
+    g_assert_cmpint(spice_server_set_copy_diff(server, TRUE), ==, 0);
+    g_assert_cmpint(spice_server_set_image_fingerprint(server, TRUE), ==, 0);
+    g_assert_cmpint(spice_server_set_pixmap_cache_policy(server, SPICE_PIXMAP_CACHE_POLICY_ARC),
+                    ==, 0);
+    g_assert_cmpint(spice_server_set_pixmap_cache_policy(server,
+                                                         SPICE_PIXMAP_CACHE_POLICY_INVALID),
+                    ==, -1);
+    g_assert_cmpint(spice_server_set_lossy_upgrade(server, TRUE), ==, 0);
+    g_assert_cmpint(spice_server_set_stream_encode_thread(server, TRUE), ==, 0);
 
     g_assert_cmpint(spice_server_init(server, core), ==, 0);
 
@@ -47,6 +56,8 @@ int main(int argc, char *argv[])
     spice_server_set_agent_mouse(server, 0);
     spice_server_set_agent_copypaste(server, 0);
     spice_server_set_agent_file_xfer(server, 0);
+    g_assert_cmpint(spice_server_set_copy_diff(server, FALSE), ==, 0);
+    g_assert_cmpint(spice_server_set_image_fingerprint(server, FALSE), ==, 0);
 
     spice_server_destroy(server);
 
@@ -0,0 +1,167 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Feed the heat map with the drawables of test_display_tiled_streaming, a
+ * video drawn in tiles whose boundaries move from frame to frame, and check
+ * that it gives a region stream covering the video. Also check that small
+ * or slow updates do not turn into streams.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <glib.h>
+
+#include <spice/macros.h>
+#include <common/log.h>
+#include "stream.h"
+
+#define SURFACE_WIDTH 1280
+#define SURFACE_HEIGHT 1024
+#define TILE_COLS 4
+#define TILE_ROWS 3
+#define VIDEO_LEFT 200
+#define VIDEO_TOP 150
+#define VIDEO_WIDTH 640
+#define VIDEO_HEIGHT 360
+#define TILE_JITTER 24
+#define FPS 25
+#define MAX_FRAMES (FPS * 5)
+
+#define CELL_SIZE (1 << RED_STREAM_HEAT_CELL_SHIFT)
+
+/* the same for every run, unlike g_random_int_range() */
+static int jitter(int frame, int i)
+{
+    return (frame * 7 + i * 13) % (2 * TILE_JITTER + 1) - TILE_JITTER;
+}
+
+static void get_tile(int frame, int tile, SpiceRect *bbox)
+{
+    int col = tile % TILE_COLS;
+    int row = tile / TILE_COLS;
+
+    bbox->left = VIDEO_WIDTH * col / TILE_COLS + (col ? jitter(frame, col) : 0);
+    bbox->right = col + 1 < TILE_COLS ?
+        VIDEO_WIDTH * (col + 1) / TILE_COLS + jitter(frame, col + 1) : VIDEO_WIDTH;
+    bbox->top = VIDEO_HEIGHT * row / TILE_ROWS + (row ? jitter(frame, TILE_COLS + row) : 0);
+    bbox->bottom = row + 1 < TILE_ROWS ?
+        VIDEO_HEIGHT * (row + 1) / TILE_ROWS + jitter(frame, TILE_COLS + row + 1) :
+        VIDEO_HEIGHT;
+    bbox->left += VIDEO_LEFT;
+    bbox->right += VIDEO_LEFT;
+    bbox->top += VIDEO_TOP;
+    bbox->bottom += VIDEO_TOP;
+}
+
+static red_time_t frame_time(int frame)
+{
+    return NSEC_PER_SEC + frame * (NSEC_PER_SEC / FPS);
+}
+
+static void test_tiled_video(void)
+{
+    StreamHeatMap heat_map;
+    SpiceRect region;
+    int frame, tile;
+    int start_frame = -1;
+
+    memset(&heat_map, 0, sizeof(heat_map));
+    for (frame = 0; frame < MAX_FRAMES && start_frame < 0; frame++) {
+        for (tile = 0; tile < TILE_COLS * TILE_ROWS; tile++) {
+            SpiceRect bbox;
+
+            get_tile(frame, tile, &bbox);
+            if (stream_heat_map_update(&heat_map, SURFACE_WIDTH, SURFACE_HEIGHT,
+                                       &bbox, frame_time(frame)) &&
+                stream_heat_map_get_region(&heat_map, SURFACE_WIDTH, SURFACE_HEIGHT,
+                                           &bbox, &region)) {
+                start_frame = frame;
+                break;
+            }
+        }
+    }
+    g_assert_cmpint(start_frame, >=, 0);
+    printf("tiled video: region stream (%d, %d) (%d, %d) at frame %d\n",
+           region.left, region.top, region.right, region.bottom, start_frame);
+
+    /* the cells must be hot for RED_STREAM_HEAT_START_WINDOWS full windows */
+    g_assert_cmpint(frame_time(start_frame) - frame_time(0), >=,
+                    RED_STREAM_HEAT_START_WINDOWS * RED_STREAM_HEAT_WINDOW);
+    g_assert_cmpint(frame_time(start_frame) - frame_time(0), <,
+                    (RED_STREAM_HEAT_START_WINDOWS + 2) * RED_STREAM_HEAT_WINDOW);
+
+    /* the whole video in one stream, no more than the cells it touches */
+    g_assert_cmpint(region.left, <=, VIDEO_LEFT);
+    g_assert_cmpint(region.top, <=, VIDEO_TOP);
+    g_assert_cmpint(region.right, >=, VIDEO_LEFT + VIDEO_WIDTH);
+    g_assert_cmpint(region.bottom, >=, VIDEO_TOP + VIDEO_HEIGHT);
+    g_assert_cmpint(region.left, >, VIDEO_LEFT - CELL_SIZE);
+    g_assert_cmpint(region.top, >, VIDEO_TOP - CELL_SIZE);
+    g_assert_cmpint(region.right, <, VIDEO_LEFT + VIDEO_WIDTH + CELL_SIZE);
+    g_assert_cmpint(region.bottom, <, VIDEO_TOP + VIDEO_HEIGHT + CELL_SIZE);
+
+    stream_heat_map_reset(&heat_map);
+}
+
+/* a blinking cursor or a throbber, hot but too small to be streamed */
+static void test_small_area(void)
+{
+    StreamHeatMap heat_map;
+    SpiceRect bbox = { 500, 400, 524, 424 };
+    SpiceRect region;
+    int frame, hot = 0;
+
+    memset(&heat_map, 0, sizeof(heat_map));
+    for (frame = 0; frame < MAX_FRAMES; frame++) {
+        if (stream_heat_map_update(&heat_map, SURFACE_WIDTH, SURFACE_HEIGHT,
+                                   &bbox, frame_time(frame))) {
+            hot++;
+            g_assert(!stream_heat_map_get_region(&heat_map, SURFACE_WIDTH, SURFACE_HEIGHT,
+                                                 &bbox, &region));
+        }
+    }
+    g_assert_cmpint(hot, >, 0);
+    stream_heat_map_reset(&heat_map);
+}
+
+/* a large area updated at less than RED_STREAM_HEAT_MIN_UPDATES per window */
+static void test_slow_updates(void)
+{
+    StreamHeatMap heat_map;
+    SpiceRect bbox = { VIDEO_LEFT, VIDEO_TOP, VIDEO_LEFT + VIDEO_WIDTH,
+                       VIDEO_TOP + VIDEO_HEIGHT };
+    int frame;
+
+    memset(&heat_map, 0, sizeof(heat_map));
+    for (frame = 0; frame < MAX_FRAMES; frame += FPS / 4) {
+        g_assert(!stream_heat_map_update(&heat_map, SURFACE_WIDTH, SURFACE_HEIGHT,
+                                         &bbox, frame_time(frame)));
+    }
+    stream_heat_map_reset(&heat_map);
+}
+
+int main(int argc, char *argv[])
+{
+    test_tiled_video();
+    test_small_area();
+    test_slow_updates();
+    return 0;
+}
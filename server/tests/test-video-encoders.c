@@ -0,0 +1,428 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Encode a few frames of each bitmap format with the built-in video
+ * encoders and check what comes out.
+ *
+ * The MJPEG frames are decoded with libjpeg and must have the size and
+ * colour of the source. There is no H.264 decoder to link with so the
+ * x264 frames are checked at the bitstream level: they must be made of
+ * Annex B NAL units with a slice, the first one must carry the SPS and PPS
+ * and the SPS must give the picture size.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <glib.h>
+#include <jpeglib.h>
+
+#include <spice/macros.h>
+#include <common/log.h>
+#include "video-encoder.h"
+
+/* far from the grays so a swapped component shows */
+#define TEST_RED 0xc8
+#define TEST_GREEN 0x60
+#define TEST_BLUE 0x28
+
+/* the loss of the encoding and of the 16 bit pixels */
+#define COLOR_TOLERANCE 16
+
+#define NUM_FRAMES 3
+
+typedef struct TestFormat {
+    SpiceBitmapFmt format;
+    uint32_t bytes_per_pixel;
+} TestFormat;
+
+static const TestFormat formats[] = {
+    { SPICE_BITMAP_FMT_32BIT, 4 },
+    { SPICE_BITMAP_FMT_24BIT, 3 },
+    { SPICE_BITMAP_FMT_16BIT, 2 },
+};
+
+typedef struct TestSize {
+    uint32_t width;
+    uint32_t height;
+} TestSize;
+
+static const TestSize sizes[] = {
+    { 64, 48 },
+    { 320, 176 },
+    /* I420 needs an even size, x264 then switches to I444 */
+    { 101, 75 },
+};
+
+typedef void (*check_frame_t)(const VideoBuffer *buffer, uint32_t frame,
+                              uint32_t width, uint32_t height);
+
+/* Returns a bitmap of the test color, with some padding after each line */
+static SpiceBitmap *create_bitmap(const TestFormat *format, uint32_t width,
+                                  uint32_t height)
+{
+    SpiceBitmap *bitmap = spice_new0(SpiceBitmap, 1);
+    uint32_t stride = width * format->bytes_per_pixel + 12;
+    uint8_t *data = spice_malloc0(stride * height);
+    uint32_t x, y;
+
+    for (y = 0; y < height; y++) {
+        uint8_t *line = data + y * stride;
+
+        for (x = 0; x < width; x++) {
+            uint8_t *pixel = line + x * format->bytes_per_pixel;
+
+            if (format->format == SPICE_BITMAP_FMT_16BIT) {
+                uint16_t rgb555 = ((TEST_RED >> 3) << 10) |
+                                  ((TEST_GREEN >> 3) << 5) | (TEST_BLUE >> 3);
+                memcpy(pixel, &rgb555, sizeof(rgb555));
+            } else {
+                pixel[0] = TEST_BLUE;
+                pixel[1] = TEST_GREEN;
+                pixel[2] = TEST_RED;
+            }
+        }
+    }
+    bitmap->format = format->format;
+    bitmap->flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    bitmap->x = width;
+    bitmap->y = height;
+    bitmap->stride = stride;
+    bitmap->data = spice_chunks_new_linear(data, stride * height);
+    bitmap->data->flags |= SPICE_CHUNKS_FLAGS_FREE;
+    return bitmap;
+}
+
+static void destroy_bitmap(SpiceBitmap *bitmap)
+{
+    spice_chunks_destroy(bitmap->data);
+    free(bitmap);
+}
+
+static void check_color(uint32_t red, uint32_t green, uint32_t blue)
+{
+    g_assert_cmpint(abs((int)red - TEST_RED), <=, COLOR_TOLERANCE);
+    g_assert_cmpint(abs((int)green - TEST_GREEN), <=, COLOR_TOLERANCE);
+    g_assert_cmpint(abs((int)blue - TEST_BLUE), <=, COLOR_TOLERANCE);
+}
+
+
+/* ---------- MJPEG ---------- */
+
+/* libjpeg may be too old for jpeg_mem_src() */
+static void source_init(j_decompress_ptr cinfo)
+{
+}
+
+static boolean source_fill(j_decompress_ptr cinfo)
+{
+    static const JOCTET eoi[] = { 0xff, JPEG_EOI };
+
+    /* truncated image */
+    g_assert_not_reached();
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = sizeof(eoi);
+    return TRUE;
+}
+
+static void source_skip(j_decompress_ptr cinfo, long num_bytes)
+{
+    g_assert_cmpuint(num_bytes, <=, cinfo->src->bytes_in_buffer);
+    cinfo->src->next_input_byte += num_bytes;
+    cinfo->src->bytes_in_buffer -= num_bytes;
+}
+
+static void source_term(j_decompress_ptr cinfo)
+{
+}
+
+static void check_mjpeg_frame(const VideoBuffer *buffer, uint32_t frame,
+                              uint32_t width, uint32_t height)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    struct jpeg_source_mgr src;
+    uint8_t *row;
+    uint32_t x;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    src.next_input_byte = buffer->data;
+    src.bytes_in_buffer = buffer->size;
+    src.init_source = source_init;
+    src.fill_input_buffer = source_fill;
+    src.skip_input_data = source_skip;
+    src.resync_to_restart = jpeg_resync_to_restart;
+    src.term_source = source_term;
+    cinfo.src = &src;
+
+    g_assert_cmpint(jpeg_read_header(&cinfo, TRUE), ==, JPEG_HEADER_OK);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    g_assert_cmpuint(cinfo.output_width, ==, buffer->width ? buffer->width : width);
+    g_assert_cmpuint(cinfo.output_height, ==, buffer->height ? buffer->height : height);
+    g_assert_cmpint(cinfo.output_components, ==, 3);
+
+    row = spice_malloc(cinfo.output_width * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        g_assert_cmpint(jpeg_read_scanlines(&cinfo, &row, 1), ==, 1);
+        for (x = 0; x < cinfo.output_width; x++) {
+            check_color(row[x * 3], row[x * 3 + 1], row[x * 3 + 2]);
+        }
+    }
+    free(row);
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+}
+
+
+/* ---------- H.264 ---------- */
+
+#ifdef HAVE_X264
+enum {
+    NAL_SLICE = 1,
+    NAL_SLICE_IDR = 5,
+    NAL_SPS = 7,
+    NAL_PPS = 8,
+    NAL_AUD = 9,
+};
+
+typedef struct BitReader {
+    const uint8_t *data;
+    uint32_t size;
+    uint32_t pos;
+} BitReader;
+
+static uint32_t read_bits(BitReader *reader, uint32_t count)
+{
+    uint32_t value = 0;
+
+    while (count--) {
+        g_assert_cmpuint(reader->pos / 8, <, reader->size);
+        value = (value << 1) |
+                ((reader->data[reader->pos / 8] >> (7 - reader->pos % 8)) & 1);
+        reader->pos++;
+    }
+    return value;
+}
+
+/* Exp-Golomb codes */
+static uint32_t read_ue(BitReader *reader)
+{
+    uint32_t zeros = 0;
+
+    while (read_bits(reader, 1) == 0) {
+        zeros++;
+        g_assert_cmpuint(zeros, <, 32);
+    }
+    return (1u << zeros) - 1 + read_bits(reader, zeros);
+}
+
+static void skip_se(BitReader *reader)
+{
+    read_ue(reader);
+}
+
+/* Gets the picture size out of the SPS RBSP, see ITU-T H.264 7.3.2.1.1 */
+static void parse_sps(const uint8_t *rbsp, uint32_t size,
+                      uint32_t *width, uint32_t *height)
+{
+    BitReader reader = { rbsp, size, 0 };
+    uint32_t profile_idc, chroma_format_idc = 1;
+    uint32_t poc_type, frame_mbs_only, crop_x = 2, crop_y = 2;
+    uint32_t width_mbs, height_map_units, i, count;
+
+    profile_idc = read_bits(&reader, 8);
+    read_bits(&reader, 16); /* constraint flags and level */
+    read_ue(&reader); /* seq_parameter_set_id */
+    if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 ||
+        profile_idc == 244 || profile_idc == 44 || profile_idc == 83 ||
+        profile_idc == 86 || profile_idc == 118 || profile_idc == 128) {
+        chroma_format_idc = read_ue(&reader);
+        /* 4:2:0, or 4:4:4 for the odd sizes */
+        g_assert(chroma_format_idc == 1 || chroma_format_idc == 3);
+        if (chroma_format_idc == 3) {
+            read_bits(&reader, 1); /* separate_colour_plane_flag */
+            crop_x = crop_y = 1;
+        }
+        read_ue(&reader); /* bit_depth_luma_minus8 */
+        read_ue(&reader); /* bit_depth_chroma_minus8 */
+        read_bits(&reader, 1); /* qpprime_y_zero_transform_bypass_flag */
+        /* x264 does not send scaling matrices unless told to */
+        g_assert_cmpuint(read_bits(&reader, 1), ==, 0);
+    }
+    read_ue(&reader); /* log2_max_frame_num_minus4 */
+    poc_type = read_ue(&reader);
+    if (poc_type == 0) {
+        read_ue(&reader); /* log2_max_pic_order_cnt_lsb_minus4 */
+    } else if (poc_type == 1) {
+        read_bits(&reader, 1); /* delta_pic_order_always_zero_flag */
+        skip_se(&reader); /* offset_for_non_ref_pic */
+        skip_se(&reader); /* offset_for_top_to_bottom_field */
+        count = read_ue(&reader);
+        for (i = 0; i < count; i++) {
+            skip_se(&reader); /* offset_for_ref_frame */
+        }
+    }
+    read_ue(&reader); /* max_num_ref_frames */
+    read_bits(&reader, 1); /* gaps_in_frame_num_value_allowed_flag */
+    width_mbs = read_ue(&reader) + 1;
+    height_map_units = read_ue(&reader) + 1;
+    frame_mbs_only = read_bits(&reader, 1);
+    if (!frame_mbs_only) {
+        read_bits(&reader, 1); /* mb_adaptive_frame_field_flag */
+    }
+    read_bits(&reader, 1); /* direct_8x8_inference_flag */
+
+    *width = width_mbs * 16;
+    *height = (2 - frame_mbs_only) * height_map_units * 16;
+    crop_y *= 2 - frame_mbs_only;
+    if (read_bits(&reader, 1)) { /* frame_cropping_flag */
+        *width -= crop_x * read_ue(&reader);
+        *width -= crop_x * read_ue(&reader);
+        *height -= crop_y * read_ue(&reader);
+        *height -= crop_y * read_ue(&reader);
+    }
+}
+
+/* Removes the emulation prevention bytes of the NAL payload */
+static uint32_t nal_to_rbsp(const uint8_t *nal, uint32_t size, uint8_t *rbsp)
+{
+    uint32_t i, rbsp_size = 0, zeros = 0;
+
+    for (i = 0; i < size; i++) {
+        if (zeros >= 2 && nal[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = nal[i] ? 0 : zeros + 1;
+        rbsp[rbsp_size++] = nal[i];
+    }
+    return rbsp_size;
+}
+
+/* Returns the offset of the NAL unit after the start code at pos, or size */
+static uint32_t next_nal(const uint8_t *data, uint32_t size, uint32_t pos)
+{
+    for (; pos + 3 <= size; pos++) {
+        if (data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 1) {
+            return pos + 3;
+        }
+    }
+    return size;
+}
+
+static void check_h264_frame(const VideoBuffer *buffer, uint32_t frame,
+                             uint32_t width, uint32_t height)
+{
+    const uint8_t *data = buffer->data;
+    uint8_t *rbsp = spice_malloc(buffer->size);
+    uint32_t sps_width = 0, sps_height = 0;
+    uint32_t pos, end, types = 0, num_nals = 0;
+
+    /* The decoded frames have the size of the stream area */
+    g_assert_cmpuint(buffer->width, ==, 0);
+    g_assert_cmpuint(buffer->height, ==, 0);
+
+    /* Annex B: each NAL unit starts with a 00 00 01 or 00 00 00 01 */
+    g_assert_cmpuint(buffer->size, >, 4);
+    g_assert(memcmp(data, "\0\0\1", 3) == 0 || memcmp(data, "\0\0\0\1", 4) == 0);
+    for (pos = next_nal(data, buffer->size, 0); pos < buffer->size; pos = end) {
+        uint32_t type, size;
+
+        end = next_nal(data, buffer->size, pos);
+        size = (end < buffer->size ? end - 3 : end) - pos;
+        while (size && data[pos + size - 1] == 0) {
+            /* the leading zero of a 4 byte start code */
+            size--;
+        }
+        g_assert_cmpuint(size, >, 0);
+        g_assert_cmpuint(data[pos] & 0x80, ==, 0); /* forbidden_zero_bit */
+        type = data[pos] & 0x1f;
+        if (num_nals == 0) {
+            g_assert_cmpuint(type, ==, NAL_AUD);
+        }
+        if (type == NAL_SPS) {
+            uint32_t rbsp_size = nal_to_rbsp(data + pos + 1, size - 1, rbsp);
+            parse_sps(rbsp, rbsp_size, &sps_width, &sps_height);
+        }
+        types |= 1 << type;
+        num_nals++;
+    }
+    free(rbsp);
+
+    g_assert(types & ((1 << NAL_SLICE) | (1 << NAL_SLICE_IDR)));
+    if (frame == 0) {
+        /* Without the parameter sets the stream cannot be decoded */
+        g_assert(types & (1 << NAL_SPS));
+        g_assert(types & (1 << NAL_PPS));
+        g_assert(types & (1 << NAL_SLICE_IDR));
+    }
+    if (types & (1 << NAL_SPS)) {
+        g_assert_cmpuint(sps_width, ==, width);
+        g_assert_cmpuint(sps_height, ==, height);
+    }
+}
+#endif
+
+
+static void test_encoder(const char *name, new_video_encoder_t new_encoder,
+                         SpiceVideoCodecType codec_type,
+                         VideoEncoderRateControlCbs *cbs, check_frame_t check_frame)
+{
+    unsigned int f, s, i;
+
+    for (f = 0; f < G_N_ELEMENTS(formats); f++) {
+        for (s = 0; s < G_N_ELEMENTS(sizes); s++) {
+            uint32_t width = sizes[s].width, height = sizes[s].height;
+            SpiceBitmap *bitmap = create_bitmap(&formats[f], width, height);
+            SpiceRect src = { 0, 0, width, height };
+            VideoEncoder *encoder;
+
+            printf("%s: format %d, %ux%u\n", name, formats[f].format, width, height);
+            encoder = new_encoder(codec_type, 0, cbs, NULL, NULL);
+            g_assert(encoder != NULL);
+            for (i = 0; i < NUM_FRAMES; i++) {
+                VideoBuffer *buffer = NULL;
+                int ret;
+
+                ret = encoder->encode_frame(encoder, 1000 + i * 40, bitmap, &src,
+                                            TRUE, NULL, &buffer);
+                g_assert_cmpint(ret, ==, VIDEO_ENCODER_FRAME_ENCODE_DONE);
+                g_assert(buffer != NULL);
+                check_frame(buffer, i, width, height);
+                buffer->free(buffer);
+            }
+            encoder->destroy(encoder);
+            destroy_bitmap(bitmap);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    test_encoder("mjpeg", mjpeg_encoder_new, SPICE_VIDEO_CODEC_TYPE_MJPEG,
+                 NULL, check_mjpeg_frame);
+#ifdef HAVE_X264
+    test_encoder("x264:h264", x264_encoder_new, SPICE_VIDEO_CODEC_TYPE_H264,
+                 NULL, check_h264_frame);
+#endif
+    return 0;
+}
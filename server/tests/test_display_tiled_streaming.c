@@ -0,0 +1,173 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Play a video the way browsers do: each frame is drawn in tiles whose
+ * boundaries move from one frame to the next, so no two consecutive
+ * drawables have the same bbox and only the region detection of the
+ * heat map can turn the area into a stream.
+ *
+ * Arguments:
+ *   partial  only a random part of each tile is updated
+ *   filter   use SPICE_STREAM_VIDEO_FILTER instead of SPICE_STREAM_VIDEO_ALL
+ *
+ * Expected result: with SPICE_DEBUG_LEVEL=4, the server logs the creation
+ * of a "region stream" covering the video area after about a second and
+ * the client plays the following tiles as sized stream frames.
+ *
+ * test-stream-heat-map checks the region detection automatically.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "test_display_base.h"
+
+#define NUM_FRAMES 600
+#define TILE_COLS 4
+#define TILE_ROWS 3
+#define VIDEO_LEFT 200
+#define VIDEO_TOP 150
+#define VIDEO_WIDTH 640
+#define VIDEO_HEIGHT 360
+/* how far the tile boundaries move between frames */
+#define TILE_JITTER 24
+
+static int partial;
+static int frame;
+static int tile;
+static int col_bounds[TILE_COLS + 1];
+static int row_bounds[TILE_ROWS + 1];
+
+static void jitter_bounds(int *bounds, int num_tiles, int size)
+{
+    int i;
+
+    bounds[0] = 0;
+    bounds[num_tiles] = size;
+    for (i = 1; i < num_tiles; i++) {
+        bounds[i] = size * i / num_tiles + g_random_int_range(-TILE_JITTER, TILE_JITTER + 1);
+    }
+}
+
+/* a moving gradient, smooth enough to pass the graduality filter */
+static uint32_t video_pixel(int x, int y)
+{
+    return ((x + frame * 4) & 0xff) |
+           (((y + frame * 2) & 0xff) << 8) |
+           (((x + y + frame) & 0xff) << 16);
+}
+
+static void create_tile(Test *test, Command *command)
+{
+    CommandDrawBitmap *cmd = &command->bitmap;
+    int col = tile % TILE_COLS;
+    int row = tile / TILE_COLS;
+    int left, top, right, bottom;
+    int x, y;
+    uint32_t *dst;
+
+    if (tile == 0) {
+        jitter_bounds(col_bounds, TILE_COLS, VIDEO_WIDTH);
+        jitter_bounds(row_bounds, TILE_ROWS, VIDEO_HEIGHT);
+    }
+
+    left = col_bounds[col];
+    right = col_bounds[col + 1];
+    top = row_bounds[row];
+    bottom = row_bounds[row + 1];
+    if (partial) {
+        /* keep at least a quarter of the tile */
+        left += g_random_int_range(0, (right - left) / 2);
+        top += g_random_int_range(0, (bottom - top) / 2);
+        right -= g_random_int_range(0, (right - left) / 2);
+        bottom -= g_random_int_range(0, (bottom - top) / 2);
+    }
+    assert(left < right && top < bottom);
+
+    cmd->surface_id = 0;
+    cmd->bbox.left = VIDEO_LEFT + left;
+    cmd->bbox.top = VIDEO_TOP + top;
+    cmd->bbox.right = VIDEO_LEFT + right;
+    cmd->bbox.bottom = VIDEO_TOP + bottom;
+    cmd->num_clip_rects = 0;
+    cmd->bitmap = g_malloc((right - left) * (bottom - top) * 4);
+    dst = (uint32_t *)cmd->bitmap;
+    for (y = top; y < bottom; y++) {
+        for (x = left; x < right; x++, dst++) {
+            *dst = video_pixel(x, y);
+        }
+    }
+
+    if (++tile == TILE_COLS * TILE_ROWS) {
+        tile = 0;
+        frame++;
+    }
+}
+
+static void get_commands(Command **commands, int *num_commands)
+{
+    int i;
+
+    *num_commands = NUM_FRAMES * TILE_COLS * TILE_ROWS + 3;
+    *commands = calloc(sizeof(Command), *num_commands);
+
+    (*commands)[0].command = DESTROY_PRIMARY;
+    (*commands)[1].command = CREATE_PRIMARY;
+    (*commands)[1].create_primary.width = 1280;
+    (*commands)[1].create_primary.height = 1024;
+    for (i = 2; i < *num_commands - 1; i++) {
+        (*commands)[i].command = SIMPLE_DRAW_BITMAP;
+        (*commands)[i].cb = create_tile;
+    }
+    (*commands)[*num_commands - 1].command = SLEEP;
+    (*commands)[*num_commands - 1].sleep.secs = 10;
+}
+
+int main(int argc, char **argv)
+{
+    SpiceCoreInterface *core;
+    Command *commands;
+    int num_commands;
+    int stream_video = SPICE_STREAM_VIDEO_ALL;
+    int i;
+    Test *test;
+
+    spice_test_config_parse_args(argc, argv);
+    for (i = 1 ; i < argc; ++i) {
+        if (strcmp(argv[i], "partial") == 0) {
+            partial = 1;
+        }
+        if (strcmp(argv[i], "filter") == 0) {
+            stream_video = SPICE_STREAM_VIDEO_FILTER;
+        }
+    }
+    core = basic_event_loop_init();
+    test = test_new(core);
+    spice_server_set_streaming_video(test->server, stream_video);
+    test_add_display_interface(test);
+    get_commands(&commands, &num_commands);
+    test_set_command_list(test, commands, num_commands);
+    basic_event_loop_mainloop();
+    free(commands);
+    return 0;
+}
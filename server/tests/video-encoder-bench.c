@@ -0,0 +1,851 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Compare the video encoders on the same sequence of frames, with their
+ * rate control driven by a scripted network.
+ *
+ * The frames are either generated (a scrolling gradient with a moving
+ * block of noise, the same for a given seed) or taken from the
+ * QXL_DRAW_COPY bitmaps of a recorded session (via
+ * SPICE_WORKER_RECORD_FILENAME) which have the size of the first one of
+ * at least 128x128.
+ *
+ * The network is described by a trace file whose lines give, from a time
+ * in milliseconds, the link bandwidth in kbps and the roundtrip time:
+ *     # time_ms kbps rtt_ms
+ *     0 8000 20
+ *     10000 1000 80
+ * The encoded frames go through the link one after the other, a frame is
+ * dropped by the "server" while the previous one is still waiting for the
+ * link, and the "client" reports the frames it receives every
+ * RED_STREAM_CLIENT_REPORT_WINDOW frames like spice-gtk does.
+ *
+ * The mjpeg rate control reads the monotonic clock, so the frames are
+ * paced in real time unless --fast is given. Except for the encoding
+ * times, the results are then reproducible within the pacing jitter.
+ *
+ * The quality is the PSNR of the decoded frames against the source ones,
+ * scaled to the source size like the client does. Only the MJPEG frames
+ * can be decoded, with libjpeg, so the other codecs get no PSNR.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <glib.h>
+#include <jpeglib.h>
+
+#include <spice/macros.h>
+#include <common/log.h>
+#include "red-replay-qxl.h"
+#include "red-parse-qxl.h"
+#include "memslot.h"
+#include "video-encoder.h"
+
+#define MAX_SURFACE_NUM 1024
+#define MIN_RECORD_SIZE 128
+
+/* see stream.h */
+#define CLIENT_REPORT_WINDOW 5
+#define CLIENT_REPORT_TIMEOUT 1000
+/* the client latency until the encoder sets it, see reds-private.h */
+#define DEFAULT_PLAYBACK_DELAY 400
+
+typedef struct BenchFrame {
+    gint refs;
+    SpiceBitmap bitmap;
+    int top_down;
+} BenchFrame;
+
+typedef struct TracePoint {
+    uint32_t time_ms;
+    uint64_t bit_rate;
+    uint32_t rtt_ms;
+} TracePoint;
+
+typedef struct ClientReport {
+    double due_time;
+    uint32_t num_frames;
+    uint32_t num_drops;
+    uint32_t start_frame_mm_time;
+    uint32_t end_frame_mm_time;
+    int32_t end_frame_delay;
+} ClientReport;
+
+typedef struct EncodedFrame {
+    uint32_t mm_time;
+    uint32_t size;
+} EncodedFrame;
+
+typedef struct Codec {
+    const char *name;
+    new_video_encoder_t new_encoder;
+    SpiceVideoCodecType codec_type;
+
+    /* results */
+    unsigned int frames;
+    unsigned int encoded;
+    unsigned int encoder_drops;
+    unsigned int server_drops;
+    unsigned int late;
+    unsigned int failed;
+    uint64_t size;
+    uint64_t encode_time_ns;
+    uint64_t max_encode_time_ns;
+    double tracking_error;
+    /* the squared errors of the decoded frames, over that many samples */
+    uint64_t sq_error;
+    uint64_t samples;
+} Codec;
+
+/* the state of the simulated link and client for the codec being run */
+typedef struct Session {
+    Codec *codec;
+    uint32_t mm_time;
+    uint32_t playback_delay;
+    /* when the link is done with the frames sent so far, in ms */
+    double link_free_time;
+    /* when the link starts sending the last frame */
+    double last_send_time;
+
+    ClientReport window;
+    double window_start;
+    GQueue *reports;
+    GArray *encoded_frames;
+} Session;
+
+static Codec codecs[] = {
+    { "mjpeg", mjpeg_encoder_new, SPICE_VIDEO_CODEC_TYPE_MJPEG },
+#if defined(HAVE_GSTREAMER_1_0) || defined(HAVE_GSTREAMER_0_10)
+    { "gstreamer:mjpeg", gstreamer_encoder_new, SPICE_VIDEO_CODEC_TYPE_MJPEG },
+    { "gstreamer:vp8", gstreamer_encoder_new, SPICE_VIDEO_CODEC_TYPE_VP8 },
+    { "gstreamer:h264", gstreamer_encoder_new, SPICE_VIDEO_CODEC_TYPE_H264 },
+#endif
+#ifdef HAVE_X264
+    { "x264:h264", x264_encoder_new, SPICE_VIDEO_CODEC_TYPE_H264 },
+#endif
+};
+
+static const TracePoint default_trace[] = {
+    { 0, 8 * 1024 * 1024, 20 },
+    { 4000, 1024 * 1024, 80 },
+    { 8000, 256 * 1024, 150 },
+    { 12000, 4 * 1024 * 1024, 40 },
+};
+
+static GArray *trace;
+static gint num_frames = 300;
+static gint source_fps = 25;
+static gint frame_width = 640;
+static gint frame_height = 360;
+static gint seed = 1;
+static gboolean fast;
+static gboolean no_rate_control;
+static GPtrArray *recorded_frames;
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static BenchFrame *bench_frame_new(SpiceBitmapFmt format, uint32_t width,
+                                   uint32_t height, uint32_t stride, int top_down)
+{
+    BenchFrame *frame = spice_new0(BenchFrame, 1);
+    uint8_t *data = spice_malloc(stride * height);
+
+    frame->refs = 1;
+    frame->bitmap.format = format;
+    frame->bitmap.flags = top_down ? SPICE_BITMAP_FLAGS_TOP_DOWN : 0;
+    frame->bitmap.x = width;
+    frame->bitmap.y = height;
+    frame->bitmap.stride = stride;
+    frame->bitmap.data = spice_chunks_new_linear(data, stride * height);
+    frame->bitmap.data->flags |= SPICE_CHUNKS_FLAGS_FREE;
+    frame->top_down = top_down;
+    return frame;
+}
+
+static void bench_frame_ref(gpointer data)
+{
+    BenchFrame *frame = data;
+
+    g_atomic_int_inc(&frame->refs);
+}
+
+static void bench_frame_unref(gpointer data)
+{
+    BenchFrame *frame = data;
+
+    if (g_atomic_int_dec_and_test(&frame->refs)) {
+        spice_chunks_destroy(frame->bitmap.data);
+        free(frame);
+    }
+}
+
+/* the frames only depend on the seed and their index */
+static BenchFrame *generate_frame(gint index)
+{
+    BenchFrame *frame = bench_frame_new(SPICE_BITMAP_FMT_32BIT, frame_width, frame_height,
+                                        frame_width * 4, TRUE);
+    GRand *rand = g_rand_new_with_seed(seed + index);
+    uint32_t *pixels = (uint32_t *)frame->bitmap.data->chunk[0].data;
+    gint block_size = MIN(frame_width, frame_height) / 4;
+    gint block_x = (index * 7) % (frame_width - block_size);
+    gint block_y = (index * 3) % (frame_height - block_size);
+    gint x, y;
+
+    for (y = 0; y < frame_height; y++) {
+        for (x = 0; x < frame_width; x++) {
+            if (x >= block_x && x < block_x + block_size &&
+                y >= block_y && y < block_y + block_size) {
+                pixels[x] = g_rand_int(rand) & 0xffffff;
+            } else {
+                pixels[x] = ((x + index * 4) & 0xff) |
+                            (((y + index * 2) & 0xff) << 8) |
+                            (((x + y + index) & 0xff) << 16);
+            }
+        }
+        pixels += frame_width;
+    }
+    g_rand_free(rand);
+    return frame;
+}
+
+static BenchFrame *get_frame(gint index)
+{
+    BenchFrame *frame;
+
+    if (!recorded_frames) {
+        return generate_frame(index);
+    }
+    frame = g_ptr_array_index(recorded_frames, index % recorded_frames->len);
+    bench_frame_ref(frame);
+    return frame;
+}
+
+static void replay_destroy_primary_surface(QXLWorker *worker, uint32_t surface_id)
+{
+}
+
+static void replay_create_primary_surface(QXLWorker *worker, uint32_t surface_id,
+                                          QXLDevSurfaceCreate *surface)
+{
+}
+
+static void replay_destroy_surfaces(QXLWorker *worker)
+{
+}
+
+static void record_frame(SpiceBitmap *bitmap)
+{
+    BenchFrame *frame, *first;
+    uint8_t *dst;
+    uint32_t i;
+
+    switch (bitmap->format) {
+    case SPICE_BITMAP_FMT_16BIT:
+    case SPICE_BITMAP_FMT_24BIT:
+    case SPICE_BITMAP_FMT_32BIT:
+    case SPICE_BITMAP_FMT_RGBA:
+        break;
+    default:
+        return;
+    }
+    if (recorded_frames->len) {
+        first = g_ptr_array_index(recorded_frames, 0);
+        if (bitmap->x != first->bitmap.x || bitmap->y != first->bitmap.y) {
+            return;
+        }
+    } else if (bitmap->x < MIN_RECORD_SIZE || bitmap->y < MIN_RECORD_SIZE) {
+        return;
+    }
+
+    frame = bench_frame_new(bitmap->format, bitmap->x, bitmap->y, bitmap->stride,
+                            bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN);
+    dst = frame->bitmap.data->chunk[0].data;
+    for (i = 0; i < bitmap->data->num_chunks; i++) {
+        memcpy(dst, bitmap->data->chunk[i].data, bitmap->data->chunk[i].len);
+        dst += bitmap->data->chunk[i].len;
+    }
+    g_ptr_array_add(recorded_frames, frame);
+}
+
+static void load_record(const char *filename)
+{
+    RedMemSlotInfo mem_slots;
+    QXLWorker worker = { 0, };
+    SpiceReplay *replay;
+    QXLCommandExt *cmd;
+    FILE *file;
+
+    file = fopen(filename, "r");
+    if (!file) {
+        g_printerr("error opening %s\n", filename);
+        exit(1);
+    }
+
+    worker.destroy_primary_surface = replay_destroy_primary_surface;
+    worker.create_primary_surface = replay_create_primary_surface;
+    worker.destroy_surfaces = replay_destroy_surfaces;
+
+    /* the record addresses are pointers of this process */
+    memslot_info_init(&mem_slots, 1 /* groups */, 1 /* slots */, 1, 1, 0);
+    memslot_info_add_slot(&mem_slots, 0, 0, 0 /* delta */, 0 /* start */, ~0ul /* end */, 0 /* generation */);
+
+    replay = spice_replay_new(file, MAX_SURFACE_NUM);
+    if (!replay) {
+        g_printerr("invalid record %s\n", filename);
+        exit(1);
+    }
+
+    recorded_frames = g_ptr_array_new_with_free_func(bench_frame_unref);
+    while ((gint)recorded_frames->len < num_frames &&
+           (cmd = spice_replay_next_cmd(replay, &worker)) != NULL) {
+        RedDrawable red;
+        SpiceImage *image;
+
+        memset(&red, 0, sizeof(red));
+        if (cmd->cmd.type != QXL_CMD_DRAW ||
+            red_get_drawable(&mem_slots, cmd->group_id, &red, cmd->cmd.data, cmd->flags)) {
+            spice_replay_free_cmd(replay, cmd);
+            continue;
+        }
+
+        image = red.type == QXL_DRAW_COPY ? red.u.copy.src_bitmap : NULL;
+        if (image && image->descriptor.type == SPICE_IMAGE_TYPE_BITMAP) {
+            record_frame(&image->u.bitmap);
+        }
+        red_put_drawable(&red);
+        spice_replay_free_cmd(replay, cmd);
+    }
+    spice_replay_free(replay);
+
+    if (!recorded_frames->len) {
+        g_printerr("no video sized bitmap in %s\n", filename);
+        exit(1);
+    }
+}
+
+static void load_trace(const char *filename)
+{
+    gchar *contents;
+    gchar **lines;
+    GError *error = NULL;
+    int i;
+
+    if (!g_file_get_contents(filename, &contents, NULL, &error)) {
+        g_printerr("error reading %s: %s\n", filename, error->message);
+        exit(1);
+    }
+    lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+
+    for (i = 0; lines[i]; i++) {
+        TracePoint point;
+        unsigned int time_ms, kbps, rtt_ms;
+        gchar *line = g_strstrip(lines[i]);
+
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%u %u %u", &time_ms, &kbps, &rtt_ms) != 3 || kbps == 0) {
+            g_printerr("%s:%d: expected time_ms kbps rtt_ms\n", filename, i + 1);
+            exit(1);
+        }
+        point.time_ms = time_ms;
+        point.bit_rate = kbps * 1024ULL;
+        point.rtt_ms = rtt_ms;
+        g_array_append_val(trace, point);
+    }
+    g_strfreev(lines);
+
+    if (!trace->len) {
+        g_printerr("empty trace %s\n", filename);
+        exit(1);
+    }
+}
+
+static const TracePoint *get_trace_point(uint32_t time_ms)
+{
+    const TracePoint *point = &g_array_index(trace, TracePoint, 0);
+    guint i;
+
+    for (i = 1; i < trace->len; i++) {
+        const TracePoint *next = &g_array_index(trace, TracePoint, i);
+        if (next->time_ms > time_ms) {
+            break;
+        }
+        point = next;
+    }
+    return point;
+}
+
+/* ---------- The rate control callbacks ---------- */
+
+static uint32_t bench_get_roundtrip_ms(void *opaque)
+{
+    Session *session = opaque;
+
+    return get_trace_point(session->mm_time)->rtt_ms;
+}
+
+static uint32_t bench_get_source_fps(void *opaque)
+{
+    return source_fps;
+}
+
+static void bench_update_client_playback_delay(void *opaque, uint32_t delay_ms)
+{
+    Session *session = opaque;
+
+    session->playback_delay = delay_ms;
+}
+
+static uint64_t bench_get_max_bit_rate(void *opaque)
+{
+    return 0;
+}
+
+static gboolean bench_can_scale_frames(void *opaque)
+{
+    return TRUE;
+}
+
+/* ---------- The PSNR of the decoded frames ---------- */
+
+/* libjpeg may be too old for jpeg_mem_src() */
+static void source_init(j_decompress_ptr cinfo)
+{
+}
+
+static boolean source_fill(j_decompress_ptr cinfo)
+{
+    static const JOCTET eoi[] = { 0xff, JPEG_EOI };
+
+    /* truncated image */
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = sizeof(eoi);
+    return TRUE;
+}
+
+static void source_skip(j_decompress_ptr cinfo, long num_bytes)
+{
+    num_bytes = MIN((size_t)num_bytes, cinfo->src->bytes_in_buffer);
+    cinfo->src->next_input_byte += num_bytes;
+    cinfo->src->bytes_in_buffer -= num_bytes;
+}
+
+static void source_term(j_decompress_ptr cinfo)
+{
+}
+
+/* the frames hold their lines in a single chunk, see bench_frame_new() */
+static void get_source_pixel(const SpiceBitmap *bitmap, uint32_t x, uint32_t y,
+                             uint8_t *rgb)
+{
+    const uint8_t *line = bitmap->data->chunk[0].data + y * bitmap->stride;
+
+    if (bitmap->format == SPICE_BITMAP_FMT_16BIT) {
+        uint16_t pixel;
+
+        memcpy(&pixel, line + x * 2, sizeof(pixel));
+        rgb[0] = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
+        rgb[1] = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
+        rgb[2] = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
+    } else {
+        const uint8_t *pixel = line + x * (bitmap->format == SPICE_BITMAP_FMT_24BIT ? 3 : 4);
+
+        rgb[0] = pixel[2];
+        rgb[1] = pixel[1];
+        rgb[2] = pixel[0];
+    }
+}
+
+/* Decodes the MJPEG frame and adds its squared error against the source
+ * frame. The lines are in the order of the bitmap, whatever top_down is.
+ */
+static void codec_add_mjpeg_error(Codec *codec, const VideoBuffer *outbuf,
+                                  const SpiceBitmap *bitmap)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    struct jpeg_source_mgr src;
+    uint32_t width, height, x, y;
+    uint8_t *pixels;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    src.next_input_byte = outbuf->data;
+    src.bytes_in_buffer = outbuf->size;
+    src.init_source = source_init;
+    src.fill_input_buffer = source_fill;
+    src.skip_input_data = source_skip;
+    src.resync_to_restart = jpeg_resync_to_restart;
+    src.term_source = source_term;
+    cinfo.src = &src;
+
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+        jpeg_destroy_decompress(&cinfo);
+        return;
+    }
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    width = cinfo.output_width;
+    height = cinfo.output_height;
+    pixels = spice_malloc(width * height * 3);
+    while (cinfo.output_scanline < height) {
+        uint8_t *row = pixels + cinfo.output_scanline * width * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    /* the sized frames are scaled to the source size */
+    for (y = 0; y < bitmap->y; y++) {
+        const uint8_t *row = pixels + (uint64_t)y * height / bitmap->y * width * 3;
+
+        for (x = 0; x < bitmap->x; x++) {
+            const uint8_t *decoded = row + (uint64_t)x * width / bitmap->x * 3;
+            uint8_t rgb[3];
+            int i;
+
+            get_source_pixel(bitmap, x, y, rgb);
+            for (i = 0; i < 3; i++) {
+                int diff = decoded[i] - rgb[i];
+                codec->sq_error += diff * diff;
+            }
+        }
+    }
+    codec->samples += (uint64_t)bitmap->x * bitmap->y * 3;
+    free(pixels);
+}
+
+static double codec_get_psnr(const Codec *codec)
+{
+    return 10 * log10(255.0 * 255.0 * codec->samples / MAX(codec->sq_error, 1));
+}
+
+/* ---------- The simulated link and client ---------- */
+
+static void session_deliver_reports(Session *session, VideoEncoder *encoder)
+{
+    ClientReport *report;
+
+    while ((report = g_queue_peek_head(session->reports)) &&
+           report->due_time <= session->mm_time) {
+        g_queue_pop_head(session->reports);
+        encoder->client_stream_report(encoder, report->num_frames, report->num_drops,
+                                      report->start_frame_mm_time,
+                                      report->end_frame_mm_time,
+                                      report->end_frame_delay, G_MAXUINT32);
+        free(report);
+    }
+}
+
+static void session_send_frame(Session *session, VideoBuffer *outbuf)
+{
+    const TracePoint *point = get_trace_point(session->mm_time);
+    EncodedFrame encoded = { session->mm_time, outbuf->size };
+    double arrival;
+    int32_t delay;
+
+    g_array_append_val(session->encoded_frames, encoded);
+    session->last_send_time = MAX(session->link_free_time, session->mm_time);
+    session->link_free_time = session->last_send_time +
+                              outbuf->size * 8 * 1000.0 / point->bit_rate;
+    arrival = session->link_free_time + point->rtt_ms / 2.0;
+
+    /* the client plays the frames playback_delay after their mm_time */
+    delay = session->mm_time + session->playback_delay - arrival;
+    if (!session->window.num_frames) {
+        session->window.start_frame_mm_time = session->mm_time;
+        session->window_start = arrival;
+    }
+    session->window.num_frames++;
+    if (delay < 0) {
+        session->window.num_drops++;
+        session->codec->late++;
+    }
+    session->window.end_frame_mm_time = session->mm_time;
+    session->window.end_frame_delay = delay;
+
+    if (session->window.num_frames >= CLIENT_REPORT_WINDOW ||
+        arrival - session->window_start >= CLIENT_REPORT_TIMEOUT) {
+        ClientReport *report = spice_new(ClientReport, 1);
+
+        *report = session->window;
+        report->due_time = arrival + point->rtt_ms / 2.0;
+        g_queue_push_tail(session->reports, report);
+        memset(&session->window, 0, sizeof(session->window));
+    }
+}
+
+/* the mean relative difference between the bit rate of the stream and
+ * the link bandwidth, over one second periods */
+static double session_get_tracking_error(Session *session, uint32_t start_mm_time)
+{
+    uint32_t duration = num_frames * 1000 / source_fps;
+    double error = 0;
+    int periods = 0;
+    guint i = 0;
+    uint32_t period;
+
+    for (period = 0; period + 1000 <= duration; period += 1000) {
+        uint64_t bit_rate = get_trace_point(start_mm_time + period)->bit_rate;
+        uint64_t size = 0;
+
+        for (; i < session->encoded_frames->len; i++) {
+            EncodedFrame *encoded = &g_array_index(session->encoded_frames, EncodedFrame, i);
+            if (encoded->mm_time >= start_mm_time + period + 1000) {
+                break;
+            }
+            size += encoded->size;
+        }
+        double diff = size * 8.0 - bit_rate;
+        error += (diff < 0 ? -diff : diff) / bit_rate;
+        periods++;
+    }
+    return periods ? error * 100 / periods : 0;
+}
+
+static void codec_run(Codec *codec)
+{
+    VideoEncoderRateControlCbs cbs = {
+        .get_roundtrip_ms = bench_get_roundtrip_ms,
+        .get_source_fps = bench_get_source_fps,
+        .update_client_playback_delay = bench_update_client_playback_delay,
+        .get_max_bit_rate = bench_get_max_bit_rate,
+        .can_scale_frames = bench_can_scale_frames,
+    };
+    Session session;
+    VideoEncoder *encoder;
+    uint32_t start_mm_time = 1000;
+    uint64_t start_time;
+    gint i;
+
+    memset(&session, 0, sizeof(session));
+    session.codec = codec;
+    session.mm_time = start_mm_time;
+    session.playback_delay = DEFAULT_PLAYBACK_DELAY;
+    session.reports = g_queue_new();
+    session.encoded_frames = g_array_new(FALSE, FALSE, sizeof(EncodedFrame));
+    cbs.opaque = &session;
+
+    if (no_rate_control) {
+        encoder = codec->new_encoder(codec->codec_type, 0, NULL,
+                                     bench_frame_ref, bench_frame_unref);
+    } else {
+        encoder = codec->new_encoder(codec->codec_type,
+                                     get_trace_point(start_mm_time)->bit_rate, &cbs,
+                                     bench_frame_ref, bench_frame_unref);
+    }
+    if (!encoder) {
+        g_printerr("%s: could not create the encoder\n", codec->name);
+        codec->failed = num_frames;
+        goto end;
+    }
+
+    start_time = get_time_ns();
+    for (i = 0; i < num_frames; i++) {
+        BenchFrame *frame;
+        VideoBuffer *outbuf = NULL;
+        SpiceRect src;
+        uint64_t encode_start, encode_time;
+        int ret;
+
+        session.mm_time = start_mm_time + i * 1000 / source_fps;
+        if (!fast) {
+            int64_t wait = start_time + (uint64_t)i * 1000000000 / source_fps - get_time_ns();
+            if (wait > 0) {
+                g_usleep(wait / 1000);
+            }
+        }
+        if (!no_rate_control) {
+            session_deliver_reports(&session, encoder);
+        }
+        codec->frames++;
+
+        /* like the worker, drop the frame while the previous one is
+         * still waiting for the link */
+        if (!no_rate_control && session.last_send_time > session.mm_time) {
+            encoder->notify_server_frame_drop(encoder);
+            codec->server_drops++;
+            continue;
+        }
+
+        frame = get_frame(i);
+        src.left = 0;
+        src.top = 0;
+        src.right = frame->bitmap.x;
+        src.bottom = frame->bitmap.y;
+        encode_start = get_time_ns();
+        ret = encoder->encode_frame(encoder, session.mm_time, &frame->bitmap, &src,
+                                    frame->top_down, frame, &outbuf);
+        encode_time = get_time_ns() - encode_start;
+
+        switch (ret) {
+        case VIDEO_ENCODER_FRAME_ENCODE_DONE:
+            codec->encoded++;
+            codec->size += outbuf->size;
+            codec->encode_time_ns += encode_time;
+            codec->max_encode_time_ns = MAX(codec->max_encode_time_ns, encode_time);
+            session_send_frame(&session, outbuf);
+            if (codec->codec_type == SPICE_VIDEO_CODEC_TYPE_MJPEG) {
+                codec_add_mjpeg_error(codec, outbuf, &frame->bitmap);
+            }
+            outbuf->free(outbuf);
+            break;
+        case VIDEO_ENCODER_FRAME_DROP:
+            codec->encoder_drops++;
+            break;
+        default:
+            codec->failed++;
+        }
+        bench_frame_unref(frame);
+    }
+
+    codec->tracking_error = session_get_tracking_error(&session, start_mm_time);
+    encoder->destroy(encoder);
+
+end:
+    while (!g_queue_is_empty(session.reports)) {
+        free(g_queue_pop_head(session.reports));
+    }
+    g_queue_free(session.reports);
+    g_array_free(session.encoded_frames, TRUE);
+}
+
+static gboolean codec_is_selected(const Codec *codec, gchar **names)
+{
+    if (!names) {
+        return TRUE;
+    }
+    for (; *names; names++) {
+        if (strcmp(*names, codec->name) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void print_results(void)
+{
+    double duration = (double)num_frames / source_fps;
+    unsigned int i;
+
+    printf("codec          \tframes\tencoded\tenc_drops\tsrv_drops\t late\tfailed"
+           "\t  fps\t  Mbps\ttrack_err(%%)\tenc_avg(ms)\tenc_max(ms)\tpsnr(dB)\n");
+    for (i = 0; i < SPICE_N_ELEMENTS(codecs); i++) {
+        const Codec *codec = &codecs[i];
+        gchar *psnr;
+
+        if (!codec->frames && !codec->failed) {
+            continue;
+        }
+        /* left empty when there is no decoder for the codec */
+        psnr = codec->samples ? g_strdup_printf("%8.2f", codec_get_psnr(codec)) : g_strdup("");
+        printf("%-15s\t%6u\t%7u\t%9u\t%9u\t%5u\t%6u\t%5.1f\t%6.2f\t%12.1f\t%11.2f\t%11.2f\t%s\n",
+               codec->name, codec->frames, codec->encoded, codec->encoder_drops,
+               codec->server_drops, codec->late, codec->failed,
+               codec->encoded / duration,
+               codec->size * 8 / duration / (1024 * 1024),
+               codec->tracking_error,
+               codec->encoded ? codec->encode_time_ns / 1e6 / codec->encoded : 0.0,
+               codec->max_encode_time_ns / 1e6,
+               psnr);
+        g_free(psnr);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    gchar **codec_names = NULL;
+    gchar *record_file = NULL;
+    gchar *trace_file = NULL;
+    gchar *size = NULL;
+    GOptionContext *context;
+    GError *error = NULL;
+    GOptionEntry entries[] = {
+        { "codec", 'c', 0, G_OPTION_ARG_STRING_ARRAY, &codec_names, "Only run this codec, may be repeated", "name" },
+        { "frames", 'n', 0, G_OPTION_ARG_INT, &num_frames, "Number of frames (300)", "n" },
+        { "fps", 'f', 0, G_OPTION_ARG_INT, &source_fps, "Source frame rate (25)", "fps" },
+        { "size", 's', 0, G_OPTION_ARG_STRING, &size, "Size of the generated frames (640x360)", "WxH" },
+        { "seed", 0, 0, G_OPTION_ARG_INT, &seed, "Seed of the generated frames (1)", "n" },
+        { "record", 'r', 0, G_OPTION_ARG_FILENAME, &record_file, "Take the frames from a recorded session", "FILENAME" },
+        { "trace", 't', 0, G_OPTION_ARG_FILENAME, &trace_file, "Network trace", "FILENAME" },
+        { "fast", 0, 0, G_OPTION_ARG_NONE, &fast, "Do not pace the frames in real time", NULL },
+        { "no-rate-control", 0, 0, G_OPTION_ARG_NONE, &no_rate_control, "Run the encoders without rate control", NULL },
+        { NULL }
+    };
+    unsigned int i;
+
+    context = g_option_context_new("- compare the video encoders on a scripted network");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    if (size && sscanf(size, "%dx%d", &frame_width, &frame_height) != 2) {
+        g_printerr("invalid size %s\n", size);
+        exit(1);
+    }
+    if (num_frames <= 0 || source_fps <= 0 ||
+        frame_width < MIN_RECORD_SIZE || frame_height < MIN_RECORD_SIZE) {
+        g_printerr("%s\n", g_option_context_get_help(context, TRUE, NULL));
+        exit(1);
+    }
+    g_option_context_free(context);
+
+    trace = g_array_new(FALSE, FALSE, sizeof(TracePoint));
+    if (trace_file) {
+        load_trace(trace_file);
+    } else {
+        g_array_append_vals(trace, default_trace, SPICE_N_ELEMENTS(default_trace));
+    }
+    if (record_file) {
+        load_record(record_file);
+    }
+
+    for (i = 0; i < SPICE_N_ELEMENTS(codecs); i++) {
+        if (codec_is_selected(&codecs[i], codec_names)) {
+            codec_run(&codecs[i]);
+        }
+    }
+    print_results();
+
+    if (recorded_frames) {
+        g_ptr_array_free(recorded_frames, TRUE);
+    }
+    g_array_free(trace, TRUE);
+    g_strfreev(codec_names);
+    g_free(record_file);
+    g_free(trace_file);
+    g_free(size);
+    return 0;
+}
@@ -69,6 +69,22 @@ static inline red_time_t spice_get_monotonic_time_ms(void)
     return g_get_monotonic_time() / 1000;
 }
 
+/* hash of the open addressing tables of the caches, the ids are mostly
+ * sequential and multiplicative hashing spreads them over the whole table */
+static inline uint32_t id_hash(uint64_t id, uint32_t shift)
+{
+    return (id * UINT64_C(0x9e3779b97f4a7c15)) >> (64 - shift);
+}
+
+/* backward shift deletion: returns whether the entry at slot, whose hash
+ * is home, must be moved to the hole left before it to still be found by
+ * the lookups, the tables then never need tombstones */
+static inline int id_hash_fills_hole(uint32_t slot, uint32_t home, uint32_t hole,
+                                     uint32_t mask)
+{
+    return ((slot - home) & mask) >= ((slot - hole) & mask);
+}
+
 int rgb32_data_has_alpha(int width, int height, size_t stride,
                          uint8_t *data, int *all_set_out);
 
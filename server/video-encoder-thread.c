@@ -0,0 +1,475 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pthread.h>
+#include <signal.h>
+
+#include "red-common.h"
+#include "video-encoder-thread.h"
+
+typedef struct ThreadFrame {
+    VideoEncoderFrame base;
+    VideoEncoderThread *thread;
+    const SpiceBitmap *bitmap;
+    gpointer bitmap_opaque;
+    /* the frame is given as the bitmap_opaque of the encoder, which can
+     * keep it after encode_frame() returns */
+    gint refs;
+} ThreadFrame;
+
+struct VideoEncoderThread {
+    VideoEncoder base;
+    VideoEncoder *encoder;
+    GMainContext *context;
+
+    bool rate_control;
+    VideoEncoderRateControlCbs cbs;
+    VideoEncoderRateControlCbs encoder_cbs;
+    bitmap_ref_t bitmap_ref;
+    bitmap_unref_t bitmap_unref;
+    video_encoder_frame_done_t frame_done;
+    void *frame_done_opaque;
+
+    pthread_t thread;
+    /* protects pending, dropped and quit */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ThreadFrame *pending;
+    uint32_t dropped;
+    bool quit;
+
+    /* held while the encoder is used */
+    pthread_mutex_t encoder_lock;
+
+    /* set by destroy(), only accessed from the main context */
+    bool stopped;
+    /* the wrapper, the frames and the callbacks on their way to the main
+     * context */
+    gint refs;
+};
+
+typedef struct PlaybackDelay {
+    VideoEncoderThread *thread;
+    uint32_t delay_ms;
+} PlaybackDelay;
+
+static void video_encoder_thread_unref(VideoEncoderThread *thread)
+{
+    if (!g_atomic_int_dec_and_test(&thread->refs)) {
+        return;
+    }
+    pthread_mutex_destroy(&thread->lock);
+    pthread_mutex_destroy(&thread->encoder_lock);
+    pthread_cond_destroy(&thread->cond);
+    free(thread);
+}
+
+static void video_encoder_thread_invoke(VideoEncoderThread *thread,
+                                        GSourceFunc func, gpointer data)
+{
+    GSource *source = g_idle_source_new();
+
+    g_source_set_callback(source, func, data, NULL);
+    g_source_attach(source, thread->context);
+    g_source_unref(source);
+}
+
+static ThreadFrame *thread_frame_new(VideoEncoderThread *thread,
+                                     uint32_t frame_mm_time,
+                                     const SpiceBitmap *bitmap,
+                                     const SpiceRect *src, const SpiceRect *dest,
+                                     int top_down, gpointer bitmap_opaque)
+{
+    ThreadFrame *frame = spice_new0(ThreadFrame, 1);
+
+    frame->base.mm_time = frame_mm_time;
+    frame->base.src = *src;
+    frame->base.dest = *dest;
+    frame->base.top_down = top_down;
+    frame->base.result = VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    frame->bitmap = bitmap;
+    frame->bitmap_opaque = bitmap_opaque;
+    frame->refs = 1;
+    frame->thread = thread;
+    g_atomic_int_inc(&thread->refs);
+    thread->bitmap_ref(bitmap_opaque);
+    return frame;
+}
+
+static void thread_frame_free(ThreadFrame *frame)
+{
+    VideoEncoderThread *thread = frame->thread;
+
+    thread->bitmap_unref(frame->bitmap_opaque);
+    video_encoder_thread_unref(thread);
+    free(frame);
+}
+
+static gboolean thread_frame_free_cb(gpointer data)
+{
+    thread_frame_free(data);
+    return FALSE;
+}
+
+static void thread_frame_unref(ThreadFrame *frame)
+{
+    if (!g_atomic_int_dec_and_test(&frame->refs)) {
+        return;
+    }
+    /* the bitmaps can only be released from the main context */
+    if (g_main_context_is_owner(frame->thread->context)) {
+        thread_frame_free(frame);
+    } else {
+        video_encoder_thread_invoke(frame->thread, thread_frame_free_cb, frame);
+    }
+}
+
+void video_encoder_thread_bitmap_ref(gpointer data)
+{
+    ThreadFrame *frame = data;
+
+    g_atomic_int_inc(&frame->refs);
+}
+
+void video_encoder_thread_bitmap_unref(gpointer data)
+{
+    thread_frame_unref(data);
+}
+
+/* The rate control callbacks are called on the encoder thread. The
+ * values returned by the getters are only estimates, reading them while
+ * the worker updates them is harmless. The playback delay however changes
+ * the state of the channel client so it is deferred to the main context.
+ */
+
+static uint32_t video_encoder_thread_get_roundtrip_ms(void *opaque)
+{
+    VideoEncoderThread *thread = opaque;
+
+    return thread->cbs.get_roundtrip_ms(thread->cbs.opaque);
+}
+
+static uint32_t video_encoder_thread_get_source_fps(void *opaque)
+{
+    VideoEncoderThread *thread = opaque;
+
+    return thread->cbs.get_source_fps(thread->cbs.opaque);
+}
+
+static uint64_t video_encoder_thread_get_max_bit_rate(void *opaque)
+{
+    VideoEncoderThread *thread = opaque;
+
+    return thread->cbs.get_max_bit_rate(thread->cbs.opaque);
+}
+
+static gboolean video_encoder_thread_can_scale_frames(void *opaque)
+{
+    VideoEncoderThread *thread = opaque;
+
+    return thread->cbs.can_scale_frames(thread->cbs.opaque);
+}
+
+static gboolean video_encoder_thread_playback_delay_cb(gpointer data)
+{
+    PlaybackDelay *delay = data;
+    VideoEncoderThread *thread = delay->thread;
+
+    if (!thread->stopped) {
+        thread->cbs.update_client_playback_delay(thread->cbs.opaque, delay->delay_ms);
+    }
+    video_encoder_thread_unref(thread);
+    free(delay);
+    return FALSE;
+}
+
+static void video_encoder_thread_update_client_playback_delay(void *opaque,
+                                                              uint32_t delay_ms)
+{
+    VideoEncoderThread *thread = opaque;
+    PlaybackDelay *delay;
+
+    if (g_main_context_is_owner(thread->context)) {
+        thread->cbs.update_client_playback_delay(thread->cbs.opaque, delay_ms);
+        return;
+    }
+    delay = spice_new(PlaybackDelay, 1);
+    delay->thread = thread;
+    delay->delay_ms = delay_ms;
+    g_atomic_int_inc(&thread->refs);
+    video_encoder_thread_invoke(thread, video_encoder_thread_playback_delay_cb, delay);
+}
+
+VideoEncoderThread *video_encoder_thread_new(GMainContext *context,
+                                             VideoEncoderRateControlCbs *cbs,
+                                             bitmap_ref_t bitmap_ref,
+                                             bitmap_unref_t bitmap_unref,
+                                             video_encoder_frame_done_t frame_done,
+                                             void *frame_done_opaque)
+{
+    VideoEncoderThread *thread = spice_new0(VideoEncoderThread, 1);
+
+    thread->context = context;
+    if (cbs) {
+        thread->rate_control = TRUE;
+        thread->cbs = *cbs;
+        thread->encoder_cbs.opaque = thread;
+        thread->encoder_cbs.get_roundtrip_ms = video_encoder_thread_get_roundtrip_ms;
+        thread->encoder_cbs.get_source_fps = video_encoder_thread_get_source_fps;
+        thread->encoder_cbs.update_client_playback_delay =
+            video_encoder_thread_update_client_playback_delay;
+        thread->encoder_cbs.get_max_bit_rate = video_encoder_thread_get_max_bit_rate;
+        thread->encoder_cbs.can_scale_frames = video_encoder_thread_can_scale_frames;
+    }
+    thread->bitmap_ref = bitmap_ref;
+    thread->bitmap_unref = bitmap_unref;
+    thread->frame_done = frame_done;
+    thread->frame_done_opaque = frame_done_opaque;
+    pthread_mutex_init(&thread->lock, NULL);
+    pthread_mutex_init(&thread->encoder_lock, NULL);
+    pthread_cond_init(&thread->cond, NULL);
+    thread->refs = 1;
+    return thread;
+}
+
+VideoEncoderRateControlCbs *video_encoder_thread_get_cbs(VideoEncoderThread *thread)
+{
+    return thread->rate_control ? &thread->encoder_cbs : NULL;
+}
+
+static int thread_frame_encode(VideoEncoderThread *thread, ThreadFrame *frame,
+                               VideoBuffer **outbuf)
+{
+    /* called with encoder_lock held */
+    return thread->encoder->encode_frame(thread->encoder, frame->base.mm_time,
+                                         frame->bitmap, &frame->base.src,
+                                         frame->base.top_down, frame, outbuf);
+}
+
+static gboolean video_encoder_thread_frame_done_cb(gpointer data)
+{
+    ThreadFrame *frame = data;
+    VideoEncoderThread *thread = frame->thread;
+
+    if (!thread->stopped) {
+        thread->frame_done(thread->frame_done_opaque, &frame->base);
+    } else if (frame->base.outbuf) {
+        frame->base.outbuf->free(frame->base.outbuf);
+    }
+    frame->base.outbuf = NULL;
+    thread_frame_unref(frame);
+    return FALSE;
+}
+
+static void *video_encoder_thread_main(void *data)
+{
+    VideoEncoderThread *thread = data;
+
+    for (;;) {
+        ThreadFrame *frame;
+        uint32_t dropped;
+
+        pthread_mutex_lock(&thread->lock);
+        while (!thread->pending && !thread->quit) {
+            pthread_cond_wait(&thread->cond, &thread->lock);
+        }
+        if (thread->quit) {
+            pthread_mutex_unlock(&thread->lock);
+            break;
+        }
+        frame = thread->pending;
+        thread->pending = NULL;
+        dropped = thread->dropped;
+        thread->dropped = 0;
+        pthread_mutex_unlock(&thread->lock);
+
+        pthread_mutex_lock(&thread->encoder_lock);
+        /* the frames replaced in the mailbox were dropped because the
+         * encoder could not keep up, which is what the pipe drops tell
+         * the rate control */
+        if (thread->rate_control) {
+            for (; dropped > 0; dropped--) {
+                thread->encoder->notify_server_frame_drop(thread->encoder);
+            }
+        }
+        frame->base.result = thread_frame_encode(thread, frame, &frame->base.outbuf);
+        if (frame->base.result != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+            frame->base.outbuf = NULL;
+        }
+        pthread_mutex_unlock(&thread->encoder_lock);
+
+        /* the reference of the mailbox goes with the frame */
+        video_encoder_thread_invoke(thread, video_encoder_thread_frame_done_cb, frame);
+    }
+    return NULL;
+}
+
+bool video_encoder_thread_post(VideoEncoderThread *thread,
+                               uint32_t frame_mm_time,
+                               const SpiceBitmap *bitmap,
+                               const SpiceRect *src, const SpiceRect *dest,
+                               int top_down, gpointer bitmap_opaque)
+{
+    ThreadFrame *frame = thread_frame_new(thread, frame_mm_time, bitmap, src, dest,
+                                          top_down, bitmap_opaque);
+    ThreadFrame *replaced;
+
+    pthread_mutex_lock(&thread->lock);
+    replaced = thread->pending;
+    thread->pending = frame;
+    if (replaced) {
+        thread->dropped++;
+    }
+    pthread_cond_signal(&thread->cond);
+    pthread_mutex_unlock(&thread->lock);
+
+    if (replaced) {
+        thread_frame_unref(replaced);
+    }
+    return replaced != NULL;
+}
+
+/* The VideoEncoder methods of the wrapper, called from the main context */
+
+static void video_encoder_thread_destroy(VideoEncoder *encoder)
+{
+    VideoEncoderThread *thread = SPICE_CONTAINEROF(encoder, VideoEncoderThread, base);
+
+    pthread_mutex_lock(&thread->lock);
+    thread->quit = TRUE;
+    pthread_cond_signal(&thread->cond);
+    pthread_mutex_unlock(&thread->lock);
+    pthread_join(thread->thread, NULL);
+
+    if (thread->pending) {
+        thread_frame_unref(thread->pending);
+        thread->pending = NULL;
+    }
+    thread->encoder->destroy(thread->encoder);
+    thread->encoder = NULL;
+    /* the frames still on their way to the main context are dropped */
+    thread->stopped = TRUE;
+    video_encoder_thread_unref(thread);
+}
+
+static int video_encoder_thread_encode_frame(VideoEncoder *encoder,
+                                             uint32_t frame_mm_time,
+                                             const SpiceBitmap *bitmap,
+                                             const SpiceRect *src, int top_down,
+                                             gpointer bitmap_opaque,
+                                             VideoBuffer **outbuf)
+{
+    VideoEncoderThread *thread = SPICE_CONTAINEROF(encoder, VideoEncoderThread, base);
+    ThreadFrame *frame = thread_frame_new(thread, frame_mm_time, bitmap, src, src,
+                                          top_down, bitmap_opaque);
+    int ret;
+
+    pthread_mutex_lock(&thread->encoder_lock);
+    ret = thread_frame_encode(thread, frame, outbuf);
+    pthread_mutex_unlock(&thread->encoder_lock);
+    thread_frame_unref(frame);
+    return ret;
+}
+
+static void video_encoder_thread_client_stream_report(VideoEncoder *encoder,
+                                                      uint32_t num_frames,
+                                                      uint32_t num_drops,
+                                                      uint32_t start_frame_mm_time,
+                                                      uint32_t end_frame_mm_time,
+                                                      int32_t end_frame_delay,
+                                                      uint32_t audio_delay)
+{
+    VideoEncoderThread *thread = SPICE_CONTAINEROF(encoder, VideoEncoderThread, base);
+
+    pthread_mutex_lock(&thread->encoder_lock);
+    thread->encoder->client_stream_report(thread->encoder, num_frames, num_drops,
+                                          start_frame_mm_time, end_frame_mm_time,
+                                          end_frame_delay, audio_delay);
+    pthread_mutex_unlock(&thread->encoder_lock);
+}
+
+static void video_encoder_thread_notify_server_frame_drop(VideoEncoder *encoder)
+{
+    VideoEncoderThread *thread = SPICE_CONTAINEROF(encoder, VideoEncoderThread, base);
+
+    pthread_mutex_lock(&thread->encoder_lock);
+    thread->encoder->notify_server_frame_drop(thread->encoder);
+    pthread_mutex_unlock(&thread->encoder_lock);
+}
+
+static uint64_t video_encoder_thread_get_bit_rate(VideoEncoder *encoder)
+{
+    VideoEncoderThread *thread = SPICE_CONTAINEROF(encoder, VideoEncoderThread, base);
+    uint64_t bit_rate;
+
+    pthread_mutex_lock(&thread->encoder_lock);
+    bit_rate = thread->encoder->get_bit_rate(thread->encoder);
+    pthread_mutex_unlock(&thread->encoder_lock);
+    return bit_rate;
+}
+
+static void video_encoder_thread_get_stats(VideoEncoder *encoder,
+                                           VideoEncoderStats *stats)
+{
+    VideoEncoderThread *thread = SPICE_CONTAINEROF(encoder, VideoEncoderThread, base);
+
+    pthread_mutex_lock(&thread->encoder_lock);
+    thread->encoder->get_stats(thread->encoder, stats);
+    pthread_mutex_unlock(&thread->encoder_lock);
+}
+
+VideoEncoder *video_encoder_thread_start(VideoEncoderThread *thread,
+                                         VideoEncoder *encoder)
+{
+    sigset_t thread_sig_mask;
+    sigset_t curr_sig_mask;
+    int r;
+
+    if (!encoder) {
+        video_encoder_thread_unref(thread);
+        return NULL;
+    }
+
+    thread->encoder = encoder;
+    thread->base.destroy = video_encoder_thread_destroy;
+    thread->base.encode_frame = video_encoder_thread_encode_frame;
+    thread->base.client_stream_report = video_encoder_thread_client_stream_report;
+    thread->base.notify_server_frame_drop = video_encoder_thread_notify_server_frame_drop;
+    thread->base.get_bit_rate = video_encoder_thread_get_bit_rate;
+    thread->base.get_stats = video_encoder_thread_get_stats;
+    thread->base.codec_type = encoder->codec_type;
+
+    /* the signals are handled by the main thread, as for the worker */
+    sigfillset(&thread_sig_mask);
+    sigdelset(&thread_sig_mask, SIGILL);
+    sigdelset(&thread_sig_mask, SIGFPE);
+    sigdelset(&thread_sig_mask, SIGSEGV);
+    pthread_sigmask(SIG_SETMASK, &thread_sig_mask, &curr_sig_mask);
+    r = pthread_create(&thread->thread, NULL, video_encoder_thread_main, thread);
+    pthread_sigmask(SIG_SETMASK, &curr_sig_mask, NULL);
+    if (r) {
+        spice_warning("failed to create the video encoder thread: %d", r);
+        encoder->destroy(encoder);
+        video_encoder_thread_unref(thread);
+        return NULL;
+    }
+    return &thread->base;
+}
@@ -0,0 +1,93 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_VIDEO_ENCODER_THREAD
+#define _H_VIDEO_ENCODER_THREAD
+
+#include <stdbool.h>
+
+#include "video-encoder.h"
+
+/* Runs the encode_frame() calls of a video encoder on a thread of its own
+ * so that a slow encode does not hold the worker.
+ *
+ * The thread has room for a single frame: a frame posted while the
+ * previous one is still waiting replaces it, so the worker never queues
+ * stale frames. The encoded frames are handed back on the main context
+ * through the frame_done callback.
+ *
+ * The encoder is wrapped in a VideoEncoder whose methods can still be
+ * called from the main context, they wait for the frame being encoded if
+ * any. Its destroy() method stops the thread.
+ */
+
+typedef struct VideoEncoderThread VideoEncoderThread;
+
+typedef struct VideoEncoderFrame {
+    uint32_t mm_time;
+    SpiceRect src;
+    /* the destination of the sized frames */
+    SpiceRect dest;
+    int top_down;
+
+    /* the value returned by encode_frame(), outbuf is only set on
+     * VIDEO_ENCODER_FRAME_ENCODE_DONE */
+    int result;
+    VideoBuffer *outbuf;
+} VideoEncoderFrame;
+
+/* Called on the main context for each encoded frame, the callee takes
+ * the ownership of frame->outbuf. */
+typedef void (*video_encoder_frame_done_t)(void *opaque, VideoEncoderFrame *frame);
+
+/* Creates the thread, the encoder must then be created with the callbacks
+ * returned by video_encoder_thread_get_cbs() and
+ * video_encoder_thread_bitmap_ref()/video_encoder_thread_bitmap_unref().
+ *
+ * @context:      The main context, the one running the worker.
+ * @cbs:          The rate control callbacks, NULL if not used.
+ * @bitmap_ref:   Called on the main context to keep the posted bitmaps.
+ * @bitmap_unref: Called on the main context to release them.
+ */
+VideoEncoderThread *video_encoder_thread_new(GMainContext *context,
+                                             VideoEncoderRateControlCbs *cbs,
+                                             bitmap_ref_t bitmap_ref,
+                                             bitmap_unref_t bitmap_unref,
+                                             video_encoder_frame_done_t frame_done,
+                                             void *frame_done_opaque);
+VideoEncoderRateControlCbs *video_encoder_thread_get_cbs(VideoEncoderThread *thread);
+/* these can be called from any thread */
+void video_encoder_thread_bitmap_ref(gpointer data);
+void video_encoder_thread_bitmap_unref(gpointer data);
+
+/* Starts the thread and returns the wrapper of the encoder, which then
+ * belongs to the thread. If the encoder is NULL or the thread cannot be
+ * started the thread is freed. */
+VideoEncoder *video_encoder_thread_start(VideoEncoderThread *thread,
+                                         VideoEncoder *encoder);
+
+/* Posts a frame to encode, the bitmap is kept with bitmap_ref() until it
+ * is encoded.
+ * Returns TRUE if the frame replaced one the thread did not pick yet. */
+bool video_encoder_thread_post(VideoEncoderThread *thread,
+                               uint32_t frame_mm_time,
+                               const SpiceBitmap *bitmap,
+                               const SpiceRect *src, const SpiceRect *dest,
+                               int top_down, gpointer bitmap_opaque);
+
+#endif
@@ -35,6 +35,11 @@ struct VideoBuffer {
     /* The size of the compressed frame in bytes. */
     uint32_t size;
 
+    /* The size of the frame if the encoder scaled the source area down,
+     * zero if the frame has the size of the source area. */
+    uint32_t width;
+    uint32_t height;
+
     /* Releases the video buffer resources and deallocates it.
      *
      * @buffer:   The video buffer.
@@ -52,6 +57,8 @@ typedef struct VideoEncoderStats {
     uint64_t starting_bit_rate;
     uint64_t cur_bit_rate;
     double avg_quality;
+    /* frames encoded straight from a single bitmap chunk, without a copy */
+    uint64_t num_zero_copy_frames;
 } VideoEncoderStats;
 
 typedef struct VideoEncoder VideoEncoder;
@@ -167,6 +174,19 @@ typedef struct VideoEncoderRateControlCbs {
      *              frames to reach the client.
      */
     void (*update_client_playback_delay)(void *opaque, uint32_t delay_ms);
+
+    /* Returns the share of the link bandwidth allotted to the stream when
+     * the client plays several streams, in bits per second, or zero if the
+     * stream can use all of it. The share changes as streams come and go
+     * so don't store the result.
+     */
+    uint64_t (*get_max_bit_rate)(void *opaque);
+
+    /* Returns TRUE if the client can play frames smaller than the source
+     * area, which lets the encoder scale the frames down when the bit rate
+     * is too low for them.
+     */
+    gboolean (*can_scale_frames)(void *opaque);
 } VideoEncoderRateControlCbs;
 
 typedef void (*bitmap_ref_t)(gpointer data);
@@ -205,6 +225,13 @@ VideoEncoder* gstreamer_encoder_new(SpiceVideoCodecType codec_type,
                                     bitmap_ref_t bitmap_ref,
                                     bitmap_unref_t bitmap_unref);
 #endif
+#ifdef HAVE_X264
+VideoEncoder* x264_encoder_new(SpiceVideoCodecType codec_type,
+                               uint64_t starting_bit_rate,
+                               VideoEncoderRateControlCbs *cbs,
+                               bitmap_ref_t bitmap_ref,
+                               bitmap_unref_t bitmap_unref);
+#endif
 
 
 typedef struct RedVideoCodec {
@@ -0,0 +1,524 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2015 Jeremy White
+   Copyright (C) 2015-2016 Francois Gouget
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "red-common.h"
+#include "utils.h"
+#include "video-rate-control.h"
+
+void video_rate_control_init(VideoRateControl *rc,
+                             const VideoEncoderRateControlCbs *cbs,
+                             uint64_t starting_bit_rate,
+                             void (*bit_rate_changed)(VideoRateControl *rc,
+                                                      gboolean stable))
+{
+    verify(VIDEO_RC_FRAME_STATISTICS_COUNT <= VIDEO_RC_HISTORY_SIZE);
+
+    if (cbs) {
+        rc->cbs = *cbs;
+    }
+    rc->starting_bit_rate = starting_bit_rate;
+    rc->bit_rate_changed = bit_rate_changed;
+}
+
+
+/* ---------- Miscellaneous helpers ---------- */
+
+uint32_t video_rate_control_get_source_fps(VideoRateControl *rc)
+{
+    return rc->cbs.get_source_fps ?
+        rc->cbs.get_source_fps(rc->cbs.opaque) : VIDEO_RC_DEFAULT_FPS;
+}
+
+uint64_t video_rate_control_get_max_bit_rate(VideoRateControl *rc)
+{
+    return rc->cbs.get_max_bit_rate ?
+        rc->cbs.get_max_bit_rate(rc->cbs.opaque) : 0;
+}
+
+uint32_t video_rate_control_get_network_latency(VideoRateControl *rc)
+{
+    /* Assume that the network latency is symmetric */
+    return rc->cbs.get_roundtrip_ms ?
+        rc->cbs.get_roundtrip_ms(rc->cbs.opaque) / 2 : 0;
+}
+
+
+/* ---------- Encoded frame statistics ---------- */
+
+uint32_t video_rate_control_get_last_frame_mm_time(VideoRateControl *rc)
+{
+    return rc->history[rc->history_last].mm_time;
+}
+
+/* Returns the current bit rate based on the last
+ * VIDEO_RC_FRAME_STATISTICS_COUNT frames.
+ */
+uint64_t video_rate_control_get_effective_bit_rate(VideoRateControl *rc)
+{
+    uint32_t next_mm_time = rc->next_frame_mm_time ?
+                            rc->next_frame_mm_time :
+                            video_rate_control_get_last_frame_mm_time(rc) +
+                                MSEC_PER_SEC / video_rate_control_get_source_fps(rc);
+    uint32_t elapsed = next_mm_time - rc->history[rc->stat_first].mm_time;
+    return elapsed ? rc->stat_size_sum * 8 * MSEC_PER_SEC / elapsed : 0;
+}
+
+static uint32_t get_stat_count(VideoRateControl *rc)
+{
+    return rc->history_last +
+        (rc->history_last < rc->stat_first ? VIDEO_RC_HISTORY_SIZE : 0) -
+        rc->stat_first + 1;
+}
+
+uint64_t video_rate_control_get_average_encoding_time(VideoRateControl *rc)
+{
+    return rc->stat_duration_sum / get_stat_count(rc);
+}
+
+static uint64_t get_average_frame_size(VideoRateControl *rc)
+{
+    return rc->stat_size_sum / get_stat_count(rc);
+}
+
+static uint32_t get_maximum_frame_size(VideoRateControl *rc)
+{
+    if (rc->stat_size_max == 0) {
+        uint32_t index = rc->history_last;
+        while (1) {
+            rc->stat_size_max = MAX(rc->stat_size_max, rc->history[index].size);
+            if (index == rc->stat_first) {
+                break;
+            }
+            index = (index ? index : VIDEO_RC_HISTORY_SIZE) - 1;
+        }
+    }
+    return rc->stat_size_max;
+}
+
+/* Returns the bit rate of the specified period. from and to must be the
+ * mm time of the first and last frame to consider.
+ */
+static uint64_t get_period_bit_rate(VideoRateControl *rc, uint32_t from,
+                                    uint32_t to)
+{
+    uint32_t sum = 0;
+    uint32_t last_mm_time = 0;
+    uint32_t index = rc->history_last;
+    while (1) {
+        if (rc->history[index].mm_time == to) {
+            if (last_mm_time == 0) {
+                /* We don't know how much time elapsed between the period's
+                 * last frame and the next so we cannot include it.
+                 */
+                sum = 1;
+                last_mm_time = to;
+            } else {
+                sum = rc->history[index].size + 1;
+            }
+
+        } else if (rc->history[index].mm_time == from) {
+            sum += rc->history[index].size;
+            return (sum - 1) * 8 * MSEC_PER_SEC / (last_mm_time - from);
+
+        } else if (sum > 0) {
+            sum += rc->history[index].size;
+
+        } else {
+            last_mm_time = rc->history[index].mm_time;
+        }
+
+        if (index == rc->history_first) {
+            /* This period is outside the recorded history */
+            spice_debug("period (%u-%u) outside known history (%u-%u)",
+                        from, to,
+                        rc->history[rc->history_first].mm_time,
+                        rc->history[rc->history_last].mm_time);
+           return 0;
+        }
+        index = (index ? index : VIDEO_RC_HISTORY_SIZE) - 1;
+    }
+
+}
+
+void video_rate_control_add_frame(VideoRateControl *rc, uint32_t frame_mm_time,
+                                  uint64_t duration, uint32_t size)
+{
+    /* Update the statistics */
+    uint32_t count = get_stat_count(rc);
+    if (count == VIDEO_RC_FRAME_STATISTICS_COUNT) {
+        rc->stat_duration_sum -= rc->history[rc->stat_first].duration;
+        rc->stat_size_sum -= rc->history[rc->stat_first].size;
+        if (rc->stat_size_max == rc->history[rc->stat_first].size) {
+            rc->stat_size_max = 0;
+        }
+        rc->stat_first = (rc->stat_first + 1) % VIDEO_RC_HISTORY_SIZE;
+    }
+    rc->stat_duration_sum += duration;
+    rc->stat_size_sum += size;
+    if (rc->stat_size_max > 0 && size > rc->stat_size_max) {
+        rc->stat_size_max = size;
+    }
+
+    /* Update the frame history */
+    rc->history_last = (rc->history_last + 1) % VIDEO_RC_HISTORY_SIZE;
+    if (rc->history_last == rc->history_first) {
+        rc->history_first = (rc->history_first + 1) % VIDEO_RC_HISTORY_SIZE;
+    }
+    rc->history[rc->history_last].mm_time = frame_mm_time;
+    rc->history[rc->history_last].duration = duration;
+    rc->history[rc->history_last].size = size;
+}
+
+
+/* ---------- Client playback delay ---------- */
+
+static uint32_t get_min_playback_delay(VideoRateControl *rc)
+{
+    /* Make sure the delay is large enough to send a large frame (typically
+     * an I frame) and an average frame. This also takes into account the
+     * frames dropped by the encoder bit rate control.
+     */
+    uint32_t size = get_maximum_frame_size(rc) + get_average_frame_size(rc);
+    uint32_t send_time = MSEC_PER_SEC * size * 8 / rc->bit_rate;
+
+    /* Also factor in the network latency with a margin for jitter. */
+    uint32_t net_latency = video_rate_control_get_network_latency(rc) *
+                           (1.0 + VIDEO_RC_LATENCY_MARGIN);
+
+    return send_time + net_latency;
+}
+
+void video_rate_control_update_client_playback_delay(VideoRateControl *rc)
+{
+    if (rc->cbs.update_client_playback_delay) {
+        uint32_t min_delay = get_min_playback_delay(rc) +
+            video_rate_control_get_average_encoding_time(rc) / NSEC_PER_MILLISEC;
+        rc->cbs.update_client_playback_delay(rc->cbs.opaque, min_delay);
+    }
+}
+
+
+/* ---------- Network bit rate control ---------- */
+
+/* The maximum bit rate we will use for the current video.
+ *
+ * This is based on a 10x compression ratio which should be more than enough
+ * for even MJPEG to provide good quality.
+ */
+static uint64_t get_bit_rate_cap(VideoRateControl *rc)
+{
+    uint64_t cap = rc->raw_frame_bits * video_rate_control_get_source_fps(rc) / 10;
+    uint64_t max_bit_rate = video_rate_control_get_max_bit_rate(rc);
+
+    return max_bit_rate ? MIN(cap, max_bit_rate) : cap;
+}
+
+void video_rate_control_set_bit_rate(VideoRateControl *rc, uint64_t bit_rate)
+{
+    gboolean stable = FALSE;
+
+    if (bit_rate == 0) {
+        /* Use the default value */
+        bit_rate = VIDEO_RC_DEFAULT_BITRATE;
+    }
+    if (bit_rate == rc->bit_rate) {
+        return;
+    }
+    if (bit_rate < VIDEO_RC_MIN_BITRATE) {
+        /* Don't let the bit rate go too low... */
+        rc->bit_rate = VIDEO_RC_MIN_BITRATE;
+    } else if (bit_rate > rc->bit_rate) {
+        /* or too high */
+        bit_rate = MIN(bit_rate, get_bit_rate_cap(rc));
+    }
+
+    if (bit_rate < rc->min_bit_rate) {
+        rc->min_bit_rate = bit_rate;
+        rc->bit_rate_step = 0;
+    } else if (rc->status == VIDEO_RC_BITRATE_DECREASING &&
+               bit_rate > rc->bit_rate) {
+        rc->min_bit_rate = rc->bit_rate;
+        rc->bit_rate_step = 0;
+    } else if (rc->status != VIDEO_RC_BITRATE_DECREASING &&
+               bit_rate < rc->bit_rate) {
+        rc->max_bit_rate = rc->bit_rate - VIDEO_RC_MIN_BITRATE;
+        rc->bit_rate_step = 0;
+    }
+    rc->increase_interval = VIDEO_RC_BITRATE_UP_INTERVAL;
+
+    if (rc->bit_rate_step == 0) {
+        rc->bit_rate_step = MAX(VIDEO_RC_MIN_BITRATE,
+                                MIN(VIDEO_RC_BITRATE_MAX_STEP,
+                                    (rc->max_bit_rate - rc->min_bit_rate) / 10));
+        rc->status = (bit_rate < rc->bit_rate) ?
+            VIDEO_RC_BITRATE_DECREASING : VIDEO_RC_BITRATE_INCREASING;
+        if (rc->max_bit_rate / VIDEO_RC_BITRATE_MARGIN < rc->min_bit_rate) {
+            /* We have sufficiently narrowed down the optimal bit rate range.
+             * Settle on the lower end to keep a safety margin and stop
+             * rocking the boat.
+             */
+            bit_rate = rc->min_bit_rate;
+            rc->status = VIDEO_RC_BITRATE_STABLE;
+            rc->increase_interval = rc->has_client_reports ?
+                VIDEO_RC_BITRATE_UP_CLIENT_STABLE : VIDEO_RC_BITRATE_UP_SERVER_STABLE;
+            stable = TRUE;
+        }
+    }
+    spice_debug("%u set_bit_rate(%.3fMbps) eff %.3f %.3f-%.3f %d",
+                video_rate_control_get_last_frame_mm_time(rc) - rc->last_change,
+                video_rate_control_get_mbps(bit_rate),
+                video_rate_control_get_mbps(video_rate_control_get_effective_bit_rate(rc)),
+                video_rate_control_get_mbps(rc->min_bit_rate),
+                video_rate_control_get_mbps(rc->max_bit_rate), rc->status);
+
+    rc->last_change = video_rate_control_get_last_frame_mm_time(rc);
+    rc->bit_rate = bit_rate;
+    rc->bit_rate_changed(rc, stable);
+
+    /* Frames preceeding the bit rate change are not relevant to the current
+     * situation anymore.
+     */
+    rc->stat_first = rc->history_last;
+    rc->stat_duration_sum = rc->history[rc->history_last].duration;
+    rc->stat_size_sum = rc->stat_size_max = rc->history[rc->history_last].size;
+}
+
+gboolean video_rate_control_set_frame_size(VideoRateControl *rc, uint32_t frame_mm_time,
+                                           uint64_t raw_frame_bits)
+{
+    rc->raw_frame_bits = raw_frame_bits;
+    if (rc->bit_rate != 0) {
+        return FALSE;
+    }
+    rc->history[0].mm_time = frame_mm_time;
+    rc->max_bit_rate = get_bit_rate_cap(rc);
+    rc->min_bit_rate = VIDEO_RC_MIN_BITRATE;
+    rc->status = VIDEO_RC_BITRATE_DECREASING;
+    video_rate_control_set_bit_rate(rc, rc->starting_bit_rate);
+    return TRUE;
+}
+
+static void increase_bit_rate(VideoRateControl *rc)
+{
+    if (video_rate_control_get_effective_bit_rate(rc) < rc->bit_rate) {
+        /* The encoder currently uses less bandwidth than allowed. So
+         * increasing the limit again makes no sense.
+         */
+        return;
+    }
+
+    if (rc->bit_rate == rc->max_bit_rate &&
+        video_rate_control_get_last_frame_mm_time(rc) - rc->last_change > VIDEO_RC_BITRATE_UP_RESET_MAX) {
+        /* The maximum bit rate seems to be sustainable so it was probably
+         * set too low. Probe for the maximum bit rate again.
+         */
+        rc->max_bit_rate = get_bit_rate_cap(rc);
+        rc->status = VIDEO_RC_BITRATE_INCREASING;
+    }
+
+    uint64_t new_bit_rate = MIN(rc->bit_rate + rc->bit_rate_step,
+                                rc->max_bit_rate);
+    spice_debug("increase bit rate to %.3fMbps %.3f-%.3fMbps %d",
+                video_rate_control_get_mbps(new_bit_rate),
+                video_rate_control_get_mbps(rc->min_bit_rate),
+                video_rate_control_get_mbps(rc->max_bit_rate), rc->status);
+    video_rate_control_set_bit_rate(rc, new_bit_rate);
+}
+
+static void decrease_bit_rate(VideoRateControl *rc, double factor)
+{
+    uint64_t bit_rate = (rc->bit_rate == rc->min_bit_rate) ?
+        rc->bit_rate / factor :
+        MAX(rc->min_bit_rate, rc->bit_rate / factor);
+    video_rate_control_set_bit_rate(rc, bit_rate);
+}
+
+void video_rate_control_limit_bit_rate(VideoRateControl *rc)
+{
+    uint64_t max_bit_rate = video_rate_control_get_max_bit_rate(rc);
+
+    if (max_bit_rate && rc->bit_rate > max_bit_rate) {
+        video_rate_control_set_bit_rate(rc, max_bit_rate);
+    }
+}
+
+
+/* ---------- Server feedback ---------- */
+
+/* Checks how many frames got dropped since the last encoded frame and
+ * adjusts the bit rate accordingly.
+ */
+gboolean video_rate_control_handle_server_drops(VideoRateControl *rc,
+                                                uint32_t frame_mm_time)
+{
+    if (rc->server_drops == 0) {
+        return FALSE;
+    }
+
+    spice_debug("server report: got %u drops in %ums after %ums",
+                rc->server_drops,
+                frame_mm_time - video_rate_control_get_last_frame_mm_time(rc),
+                frame_mm_time - rc->last_change);
+
+    /* Add a 0 byte frame so the time spent dropping frames is not counted as
+     * time during which the buffer was refilling. This implies dropping this
+     * frame.
+     */
+    video_rate_control_add_frame(rc, frame_mm_time, 0, 0);
+
+    if (rc->server_drops >= video_rate_control_get_source_fps(rc)) {
+        spice_debug("cut the bit rate");
+        decrease_bit_rate(rc, VIDEO_RC_BITRATE_CUT);
+    } else {
+        spice_debug("reduce the bit rate");
+        decrease_bit_rate(rc, VIDEO_RC_BITRATE_REDUCE);
+    }
+    rc->server_drops = 0;
+    return TRUE;
+}
+
+void video_rate_control_server_increase_bit_rate(VideoRateControl *rc,
+                                                 uint32_t frame_mm_time)
+{
+    /* Let video_rate_control_client_stream_report() deal with bit rate
+     * increases if we receive client reports.
+     */
+    if (!rc->has_client_reports && rc->server_drops == 0 &&
+        frame_mm_time - rc->last_change >= rc->increase_interval) {
+        increase_bit_rate(rc);
+    }
+}
+
+void video_rate_control_notify_server_frame_drop(VideoRateControl *rc)
+{
+    if (rc->server_drops == 0) {
+        spice_debug("server report: getting frame drops...");
+    }
+    rc->server_drops++;
+}
+
+
+/* ---------- Client feedback ---------- */
+
+void video_rate_control_client_stream_report(VideoRateControl *rc,
+                                             uint32_t num_frames,
+                                             uint32_t num_drops,
+                                             uint32_t start_frame_mm_time,
+                                             uint32_t end_frame_mm_time,
+                                             int32_t video_margin,
+                                             uint32_t audio_margin)
+{
+    rc->has_client_reports = TRUE;
+
+    rc->max_video_margin = MAX(rc->max_video_margin, video_margin);
+    rc->max_audio_margin = MAX(rc->max_audio_margin, audio_margin);
+    int32_t margin_delta = video_margin - rc->last_video_margin;
+    rc->last_video_margin = video_margin;
+
+    uint64_t period_bit_rate = get_period_bit_rate(rc, start_frame_mm_time, end_frame_mm_time);
+    spice_debug("client report: %u/%u drops in %ums margins video %3d/%3d audio %3u/%3u bw %.3f/%.3fMbps%s",
+                num_drops, num_frames, end_frame_mm_time - start_frame_mm_time,
+                video_margin, rc->max_video_margin,
+                audio_margin, rc->max_audio_margin,
+                video_rate_control_get_mbps(period_bit_rate),
+                video_rate_control_get_mbps(video_rate_control_get_effective_bit_rate(rc)),
+                start_frame_mm_time < rc->last_change ? " obsolete" : "");
+    if (rc->status == VIDEO_RC_BITRATE_DECREASING &&
+        start_frame_mm_time < rc->last_change) {
+        /* Some of this data predates the last bit rate reduction
+         * so it is obsolete.
+         */
+        return;
+    }
+
+    /* We normally arrange for even the largest frames to arrive a bit over
+     * one period before they should be displayed.
+     */
+    uint32_t min_margin = MSEC_PER_SEC / video_rate_control_get_source_fps(rc) +
+        video_rate_control_get_network_latency(rc) * VIDEO_RC_LATENCY_MARGIN;
+
+    /* A low video margin indicates that the bit rate is too high. */
+    uint32_t score;
+    if (num_drops) {
+        score = 4;
+    } else if (margin_delta >= 0) {
+        /* The situation was bad but seems to be improving */
+        score = 0;
+    } else if (video_margin < min_margin * VIDEO_RC_VIDEO_MARGIN_BAD ||
+               video_margin < rc->max_video_margin * VIDEO_RC_VIDEO_MARGIN_BAD) {
+        score = 3;
+    } else if (video_margin < min_margin ||
+               video_margin < rc->max_video_margin * VIDEO_RC_VIDEO_MARGIN_AVERAGE) {
+        score = 2;
+    } else if (video_margin < rc->max_video_margin * VIDEO_RC_VIDEO_MARGIN_GOOD) {
+        score = 1;
+    } else {
+        score = 0;
+    }
+    /* A fast dropping video margin is a compounding factor. */
+    if (margin_delta < -abs(rc->max_video_margin) * VIDEO_RC_VIDEO_DELTA_BAD) {
+        score += 2;
+    } else if (margin_delta < -abs(rc->max_video_margin) * VIDEO_RC_VIDEO_DELTA_AVERAGE) {
+        score += 1;
+    }
+
+    if (score > 3) {
+        spice_debug("score %u, cut the bit rate", score);
+        decrease_bit_rate(rc, VIDEO_RC_BITRATE_CUT);
+
+    } else if (score == 3) {
+        spice_debug("score %u, reduce the bit rate", score);
+        decrease_bit_rate(rc, VIDEO_RC_BITRATE_REDUCE);
+
+    } else if (score == 2) {
+        spice_debug("score %u, decrement the bit rate", score);
+        video_rate_control_set_bit_rate(rc, rc->bit_rate - rc->bit_rate_step);
+
+    } else if (audio_margin < rc->max_audio_margin * VIDEO_RC_AUDIO_MARGIN_BAD &&
+               audio_margin * VIDEO_RC_AUDIO_VIDEO_RATIO < video_margin) {
+        /* The audio margin has decreased a lot while the video_margin
+         * remained higher. It may be that the video stream is starving the
+         * audio one of bandwidth. So reduce the bit rate.
+         */
+        spice_debug("free some bandwidth for the audio stream");
+        video_rate_control_set_bit_rate(rc, rc->bit_rate - rc->bit_rate_step);
+
+    } else if (score == 1 && period_bit_rate <= rc->bit_rate &&
+               rc->status == VIDEO_RC_BITRATE_INCREASING) {
+        /* We only increase the bit rate when score == 0 so things got worse
+         * since the last increase, and not because of a transient bit rate
+         * peak.
+         */
+        spice_debug("degraded margin, decrement bit rate %.3f <= %.3fMbps",
+                    video_rate_control_get_mbps(period_bit_rate),
+                    video_rate_control_get_mbps(rc->bit_rate));
+        video_rate_control_set_bit_rate(rc, rc->bit_rate - rc->bit_rate_step);
+
+    } else if (score == 0 &&
+               video_rate_control_get_last_frame_mm_time(rc) - rc->last_change >= rc->increase_interval) {
+        /* The video margin is consistently high so increase the bit rate. */
+        increase_bit_rate(rc);
+    }
+}
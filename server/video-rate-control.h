@@ -0,0 +1,257 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2015 Jeremy White
+   Copyright (C) 2015-2016 Francois Gouget
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_VIDEO_RATE_CONTROL
+#define _H_VIDEO_RATE_CONTROL
+
+#include "video-encoder.h"
+
+/* The network bit rate control of the GStreamer and x264 video encoders.
+ *
+ * It keeps the history of the encoded frames, follows the client reports
+ * and the server drops to find the bit rate the network can sustain, and
+ * tells the encoder through bit_rate_changed() whenever that bit rate
+ * changes. How the encoder keeps to it is up to the encoder.
+ */
+
+#define VIDEO_RC_DEFAULT_FPS 30
+
+/* The minimum bit rate / bit rate increment. */
+#define VIDEO_RC_MIN_BITRATE (128 * 1024)
+
+/* The default bit rate. */
+#define VIDEO_RC_DEFAULT_BITRATE (8 * 1024 * 1024)
+
+/* How big of a margin to take to cover for latency jitter. */
+#define VIDEO_RC_LATENCY_MARGIN 0.1
+
+/* How much to reduce the bit rate in case of network congestion. */
+#define VIDEO_RC_BITRATE_CUT 2
+#define VIDEO_RC_BITRATE_REDUCE (4.0 / 3.0)
+
+/* Never increase the bit rate by more than this amount (bits per second). */
+#define VIDEO_RC_BITRATE_MAX_STEP (1024 * 1024)
+
+/* Defines when the spread between max_bit_rate and min_bit_rate has been
+ * narrowed down enough. Note that this value should be large enough for
+ * min_bit_rate to allow recovery from network congestion in a reasonable
+ * time frame, and to absorb transient traffic spikes (potentially from
+ * other sources).
+ * This is also used by the encoders as a multiplier for their own bit rate
+ * target so it does not have to be changed too often.
+ */
+#define VIDEO_RC_BITRATE_MARGIN VIDEO_RC_BITRATE_REDUCE
+
+/* How often to increase the bit rate. */
+#define VIDEO_RC_BITRATE_UP_INTERVAL (MSEC_PER_SEC * 2)
+#define VIDEO_RC_BITRATE_UP_CLIENT_STABLE (MSEC_PER_SEC * 60 * 2)
+#define VIDEO_RC_BITRATE_UP_SERVER_STABLE (MSEC_PER_SEC * 3600 * 4)
+#define VIDEO_RC_BITRATE_UP_RESET_MAX (MSEC_PER_SEC * 30)
+
+#define VIDEO_RC_VIDEO_MARGIN_GOOD 0.75
+#define VIDEO_RC_VIDEO_MARGIN_AVERAGE 0.5
+#define VIDEO_RC_VIDEO_MARGIN_BAD 0.3
+
+#define VIDEO_RC_VIDEO_DELTA_BAD 0.2
+#define VIDEO_RC_VIDEO_DELTA_AVERAGE 0.15
+
+#define VIDEO_RC_AUDIO_MARGIN_BAD 0.5
+#define VIDEO_RC_AUDIO_VIDEO_RATIO 1.25
+
+/* Should be >= than VIDEO_RC_FRAME_STATISTICS_COUNT. This is also used to
+ * annotate the client report debug traces with bit rate information.
+ */
+#define VIDEO_RC_HISTORY_SIZE 60
+
+/* How many frames to take into account when computing the effective
+ * bit rate, average frame size, etc. This should be large enough so the
+ * I and P frames average out, and short enough for it to reflect the
+ * current situation.
+ */
+#define VIDEO_RC_FRAME_STATISTICS_COUNT 21
+
+typedef struct VideoRateControlFrame {
+    uint32_t mm_time;
+    uint32_t size;
+    uint64_t duration;
+} VideoRateControlFrame;
+
+typedef enum VideoRateControlStatus {
+    VIDEO_RC_BITRATE_DECREASING,
+    VIDEO_RC_BITRATE_INCREASING,
+    VIDEO_RC_BITRATE_STABLE,
+} VideoRateControlStatus;
+
+typedef struct VideoRateControl VideoRateControl;
+struct VideoRateControl {
+    /* Rate control callbacks */
+    VideoEncoderRateControlCbs cbs;
+
+    /* Called once the bit rate has changed, stable is TRUE if the bit rate
+     * settled on the lower end of the range found. The frame statistics
+     * still describe the frames before the change.
+     */
+    void (*bit_rate_changed)(VideoRateControl *rc, gboolean stable);
+
+    /* Spice's initial bit rate estimation in bits per second. */
+    uint64_t starting_bit_rate;
+
+    /* The size of an uncompressed frame, in bits. */
+    uint64_t raw_frame_bits;
+
+    /* ---------- Encoded frame statistics ---------- */
+
+    /* A circular buffer containing the past encoded frames information. */
+    VideoRateControlFrame history[VIDEO_RC_HISTORY_SIZE];
+
+    /* The indices of the oldest and newest frames in the history buffer. */
+    uint32_t history_first;
+    uint32_t history_last;
+
+    /* The index of the oldest frame taken into account for the statistics. */
+    uint32_t stat_first;
+
+    /* Used to compute the average frame encoding time. */
+    uint64_t stat_duration_sum;
+
+    /* Used to compute the average frame size. */
+    uint64_t stat_size_sum;
+
+    /* Tracks the maximum frame size. */
+    uint32_t stat_size_max;
+
+    /* The encoders that drop frames to keep to the bit rate set this to
+     * the minimum mm_time of the next frame to encode, zero otherwise.
+     */
+    uint32_t next_frame_mm_time;
+
+    /* ---------- Network bit rate control ---------- */
+
+    /* The bit rate target for the outgoing network stream. (bits per second) */
+    uint64_t bit_rate;
+
+    /* The mm_time of the last bit rate change. */
+    uint32_t last_change;
+
+    /* The maximum bit rate that one can maybe use without causing network
+     * congestion.
+     */
+    uint64_t max_bit_rate;
+
+    /* The last bit rate that let us recover from network congestion. */
+    uint64_t min_bit_rate;
+
+    /* Whether the bit rate was last decreased, increased or kept stable. */
+    VideoRateControlStatus status;
+
+    /* The network bit rate control uses an AIMD scheme (Additive Increase,
+     * Multiplicative Decrease). The increment step depends on the spread
+     * between the minimum and maximum bit rates.
+     */
+    uint64_t bit_rate_step;
+
+    /* How often to increase the bit rate. */
+    uint32_t increase_interval;
+
+    /* ---------- Client feedback ---------- */
+
+    /* TRUE if video_rate_control_client_stream_report() is being called. */
+    gboolean has_client_reports;
+
+    /* The margin is the amount of time between the reception of a piece of
+     * media data by the client and the time when it should be displayed.
+     * Increasing the bit rate increases the transmission time and thus
+     * reduces the margin.
+     */
+    int32_t last_video_margin;
+    int32_t max_video_margin;
+    uint32_t max_audio_margin;
+
+    /* ---------- Server feedback ---------- */
+
+    /* How many frames were dropped by the server since the last encoded frame. */
+    uint32_t server_drops;
+};
+
+/* The other fields must be zero */
+void video_rate_control_init(VideoRateControl *rc,
+                             const VideoEncoderRateControlCbs *cbs,
+                             uint64_t starting_bit_rate,
+                             void (*bit_rate_changed)(VideoRateControl *rc,
+                                                      gboolean stable));
+
+static inline double video_rate_control_get_mbps(uint64_t bit_rate)
+{
+    return (double)bit_rate / 1024 / 1024;
+}
+
+static inline int video_rate_control_is_active(VideoRateControl *rc)
+{
+    return rc->cbs.get_roundtrip_ms != NULL;
+}
+
+/* Returns the source frame rate which may change at any time so don't store
+ * the result.
+ */
+uint32_t video_rate_control_get_source_fps(VideoRateControl *rc);
+/* Returns the share of the link allotted to the stream, 0 if not limited.
+ * It changes as the other streams come and go.
+ */
+uint64_t video_rate_control_get_max_bit_rate(VideoRateControl *rc);
+uint32_t video_rate_control_get_network_latency(VideoRateControl *rc);
+
+/* Sets the size of the frames, the first call starts the bit rate control
+ * and returns TRUE.
+ */
+gboolean video_rate_control_set_frame_size(VideoRateControl *rc, uint32_t frame_mm_time,
+                                           uint64_t raw_frame_bits);
+
+void video_rate_control_add_frame(VideoRateControl *rc, uint32_t frame_mm_time,
+                                  uint64_t duration, uint32_t size);
+uint32_t video_rate_control_get_last_frame_mm_time(VideoRateControl *rc);
+uint64_t video_rate_control_get_effective_bit_rate(VideoRateControl *rc);
+uint64_t video_rate_control_get_average_encoding_time(VideoRateControl *rc);
+
+void video_rate_control_set_bit_rate(VideoRateControl *rc, uint64_t bit_rate);
+void video_rate_control_update_client_playback_delay(VideoRateControl *rc);
+
+/* The helpers of encode_frame(), for when the rate control is active */
+
+/* Gives the bandwidth back when other streams start */
+void video_rate_control_limit_bit_rate(VideoRateControl *rc);
+/* Returns TRUE if the server dropped frames, the bit rate is then reduced
+ * and the frame must be dropped as well.
+ */
+gboolean video_rate_control_handle_server_drops(VideoRateControl *rc,
+                                                uint32_t frame_mm_time);
+/* Called after a frame is encoded */
+void video_rate_control_server_increase_bit_rate(VideoRateControl *rc,
+                                                 uint32_t frame_mm_time);
+
+/* The implementations of the VideoEncoder methods */
+void video_rate_control_client_stream_report(VideoRateControl *rc,
+                                             uint32_t num_frames,
+                                             uint32_t num_drops,
+                                             uint32_t start_frame_mm_time,
+                                             uint32_t end_frame_mm_time,
+                                             int32_t video_margin,
+                                             uint32_t audio_margin);
+void video_rate_control_notify_server_frame_drop(VideoRateControl *rc);
+
+#endif
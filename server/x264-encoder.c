@@ -0,0 +1,564 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* An H.264 encoder calling libx264 directly, without the GStreamer
+ * pipeline, its threads and the appsrc/appsink hops of each frame.
+ *
+ * The frames are converted to I420, or to I444 when their size is odd,
+ * straight from the bitmap chunks into the x264 picture, and x264 runs with the zerolatency tuning so that each
+ * frame comes out of x264_encoder_encode() as soon as it is encoded.
+ * Intra refresh replaces the periodic IDR frames so the size of the
+ * frames stays even.
+ *
+ * The x264 speed preset defaults to SPICE_X264_DEFAULT_PRESET and can be
+ * changed with the SPICE_X264_PRESET environment variable.
+ *
+ * The network bit rate control is the one of the GStreamer encoder, see
+ * video-rate-control.h, x264 then keeps to the bit rate it picks.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <x264.h>
+
+#include "red-common.h"
+#include "video-encoder.h"
+#include "video-rate-control.h"
+#include "utils.h"
+
+
+#define SPICE_X264_DEFAULT_PRESET "ultrafast"
+
+/* qp-min ensures the bit rate does not get needlessly high */
+#define SPICE_X264_QP_MIN 15
+
+/* The intra refresh goes over the whole frame in that many seconds */
+#define SPICE_X264_REFRESH_PERIOD 2
+
+/* The size of the x264 VBV buffer in milliseconds worth of data. It allows
+ * short bursts while keeping the bit rate close to the target. */
+#define SPICE_X264_VBV_SIZE 300
+
+typedef struct SpiceX264Encoder {
+    VideoEncoder base;
+
+    /* ---------- Video characteristics ---------- */
+
+    uint32_t width;
+    uint32_t height;
+    SpiceBitmapFmt spice_format;
+    uint32_t bytes_per_pixel;
+
+    /* Number of consecutive frame encoding errors. */
+    uint32_t errors;
+
+    /* ---------- x264 ---------- */
+
+    const char *preset;
+    x264_param_t param;
+
+    /* If x264 is NULL the picture is not allocated. */
+    x264_t *x264;
+    x264_picture_t picture;
+
+    /* The lines of 16 bit frames converted to BGR */
+    uint8_t *row;
+
+    /* ---------- Network bit rate control ---------- */
+
+    VideoRateControl rate;
+} SpiceX264Encoder;
+
+
+/* ---------- The VideoBuffer implementation ---------- */
+
+static void x264_video_buffer_free(VideoBuffer *buffer)
+{
+    free(buffer->data);
+    free(buffer);
+}
+
+static VideoBuffer *create_x264_video_buffer(const uint8_t *data, uint32_t size)
+{
+    VideoBuffer *buffer = spice_new0(VideoBuffer, 1);
+
+    buffer->free = x264_video_buffer_free;
+    buffer->data = spice_malloc(size);
+    buffer->size = size;
+    memcpy(buffer->data, data, size);
+    return buffer;
+}
+
+
+/* ---------- Miscellaneous helpers ---------- */
+
+static void close_x264(SpiceX264Encoder *encoder)
+{
+    if (encoder->x264) {
+        x264_encoder_close(encoder->x264);
+        x264_picture_clean(&encoder->picture);
+        encoder->x264 = NULL;
+    }
+}
+
+
+/* ---------- Bit rate control ---------- */
+
+/* Sets the x264 rate control parameters from the bit rate. Since the VBV
+ * maximum bit rate is the same as the target x264 keeps the bit rate close
+ * to it without the frame drops of a virtual buffer on our side.
+ */
+static void set_x264_bit_rate(SpiceX264Encoder *encoder)
+{
+    uint32_t kbps = MAX(encoder->rate.bit_rate / 1000, 1);
+
+    encoder->param.rc.i_rc_method = X264_RC_ABR;
+    encoder->param.rc.i_bitrate = kbps;
+    encoder->param.rc.i_vbv_max_bitrate = kbps;
+    encoder->param.rc.i_vbv_buffer_size = MAX(kbps * SPICE_X264_VBV_SIZE / MSEC_PER_SEC, 1);
+}
+
+/* Adapts x264 to the bit rate picked by the network bit rate control */
+static void bit_rate_changed(VideoRateControl *rc, gboolean stable)
+{
+    SpiceX264Encoder *encoder = SPICE_CONTAINEROF(rc, SpiceX264Encoder, rate);
+
+    if (encoder->x264) {
+        set_x264_bit_rate(encoder);
+        if (x264_encoder_reconfig(encoder->x264, &encoder->param) < 0) {
+            spice_warning("x264 refused the %.3fMbps bit rate",
+                          video_rate_control_get_mbps(rc->bit_rate));
+        }
+    }
+    video_rate_control_update_client_playback_delay(rc);
+}
+
+
+/* ---------- Frame conversion ---------- */
+
+static inline uint8_t *get_image_line(SpiceChunks *chunks, size_t *offset,
+                                      int *chunk_nr, int stride)
+{
+    uint8_t *ret;
+    SpiceChunk *chunk;
+
+    chunk = &chunks->chunk[*chunk_nr];
+
+    if (*offset == chunk->len) {
+        if (*chunk_nr == chunks->num_chunks - 1) {
+            return NULL; /* Last chunk */
+        }
+        *offset = 0;
+        (*chunk_nr)++;
+        chunk = &chunks->chunk[*chunk_nr];
+    }
+
+    if (chunk->len - *offset < stride) {
+        spice_warning("bad chunk alignment");
+        return NULL;
+    }
+    ret = chunk->data + *offset;
+    *offset += stride;
+    return ret;
+}
+
+static void convert_rgb16_line(uint8_t *dest, const uint8_t *src, uint32_t width)
+{
+    const uint16_t *pixels = (const uint16_t *)src;
+    uint32_t x;
+
+    for (x = 0; x < width; x++, dest += 3) {
+        uint16_t pixel = pixels[x];
+        dest[0] = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
+        dest[1] = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
+        dest[2] = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
+    }
+}
+
+#define RGB_TO_Y(r, g, b) ((( 66 * (r) + 129 * (g) +  25 * (b) + 128) >> 8) + 16)
+#define RGB_TO_U(r, g, b) (((-38 * (r) -  74 * (g) + 112 * (b) + 128) >> 8) + 128)
+#define RGB_TO_V(r, g, b) (((112 * (r) -  94 * (g) -  18 * (b) + 128) >> 8) + 128)
+
+/* Converts two lines of blue, green, red pixels, bpp bytes apart, to the
+ * BT.601 limited range I420 the decoders assume by default.
+ */
+static void convert_line_pair(SpiceX264Encoder *encoder, const uint8_t *line0,
+                              const uint8_t *line1, uint32_t bpp, uint32_t y)
+{
+    x264_image_t *img = &encoder->picture.img;
+    uint8_t *y0 = img->plane[0] + y * img->i_stride[0];
+    uint8_t *y1 = y0 + img->i_stride[0];
+    uint8_t *u = img->plane[1] + y / 2 * img->i_stride[1];
+    uint8_t *v = img->plane[2] + y / 2 * img->i_stride[2];
+    uint32_t x;
+
+    for (x = 0; x < encoder->width; x += 2) {
+        const uint8_t *p0 = line0 + x * bpp;
+        const uint8_t *p1 = line1 + x * bpp;
+        int r, g, b;
+
+        y0[x] = RGB_TO_Y(p0[2], p0[1], p0[0]);
+        y0[x + 1] = RGB_TO_Y(p0[bpp + 2], p0[bpp + 1], p0[bpp]);
+        y1[x] = RGB_TO_Y(p1[2], p1[1], p1[0]);
+        y1[x + 1] = RGB_TO_Y(p1[bpp + 2], p1[bpp + 1], p1[bpp]);
+
+        r = (p0[2] + p0[bpp + 2] + p1[2] + p1[bpp + 2] + 2) >> 2;
+        g = (p0[1] + p0[bpp + 1] + p1[1] + p1[bpp + 1] + 2) >> 2;
+        b = (p0[0] + p0[bpp] + p1[0] + p1[bpp] + 2) >> 2;
+        u[x / 2] = RGB_TO_U(r, g, b);
+        v[x / 2] = RGB_TO_V(r, g, b);
+    }
+}
+
+/* Same as convert_line_pair() but for a single line and with a chroma
+ * sample per pixel, I444 being used for the odd sized frames.
+ */
+static void convert_line_i444(SpiceX264Encoder *encoder, const uint8_t *line,
+                              uint32_t bpp, uint32_t y)
+{
+    x264_image_t *img = &encoder->picture.img;
+    uint8_t *luma = img->plane[0] + y * img->i_stride[0];
+    uint8_t *u = img->plane[1] + y * img->i_stride[1];
+    uint8_t *v = img->plane[2] + y * img->i_stride[2];
+    uint32_t x;
+
+    for (x = 0; x < encoder->width; x++) {
+        const uint8_t *p = line + x * bpp;
+
+        luma[x] = RGB_TO_Y(p[2], p[1], p[0]);
+        u[x] = RGB_TO_U(p[2], p[1], p[0]);
+        v[x] = RGB_TO_V(p[2], p[1], p[0]);
+    }
+}
+
+/* Reads the lines from the bitmap chunks and converts them into the x264
+ * picture, there is no intermediate copy of the frame.
+ */
+static gboolean convert_frame(SpiceX264Encoder *encoder, const SpiceBitmap *bitmap,
+                              const SpiceRect *src, int top_down)
+{
+    SpiceChunks *chunks = bitmap->data;
+    size_t offset = 0;
+    int chunk = 0;
+    uint32_t bpp = encoder->bytes_per_pixel;
+    int skip_lines = top_down ? src->top : bitmap->y - src->bottom;
+    uint32_t y;
+    int i;
+
+    for (i = 0; i < skip_lines; i++) {
+        get_image_line(chunks, &offset, &chunk, bitmap->stride);
+    }
+
+    for (y = 0; y < encoder->height; y += 2) {
+        uint8_t *lines[2];
+
+        for (i = 0; i < 2; i++) {
+            if (y + i == encoder->height) {
+                lines[i] = lines[0];
+                break;
+            }
+            lines[i] = get_image_line(chunks, &offset, &chunk, bitmap->stride);
+            if (!lines[i]) {
+                return FALSE;
+            }
+            lines[i] += src->left * encoder->bytes_per_pixel;
+        }
+        if (encoder->spice_format == SPICE_BITMAP_FMT_16BIT) {
+            convert_rgb16_line(encoder->row, lines[0], encoder->width);
+            convert_rgb16_line(encoder->row + encoder->width * 3, lines[1], encoder->width);
+            lines[0] = encoder->row;
+            lines[1] = encoder->row + encoder->width * 3;
+            bpp = 3;
+        }
+        if (encoder->param.i_csp == X264_CSP_I444) {
+            convert_line_i444(encoder, lines[0], bpp, y);
+            if (y + 1 < encoder->height) {
+                convert_line_i444(encoder, lines[1], bpp, y + 1);
+            }
+        } else {
+            convert_line_pair(encoder, lines[0], lines[1], bpp, y);
+        }
+    }
+    return TRUE;
+}
+
+
+/* ---------- x264 ---------- */
+
+static gboolean open_x264(SpiceX264Encoder *encoder)
+{
+    x264_param_t *param = &encoder->param;
+
+    /* - zerolatency disables the lookahead, the B frames and the frame
+     *   threads so each frame is output as soon as it is encoded.
+     */
+    if (x264_param_default_preset(param, encoder->preset, "zerolatency") < 0) {
+        spice_warning("unknown x264 preset %s, using %s",
+                      encoder->preset, SPICE_X264_DEFAULT_PRESET);
+        encoder->preset = SPICE_X264_DEFAULT_PRESET;
+        x264_param_default_preset(param, encoder->preset, "zerolatency");
+    }
+    param->i_log_level = X264_LOG_WARNING;
+
+    /* I420 needs an even size and its SPS can only crop an even number of
+     * pixels, so padding the odd sized frames would make the decoded frame
+     * larger than the stream area. They are encoded in I444 instead, which
+     * the SPS crops to the exact size.
+     */
+    param->i_width = encoder->width;
+    param->i_height = encoder->height;
+    param->i_csp = (encoder->width | encoder->height) & 1 ? X264_CSP_I444 : X264_CSP_I420;
+    param->i_fps_num = video_rate_control_get_source_fps(&encoder->rate);
+    param->i_fps_den = 1;
+    param->b_vfr_input = 1;
+    param->i_timebase_num = 1;
+    param->i_timebase_den = MSEC_PER_SEC;
+
+    /* - The client gets a byte stream with access unit delimiters, the
+     *   same as with the GStreamer x264enc element.
+     * - Intra refresh replaces the periodic IDR frames to get more
+     *   uniform compressed frame sizes, thus helping with streaming.
+     */
+    param->b_annexb = 1;
+    param->b_aud = 1;
+    param->b_repeat_headers = 1;
+    param->b_intra_refresh = 1;
+    param->i_keyint_max = param->i_fps_num * SPICE_X264_REFRESH_PERIOD;
+    param->rc.i_qp_min = SPICE_X264_QP_MIN;
+    set_x264_bit_rate(encoder);
+
+    encoder->x264 = x264_encoder_open(param);
+    if (!encoder->x264) {
+        spice_warning("could not open x264 for %ux%u frames", encoder->width, encoder->height);
+        return FALSE;
+    }
+    if (x264_picture_alloc(&encoder->picture, param->i_csp,
+                           param->i_width, param->i_height) < 0) {
+        x264_encoder_close(encoder->x264);
+        encoder->x264 = NULL;
+        return FALSE;
+    }
+    spice_debug("x264 %s: %ux%u %.3fMbps", encoder->preset, encoder->width,
+                encoder->height, video_rate_control_get_mbps(encoder->rate.bit_rate));
+    return TRUE;
+}
+
+/* Returns the size of the pixels or 0 if the format is not supported */
+static uint32_t get_bytes_per_pixel(SpiceBitmapFmt format)
+{
+    switch (format) {
+    case SPICE_BITMAP_FMT_32BIT:
+    case SPICE_BITMAP_FMT_RGBA:
+        return 4;
+    case SPICE_BITMAP_FMT_24BIT:
+        return 3;
+    case SPICE_BITMAP_FMT_16BIT:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+/* A helper for spice_x264_encoder_encode_frame() */
+static int set_video_format(SpiceX264Encoder *encoder, uint32_t frame_mm_time,
+                            SpiceBitmapFmt format, uint32_t width, uint32_t height)
+{
+    spice_debug("video format change: width %d -> %d, height %d -> %d, format %d -> %d",
+                encoder->width, width, encoder->height, height,
+                encoder->spice_format, format);
+    close_x264(encoder);
+    encoder->spice_format = format;
+    encoder->width = width;
+    encoder->height = height;
+    encoder->errors = 0;
+
+    encoder->bytes_per_pixel = get_bytes_per_pixel(format);
+    if (!encoder->bytes_per_pixel) {
+        spice_warning("unsupported format %d", format);
+        return FALSE;
+    }
+    if (format == SPICE_BITMAP_FMT_16BIT) {
+        encoder->row = spice_renew(uint8_t, encoder->row, width * 3 * 2);
+    }
+    video_rate_control_set_frame_size(&encoder->rate, frame_mm_time,
+                                      (uint64_t)width * height * 24);
+    return TRUE;
+}
+
+
+/* ---------- VideoEncoder's public API ---------- */
+
+static void spice_x264_encoder_destroy(VideoEncoder *video_encoder)
+{
+    SpiceX264Encoder *encoder = (SpiceX264Encoder*)video_encoder;
+
+    close_x264(encoder);
+    free(encoder->row);
+    free(encoder);
+}
+
+static int spice_x264_encoder_encode_frame(VideoEncoder *video_encoder,
+                                     uint32_t frame_mm_time,
+                                     const SpiceBitmap *bitmap,
+                                     const SpiceRect *src, int top_down,
+                                     gpointer bitmap_opaque,
+                                     VideoBuffer **outbuf)
+{
+    SpiceX264Encoder *encoder = (SpiceX264Encoder*)video_encoder;
+    uint32_t width = src->right - src->left;
+    uint32_t height = src->bottom - src->top;
+    x264_picture_t picture_out;
+    x264_nal_t *nals;
+    int num_nals;
+    int size;
+
+    g_return_val_if_fail(outbuf != NULL, VIDEO_ENCODER_FRAME_UNSUPPORTED);
+    *outbuf = NULL;
+
+    if (width != encoder->width || height != encoder->height ||
+        encoder->spice_format != bitmap->format) {
+        if (!set_video_format(encoder, frame_mm_time, bitmap->format, width, height)) {
+            /* Give up until something changes */
+            encoder->errors = 3;
+        }
+    }
+    if (encoder->errors >= 3) {
+        return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    }
+
+    VideoRateControl *rc = &encoder->rate;
+    if (video_rate_control_is_active(rc)) {
+        video_rate_control_limit_bit_rate(rc);
+        if (video_rate_control_handle_server_drops(rc, frame_mm_time)) {
+            return VIDEO_ENCODER_FRAME_DROP;
+        }
+    }
+
+    if (!encoder->x264 && !open_x264(encoder)) {
+        encoder->errors++;
+        return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    }
+
+    uint64_t start = spice_get_monotonic_time_ns();
+    if (!convert_frame(encoder, bitmap, src, top_down)) {
+        encoder->errors++;
+        return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    }
+    encoder->picture.i_type = X264_TYPE_AUTO;
+    encoder->picture.i_pts = frame_mm_time;
+    size = x264_encoder_encode(encoder->x264, &nals, &num_nals,
+                               &encoder->picture, &picture_out);
+    if (size <= 0) {
+        /* zerolatency should always give the frame back right away */
+        spice_debug("x264 failed to encode the frame (%d)", size);
+        encoder->errors++;
+        close_x264(encoder);
+        return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    }
+    encoder->errors = 0;
+    uint64_t encode_time = spice_get_monotonic_time_ns() - start;
+
+    /* The NAL units are contiguous in the x264 buffer, which is reused for
+     * the next frame. */
+    *outbuf = create_x264_video_buffer(nals[0].p_payload, size);
+
+    video_rate_control_add_frame(rc, frame_mm_time, encode_time, size);
+    if (video_rate_control_is_active(rc)) {
+        video_rate_control_server_increase_bit_rate(rc, frame_mm_time);
+    }
+    return VIDEO_ENCODER_FRAME_ENCODE_DONE;
+}
+
+static void spice_x264_encoder_client_stream_report(VideoEncoder *video_encoder,
+                                              uint32_t num_frames,
+                                              uint32_t num_drops,
+                                              uint32_t start_frame_mm_time,
+                                              uint32_t end_frame_mm_time,
+                                              int32_t video_margin,
+                                              uint32_t audio_margin)
+{
+    SpiceX264Encoder *encoder = (SpiceX264Encoder*)video_encoder;
+
+    video_rate_control_client_stream_report(&encoder->rate, num_frames, num_drops,
+                                            start_frame_mm_time, end_frame_mm_time,
+                                            video_margin, audio_margin);
+}
+
+static void spice_x264_encoder_notify_server_frame_drop(VideoEncoder *video_encoder)
+{
+    SpiceX264Encoder *encoder = (SpiceX264Encoder*)video_encoder;
+
+    video_rate_control_notify_server_frame_drop(&encoder->rate);
+}
+
+static uint64_t spice_x264_encoder_get_bit_rate(VideoEncoder *video_encoder)
+{
+    SpiceX264Encoder *encoder = (SpiceX264Encoder*)video_encoder;
+
+    return video_rate_control_get_effective_bit_rate(&encoder->rate);
+}
+
+static void spice_x264_encoder_get_stats(VideoEncoder *video_encoder,
+                                   VideoEncoderStats *stats)
+{
+    SpiceX264Encoder *encoder = (SpiceX264Encoder*)video_encoder;
+    uint64_t raw_bit_rate = (uint64_t)encoder->width * encoder->height *
+                            encoder->bytes_per_pixel * 8 *
+                            video_rate_control_get_source_fps(&encoder->rate);
+
+    spice_return_if_fail(stats != NULL);
+    stats->starting_bit_rate = encoder->rate.starting_bit_rate;
+    stats->cur_bit_rate = video_rate_control_get_effective_bit_rate(&encoder->rate);
+
+    /* Use the compression level as a proxy for the quality */
+    stats->avg_quality = stats->cur_bit_rate ? 100.0 - raw_bit_rate / stats->cur_bit_rate : 0;
+    if (stats->avg_quality < 0) {
+        stats->avg_quality = 0;
+    }
+}
+
+VideoEncoder *x264_encoder_new(SpiceVideoCodecType codec_type,
+                               uint64_t starting_bit_rate,
+                               VideoEncoderRateControlCbs *cbs,
+                               bitmap_ref_t bitmap_ref,
+                               bitmap_unref_t bitmap_unref)
+{
+    spice_return_val_if_fail(codec_type == SPICE_VIDEO_CODEC_TYPE_H264, NULL);
+
+    SpiceX264Encoder *encoder = spice_new0(SpiceX264Encoder, 1);
+    encoder->base.destroy = spice_x264_encoder_destroy;
+    encoder->base.encode_frame = spice_x264_encoder_encode_frame;
+    encoder->base.client_stream_report = spice_x264_encoder_client_stream_report;
+    encoder->base.notify_server_frame_drop = spice_x264_encoder_notify_server_frame_drop;
+    encoder->base.get_bit_rate = spice_x264_encoder_get_bit_rate;
+    encoder->base.get_stats = spice_x264_encoder_get_stats;
+    encoder->base.codec_type = codec_type;
+
+    video_rate_control_init(&encoder->rate, cbs, starting_bit_rate,
+                            bit_rate_changed);
+    encoder->preset = getenv("SPICE_X264_PRESET");
+    if (!encoder->preset) {
+        encoder->preset = SPICE_X264_DEFAULT_PRESET;
+    }
+    /* The frames are converted as they are read so the bitmaps are never
+     * kept past encode_frame() and bitmap_ref()/bitmap_unref() are not
+     * needed. All the other fields are initialized to zero by spice_new0().
+     */
+    return (VideoEncoder*)encoder;
+}
@@ -0,0 +1,151 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define SPICE_LOG_DOMAIN "SpiceZstdEncoder"
+
+#include <zstd.h>
+#include "red-common.h"
+#include "zstd-encoder.h"
+
+struct ZstdEncoder {
+    ZstdEncoderUsrContext *usr;
+
+    ZSTD_CCtx *cctx;
+    int last_level;
+};
+
+ZstdEncoder* zstd_encoder_create(ZstdEncoderUsrContext *usr)
+{
+    ZstdEncoder *enc;
+
+    if (!usr->more_space || !usr->more_lines) {
+        return NULL;
+    }
+
+    enc = spice_new0(ZstdEncoder, 1);
+    enc->usr = usr;
+    enc->cctx = ZSTD_createCCtx();
+    if (!enc->cctx) {
+        spice_printerr("zstd error");
+        free(enc);
+        return NULL;
+    }
+    enc->last_level = -1;
+
+    return enc;
+}
+
+void zstd_encoder_destroy(ZstdEncoder *encoder)
+{
+    ZSTD_freeCCtx(encoder->cctx);
+    free(encoder);
+}
+
+int zstd_encoder_check_level(int level)
+{
+    return MAX(1, MIN(level, ZSTD_maxCLevel()));
+}
+
+static int zstd_encoder_start(ZstdEncoder *zstd, int level, size_t input_size)
+{
+    ZSTD_CCtx_reset(zstd->cctx, ZSTD_reset_session_only);
+    if (level != zstd->last_level) {
+        if (ZSTD_isError(ZSTD_CCtx_setParameter(zstd->cctx, ZSTD_c_compressionLevel, level))) {
+            return FALSE;
+        }
+        zstd->last_level = level;
+    }
+    // lets the encoder size its tables for the image
+    return !ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(zstd->cctx, input_size));
+}
+
+int zstd_encode(ZstdEncoder *zstd, int level, int height, int stride,
+                uint8_t *io_ptr, unsigned int num_io_bytes,
+                int top_down, uint8_t format)
+{
+    ZSTD_outBuffer out;
+    int total_lines = 0;
+    int out_size;
+    size_t ret;
+
+    if (!zstd_encoder_start(zstd, level, (size_t)height * stride)) {
+        spice_warning("zstd init failed");
+        return 0;
+    }
+
+    // Encode direction and format
+    io_ptr[0] = top_down ? 1 : 0;
+    io_ptr[1] = format;
+    out.dst = io_ptr + 2;
+    out.size = num_io_bytes - 2;
+    out.pos = 0;
+    out_size = 2;
+
+    do {
+        ZSTD_EndDirective mode;
+        ZSTD_inBuffer in;
+        uint8_t *lines;
+        int num_lines;
+
+        num_lines = zstd->usr->more_lines(zstd->usr, &lines);
+        if (num_lines <= 0) {
+            spice_error("more lines failed");
+            return 0;
+        }
+        total_lines += num_lines;
+        in.src = lines;
+        in.size = (size_t)num_lines * stride;
+        in.pos = 0;
+        mode = total_lines >= height ? ZSTD_e_end : ZSTD_e_continue;
+
+        do {
+            /* ask for space only when needed, an unused buffer would be leaked */
+            if (out.pos == out.size) {
+                uint8_t *next;
+                int next_size;
+
+                out_size += out.pos;
+                next_size = zstd->usr->more_space(zstd->usr, &next);
+                if (next_size <= 0) {
+                    spice_error("more space failed");
+                    return 0;
+                }
+                out.dst = next;
+                out.size = next_size;
+                out.pos = 0;
+            }
+            ret = ZSTD_compressStream2(zstd->cctx, &out, &in, mode);
+            if (ZSTD_isError(ret)) {
+                spice_warning("zstd compress failed: %s", ZSTD_getErrorName(ret));
+                return 0;
+            }
+            /* with ZSTD_e_end the frame is complete once ret is 0,
+             * otherwise the input must be consumed */
+        } while (mode == ZSTD_e_end ? ret != 0 : in.pos < in.size);
+    } while (total_lines < height);
+
+    if (total_lines != height) {
+        spice_error("too many lines");
+        return 0;
+    }
+
+    return out_size + out.pos;
+}
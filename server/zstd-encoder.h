@@ -0,0 +1,45 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _H_ZSTD_ENCODER
+#define _H_ZSTD_ENCODER
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#define ZSTD_ENCODER_DEFAULT_LEVEL 3
+
+typedef struct ZstdEncoder ZstdEncoder;
+typedef struct ZstdEncoderUsrContext ZstdEncoderUsrContext;
+
+struct ZstdEncoderUsrContext {
+    int (*more_space)(ZstdEncoderUsrContext *usr, uint8_t **io_ptr);
+    int (*more_lines)(ZstdEncoderUsrContext *usr, uint8_t **lines);
+};
+
+ZstdEncoder* zstd_encoder_create(ZstdEncoderUsrContext *usr);
+void zstd_encoder_destroy(ZstdEncoder *encoder);
+
+/* clamps level to the range supported by libzstd and returns it */
+int zstd_encoder_check_level(int level);
+
+/* Encodes the image as [top_down, format, zstd frame].
+ * returns the total size of the encoded data, 0 on failure */
+int zstd_encode(ZstdEncoder *zstd, int level, int height, int stride,
+                uint8_t *io_ptr, unsigned int num_io_bytes,
+                int top_down, uint8_t format);
+#endif